@@ -0,0 +1,115 @@
+#ifndef BITMAP_H
+#define BITMAP_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "filesys.h"
+
+/**
+ * bit scanning kernels for MSB-first bitmaps such as the dblock bitmask.
+ *
+ * bit `n` of a bitmap is bit `7 - n % 8` of byte `n / 8`. every function only looks at
+ * the first `nbits` bits, so padding bits in the last byte are ignored.
+ *
+ * the scans and the popcount have AVX2 and SSE4.2 versions. the fastest version the cpu
+ * supports is picked when the program starts, otherwise a portable version is used.
+ */
+
+typedef enum bitmap_kernel
+{
+    BITMAP_KERNEL_PORTABLE,
+    BITMAP_KERNEL_SSE42,
+    BITMAP_KERNEL_AVX2,
+    BITMAP_KERNEL_TOTAL
+} bitmap_kernel_t;
+
+static inline bool bitmap_test(const byte *bitmap, size_t n)
+{
+    return bitmap[n / 8] & (1 << (7 - n % 8));
+}
+
+static inline void bitmap_set(byte *bitmap, size_t n)
+{
+    bitmap[n / 8] |= 1 << (7 - n % 8);
+}
+
+// sets a bit while other threads may be setting bits of the same byte. returns whether it was already set
+static inline bool bitmap_set_atomic(byte *bitmap, size_t n)
+{
+    byte bit = (byte) (1 << (7 - n % 8));
+    return __atomic_fetch_or(&bitmap[n / 8], bit, __ATOMIC_RELAXED) & bit;
+}
+
+static inline void bitmap_clear(byte *bitmap, size_t n)
+{
+    bitmap[n / 8] &= ~(1 << (7 - n % 8));
+}
+
+/**
+ * counts the set bits of a bitmap
+ *
+ * @param bitmap the bitmap to count
+ * @param nbits the number of bits in the bitmap
+ * @return the number of set bits among the first `nbits` bits
+ */
+size_t bitmap_popcount(const byte *bitmap, size_t nbits);
+
+/**
+ * finds the lowest set bit at or after `start`
+ *
+ * @param bitmap the bitmap to search
+ * @param nbits the number of bits in the bitmap
+ * @param start the first bit to look at
+ * @param index the address to store the index of the bit in
+ * @return true if a set bit was found, false otherwise
+ */
+bool bitmap_find_first_set(const byte *bitmap, size_t nbits, size_t start, size_t *index);
+
+/**
+ * finds the lowest clear bit at or after `start`
+ *
+ * @param bitmap the bitmap to search
+ * @param nbits the number of bits in the bitmap
+ * @param start the first bit to look at
+ * @param index the address to store the index of the bit in
+ * @return true if a clear bit was found, false otherwise
+ */
+bool bitmap_find_first_clear(const byte *bitmap, size_t nbits, size_t start, size_t *index);
+
+/**
+ * finds the lowest run of at least `len` consecutive set bits starting at or after `start`
+ *
+ * @param bitmap the bitmap to search
+ * @param nbits the number of bits in the bitmap
+ * @param start the first bit to look at
+ * @param len the length of the run. must not be 0
+ * @param index the address to store the index of the first bit of the run in
+ * @return true if such a run was found, false otherwise
+ */
+bool bitmap_find_set_run(const byte *bitmap, size_t nbits, size_t start, size_t len, size_t *index);
+
+/**
+ * sets the bits `first` to `first + len - 1`
+ */
+void bitmap_set_range(byte *bitmap, size_t first, size_t len);
+
+/**
+ * clears the bits `first` to `first + len - 1`
+ */
+void bitmap_clear_range(byte *bitmap, size_t first, size_t len);
+
+/**
+ * forces the kernels used by the functions above. meant for tests and benchmarks.
+ *
+ * @param kernel the kernel to use
+ * @return true if the cpu supports `kernel` and it is now used, false otherwise
+ */
+bool bitmap_select_kernel(bitmap_kernel_t kernel);
+
+/**
+ * @return the kernel currently used by the functions above
+ */
+bitmap_kernel_t bitmap_current_kernel(void);
+
+#endif
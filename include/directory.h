@@ -0,0 +1,164 @@
+#ifndef DIRECTORY_H
+#define DIRECTORY_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "filesys.h"
+
+/**
+ * directory entries are `(inode_index_t, name[MAX_FILE_NAME_LEN])` records. an entry whose
+ * name is empty is a tombstone left by a removal, and the next entry added takes its place.
+ * a name of MAX_FILE_NAME_LEN characters is stored without a terminating zero.
+ *
+ * the functions below work on any directory by scanning its entries. given a
+ * `directory_index_t` they use a hash table of the names instead, so a lookup costs the
+ * same however many entries the directory has.
+ *
+ * once `fs_enable_concurrency` was called, each function takes the lock of the directories
+ * it reads or changes itself, so the caller holds the file system lock but none of those.
+ * an index belongs to a single thread.
+ */
+
+typedef struct directory_bucket
+{
+    uint32_t hash;
+    uint32_t slot; // the entry's slot plus one. 0 if the bucket never held an entry
+} directory_bucket_t;
+
+/**
+ * a hash index of one directory's names, kept in memory by the caller. a zeroed index is
+ * valid and is built the first time it is used. it is rebuilt on its own whenever it was
+ * built for another directory, the directory grew or shrank behind its back, or the file
+ * system's `relocation_generation` changed since, so changes to other files never cost a
+ * rebuild. entries renamed in place by other functions need a call to `directory_index_free`
+ * first.
+ */
+typedef struct directory_index
+{
+    const inode_t *dir;
+    size_t relocation_generation;
+    size_t slot_count; // entries the directory had when the index last saw it
+    byte **entries; // where each slot of the directory lives
+    size_t entries_capacity;
+    directory_bucket_t *buckets;
+    size_t bucket_count; // a power of 2, or 0 before the index is first built
+    size_t used_buckets; // buckets holding an entry or the mark of a removed one
+    uint32_t *free_slots; // tombstones a new entry can take
+    size_t free_slot_count;
+    size_t free_slots_capacity;
+} directory_index_t;
+
+/**
+ * finds the inode an entry of a directory names
+ *
+ * @param fs the file system the directory is in
+ * @param dir the directory to search
+ * @param index null to scan the entries, otherwise the index of `dir`
+ * @param name the name to look for
+ * @param found the address to store the inode index of the entry in
+ * @return SUCCESS if the name was found
+ *         INVALID_INPUT if an argument is null or `dir` is not a directory
+ *         EMPTY_FILENAME if `name` is empty
+ *         INVALID_FILENAME if `name` is longer than MAX_FILE_NAME_LEN
+ *         NOT_FOUND if no entry has that name
+ *         SYSTEM_ERROR if memory for the index could not be allocated
+ */
+fs_retcode_t directory_lookup(filesystem_t *fs, inode_t *dir, directory_index_t *index, const char *name, inode_index_t *found);
+
+/**
+ * adds an entry to a directory, in one of its tombstones if there are any and at the end
+ * otherwise. the dentry cache forgets the name
+ *
+ * @param fs the file system the directory is in
+ * @param dir the directory to add to
+ * @param index null to scan the entries, otherwise the index of `dir`
+ * @param name the name of the entry
+ * @param inode the inode the entry names
+ * @return SUCCESS if the entry was added
+ *         the errors of `directory_lookup`, besides NOT_FOUND
+ *         FILE_EXIST or DIRECTORY_EXIST if an entry already has that name
+ *         the errors of `inode_write_data` if the directory could not grow
+ */
+fs_retcode_t directory_add_entry(filesystem_t *fs, inode_t *dir, directory_index_t *index, const char *name, inode_index_t inode);
+
+/**
+ * turns the entry with a name into a tombstone. the directory keeps its size, and the
+ * dentry cache forgets the name
+ *
+ * @param fs the file system the directory is in
+ * @param dir the directory to remove from
+ * @param index null to scan the entries, otherwise the index of `dir`
+ * @param name the name of the entry
+ * @return SUCCESS if the entry was removed
+ *         the errors of `directory_lookup`
+ */
+fs_retcode_t directory_remove_entry(filesystem_t *fs, inode_t *dir, directory_index_t *index, const char *name);
+
+/**
+ * frees what an index holds and zeroes it. it can be used again afterwards
+ */
+void directory_index_free(directory_index_t *index);
+
+#define DENTRY_CACHE_SIZE 256 // a power of 2
+
+/**
+ * the result of looking up a name in a directory. a negative entry remembers that the
+ * name was not there
+ */
+typedef struct dentry
+{
+    inode_index_t parent;
+    inode_index_t inode;
+    char name[MAX_FILE_NAME_LEN];
+    bool valid;
+    bool negative;
+} dentry_t;
+
+/**
+ * the file system's cache of names, keyed by directory and name. each key has one place
+ * in the table, and a newer lookup takes it over. adding or removing an entry drops only
+ * that name. the whole cache is dropped when the file system's `relocation_generation`
+ * changes, since a compaction renumbers the inodes
+ */
+typedef struct dentry_cache
+{
+    size_t relocation_generation;
+    dentry_t entries[DENTRY_CACHE_SIZE];
+} dentry_cache_t;
+
+/**
+ * finds the inode a path leads to. a path starting with '/' starts at the root directory
+ * and any other at `cwd`. empty components are skipped, and "." and ".." are looked up like
+ * any other name. every lookup goes through the file system's dentry cache
+ *
+ * `directory_add_entry` and `directory_remove_entry` keep the cache right. entries changed
+ * any other way need a call to `dentry_cache_forget`, and a removed directory needs one to
+ * `dentry_cache_forget_directory` before its inode is reused
+ *
+ * @param fs the file system
+ * @param cwd the directory a relative path starts at
+ * @param path the path to resolve
+ * @param found the address to store the inode index the path leads to in
+ * @return SUCCESS if the path was resolved
+ *         INVALID_INPUT if an argument is null, or an entry names an inode out of range
+ *         EMPTY_FILENAME if `path` is empty
+ *         INVALID_FILENAME if a component is longer than MAX_FILE_NAME_LEN
+ *         DIR_NOT_FOUND if a component before the last is missing or not a directory
+ *         NOT_FOUND if the last component is missing
+ *         SYSTEM_ERROR if memory for the cache could not be allocated
+ */
+fs_retcode_t directory_resolve_path(filesystem_t *fs, inode_t *cwd, const char *path, inode_index_t *found);
+
+/**
+ * drops what the dentry cache knows about a name in a directory
+ */
+void dentry_cache_forget(filesystem_t *fs, inode_index_t parent, const char *name);
+
+/**
+ * drops every name the dentry cache knows in a directory. to be called when the directory
+ * is removed, before its inode can be reused
+ */
+void dentry_cache_forget_directory(filesystem_t *fs, inode_index_t dir);
+
+#endif
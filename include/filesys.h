@@ -8,10 +8,20 @@
 #include <stdint.h>
 #include <stddef.h>
 #include <stdio.h>
+#include <stdbool.h>
+#include <sys/uio.h>
 
 #define STR(x) #x
 
-#define DATA_BLOCK_SIZE 64
+// the block size of the original image format. building with another DATA_BLOCK_SIZE (see the
+// FS_DATA_BLOCK_SIZE cmake option) records the block size in the image header
+#define DEFAULT_DATA_BLOCK_SIZE 64
+#ifndef DATA_BLOCK_SIZE
+#define DATA_BLOCK_SIZE DEFAULT_DATA_BLOCK_SIZE
+#endif
+#if DATA_BLOCK_SIZE < 64 || DATA_BLOCK_SIZE > 65536 || DATA_BLOCK_SIZE % 4 != 0
+#error "DATA_BLOCK_SIZE must be a multiple of 4 between 64 and 65536"
+#endif
 #define MAX_FILE_NAME_LEN 14
 #define INODE_DIRECT_BLOCK_COUNT 4
 
@@ -22,6 +32,9 @@ do { \
 
 typedef uint8_t byte;
 typedef uint32_t dblock_index_t;
+
+// bytes an inline inode can hold in place of its dblock indices
+#define INODE_INLINE_CAPACITY ((INODE_DIRECT_BLOCK_COUNT + 1) * sizeof(dblock_index_t))
 typedef uint16_t inode_index_t;
 
 typedef enum fs_retcode
@@ -62,11 +75,22 @@ typedef enum permission
     FS_EXECUTE = 0x4
 } permission_t;
 
+// how the index dblocks of an inode are organized
+typedef enum indirect_layout
+{
+    INDIRECT_CHAIN, // a list of index dblocks, each ending with the index of the next one
+    INDIRECT_TREE, // a tree of index dblocks that gains a level whenever the file outgrows it
+    INDIRECT_EXTENTS, // runs of consecutive data dblocks, listed as (first dblock, length) pairs in a chain of extent dblocks
+    INDIRECT_INLINE // no dblocks at all. the data itself is stored over `direct_data` and `indirect_dblock`
+} indirect_layout_t;
+
 struct inode_internal
 {
     file_type_t file_type;
     permission_t file_perms;
     char file_name[MAX_FILE_NAME_LEN];
+    uint8_t indirect_layout; // an `indirect_layout_t`. 0 (a chain) in images from before trees existed
+    uint8_t indirect_height; // levels of index dblocks below `indirect_dblock` if it is a tree
     size_t file_size;
     dblock_index_t direct_data[INODE_DIRECT_BLOCK_COUNT];
     dblock_index_t indirect_dblock;
@@ -78,16 +102,59 @@ typedef union inode
     struct inode_internal internal;
 } inode_t;
 
+// one bit per inode, dblock and bitmask byte that changed since the image was last loaded or saved
+struct dirty_state
+{
+    byte *inodes;
+    byte *dblocks;
+    byte *bitmask;
+    bool header;
+};
+
 typedef struct filesystem
 {   
-    inode_index_t available_inode; 
+    inode_index_t available_inode; // once threads share the file system, only current while its lock is held exclusively. see `fs_enable_concurrency`
     inode_t *inodes;
     size_t inode_count;
     byte *dblock_bitmask;
     byte *dblocks;
     size_t dblock_count;
+    size_t map_generation; // bumped whenever an indirect chain loses index dblocks
+    size_t relocation_generation; // bumped when the defragmenter moves dblocks or a compaction renumbers inodes
+    size_t dblock_hint; // no dblock below this index is available
+    size_t free_inode_count; // kept in sync by the claim and release functions
+    size_t free_dblock_count; // kept in sync by the claim and release functions
+    byte *image_map; // start of the image mapping if opened with `map_filesystem`, otherwise null
+    size_t image_map_size;
+    struct dirty_state dirty;
+    indirect_layout_t indirect_layout; // layout given to an inode when it first needs index dblocks. INDIRECT_CHAIN by default
+    size_t inline_data_limit; // files of at most this many bytes (and INODE_INLINE_CAPACITY) are stored inline. 0 by default, which turns it off
+    bool sorted_free_inodes; // `release_inode` keeps the free inode list in ascending order, so claims hand out the lowest free inode. off by default
+    struct dentry_cache *dentry_cache; // names resolved by `directory_resolve_path`, allocated on first use. see directory.h
+    struct fs_locks *locks; // set by `fs_enable_concurrency`. null while the file system has a single user
+    struct fs_journal *journal; // set by `attach_journal`, otherwise null
+    struct fs_flusher *flusher; // set by `start_flusher`, otherwise null
 } filesystem_t;
 
+/**
+ * remembers the last index dblock visited while walking an inode's indirect chain.
+ * sequential lookups resume from the cached index dblock instead of walking the chain
+ * from `indirect_dblock` again. a zeroed cursor is valid and starts at the head of the chain.
+ * for extents it remembers the last extent looked at, so appends and sequential lookups
+ * resume there instead of walking every extent dblock again.
+ * the cursor is discarded automatically if it belongs to another inode or if the file
+ * system's `map_generation` changed since it was filled in.
+ */
+typedef struct dblock_cursor
+{
+    inode_t *inode;
+    size_t generation;
+    size_t index_block_number; // position of `index_dblock` in the chain (0 is `indirect_dblock`)
+    dblock_index_t index_dblock; // for extents, the extent dblock holding the remembered extent
+    size_t extent_entry; // the remembered extent's entry in `index_dblock`
+    size_t extent_first; // the data dblock past the direct ones the remembered extent starts at
+} dblock_cursor_t;
+
 /*----------------------------------------------------*
  |  PART 0: INITIALIZATION & INODE/DBLOCK ALLOCATION  |
  |  THIS PART IS OPTIONAL. THE CODE IS PROVIDED.      |
@@ -150,8 +217,8 @@ void free_filesystem(filesystem_t *fs);
 /**
  * calculates the available number of inodes in a file system
  * 
- * iterates through inactive inodes via their `next_free_inode` field,
- * starting from the `available_inode` field of the file system argument
+ * the count is maintained by `claim_available_inode` and `release_inode`, 
+ * so this is O(1). see `refresh_available_counts`.
  * 
  * @param fs the file system to calculate the available inodes in
  * @return the number of available inodes in the `fs`. if `fs` is null, 0.
@@ -161,14 +228,26 @@ size_t available_inodes(filesystem_t *fs);
 /**
  * calculates the available number of data blocks in a file system
  * 
- * uses the bitmask in `fs` to calculate the available data blocks.
- * if the bit is set, then it is available. if not, then it is unavailable.
+ * the count is maintained by `claim_available_dblock` and `release_dblock`,
+ * so this is O(1). see `refresh_available_counts`.
  * 
  * @param fs the file system to calculate the available data blocks in
  * @return the number of available data blocks in the `fs`. if `fs` is null, 0.
  */
 size_t available_dblocks(filesystem_t *fs);
 
+/**
+ * recounts the available inodes and data blocks of a file system from the free inode
+ * list and the dblock bitmask.
+ * 
+ * `available_inodes` and `available_dblocks` return running counts that are updated by
+ * the claim and release functions. this only needs to be called after the free list or
+ * bitmask is filled in by other means, such as when loading a file system.
+ * 
+ * @param fs the file system to recount. if `fs` is null, nothing is done.
+ */
+void refresh_available_counts(filesystem_t *fs);
+
 /**
  * claims the available inode for the caller and mark it as now unavailable until
  * it is released.
@@ -201,6 +280,40 @@ fs_retcode_t claim_available_inode(filesystem_t *fs, inode_index_t *index);
  */
 fs_retcode_t claim_available_dblock(filesystem_t *fs, dblock_index_t *index);
 
+/**
+ * claims `count` available data blocks in a single pass over the bitmask and marks them
+ * as unavailable until they are released.
+ * 
+ * the lowest available data blocks are claimed, in the same order `count` calls to 
+ * `claim_available_dblock` would have returned them, so the blocks form a contiguous run
+ * whenever the free space allows it. either all `count` data blocks are claimed or the
+ * file system is not modified.
+ * 
+ * @param fs the file system to claim the data blocks from
+ * @param count the number of data blocks to claim
+ * @param indices the array of at least `count` elements to store the claimed indices in
+ * @return SUCCESS if all the data blocks are successfully claimed.
+ *         INVALID_INPUT if `fs` is null, or `indices` is null and `count` is not 0.
+ *         DBLOCK_UNAVAILABLE if there are less than `count` available data blocks.
+ */
+fs_retcode_t claim_available_dblocks(filesystem_t *fs, size_t count, dblock_index_t *indices);
+
+/**
+ * claims `count` consecutive available data blocks.
+ * 
+ * the run starting at `preferred` is taken if it is entirely available, so a file can keep
+ * growing in place. otherwise the lowest run of `count` available data blocks is taken.
+ * 
+ * @param fs the file system to claim the data blocks from
+ * @param count the number of data blocks to claim
+ * @param preferred the index the run should start at if possible
+ * @param first the address to store the index of the first claimed data block in
+ * @return SUCCESS if the run is successfully claimed.
+ *         INVALID_INPUT if `fs` or `first` is null, or `count` is 0.
+ *         DBLOCK_UNAVAILABLE if there is no run of `count` available data blocks.
+ */
+fs_retcode_t claim_dblock_run(filesystem_t *fs, size_t count, size_t preferred, dblock_index_t *first);
+
 /**
  * releases a claimed inode and marks it as available now
  * 
@@ -212,6 +325,9 @@ fs_retcode_t claim_available_dblock(filesystem_t *fs, dblock_index_t *index);
  * there is not point in zeroing out that data since it will be assumedly overwritten
  * by a caller to `claim_available_inode`
  * 
+ * if the file system's `sorted_free_inodes` is set, `inode` is linked in after the last
+ * free inode with a lower index instead, which walks the free list up to that point.
+ * 
  * @param fs the file system to release the inode
  * @param inode the inode to release
  * @return SUCCESS if the inode is successfully released.
@@ -220,6 +336,18 @@ fs_retcode_t claim_available_dblock(filesystem_t *fs, dblock_index_t *index);
  */
 fs_retcode_t release_inode(filesystem_t *fs, inode_t *inode);
 
+/**
+ * relinks the free inode list in ascending order, so the next claims hand out the lowest
+ * free inodes first. `release_inode` keeps the list in that order while the file system's
+ * `sorted_free_inodes` is set.
+ * 
+ * @param fs the file system whose free inode list to sort
+ * @return SUCCESS if the list is sorted.
+ *         INVALID_INPUT if `fs` is null.
+ *         SYSTEM_ERROR if memory for the sort could not be allocated.
+ */
+fs_retcode_t sort_free_inodes(filesystem_t *fs);
+
 /**
  * releases a claimed data block and marks it as unavailable now
  * 
@@ -234,6 +362,77 @@ fs_retcode_t release_inode(filesystem_t *fs, inode_t *inode);
  */
 fs_retcode_t release_dblock(filesystem_t *fs, byte *dblock);
 
+/**
+ * records that an inode was changed so the next `save_filesystem_incremental` or
+ * `sync_filesystem` writes it out. the functions of this file mark what they change
+ * themselves. this is only needed by code that modifies an inode directly.
+ * 
+ * @param fs the file system the inode is in. if null, nothing is done
+ * @param inode the changed inode. if null, nothing is done
+ */
+void mark_inode_dirty(filesystem_t *fs, inode_t *inode);
+
+/**
+ * records that the content of a data block was changed so the next
+ * `save_filesystem_incremental` or `sync_filesystem` writes it out.
+ * 
+ * @param fs the file system the data block is in. if null, nothing is done
+ * @param index the index of the changed data block
+ */
+void mark_dblock_dirty(filesystem_t *fs, dblock_index_t index);
+
+/**
+ * lets threads share the file system. afterwards the claim and release functions above
+ * serialize on their own, and the high level file functions take the locks below
+ * 
+ * everything else stays unsynchronized, so code calling the inode functions directly holds:
+ *      - the file system lock shared, or exclusive for anything that moves dblocks or
+ *        renumbers inodes of files it does not hold. `defragment_filesystem`,
+ *        `compact_inodes`, `fsck_filesystem` and the save functions take it exclusively
+ *        themselves
+ *      - the lock of each inode it reads (shared) or changes (exclusive), taken in
+ *        ascending inode order when there are several
+ * 
+ * unless `sorted_free_inodes` is set, claiming and releasing inodes takes no lock. each
+ * thread keeps a few free inodes aside in a cache of its own, which other threads only empty
+ * once the list runs out, and `available_inode` is only the head of the free inode list
+ * while the file system lock is held exclusively. claims and releases from
+ * threads that do not hold the file system lock must not overlap with an exclusive holder
+ * 
+ * dblocks are split into up to `DBLOCK_GROUP_COUNT` groups with a lock each. a thread claims
+ * from a group of its own first and from the others once that runs out, so the dblocks of a
+ * file written by one thread stay close together
+ * 
+ * a file system without concurrency makes every lock function a no-op
+ * 
+ * @param fs the file system to share. nothing else may use it during the call
+ * @return SUCCESS if the locks were set up, or already were
+ *         INVALID_INPUT if fs is null
+ *         SYSTEM_ERROR if memory for the locks could not be allocated
+ */
+fs_retcode_t fs_enable_concurrency(filesystem_t *fs);
+
+/**
+ * takes the lock of the whole file system. not to be called while holding an inode lock
+ * 
+ * @param fs the file system
+ * @param exclusive true to keep every other thread out, false to share it
+ */
+void fs_lock_filesystem(filesystem_t *fs, bool exclusive);
+
+void fs_unlock_filesystem(filesystem_t *fs);
+
+/**
+ * takes the lock of one inode. the file system lock must be held
+ * 
+ * @param fs the file system the inode is in
+ * @param inode the inode to lock
+ * @param exclusive true to change the inode, false to read it
+ */
+void fs_lock_inode(filesystem_t *fs, inode_t *inode, bool exclusive);
+
+void fs_unlock_inode(filesystem_t *fs, inode_t *inode);
+
 /*---------------------------------------------*
  |  PART 1: LOW LEVEL INODE-DATA MANIPULATION  |
  |  functions you need to implement:           |
@@ -337,6 +536,130 @@ fs_retcode_t inode_shrink_data(filesystem_t *fs, inode_t *inode, size_t new_size
  */
 fs_retcode_t inode_release_data(filesystem_t *fs, inode_t *inode);
 
+/**
+ * same as `inode_read_data`, but resumes the indirect chain walk from `cursor` and
+ * leaves the cursor at the last index dblock visited. passing the same cursor to
+ * consecutive calls makes sequential reads O(1) amortized per dblock.
+ * 
+ * @param cursor the block map cursor to use and update. may be null.
+ */
+fs_retcode_t inode_read_data_cursor(filesystem_t *fs, inode_t *inode, dblock_cursor_t *cursor, size_t offset, void *buffer, size_t n, size_t *bytes_read);
+
+/**
+ * same as `inode_modify_data`, but resumes the indirect chain walk from `cursor` and
+ * leaves the cursor at the last index dblock visited.
+ * 
+ * @param cursor the block map cursor to use and update. may be null.
+ */
+fs_retcode_t inode_modify_data_cursor(filesystem_t *fs, inode_t *inode, dblock_cursor_t *cursor, size_t offset, void *buffer, size_t n);
+
+/**
+ * same as `inode_read_data_cursor`, but scatters the data over `iovcnt` buffers, filling
+ * each one before moving to the next. every dblock is looked up once for the whole batch,
+ * however many buffers its bytes go to.
+ * 
+ * @param iov the buffers to read into
+ * @param iovcnt the number of buffers
+ * @param bytes_read the address to store the total number of bytes read
+ * @return the same as `inode_read_data`, or INVALID_INPUT if the block map is missing a
+ *         dblock the file size covers. `bytes_read` then holds what was read before it
+ */
+fs_retcode_t inode_read_data_vec(filesystem_t *fs, inode_t *inode, dblock_cursor_t *cursor, size_t offset, const struct iovec *iov, size_t iovcnt, size_t *bytes_read);
+
+/**
+ * same as `inode_modify_data_cursor`, but gathers the new data from `iovcnt` buffers
+ * as if they were one. the dblocks for the whole batch are claimed at once, so either
+ * every buffer is written or the file system is not modified.
+ * 
+ * @param iov the buffers to write from
+ * @param iovcnt the number of buffers
+ */
+fs_retcode_t inode_modify_data_vec(filesystem_t *fs, inode_t *inode, dblock_cursor_t *cursor, size_t offset, const struct iovec *iov, size_t iovcnt);
+
+/**
+ * walks a byte range of an inode as spans that point straight into the file system's memory,
+ * so readers can look at the data without copying it. dblocks that follow each other on disk
+ * are joined into one span. the spans are only valid until the inode is modified.
+ */
+typedef struct dblock_span_iterator
+{
+    filesystem_t *fs;
+    inode_t *inode;
+    dblock_cursor_t cursor;
+    size_t offset; // first byte of the next span
+    size_t end; // one past the last byte of the range
+    const byte *pending; // the run found right after the last span, if it could not be joined to it
+    size_t pending_len;
+} dblock_span_iterator_t;
+
+/**
+ * starts iterating over `n` bytes of an inode from `offset`. the range is clipped to the file size.
+ * 
+ * @param it the iterator to initialize
+ * @return SUCCESS if the iterator is ready
+ *         INVALID_INPUT if fs, inode or it is null
+ */
+fs_retcode_t inode_span_begin(filesystem_t *fs, inode_t *inode, size_t offset, size_t n, dblock_span_iterator_t *it);
+
+/**
+ * gets the next span of an iterator started with `inode_span_begin`
+ * 
+ * @param it the iterator
+ * @param ptr the address to store the first byte of the span in
+ * @param len the address to store the length of the span in. never 0 for a returned span
+ * @return true if a span was stored, false once the range is done
+ */
+bool inode_span_next(dblock_span_iterator_t *it, const byte **ptr, size_t *len);
+
+/**
+ * how far a defragmentation pass got. a zeroed state starts a new pass
+ */
+typedef struct fs_defrag_state
+{
+    size_t next_inode; // the inode the next call starts at
+    size_t moved_dblocks; // dblocks moved since the pass started
+    bool done; // every inode was visited. the next call starts a new pass
+} fs_defrag_state_t;
+
+/**
+ * moves the dblocks of each inode into one run of consecutive dblocks: its data in file
+ * order, then its index dblocks. a file that already is one run is moved only if there
+ * is room for it further down, so the free space gathers at the end of the file system.
+ * runs are placed first-fit, and a file is left alone if no run is large enough for it.
+ * 
+ * a pass can be spread over many calls. each call picks up where `state` left off and
+ * stops once it moved `budget` dblocks, or before a file that would go past it. the first
+ * file of a call is always handled, however large it is.
+ * 
+ * @param fs the file system to defragment
+ * @param budget the number of dblocks one call may move. 0 finishes the pass in one call
+ * @param state the progress of the pass, updated by the call
+ * @return SUCCESS if the call did its part of the pass
+ *         INVALID_INPUT if fs or state is null, or the free inode list leaves the inode
+ *         table or loops
+ *         SYSTEM_ERROR if memory for the pass could not be allocated
+ */
+fs_retcode_t defragment_filesystem(filesystem_t *fs, size_t budget, fs_defrag_state_t *state);
+
+/**
+ * renumbers the inodes in use so they fill the start of the inode table, keeping their
+ * order, and rewrites every directory entry to the new numbers. the free inodes follow
+ * in ascending order. the root directory stays inode 0.
+ * 
+ * an inode pointer taken before the call may point to another file afterwards.
+ * `renumbered` tells the caller where each file went.
+ * 
+ * @param fs the file system to compact
+ * @param renumbered null, or an array of `inode_count` elements to store the new index of
+ *        each inode in. free inodes are mapped to 0
+ * @return SUCCESS if the inodes are compacted
+ *         INVALID_INPUT if fs is null, the free inode list leaves the inode table or loops,
+ *         or a directory cannot be read or names an inode that is free or out of range.
+ *         the file system is not modified then
+ *         SYSTEM_ERROR if memory for the compaction could not be allocated
+ */
+fs_retcode_t compact_inodes(filesystem_t *fs, inode_index_t *renumbered);
+
 typedef struct terminal_context
 {
     filesystem_t *fs;
@@ -348,6 +671,7 @@ struct fs_file
     filesystem_t *fs;
     inode_t *inode;
     size_t offset;
+    dblock_cursor_t cursor;
 };
 
 typedef struct fs_file *fs_file_t;
@@ -433,6 +757,42 @@ typedef enum seek_mode
  */
 int fs_seek(fs_file_t file, seek_mode_t seek_mode, int offset);
 
+/**
+ * reads the content of a file into several buffers, filling each one before moving to the
+ * next, as one read of their total length would
+ * 
+ * @param file the file handler returned by `fs_open`
+ * @param iov the buffers to store the data in
+ * @param iovcnt the number of buffers
+ * @return the number of bytes read. if `file` is null, return 0.
+ */
+size_t fs_readv(fs_file_t file, const struct iovec *iov, size_t iovcnt);
+
+/**
+ * writes the content of several buffers to a file, as one write of the buffers put
+ * together would. either every buffer is written or none is.
+ * 
+ * @param file the file handler returned by `fs_open`
+ * @param iov the buffers to write the data from
+ * @param iovcnt the number of buffers
+ * @return the number of bytes written. if `file` is null or any error, return 0.
+ */
+size_t fs_writev(fs_file_t file, const struct iovec *iov, size_t iovcnt);
+
+/**
+ * same as `fs_readv` and `fs_writev`, but at `offset` instead of the current position,
+ * which is left as it is
+ */
+size_t fs_preadv(fs_file_t file, const struct iovec *iov, size_t iovcnt, size_t offset);
+size_t fs_pwritev(fs_file_t file, const struct iovec *iov, size_t iovcnt, size_t offset);
+
+/**
+ * same as `fs_read` and `fs_write`, but at `offset` instead of the current position,
+ * which is left as it is
+ */
+size_t fs_pread(fs_file_t file, void *buffer, size_t n, size_t offset);
+size_t fs_pwrite(fs_file_t file, void *buffer, size_t n, size_t offset);
+
 /*----------------------------------------------*
  |  PART 3: HIGH LEVEL FILE SYSTEM OPERATIONS   |
  |  functions you need to implement:            |
@@ -552,21 +912,73 @@ int tree(terminal_context_t *context, char *path);
  /**
  * loads a file system from a input file
  * 
+ * the header counts are checked against the size of the file before anything is
+ * allocated, and the image is read in fixed size chunks straight into the file system.
+ * on failure nothing stays allocated.
+ * 
  * @param file the input file to load the file system from
  * @param fs the filesystem to write the content of the input file to
  * @return SUCCESS if the file system is correctly loaded
+ *         INVALID_BINARY_FORMAT if the image is truncated or its free inode list is broken
+ *         SYSTEM_ERROR if the file system could not be allocated
  */
 fs_retcode_t load_filesystem(FILE* file, filesystem_t *fs);
 
+/**
+ * what the consistency check of `load_filesystem_checked` found
+ */
+typedef struct fs_load_report
+{
+    size_t leaked_dblocks; // marked as used but not referenced by any inode
+    size_t unmarked_dblocks; // referenced by an inode but marked as available
+    size_t shared_dblocks; // references to a dblock that another reference already uses
+    size_t invalid_references; // dblock indices past the last dblock
+    size_t size_mismatches; // inodes whose file size is more than their block map holds
+} fs_load_report_t;
+
+/**
+ * loads a file system like `load_filesystem` while checking the dblock bitmask against
+ * the dblocks the inodes actually reference. the check runs on a second thread that
+ * follows the indirect chains as the loader reads the dblocks they live in.
+ * 
+ * only the dblocks covered by an inode's file size count as referenced. an inconsistent
+ * file system still loads; what was found is left in `report`.
+ * 
+ * @param file the input file to load the file system from
+ * @param fs the filesystem to write the content of the input file to
+ * @param report where to store the result of the check
+ * @return the same as `load_filesystem`, or INVALID_INPUT if `report` is null
+ */
+fs_retcode_t load_filesystem_checked(FILE *file, filesystem_t *fs, fs_load_report_t *report);
+
 /**
  * stores a file system to an output file
  * 
  * @param file the output file to write the file system to
  * @param fs the file system to store in the output file
  * @return SUCCESS if the file system is correctly saved
+ *         SYSTEM_ERROR if writing to the output file failed. the changes stay marked dirty
  */
 fs_retcode_t save_filesystem(FILE* file, filesystem_t *fs);
 
+/**
+ * writes only the parts of a file system that changed since it was last loaded or saved
+ * to an existing image file, using `pwrite` for each changed run of inodes, bitmask bytes
+ * and data blocks.
+ * 
+ * the file must hold the image of this file system as of its last load or save, so
+ * typically it is the file the file system was loaded from. `save_filesystem` writes the
+ * whole image instead.
+ * 
+ * @param file the image file to update, opened for reading and writing
+ * @param fs the file system to store in the image file
+ * @return SUCCESS if the image file is up to date
+ *         INVALID_INPUT if `file` or `fs` is null
+ *         INVALID_BINARY_FORMAT if the image file has a different geometry than `fs`
+ *         SYSTEM_ERROR if writing to the image file failed
+ */
+fs_retcode_t save_filesystem_incremental(FILE *file, filesystem_t *fs);
+
 // DEBUGGING FUNCTION
 
 typedef enum fs_display_flag
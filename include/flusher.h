@@ -0,0 +1,91 @@
+#ifndef FLUSHER_H
+#define FLUSHER_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <pthread.h>
+
+#include "filesys.h"
+#include "image.h"
+
+/**
+ * a background thread writing the changes to a file system to its image file. the file system
+ * counts the bytes it marks as changed, and wakes the flusher once they pass its threshold.
+ */
+
+// a flusher started with `start_flusher`
+struct fs_flusher
+{
+    filesystem_t *fs;
+    FILE *file;
+    pthread_t thread;
+    pthread_mutex_t lock; // guards the fields below `pending_size`
+    pthread_cond_t wake; // signaled when a flush is asked for, the threshold is reached or the flusher is stopped
+    pthread_cond_t flushed; // broadcast after every flush
+    size_t interval_ms; // 0 to only flush when asked to or past the threshold
+    size_t threshold; // a flush starts early once this many bytes changed. 0 for no threshold
+    size_t pending_size; // bytes changed since the last snapshot, roughly. updated atomically
+    uint64_t requested; // flushes asked for by `flush_filesystem`
+    uint64_t completed; // the last request the written snapshot was taken after
+    fs_retcode_t result; // of the last flush
+    bool stopping;
+    struct dirty_state taken; // what the snapshot being written took from `fs->dirty`
+    struct byte_buffer snapshot; // the regions of the image that changed, copied under the file system lock
+};
+
+// wakes the flusher once it has `threshold` bytes to write
+void wake_flusher(struct fs_flusher *flusher);
+
+/**
+ * starts a thread that writes the changes to a file system to its image file in the background.
+ * a flush holds the file system lock exclusively only while it copies the changed inodes,
+ * dblocks, bitmask bytes and header. writing the copies and waiting for them with `fdatasync`
+ * happens after the lock is released, so the threads using the file system wait for a copy
+ * of what changed and never for the disk.
+ *
+ * the flusher flushes every `interval_ms` milliseconds, once `threshold` bytes changed, and when
+ * asked to by `flush_filesystem`. a flush that fails leaves its changes for the next one.
+ * the image file gets one consistent state of the file system at a time, but a crash during a
+ * flush can leave it partly written. a journal is what survives that, see `attach_journal`
+ *
+ * while the flusher runs, the save functions do not forget what changed, since the
+ * flusher still has to write it. the flusher shares the file system with the threads using it,
+ * so this enables concurrency, see `fs_enable_concurrency`
+ *
+ * @param fs the file system to flush. a flusher it already had is stopped first. a file system
+ *        opened with `map_filesystem` is synced with `sync_filesystem` instead
+ * @param file the image file `fs` was loaded from or last saved to, opened for reading and writing.
+ *        the file system closes it when the flusher is stopped or the file system is freed
+ * @param interval_ms time between flushes. 0 to only flush when asked to or past the threshold
+ * @param threshold bytes of changes that start a flush early. 0 for no threshold
+ * @return SUCCESS if the flusher is running
+ *         INVALID_INPUT if `fs` or `file` is null, or `fs` is mapped
+ *         INVALID_BINARY_FORMAT if `file` is not an image with the geometry of `fs`
+ *         SYSTEM_ERROR if memory could not be allocated or the thread not started
+ */
+fs_retcode_t start_flusher(filesystem_t *fs, FILE *file, size_t interval_ms, size_t threshold);
+
+/**
+ * asks the flusher for a flush that includes every change made so far. not to be called with
+ * `wait` while holding the file system lock
+ *
+ * @param fs the file system with a flusher
+ * @param wait true to return once the flush is done, false to return right away
+ * @return the result of the last flush that finished, SUCCESS if there was none yet
+ *         INVALID_INPUT if `fs` is null or has no flusher
+ */
+fs_retcode_t flush_filesystem(filesystem_t *fs, bool wait);
+
+/**
+ * flushes whatever changed, stops the flusher and closes the image file. `free_filesystem` does
+ * this too. not to be called while holding the file system lock
+ *
+ * @param fs the file system
+ * @return the result of the final flush, or SUCCESS if `fs` has no flusher
+ *         INVALID_INPUT if `fs` is null
+ */
+fs_retcode_t stop_flusher(filesystem_t *fs);
+
+#endif
@@ -0,0 +1,71 @@
+#ifndef FSCK_H
+#define FSCK_H
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "filesys.h"
+
+/**
+ * the consistency check behind `fsck_filesystem` and `load_filesystem_checked`.
+ *
+ * the check follows the block map of every inode in use and marks each dblock it reaches,
+ * then compares the marks with the dblock bitmask. `fsck_filesystem` splits the inodes
+ * between the threads of a scan. while loading, the check runs on a thread of its own and
+ * waits for the loader to read each index dblock before it looks inside.
+ */
+
+/**
+ * what `fsck_filesystem` found
+ */
+typedef struct fs_fsck_report
+{
+    fs_load_report_t dblocks; // leaked, unmarked (allocated twice once claimed), shared (cross-linked) and invalid dblocks
+    bool broken_free_inode_list; // the list from `available_inode` leaves the inode table or loops
+    size_t checked_inodes; // inodes not on the free inode list
+    size_t thread_count; // threads the check ran on
+} fs_fsck_report_t;
+
+/**
+ * checks a file system in memory the way `load_filesystem_checked` checks an image, and
+ * also checks the free inode list. the inodes are scanned like `fs_for_each_inode` does.
+ * 
+ * @param fs the file system to check
+ * @param thread_count how many threads to check with. 0 uses one per online cpu
+ * @param report where to store what the check found
+ * @return SUCCESS if the check ran, whatever it found
+ *         INVALID_INPUT if fs or report is null
+ *         SYSTEM_ERROR if memory for the check could not be allocated
+ */
+fs_retcode_t fsck_filesystem(filesystem_t *fs, size_t thread_count, fs_fsck_report_t *report);
+
+// how far the loader got into the dblocks, shared with the consistency check
+typedef struct load_progress
+{
+    pthread_mutex_t lock;
+    pthread_cond_t advanced;
+    size_t loaded_dblocks;
+    bool failed;
+} load_progress_t;
+
+// the state of one thread of a check
+typedef struct consistency_check
+{
+    filesystem_t *fs;
+    const byte *free_inodes; // one bit per inode on the free list
+    load_progress_t *progress; // null if the dblocks are already loaded
+    size_t known_loaded_dblocks;
+    byte *referenced; // one bit per dblock referenced by an inode, shared by every thread of a check
+    fs_load_report_t report;
+    bool aborted;
+} consistency_check_t;
+
+// checks every inode not set in `check->free_inodes` on the calling thread. the argument and
+// result are those of a pthread start routine, so the loader can run it on a thread of its own
+void *run_consistency_check(void *arg);
+
+// adds the dblocks marked in `check->referenced` that disagree with the bitmask to the report
+void compare_referenced_dblocks(consistency_check_t *check);
+
+#endif
@@ -0,0 +1,148 @@
+#ifndef IMAGE_H
+#define IMAGE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "filesys.h"
+
+/**
+ * the image file of a file system and the changes to it.
+ *
+ * an image is a header, the inode table, the dblock bitmask and the dblocks, in that order.
+ * the header holds the inode count, the head of the free inode list and the dblock count.
+ * images of a build with a non default block size start with a magic number and the block
+ * size, so they can not be mistaken for images of another block size. default images keep
+ * the original format.
+ *
+ * the dirty maps record which parts of the image changed since they were last cleared, one
+ * bit per inode, dblock and bitmask byte. `fs->dirty` tracks what the image file is missing;
+ * a journal and a flusher keep maps of their own. the functions below walk the changed parts
+ * as regions, each an offset in the image and the bytes it should now hold.
+ */
+
+#define IMAGE_GEOMETRY_MAGIC ((size_t) 0x3153424B4C425346) // "FSBLKBS1"
+#define IMAGE_HAS_GEOMETRY (DATA_BLOCK_SIZE != DEFAULT_DATA_BLOCK_SIZE)
+#define IMAGE_GEOMETRY_SIZE (IMAGE_HAS_GEOMETRY ? 2 * sizeof(size_t) : 0)
+
+#define IMAGE_HEADER_SIZE (IMAGE_GEOMETRY_SIZE + sizeof(size_t) + sizeof(inode_index_t) + sizeof(size_t))
+#define IMAGE_INODE_COUNT_OFFSET IMAGE_GEOMETRY_SIZE
+#define IMAGE_AVAILABLE_INODE_OFFSET (IMAGE_INODE_COUNT_OFFSET + sizeof(size_t))
+#define IMAGE_DBLOCK_COUNT_OFFSET (IMAGE_AVAILABLE_INODE_OFFSET + sizeof(inode_index_t))
+#define IMAGE_INODES_OFFSET IMAGE_HEADER_SIZE
+#define IMAGE_BITMASK_SIZE(dblock_count) (((dblock_count) + 7) / 8)
+#define IMAGE_BITMASK_OFFSET(inode_count) (IMAGE_INODES_OFFSET + (inode_count) * sizeof(inode_t))
+#define IMAGE_DBLOCKS_OFFSET(inode_count, dblock_count) (IMAGE_BITMASK_OFFSET(inode_count) + IMAGE_BITMASK_SIZE(dblock_count))
+#define IMAGE_SIZE(inode_count, dblock_count) (IMAGE_DBLOCKS_OFFSET(inode_count, dblock_count) + (dblock_count) * DATA_BLOCK_SIZE)
+
+// serializes the header of the image of a file system into IMAGE_HEADER_SIZE bytes
+void encode_image_header(const filesystem_t *fs, byte *header);
+
+// reads a serialized header. returns false if it was written by a build with another block size
+bool decode_image_header(const byte *header, size_t *inode_count, inode_index_t *available_inode, size_t *dblock_count);
+
+// SUCCESS if the image file behind `fd` is laid out exactly like `fs`, INVALID_BINARY_FORMAT if not
+fs_retcode_t check_image_layout(int fd, const filesystem_t *fs);
+
+// called with the offset of a changed region in the image and the bytes it should now hold
+typedef fs_retcode_t (*image_region_fn)(filesystem_t *fs, size_t offset, const void *data, size_t len, void *ctx);
+
+// calls `fn` for every region of the image a set of dirty maps marks as changed, in file order.
+// stops at the first call that does not return SUCCESS, and returns what it returned
+fs_retcode_t for_each_dirty_region(filesystem_t *fs, const struct dirty_state *dirty, image_region_fn fn, void *ctx);
+
+// an image_region_fn writing a region to its place in the file whose descriptor `ctx` points to
+fs_retcode_t write_image_region(filesystem_t *fs, size_t offset, const void *data, size_t len, void *ctx);
+
+// writes what `fs->dirty` marks as changed to an image file laid out like `fs`, and clears
+// the marks unless a flusher still has to write them. does not take the file system lock
+fs_retcode_t write_dirty_image(FILE *file, filesystem_t *fs);
+
+// bytes gathered in memory before they are written out
+struct byte_buffer
+{
+    byte *data;
+    size_t size;
+    size_t capacity;
+};
+
+// makes room for `len` more bytes at the end of the buffer
+fs_retcode_t grow_byte_buffer(struct byte_buffer *buffer, size_t len);
+
+// how `append_image_region` stores a region in a buffer, right before its contents
+typedef struct image_region
+{
+    uint64_t offset;
+    uint64_t length;
+} image_region_t;
+
+// an image_region_fn appending a region to the byte_buffer `ctx` points to
+fs_retcode_t append_image_region(filesystem_t *fs, size_t offset, const void *data, size_t len, void *ctx);
+
+// writes `length` bytes of regions appended by `append_image_region` to the image file behind `fd`
+fs_retcode_t write_image_regions(int fd, const byte *regions, size_t length);
+
+/**
+ * opens a file system by memory mapping an image file instead of reading it.
+ * 
+ * `fs->inodes`, `fs->dblock_bitmask` and `fs->dblocks` point directly into a shared 
+ * mapping of the image, so opening is O(1) in the size of the image and data blocks that
+ * are never accessed are never read from disk. every change made to the file system is a
+ * change to the image file. `sync_filesystem` flushes it and `free_filesystem` unmaps it.
+ * 
+ * the image layout packs the inode table right after an 18 byte header, so inodes and
+ * dblock indices in the mapping are not naturally aligned. this relies on the platform
+ * allowing unaligned loads and stores (x86-64 and arm64 both do).
+ * 
+ * @param file the image file, opened for reading and writing. it may be closed afterwards
+ * @param fs the file system to map the image into
+ * @return SUCCESS if the image is mapped
+ *         INVALID_INPUT if `file` or `fs` is null
+ *         INVALID_BINARY_FORMAT if the image is truncated
+ *         SYSTEM_ERROR if the image could not be mapped
+ */
+fs_retcode_t map_filesystem(FILE *file, filesystem_t *fs);
+
+/**
+ * flushes a file system opened with `map_filesystem` to its image file and waits for
+ * the write to complete. only the pages holding changes since the last flush are synced.
+ * 
+ * @param fs the mapped file system to flush
+ * @return SUCCESS if the image file is up to date
+ *         INVALID_INPUT if `fs` is null or was not opened with `map_filesystem`
+ *         SYSTEM_ERROR if the flush failed
+ */
+fs_retcode_t sync_filesystem(filesystem_t *fs);
+
+// unmaps a file system opened with `map_filesystem`. the kernel writes back the pages lazily
+void unmap_filesystem(filesystem_t *fs);
+
+// the dirty maps are kept up to date by filesys.c
+
+fs_retcode_t init_dirty_state(filesystem_t *fs, bool all_dirty);
+
+void clear_dirty_state(filesystem_t *fs);
+
+void free_dirty_state(filesystem_t *fs);
+
+// the same for dirty maps other than `fs->dirty`, sized for the file system
+fs_retcode_t init_dirty_maps(const filesystem_t *fs, struct dirty_state *dirty);
+
+void clear_dirty_maps(const filesystem_t *fs, struct dirty_state *dirty);
+
+void copy_dirty_maps(const filesystem_t *fs, struct dirty_state *dest, const struct dirty_state *src);
+
+// marks everything marked in `src` in `dest` as well
+void merge_dirty_maps(const filesystem_t *fs, struct dirty_state *dest, const struct dirty_state *src);
+
+void free_dirty_maps(struct dirty_state *dirty);
+
+void mark_bitmask_dirty(filesystem_t *fs, size_t dblock_index);
+
+void mark_bitmask_range_dirty(filesystem_t *fs, size_t dblock_index, size_t count);
+
+void mark_header_dirty(filesystem_t *fs);
+
+#endif
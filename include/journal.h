@@ -0,0 +1,143 @@
+#ifndef JOURNAL_H
+#define JOURNAL_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <pthread.h>
+
+#include "filesys.h"
+#include "image.h"
+
+/**
+ * a write-ahead journal of the changes to a file system's image. the file system records what
+ * changes in the dirty maps of its journal, and each commit appends the new contents of those
+ * parts of the image to the journal file as one transaction.
+ */
+
+// the changes one thread made while others shared the file system lock with it. they go into
+// the thread's own transactions, so no other thread copies them before the change is complete
+struct journal_writer
+{
+    struct journal_writer *next;
+    pthread_t thread;
+    struct dirty_state pending;
+};
+
+// a journal attached with `attach_journal`
+struct fs_journal
+{
+    FILE *file;
+    uint64_t id; // tells the journal apart from the ones attached before it, for the threads that remember their writer
+    struct journal_writer *writers; // pushed without a lock, and only freed with the journal
+    size_t committing; // threads that took the file system lock to add a transaction and did not yet. updated atomically
+    pthread_mutex_t lock; // orders the transactions. guards the fields below
+    pthread_cond_t changed; // broadcast when a transaction is added to the buffer and after every write of it
+    struct dirty_state pending; // what changed since the last transaction while nobody shared the file system lock
+    struct byte_buffer buffer; // transactions committed but not yet written
+    size_t group_size; // how many transactions a write waits for while other threads are still committing
+    size_t durable_size; // the journal file holds this many bytes of whole transactions
+    uint64_t sequence; // of the next transaction
+    uint64_t durable_sequence; // every transaction before this one is in the journal file
+    bool writing; // a thread is waiting for the journal file outside of `lock`
+};
+
+// the maps the calling thread records its changes in while others share the file system lock, null without memory
+struct dirty_state *journal_writer_pending(filesystem_t *fs);
+
+/**
+ * starts writing the changes to a file system to a journal file, so they survive a crash
+ * without saving the whole image after every change.
+ * 
+ * each `commit_journal` appends one transaction to the journal: the new contents of every
+ * part of the image (header, inodes, bitmask bytes and dblocks) that changed since the
+ * previous one. after a crash, `replay_journal` brings the image file up to date with the
+ * last transaction that was completely written.
+ * 
+ * a commit returns once its transaction is in the journal file. threads committing at the
+ * same time share one `fdatasync`: the thread that writes waits for the others still adding
+ * their transactions, up to `group_size` of them. the journal file starts out empty, and
+ * replaying it only helps with the image file the file system was last loaded from or saved to.
+ * 
+ * @param fs the file system to journal. a journal it already had is detached first
+ * @param file the journal file, opened for reading and writing. the file system closes it
+ *        when the journal is detached or the file system is freed
+ * @param group_size the most transactions a write waits for. 1 writes each one by itself
+ * @return SUCCESS if the journal is attached
+ *         INVALID_INPUT if `fs` or `file` is null or `group_size` is 0
+ *         SYSTEM_ERROR if memory could not be allocated or the journal file not emptied
+ */
+fs_retcode_t attach_journal(filesystem_t *fs, FILE *file, size_t group_size);
+
+/**
+ * ends a transaction of the journal and waits until it is in the journal file. the high
+ * level file functions call it after every change they make.
+ * 
+ * with concurrency, each thread's changes go into its own transactions, built under the
+ * shared file system lock, so writers do not wait for each other's commits. a transaction
+ * holds the calling thread's changes since its last one, and whatever changed while the file
+ * system lock was held exclusively. one with a change to the free inode list in the header
+ * takes everybody's changes and the lock exclusively, as other threads' transactions cannot
+ * say where the list starts. a crash can still leak the inodes or dblocks a change that was
+ * not committed yet had claimed
+ * 
+ * @param fs the file system
+ * @return SUCCESS if the transaction is in the journal file, or `fs` has no journal
+ *         INVALID_INPUT if `fs` is null
+ *         SYSTEM_ERROR if memory could not be allocated or writing the journal file failed.
+ *         the transaction is written again with the next one
+ */
+fs_retcode_t commit_journal(filesystem_t *fs);
+
+/**
+ * waits until every committed transaction is in the journal file, and writes the ones a
+ * failed write left behind
+ * 
+ * @param fs the file system
+ * @return SUCCESS if every committed transaction is in the journal file, or `fs` has no journal
+ *         INVALID_INPUT if `fs` is null
+ *         SYSTEM_ERROR if writing the journal file failed
+ */
+fs_retcode_t sync_journal(filesystem_t *fs);
+
+/**
+ * writes every change to the image file like `save_filesystem_incremental` and then empties
+ * the journal, which the image file no longer needs
+ * 
+ * @param file the image file the file system was last loaded from or saved to
+ * @param fs the file system with a journal
+ * @return SUCCESS if the image file is up to date and the journal empty
+ *         INVALID_INPUT if `file` or `fs` is null or `fs` has no journal
+ *         INVALID_BINARY_FORMAT if the image file has a different geometry than `fs`
+ *         SYSTEM_ERROR if writing either file failed
+ */
+fs_retcode_t checkpoint_journal(FILE *file, filesystem_t *fs);
+
+/**
+ * writes the committed transactions, stops journaling and closes the journal file.
+ * `free_filesystem` does this too.
+ * 
+ * @param fs the file system
+ * @return SUCCESS if the journal file is complete, or `fs` has no journal
+ *         INVALID_INPUT if `fs` is null
+ *         SYSTEM_ERROR if writing the journal file failed. it is closed anyway
+ */
+fs_retcode_t detach_journal(filesystem_t *fs);
+
+/**
+ * applies the transactions of a journal to the image file it was written for, in order.
+ * a transaction that was only partly written, or that does not fit the image, ends the
+ * replay without changing anything, since nothing after it was committed. replaying the
+ * same journal twice writes the same bytes twice.
+ * 
+ * @param journal the journal file
+ * @param image the image file, opened for reading and writing
+ * @param replayed where to store how many transactions were applied. may be null
+ * @return SUCCESS if every complete transaction was applied
+ *         INVALID_INPUT if `journal` or `image` is null
+ *         SYSTEM_ERROR if reading the journal or writing the image failed
+ */
+fs_retcode_t replay_journal(FILE *journal, FILE *image, size_t *replayed);
+
+#endif
@@ -0,0 +1,62 @@
+#ifndef SCAN_H
+#define SCAN_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "filesys.h"
+
+/**
+ * parallel scans of the inode table.
+ *
+ * the free inode list is turned into a mask once, then the table is split into chunks that
+ * the threads, the calling one included, take in turn. free inodes are skipped a word of the
+ * mask at a time, so a mostly empty table costs little to scan.
+ */
+
+/**
+ * decides whether `fs_for_each_inode` hands an inode in use to its callback. may be called
+ * from several threads at once
+ */
+typedef bool (*fs_inode_predicate_t)(const filesystem_t *fs, inode_index_t index, const inode_t *inode, void *arg);
+
+/**
+ * called by `fs_for_each_inode` for each inode in use the predicate accepted. calls for
+ * different inodes run on different threads in no particular order. `worker` is the index of
+ * the calling thread, below the count `fs_scan_thread_count` gives, so per-thread state can
+ * be kept without locks
+ */
+typedef void (*fs_inode_callback_t)(filesystem_t *fs, inode_index_t index, inode_t *inode, size_t worker, void *arg);
+
+/**
+ * @param fs the file system a scan would run over, or null
+ * @param thread_count the thread count asked for. 0 asks for one per online cpu
+ * @return the number of threads `fs_for_each_inode` and `fsck_filesystem` use for
+ *         `thread_count`. never more than there are chunks of inodes to take
+ */
+size_t fs_scan_thread_count(filesystem_t *fs, size_t thread_count);
+
+/**
+ * calls `callback` for every inode in use that `predicate` accepts.
+ * 
+ * @param fs the file system whose inodes to scan
+ * @param predicate null to accept every inode in use
+ * @param callback what to do with each accepted inode
+ * @param arg passed to `predicate` and `callback`
+ * @param thread_count how many threads to scan with. 0 uses one per online cpu
+ * @return SUCCESS once every inode was handed out
+ *         INVALID_INPUT if fs or callback is null, or the free inode list loops or leaves
+ *         the inode table
+ *         SYSTEM_ERROR if memory for the scan could not be allocated
+ */
+fs_retcode_t fs_for_each_inode(filesystem_t *fs, fs_inode_predicate_t predicate, fs_inode_callback_t callback, void *arg, size_t thread_count);
+
+// sets the bit of every inode on the free inode list in `free_inodes`, which starts out clear.
+// false if the list leaves the inode table or loops, after marking the inodes before that point
+bool collect_free_inodes(filesystem_t *fs, byte *free_inodes);
+
+// scans the inodes not set in `free_inodes` with exactly `thread_count` workers, for callers
+// that built the mask themselves. the calling thread is the first worker
+fs_retcode_t scan_inodes(filesystem_t *fs, const byte *free_inodes, fs_inode_predicate_t predicate, fs_inode_callback_t callback, void *arg, size_t thread_count);
+
+#endif
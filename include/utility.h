@@ -7,10 +7,17 @@
 
 #include <stddef.h>
 
+// a tree of index dblocks this tall reaches 16^8 data dblocks, past the largest dblock index
+#define TREE_MAX_HEIGHT 8
+
 size_t calculate_index_dblock_amount(size_t file_size);
 
 size_t calculate_necessary_dblock_amount(size_t file_size);
 
+size_t calculate_tree_capacity(size_t height);
+
+size_t calculate_tree_index_dblock_amount(size_t file_size);
+
 dblock_index_t *cast_dblock_ptr(void *addr);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,290 @@
+#include "bitmap.h"
+
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define BITMAP_HAS_X86_KERNELS 1
+#include <immintrin.h>
+#else
+#define BITMAP_HAS_X86_KERNELS 0
+#endif
+
+// a kernel works on whole bytes. the functions below deal with the partial bytes at the edges.
+typedef struct bitmap_kernel_table
+{
+    // counts the set bits of `len` bytes
+    size_t (*popcount_bytes)(const byte *bytes, size_t len);
+    // returns the offset of the first byte that is not `skip`, or `len` if there is none
+    size_t (*find_byte_not)(const byte *bytes, size_t len, byte skip);
+} bitmap_kernel_table_t;
+
+// ----------------------- PORTABLE KERNEL ----------------------- //
+
+static size_t popcount_bytes_portable(const byte *bytes, size_t len)
+{
+    size_t count = 0;
+    size_t i = 0;
+    for (; i + sizeof(uint64_t) <= len; i += sizeof(uint64_t))
+    {
+        uint64_t word;
+        memcpy(&word, bytes + i, sizeof(word));
+        count += __builtin_popcountll(word);
+    }
+    for (; i < len; ++i) count += __builtin_popcount(bytes[i]);
+    return count;
+}
+
+static size_t find_byte_not_portable(const byte *bytes, size_t len, byte skip)
+{
+    uint64_t pattern = skip ? UINT64_MAX : 0;
+    size_t i = 0;
+    for (; i + sizeof(uint64_t) <= len; i += sizeof(uint64_t))
+    {
+        uint64_t word;
+        memcpy(&word, bytes + i, sizeof(word));
+        if (word != pattern) break;
+    }
+    for (; i < len; ++i)
+    {
+        if (bytes[i] != skip) return i;
+    }
+    return len;
+}
+
+// ----------------------- X86 KERNELS ----------------------- //
+
+#if BITMAP_HAS_X86_KERNELS
+
+__attribute__((target("sse4.2,popcnt")))
+static size_t popcount_bytes_sse42(const byte *bytes, size_t len)
+{
+    size_t count = 0;
+    size_t i = 0;
+#if defined(__x86_64__)
+    for (; i + sizeof(uint64_t) <= len; i += sizeof(uint64_t))
+    {
+        uint64_t word;
+        memcpy(&word, bytes + i, sizeof(word));
+        count += _mm_popcnt_u64(word);
+    }
+#endif
+    for (; i + sizeof(uint32_t) <= len; i += sizeof(uint32_t))
+    {
+        uint32_t word;
+        memcpy(&word, bytes + i, sizeof(word));
+        count += _mm_popcnt_u32(word);
+    }
+    for (; i < len; ++i) count += _mm_popcnt_u32(bytes[i]);
+    return count;
+}
+
+__attribute__((target("sse4.2")))
+static size_t find_byte_not_sse42(const byte *bytes, size_t len, byte skip)
+{
+    const __m128i pattern = _mm_set1_epi8((char) skip);
+    size_t i = 0;
+    for (; i + sizeof(__m128i) <= len; i += sizeof(__m128i))
+    {
+        __m128i chunk = _mm_loadu_si128((const __m128i *) (bytes + i));
+        unsigned equal = (unsigned) _mm_movemask_epi8(_mm_cmpeq_epi8(chunk, pattern));
+        if (equal != 0xFFFF) return i + __builtin_ctz(~equal);
+    }
+    for (; i < len; ++i)
+    {
+        if (bytes[i] != skip) return i;
+    }
+    return len;
+}
+
+// nibble lookup popcount (Mula et al.), summed per 64 bit lane with psadbw
+__attribute__((target("avx2,popcnt")))
+static size_t popcount_bytes_avx2(const byte *bytes, size_t len)
+{
+    const __m256i lookup = _mm256_setr_epi8(
+        0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4,
+        0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4
+    );
+    const __m256i low_mask = _mm256_set1_epi8(0x0F);
+    const __m256i zero = _mm256_setzero_si256();
+    __m256i total = zero;
+
+    size_t i = 0;
+    for (; i + sizeof(__m256i) <= len; i += sizeof(__m256i))
+    {
+        __m256i chunk = _mm256_loadu_si256((const __m256i *) (bytes + i));
+        __m256i low = _mm256_and_si256(chunk, low_mask);
+        __m256i high = _mm256_and_si256(_mm256_srli_epi16(chunk, 4), low_mask);
+        __m256i counts = _mm256_add_epi8(_mm256_shuffle_epi8(lookup, low), _mm256_shuffle_epi8(lookup, high));
+        total = _mm256_add_epi64(total, _mm256_sad_epu8(counts, zero));
+    }
+
+    uint64_t lanes[4];
+    _mm256_storeu_si256((__m256i *) lanes, total);
+    size_t count = lanes[0] + lanes[1] + lanes[2] + lanes[3];
+
+    return count + popcount_bytes_sse42(bytes + i, len - i);
+}
+
+__attribute__((target("avx2")))
+static size_t find_byte_not_avx2(const byte *bytes, size_t len, byte skip)
+{
+    const __m256i pattern = _mm256_set1_epi8((char) skip);
+    size_t i = 0;
+    for (; i + sizeof(__m256i) <= len; i += sizeof(__m256i))
+    {
+        __m256i chunk = _mm256_loadu_si256((const __m256i *) (bytes + i));
+        unsigned equal = (unsigned) _mm256_movemask_epi8(_mm256_cmpeq_epi8(chunk, pattern));
+        if (equal != UINT32_MAX) return i + __builtin_ctz(~equal);
+    }
+    for (; i < len; ++i)
+    {
+        if (bytes[i] != skip) return i;
+    }
+    return len;
+}
+
+#endif
+
+// ----------------------- DISPATCH ----------------------- //
+
+static const bitmap_kernel_table_t kernel_tables[BITMAP_KERNEL_TOTAL] = {
+    [BITMAP_KERNEL_PORTABLE] = { popcount_bytes_portable, find_byte_not_portable },
+#if BITMAP_HAS_X86_KERNELS
+    [BITMAP_KERNEL_SSE42] = { popcount_bytes_sse42, find_byte_not_sse42 },
+    [BITMAP_KERNEL_AVX2] = { popcount_bytes_avx2, find_byte_not_avx2 },
+#else
+    [BITMAP_KERNEL_SSE42] = { popcount_bytes_portable, find_byte_not_portable },
+    [BITMAP_KERNEL_AVX2] = { popcount_bytes_portable, find_byte_not_portable },
+#endif
+};
+
+static bitmap_kernel_t current_kernel = BITMAP_KERNEL_PORTABLE;
+
+static bool kernel_supported(bitmap_kernel_t kernel)
+{
+    switch (kernel)
+    {
+    case BITMAP_KERNEL_PORTABLE:
+        return true;
+#if BITMAP_HAS_X86_KERNELS
+    case BITMAP_KERNEL_SSE42:
+        return __builtin_cpu_supports("sse4.2") && __builtin_cpu_supports("popcnt");
+    case BITMAP_KERNEL_AVX2:
+        return __builtin_cpu_supports("avx2") && __builtin_cpu_supports("popcnt");
+#endif
+    default:
+        return false;
+    }
+}
+
+// picks the fastest supported kernel before main runs, so no call ever races the selection
+__attribute__((constructor))
+static void select_best_kernel(void)
+{
+#if BITMAP_HAS_X86_KERNELS
+    __builtin_cpu_init();
+#endif
+    for (int kernel = BITMAP_KERNEL_TOTAL - 1; kernel >= 0; --kernel)
+    {
+        if (kernel_supported((bitmap_kernel_t) kernel))
+        {
+            current_kernel = (bitmap_kernel_t) kernel;
+            return;
+        }
+    }
+}
+
+bool bitmap_select_kernel(bitmap_kernel_t kernel)
+{
+    if (kernel >= BITMAP_KERNEL_TOTAL || !kernel_supported(kernel)) return false;
+    current_kernel = kernel;
+    return true;
+}
+
+bitmap_kernel_t bitmap_current_kernel(void)
+{
+    return current_kernel;
+}
+
+// ----------------------- BITMAP FUNCTIONS ----------------------- //
+
+size_t bitmap_popcount(const byte *bitmap, size_t nbits)
+{
+    size_t full_bytes = nbits / 8;
+    size_t count = kernel_tables[current_kernel].popcount_bytes(bitmap, full_bytes);
+
+    // only the leading bits of the last partial byte belong to the bitmap
+    size_t rest = nbits % 8;
+    if (rest) count += __builtin_popcount(bitmap[full_bytes] & (0xFF << (8 - rest)) & 0xFF);
+    return count;
+}
+
+// finds the first bit at or after start whose value is not the one repeated in `skip` (0x00 or 0xFF)
+static bool find_first_bit_not(const byte *bitmap, size_t nbits, size_t start, byte skip, size_t *index)
+{
+    if (start >= nbits) return false;
+
+    size_t byte_count = (nbits + 7) / 8;
+    size_t b = start / 8;
+
+    // the bits we are looking for become set bits after flipping with skip
+    byte head = (byte) (bitmap[b] ^ skip) & (0xFF >> (start % 8));
+    if (!head)
+    {
+        ++b;
+        b += kernel_tables[current_kernel].find_byte_not(bitmap + b, byte_count - b, skip);
+        if (b >= byte_count) return false;
+        head = (byte) (bitmap[b] ^ skip);
+    }
+
+    size_t idx = b * 8 + (__builtin_clz(head) - (sizeof(unsigned) - 1) * 8);
+    if (idx >= nbits) return false;
+    *index = idx;
+    return true;
+}
+
+bool bitmap_find_first_set(const byte *bitmap, size_t nbits, size_t start, size_t *index)
+{
+    return find_first_bit_not(bitmap, nbits, start, 0x00, index);
+}
+
+bool bitmap_find_first_clear(const byte *bitmap, size_t nbits, size_t start, size_t *index)
+{
+    return find_first_bit_not(bitmap, nbits, start, 0xFF, index);
+}
+
+bool bitmap_find_set_run(const byte *bitmap, size_t nbits, size_t start, size_t len, size_t *index)
+{
+    if (len == 0) return false;
+
+    size_t run_start;
+    while (bitmap_find_first_set(bitmap, nbits, start, &run_start))
+    {
+        size_t run_end;
+        if (!bitmap_find_first_clear(bitmap, nbits, run_start, &run_end)) run_end = nbits;
+        if (run_end - run_start >= len)
+        {
+            *index = run_start;
+            return true;
+        }
+        start = run_end;
+    }
+    return false;
+}
+
+void bitmap_set_range(byte *bitmap, size_t first, size_t len)
+{
+    for (; len && first % 8; --len) bitmap_set(bitmap, first++);
+    memset(bitmap + first / 8, 0xFF, len / 8);
+    first += len / 8 * 8;
+    for (len %= 8; len; --len) bitmap_set(bitmap, first++);
+}
+
+void bitmap_clear_range(byte *bitmap, size_t first, size_t len)
+{
+    for (; len && first % 8; --len) bitmap_clear(bitmap, first++);
+    memset(bitmap + first / 8, 0x00, len / 8);
+    first += len / 8 * 8;
+    for (len %= 8; len; --len) bitmap_clear(bitmap, first++);
+}
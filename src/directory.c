@@ -0,0 +1,520 @@
+#include "directory.h"
+#include "utility.h"
+#include "locks.h"
+
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define DIRECTORY_ENTRY_SIZE (sizeof(inode_index_t) + MAX_FILE_NAME_LEN)
+
+// a bucket whose entry was removed. lookups probe past it
+#define BUCKET_REMOVED UINT32_MAX
+
+#define MIN_BUCKET_COUNT 16
+
+// an entry never straddles two dblocks, so each one is a single span
+_Static_assert(DATA_BLOCK_SIZE % DIRECTORY_ENTRY_SIZE == 0, "directory entries must not straddle dblocks");
+
+// ----------------------- ENTRIES ----------------------- //
+
+// only the defragmenter and a compaction move dblocks or inodes from under a directory, and both hold the
+// file system lock exclusively. shrinking other files leaves the entries where they are
+static size_t current_generation(filesystem_t *fs)
+{
+    return __atomic_load_n(&fs->relocation_generation, __ATOMIC_RELAXED);
+}
+
+static fs_retcode_t check_name(const char *name)
+{
+    if (name[0] == '\0') return EMPTY_FILENAME;
+    if (strnlen(name, MAX_FILE_NAME_LEN + 1) > MAX_FILE_NAME_LEN) return INVALID_FILENAME;
+    return SUCCESS;
+}
+
+static const char *entry_name(const byte *entry)
+{
+    return (const char *) entry + sizeof(inode_index_t);
+}
+
+static inode_index_t entry_inode(const byte *entry)
+{
+    inode_index_t idx;
+    memcpy(&idx, entry, sizeof(idx));
+    return idx;
+}
+
+static bool entry_has_name(const byte *entry, const char *name)
+{
+    return strncmp(entry_name(entry), name, MAX_FILE_NAME_LEN) == 0;
+}
+
+// FNV-1a over at most MAX_FILE_NAME_LEN characters, like the names in the entries
+static uint32_t hash_name(const char *name)
+{
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < MAX_FILE_NAME_LEN && name[i]; ++i)
+    {
+        hash ^= (byte) name[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+// hands each entry of a directory to `visit` until it returns true. returns the slot it stopped at, or the slot count
+typedef bool (*entry_visitor_t)(byte *entry, size_t slot, void *arg);
+
+static size_t visit_entries(filesystem_t *fs, inode_t *dir, entry_visitor_t visit, void *arg)
+{
+    size_t slot_count = dir->internal.file_size / DIRECTORY_ENTRY_SIZE;
+    dblock_span_iterator_t it;
+    if (inode_span_begin(fs, dir, 0, slot_count * DIRECTORY_ENTRY_SIZE, &it) != SUCCESS) return slot_count;
+
+    const byte *span;
+    size_t len;
+    size_t slot = 0;
+    while (inode_span_next(&it, &span, &len))
+    {
+        for (size_t offset = 0; offset + DIRECTORY_ENTRY_SIZE <= len; offset += DIRECTORY_ENTRY_SIZE, ++slot)
+        {
+            if (visit((byte *) span + offset, slot, arg)) return slot;
+        }
+    }
+    return slot_count;
+}
+
+// what a scan without an index is looking for, and the first tombstone it passed
+typedef struct entry_search
+{
+    const char *name;
+    byte *found;
+    size_t free_slot;
+} entry_search_t;
+
+static bool match_entry(byte *entry, size_t slot, void *arg)
+{
+    entry_search_t *search = arg;
+    if (entry_name(entry)[0] == '\0')
+    {
+        if (search->free_slot == SIZE_MAX) search->free_slot = slot;
+        return false;
+    }
+    if (!entry_has_name(entry, search->name)) return false;
+    search->found = entry;
+    return true;
+}
+
+static size_t scan_entries(filesystem_t *fs, inode_t *dir, entry_search_t *search)
+{
+    search->found = NULL;
+    search->free_slot = SIZE_MAX;
+    return visit_entries(fs, dir, match_entry, search);
+}
+
+// ----------------------- INDEX ----------------------- //
+
+static bool push_free_slot(directory_index_t *index, uint32_t slot)
+{
+    if (index->free_slot_count == index->free_slots_capacity)
+    {
+        size_t capacity = index->free_slots_capacity ? 2 * index->free_slots_capacity : 16;
+        uint32_t *free_slots = realloc(index->free_slots, capacity * sizeof(uint32_t));
+        if (!free_slots) return false;
+        index->free_slots = free_slots;
+        index->free_slots_capacity = capacity;
+    }
+    index->free_slots[index->free_slot_count++] = slot;
+    return true;
+}
+
+static bool reserve_entries(directory_index_t *index, size_t count)
+{
+    if (count <= index->entries_capacity) return true;
+    size_t capacity = index->entries_capacity ? 2 * index->entries_capacity : 16;
+    if (capacity < count) capacity = count;
+    byte **entries = realloc(index->entries, capacity * sizeof(byte *));
+    if (!entries) return false;
+    index->entries = entries;
+    index->entries_capacity = capacity;
+    return true;
+}
+
+static void place_bucket(directory_bucket_t *buckets, size_t bucket_count, uint32_t hash, uint32_t slot)
+{
+    size_t b = hash & (bucket_count - 1);
+    while (buckets[b].slot != 0) b = (b + 1) & (bucket_count - 1);
+    buckets[b] = (directory_bucket_t) { .hash = hash, .slot = slot + 1 };
+}
+
+// rehashes into enough buckets for `live` entries, dropping the marks of removed ones
+static bool resize_buckets(directory_index_t *index, size_t live)
+{
+    size_t bucket_count = MIN_BUCKET_COUNT;
+    while (bucket_count < 2 * live) bucket_count *= 2;
+    directory_bucket_t *buckets = calloc(bucket_count, sizeof(directory_bucket_t));
+    if (!buckets) return false;
+
+    for (size_t b = 0; b < index->bucket_count; ++b)
+    {
+        uint32_t slot = index->buckets[b].slot;
+        if (slot != 0 && slot != BUCKET_REMOVED) place_bucket(buckets, bucket_count, index->buckets[b].hash, slot - 1);
+    }
+    free(index->buckets);
+    index->buckets = buckets;
+    index->bucket_count = bucket_count;
+    index->used_buckets = live;
+    return true;
+}
+
+// buckets stay at most three quarters used, removed ones included, so probes stay short
+static bool insert_bucket(directory_index_t *index, uint32_t hash, uint32_t slot)
+{
+    if ((index->used_buckets + 1) * 4 > index->bucket_count * 3)
+    {
+        if (!resize_buckets(index, index->slot_count - index->free_slot_count + 1)) return false;
+    }
+    place_bucket(index->buckets, index->bucket_count, hash, slot);
+    index->used_buckets++;
+    return true;
+}
+
+static directory_bucket_t *find_bucket(directory_index_t *index, const char *name)
+{
+    uint32_t hash = hash_name(name);
+    for (size_t b = hash & (index->bucket_count - 1); index->buckets[b].slot != 0; b = (b + 1) & (index->bucket_count - 1))
+    {
+        directory_bucket_t *bucket = &index->buckets[b];
+        if (bucket->slot != BUCKET_REMOVED && bucket->hash == hash && entry_has_name(index->entries[bucket->slot - 1], name)) return bucket;
+    }
+    return NULL;
+}
+
+typedef struct index_build
+{
+    directory_index_t *index;
+    bool failed;
+} index_build_t;
+
+static bool index_entry(byte *entry, size_t slot, void *arg)
+{
+    index_build_t *build = arg;
+    directory_index_t *index = build->index;
+    index->entries[slot] = entry;
+    bool added = entry_name(entry)[0] == '\0' ? push_free_slot(index, slot) : insert_bucket(index, hash_name(entry_name(entry)), slot);
+    build->failed = !added;
+    return build->failed;
+}
+
+static fs_retcode_t build_index(filesystem_t *fs, inode_t *dir, directory_index_t *index)
+{
+    directory_index_free(index);
+    size_t slot_count = dir->internal.file_size / DIRECTORY_ENTRY_SIZE;
+    index->slot_count = slot_count;
+    index_build_t build = { .index = index, .failed = false };
+    if (!reserve_entries(index, slot_count) || !resize_buckets(index, slot_count))
+    {
+        directory_index_free(index);
+        return SYSTEM_ERROR;
+    }
+
+    index->used_buckets = 0;
+    visit_entries(fs, dir, index_entry, &build);
+    if (build.failed)
+    {
+        directory_index_free(index);
+        return SYSTEM_ERROR;
+    }
+    index->dir = dir;
+    index->relocation_generation = current_generation(fs);
+    return SUCCESS;
+}
+
+// rebuilds the index unless it still describes the directory as it is
+static fs_retcode_t current_index(filesystem_t *fs, inode_t *dir, directory_index_t *index)
+{
+    bool current = index->bucket_count > 0 && index->dir == dir && index->relocation_generation == current_generation(fs) &&
+                   index->slot_count == dir->internal.file_size / DIRECTORY_ENTRY_SIZE;
+    return current ? SUCCESS : build_index(fs, dir, index);
+}
+
+// ----------------------- DENTRY CACHE ----------------------- //
+
+static dentry_t *dentry_slot(dentry_cache_t *cache, inode_index_t parent, const char *name)
+{
+    uint32_t hash = (hash_name(name) ^ parent) * 16777619u;
+    return &cache->entries[(hash ^ (hash >> 16)) & (DENTRY_CACHE_SIZE - 1)];
+}
+
+static void lock_dentries(filesystem_t *fs)
+{
+    if (fs->locks) pthread_mutex_lock(&fs->locks->dentries);
+}
+
+static void unlock_dentries(filesystem_t *fs)
+{
+    if (fs->locks) pthread_mutex_unlock(&fs->locks->dentries);
+}
+
+static bool dentry_matches(const dentry_t *dentry, inode_index_t parent, const char *name)
+{
+    return dentry->valid && dentry->parent == parent && strncmp(dentry->name, name, MAX_FILE_NAME_LEN) == 0;
+}
+
+// the file system's cache, allocated on first use and emptied once a compaction renumbered the inodes.
+// names added or removed only drop their own entry, see `dentry_cache_forget`
+static dentry_cache_t *current_dentry_cache(filesystem_t *fs)
+{
+    if (!fs->dentry_cache) fs->dentry_cache = malloc(sizeof(dentry_cache_t));
+    else if (fs->dentry_cache->relocation_generation == current_generation(fs)) return fs->dentry_cache;
+    if (!fs->dentry_cache) return NULL;
+
+    memset(fs->dentry_cache, 0, sizeof(dentry_cache_t));
+    fs->dentry_cache->relocation_generation = current_generation(fs);
+    return fs->dentry_cache;
+}
+
+// ----------------------- CORE FUNCTION ----------------------- //
+
+// checks the arguments every function takes, and brings the index up to date
+static fs_retcode_t prepare(filesystem_t *fs, inode_t *dir, directory_index_t *index, const char *name)
+{
+    if (!fs || !dir || !name || dir->internal.file_type != DIRECTORY) return INVALID_INPUT;
+    fs_retcode_t result = check_name(name);
+    if (result != SUCCESS || !index) return result;
+    return current_index(fs, dir, index);
+}
+
+// the functions below are the public ones without the lock of the directory
+
+static fs_retcode_t lookup_entry(filesystem_t *fs, inode_t *dir, directory_index_t *index, const char *name, inode_index_t *found)
+{
+    if (!found) return INVALID_INPUT;
+    fs_retcode_t result = prepare(fs, dir, index, name);
+    if (result != SUCCESS) return result;
+
+    const byte *entry;
+    if (index)
+    {
+        directory_bucket_t *bucket = find_bucket(index, name);
+        entry = bucket ? index->entries[bucket->slot - 1] : NULL;
+    }
+    else
+    {
+        entry_search_t search = { .name = name };
+        scan_entries(fs, dir, &search);
+        entry = search.found;
+    }
+    if (!entry) return NOT_FOUND;
+    *found = entry_inode(entry);
+    return SUCCESS;
+}
+
+static fs_retcode_t add_entry(filesystem_t *fs, inode_t *dir, directory_index_t *index, const char *name, inode_index_t inode)
+{
+    inode_index_t existing;
+    fs_retcode_t result = lookup_entry(fs, dir, index, name, &existing);
+    if (result == SUCCESS)
+    {
+        bool is_directory = existing < fs->inode_count && fs->inodes[existing].internal.file_type == DIRECTORY;
+        return is_directory ? DIRECTORY_EXIST : FILE_EXIST;
+    }
+    if (result != NOT_FOUND) return result;
+
+    dentry_cache_forget(fs, dir - fs->inodes, name);
+    byte entry[DIRECTORY_ENTRY_SIZE] = { 0 };
+    memcpy(entry, &inode, sizeof(inode));
+    strncpy((char *) entry + sizeof(inode_index_t), name, MAX_FILE_NAME_LEN);
+
+    // a tombstone is filled in place
+    size_t free_slot;
+    if (index)
+    {
+        free_slot = index->free_slot_count > 0 ? index->free_slots[index->free_slot_count - 1] : SIZE_MAX;
+    }
+    else
+    {
+        entry_search_t search = { .name = name };
+        scan_entries(fs, dir, &search);
+        free_slot = search.free_slot;
+    }
+    if (free_slot != SIZE_MAX)
+    {
+        result = inode_modify_data(fs, dir, free_slot * DIRECTORY_ENTRY_SIZE, entry, DIRECTORY_ENTRY_SIZE);
+        if (result != SUCCESS || !index) return result;
+        index->free_slot_count--;
+        if (!insert_bucket(index, hash_name(name), free_slot)) directory_index_free(index);
+        return SUCCESS;
+    }
+
+    // otherwise the directory grows by one entry
+    size_t slot = dir->internal.file_size / DIRECTORY_ENTRY_SIZE;
+    if (index && !reserve_entries(index, slot + 1)) return SYSTEM_ERROR;
+    bool was_inline = dir->internal.indirect_layout == INDIRECT_INLINE;
+    result = inode_write_data(fs, dir, entry, DIRECTORY_ENTRY_SIZE);
+    if (result != SUCCESS || !index) return result;
+
+    // the entries moved out of the inode or to other dblocks, so no pointer to them holds
+    bool moved = was_inline != (dir->internal.indirect_layout == INDIRECT_INLINE) || index->relocation_generation != current_generation(fs);
+    dblock_span_iterator_t it;
+    const byte *span;
+    size_t len;
+    if (moved || inode_span_begin(fs, dir, slot * DIRECTORY_ENTRY_SIZE, DIRECTORY_ENTRY_SIZE, &it) != SUCCESS || !inode_span_next(&it, &span, &len))
+    {
+        directory_index_free(index);
+        return SUCCESS;
+    }
+    index->entries[slot] = (byte *) span;
+    index->slot_count = slot + 1;
+    if (!insert_bucket(index, hash_name(name), slot)) directory_index_free(index);
+    return SUCCESS;
+}
+
+static fs_retcode_t remove_entry(filesystem_t *fs, inode_t *dir, directory_index_t *index, const char *name)
+{
+    fs_retcode_t result = prepare(fs, dir, index, name);
+    if (result != SUCCESS) return result;
+
+    size_t slot;
+    directory_bucket_t *bucket = NULL;
+    if (index)
+    {
+        bucket = find_bucket(index, name);
+        slot = bucket ? bucket->slot - 1 : SIZE_MAX;
+    }
+    else
+    {
+        entry_search_t search = { .name = name };
+        slot = scan_entries(fs, dir, &search);
+        if (!search.found) slot = SIZE_MAX;
+    }
+    if (slot == SIZE_MAX) return NOT_FOUND;
+
+    dentry_cache_forget(fs, dir - fs->inodes, name);
+    byte tombstone[DIRECTORY_ENTRY_SIZE] = { 0 };
+    result = inode_modify_data(fs, dir, slot * DIRECTORY_ENTRY_SIZE, tombstone, DIRECTORY_ENTRY_SIZE);
+    if (result != SUCCESS || !index) return result;
+    bucket->slot = BUCKET_REMOVED;
+    if (!push_free_slot(index, slot)) directory_index_free(index);
+    return SUCCESS;
+}
+
+fs_retcode_t directory_lookup(filesystem_t *fs, inode_t *dir, directory_index_t *index, const char *name, inode_index_t *found)
+{
+    if (!fs || !dir) return INVALID_INPUT;
+    fs_lock_inode(fs, dir, false);
+    fs_retcode_t result = lookup_entry(fs, dir, index, name, found);
+    fs_unlock_inode(fs, dir);
+    return result;
+}
+
+fs_retcode_t directory_add_entry(filesystem_t *fs, inode_t *dir, directory_index_t *index, const char *name, inode_index_t inode)
+{
+    if (!fs || !dir) return INVALID_INPUT;
+    fs_lock_inode(fs, dir, true);
+    fs_retcode_t result = add_entry(fs, dir, index, name, inode);
+    fs_unlock_inode(fs, dir);
+    return result;
+}
+
+fs_retcode_t directory_remove_entry(filesystem_t *fs, inode_t *dir, directory_index_t *index, const char *name)
+{
+    if (!fs || !dir) return INVALID_INPUT;
+    fs_lock_inode(fs, dir, true);
+    fs_retcode_t result = remove_entry(fs, dir, index, name);
+    fs_unlock_inode(fs, dir);
+    return result;
+}
+
+void directory_index_free(directory_index_t *index)
+{
+    if (!index) return;
+    free(index->entries);
+    free(index->buckets);
+    free(index->free_slots);
+    *index = (directory_index_t) { 0 };
+}
+
+// looks up a name the caller checked in a directory it holds, remembering the answer whether or not it was found
+static fs_retcode_t cached_lookup(filesystem_t *fs, inode_index_t parent, const char *name, inode_index_t *found)
+{
+    lock_dentries(fs);
+    dentry_cache_t *cache = current_dentry_cache(fs);
+    dentry_t *dentry = cache ? dentry_slot(cache, parent, name) : NULL;
+    bool hit = dentry && dentry_matches(dentry, parent, name);
+    if (hit) *found = dentry->inode;
+    fs_retcode_t result = !cache ? SYSTEM_ERROR : hit && dentry->negative ? NOT_FOUND : SUCCESS;
+    unlock_dentries(fs);
+    if (hit || !cache) return result;
+
+    result = lookup_entry(fs, &fs->inodes[parent], NULL, name, found);
+    if (result != SUCCESS && result != NOT_FOUND) return result;
+
+    // the cache may have been emptied meanwhile, so the slot is looked up again
+    lock_dentries(fs);
+    cache = current_dentry_cache(fs);
+    if (cache)
+    {
+        dentry = dentry_slot(cache, parent, name);
+        *dentry = (dentry_t) { .parent = parent, .inode = result == SUCCESS ? *found : 0, .valid = true, .negative = result == NOT_FOUND };
+        memcpy(dentry->name, name, strnlen(name, MAX_FILE_NAME_LEN));
+    }
+    unlock_dentries(fs);
+    return result;
+}
+
+fs_retcode_t directory_resolve_path(filesystem_t *fs, inode_t *cwd, const char *path, inode_index_t *found)
+{
+    if (!fs || !cwd || !path || !found) return INVALID_INPUT;
+    if (path[0] == '\0') return EMPTY_FILENAME;
+
+    inode_index_t current = path[0] == '/' ? 0 : cwd - fs->inodes;
+    const char *component = path;
+    while (*component)
+    {
+        size_t len = strcspn(component, "/");
+        if (len == 0)
+        {
+            component++;
+            continue;
+        }
+        if (len > MAX_FILE_NAME_LEN) return INVALID_FILENAME;
+
+        char name[MAX_FILE_NAME_LEN + 1] = { 0 };
+        memcpy(name, component, len);
+        component += len;
+        bool last = component[strspn(component, "/")] == '\0';
+
+        // each directory is only held while its component is looked up
+        inode_t *dir = &fs->inodes[current];
+        inode_index_t next;
+        fs_lock_inode(fs, dir, false);
+        fs_retcode_t result = dir->internal.file_type == DIRECTORY ? cached_lookup(fs, current, name, &next) : DIR_NOT_FOUND;
+        fs_unlock_inode(fs, dir);
+        if (result == NOT_FOUND) return last ? NOT_FOUND : DIR_NOT_FOUND;
+        if (result != SUCCESS) return result;
+        if (next >= fs->inode_count) return INVALID_INPUT;
+        current = next;
+    }
+    *found = current;
+    return SUCCESS;
+}
+
+void dentry_cache_forget(filesystem_t *fs, inode_index_t parent, const char *name)
+{
+    if (!fs || !name) return;
+    lock_dentries(fs);
+    dentry_t *dentry = fs->dentry_cache ? dentry_slot(fs->dentry_cache, parent, name) : NULL;
+    if (dentry && dentry_matches(dentry, parent, name)) dentry->valid = false;
+    unlock_dentries(fs);
+}
+
+void dentry_cache_forget_directory(filesystem_t *fs, inode_index_t dir)
+{
+    if (!fs) return;
+    lock_dentries(fs);
+    for (size_t i = 0; fs->dentry_cache && i < DENTRY_CACHE_SIZE; ++i)
+    {
+        if (fs->dentry_cache->entries[i].parent == dir) fs->dentry_cache->entries[i].valid = false;
+    }
+    unlock_dentries(fs);
+}
@@ -1,6 +1,7 @@
 #include "filesys.h"
 #include "debug.h"
 #include "utility.h"
+#include "journal.h"
 
 #include <string.h>
 #include <stdbool.h>
@@ -8,6 +9,18 @@
 #define DIRECTORY_ENTRY_SIZE (sizeof(inode_index_t) + MAX_FILE_NAME_LEN)
 #define DIRECTORY_ENTRIES_PER_DATABLOCK (DATA_BLOCK_SIZE / DIRECTORY_ENTRY_SIZE)
 
+// ----------------------- LOCKING ----------------------- //
+
+//the locks `fs_enable_concurrency` asks for: the file system shared, and the file's inode
+static void lock_file(fs_file_t file, bool exclusive){
+    fs_lock_filesystem(file->fs, false);
+    fs_lock_inode(file->fs, file->inode, exclusive);
+}
+
+static void unlock_file(fs_file_t file){
+    fs_unlock_inode(file->fs, file->inode);
+    fs_unlock_filesystem(file->fs);
+}
 
 // ----------------------- CORE FUNCTION ----------------------- //
 int new_file(terminal_context_t *context, char *path, permission_t perms)
@@ -139,6 +152,8 @@ size_t fs_read(fs_file_t file, void *buffer, size_t n)
     //number of bytes to read
     size_t bytes_to_read = n;
 
+    lock_file(file, false);
+
     //current file size
     size_t current_file_size = inode_ptr->internal.file_size;
 
@@ -147,7 +162,8 @@ size_t fs_read(fs_file_t file, void *buffer, size_t n)
     }
 
     size_t total_bytes_read = 0;
-    fs_retcode_t result = inode_read_data(file_ptr, inode_ptr, curr_offset, buffer, bytes_to_read, &total_bytes_read);
+    fs_retcode_t result = inode_read_data_cursor(file_ptr, inode_ptr, &file->cursor, curr_offset, buffer, bytes_to_read, &total_bytes_read);
+    unlock_file(file);
     if(result != SUCCESS){
         return 0;
     }
@@ -176,12 +192,16 @@ size_t fs_write(fs_file_t file, void *buffer, size_t n)
     //number of bytes to write
     size_t total_bytes_written = 0;
 
-   
-    fs_retcode_t result = inode_modify_data(file_ptr, inode_ptr, curr_offset, buffer, n);
+    lock_file(file, true);
+    fs_retcode_t result = inode_modify_data_cursor(file_ptr, inode_ptr, &file->cursor, curr_offset, buffer, n);
+    unlock_file(file);
     if(result != SUCCESS){
         return 0;
     }
 
+    //the write is in memory either way. a commit that fails is retried by the next one
+    commit_journal(file_ptr);
+
     total_bytes_written = n;
 
     curr_offset += total_bytes_written;
@@ -206,7 +226,9 @@ int fs_seek(fs_file_t file, seek_mode_t seek_mode, int offset)
 
     inode_t *inode_ptr = file->inode;
     size_t curr_offset = file->offset;
+    lock_file(file, false);
     size_t current_file_size = inode_ptr->internal.file_size;
+    unlock_file(file);
 
     //if seekmode is fs_seek_start
     if(seek_mode == FS_SEEK_START){
@@ -238,3 +260,74 @@ int fs_seek(fs_file_t file, seek_mode_t seek_mode, int offset)
     return 0;
 }
 
+size_t fs_preadv(fs_file_t file, const struct iovec *iov, size_t iovcnt, size_t offset)
+{
+    if(file == NULL){
+        return 0;
+    }
+
+    size_t total_bytes_read = 0;
+    lock_file(file, false);
+    fs_retcode_t result = inode_read_data_vec(file->fs, file->inode, &file->cursor, offset, iov, iovcnt, &total_bytes_read);
+    unlock_file(file);
+    if(result != SUCCESS){
+        return 0;
+    }
+    return total_bytes_read;
+}
+
+size_t fs_pwritev(fs_file_t file, const struct iovec *iov, size_t iovcnt, size_t offset)
+{
+    if(file == NULL){
+        return 0;
+    }
+
+    lock_file(file, true);
+    fs_retcode_t result = inode_modify_data_vec(file->fs, file->inode, &file->cursor, offset, iov, iovcnt);
+    unlock_file(file);
+    if(result != SUCCESS){
+        return 0;
+    }
+    commit_journal(file->fs);
+
+    size_t total_bytes_written = 0;
+    for(size_t i = 0; i < iovcnt; i++){
+        total_bytes_written += iov[i].iov_len;
+    }
+    return total_bytes_written;
+}
+
+size_t fs_readv(fs_file_t file, const struct iovec *iov, size_t iovcnt)
+{
+    if(file == NULL){
+        return 0;
+    }
+
+    size_t total_bytes_read = fs_preadv(file, iov, iovcnt, file->offset);
+    file->offset += total_bytes_read;
+    return total_bytes_read;
+}
+
+size_t fs_writev(fs_file_t file, const struct iovec *iov, size_t iovcnt)
+{
+    if(file == NULL){
+        return 0;
+    }
+
+    size_t total_bytes_written = fs_pwritev(file, iov, iovcnt, file->offset);
+    file->offset += total_bytes_written;
+    return total_bytes_written;
+}
+
+size_t fs_pread(fs_file_t file, void *buffer, size_t n, size_t offset)
+{
+    struct iovec iov = { .iov_base = buffer, .iov_len = n };
+    return fs_preadv(file, &iov, 1, offset);
+}
+
+size_t fs_pwrite(fs_file_t file, void *buffer, size_t n, size_t offset)
+{
+    struct iovec iov = { .iov_base = buffer, .iov_len = n };
+    return fs_pwritev(file, &iov, 1, offset);
+}
+
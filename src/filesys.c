@@ -1,10 +1,17 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdbool.h>
+#include <pthread.h>
 
 #include "filesys.h"
 #include "debug.h"
 #include "utility.h"
+#include "bitmap.h"
+#include "image.h"
+#include "journal.h"
+#include "flusher.h"
+#include "locks.h"
 
 #define DBLOCK_MASK_SIZE(blk_count) (((blk_count) + 7) / (sizeof(byte) * 8))
 
@@ -19,12 +26,690 @@
 // marks the nth dblock as being used 
 static void mark_dblock_as_used(byte *dblock_bitmask, size_t n)
 {
-    dblock_bitmask[n / 8] &= ~(1 << (7 - n % 8));
+    bitmap_clear(dblock_bitmask, n);
 }
 
 static void mark_dblock_as_unused(byte *dblock_bitmask, size_t n)
 {
-    dblock_bitmask[n / 8] |= 1 << (7 - n % 8);
+    bitmap_set(dblock_bitmask, n);
+}
+
+// ----------------------- DIRTY TRACKING ----------------------- //
+
+// allocates dirty maps for a file system whose inodes and dblocks are already set up, all clear
+fs_retcode_t init_dirty_maps(const filesystem_t *fs, struct dirty_state *dirty)
+{
+    dirty->inodes = calloc(DBLOCK_MASK_SIZE(fs->inode_count), sizeof(byte));
+    dirty->dblocks = calloc(DBLOCK_MASK_SIZE(fs->dblock_count), sizeof(byte));
+    dirty->bitmask = calloc(DBLOCK_MASK_SIZE(DBLOCK_MASK_SIZE(fs->dblock_count)), sizeof(byte));
+    dirty->header = false;
+    if (!dirty->inodes || !dirty->dblocks || !dirty->bitmask)
+    {
+        free_dirty_maps(dirty);
+        return SYSTEM_ERROR;
+    }
+    return SUCCESS;
+}
+
+void clear_dirty_maps(const filesystem_t *fs, struct dirty_state *dirty)
+{
+    if (!dirty->inodes) return;
+    memset(dirty->inodes, 0, DBLOCK_MASK_SIZE(fs->inode_count));
+    memset(dirty->dblocks, 0, DBLOCK_MASK_SIZE(fs->dblock_count));
+    memset(dirty->bitmask, 0, DBLOCK_MASK_SIZE(DBLOCK_MASK_SIZE(fs->dblock_count)));
+    __atomic_store_n(&dirty->header, false, __ATOMIC_RELAXED);
+}
+
+void copy_dirty_maps(const filesystem_t *fs, struct dirty_state *dest, const struct dirty_state *src)
+{
+    if (!dest->inodes || !src->inodes) return;
+    memcpy(dest->inodes, src->inodes, DBLOCK_MASK_SIZE(fs->inode_count));
+    memcpy(dest->dblocks, src->dblocks, DBLOCK_MASK_SIZE(fs->dblock_count));
+    memcpy(dest->bitmask, src->bitmask, DBLOCK_MASK_SIZE(DBLOCK_MASK_SIZE(fs->dblock_count)));
+    dest->header = src->header;
+}
+
+static void merge_dirty_map(byte *dest, const byte *src, size_t len)
+{
+    for (size_t i = 0; i < len; ++i) dest[i] |= src[i];
+}
+
+void merge_dirty_maps(const filesystem_t *fs, struct dirty_state *dest, const struct dirty_state *src)
+{
+    if (!dest->inodes || !src->inodes) return;
+    merge_dirty_map(dest->inodes, src->inodes, DBLOCK_MASK_SIZE(fs->inode_count));
+    merge_dirty_map(dest->dblocks, src->dblocks, DBLOCK_MASK_SIZE(fs->dblock_count));
+    merge_dirty_map(dest->bitmask, src->bitmask, DBLOCK_MASK_SIZE(DBLOCK_MASK_SIZE(fs->dblock_count)));
+    dest->header |= src->header;
+}
+
+void free_dirty_maps(struct dirty_state *dirty)
+{
+    free(dirty->inodes);
+    free(dirty->dblocks);
+    free(dirty->bitmask);
+    dirty->inodes = NULL;
+    dirty->dblocks = NULL;
+    dirty->bitmask = NULL;
+    dirty->header = false;
+}
+
+fs_retcode_t init_dirty_state(filesystem_t *fs, bool all_dirty)
+{
+    if (init_dirty_maps(fs, &fs->dirty) != SUCCESS) return SYSTEM_ERROR;
+    if (all_dirty)
+    {
+        bitmap_set_range(fs->dirty.inodes, 0, fs->inode_count);
+        bitmap_set_range(fs->dirty.dblocks, 0, fs->dblock_count);
+        bitmap_set_range(fs->dirty.bitmask, 0, DBLOCK_MASK_SIZE(fs->dblock_count));
+        mark_header_dirty(fs);
+    }
+    return SUCCESS;
+}
+
+void clear_dirty_state(filesystem_t *fs)
+{
+    clear_dirty_maps(fs, &fs->dirty);
+}
+
+void free_dirty_state(filesystem_t *fs)
+{
+    free_dirty_maps(&fs->dirty);
+}
+
+static bool single_user(filesystem_t *fs);
+
+// changes are recorded both for the next save and, with a journal, for its next transaction.
+// a flusher also counts the bytes, to know when it has enough of them
+
+static void count_flush_bytes(filesystem_t *fs, size_t len)
+{
+    struct fs_flusher *flusher = fs->flusher;
+    size_t before = __atomic_fetch_add(&flusher->pending_size, len, __ATOMIC_RELAXED);
+    if (flusher->threshold && before < flusher->threshold && before + len >= flusher->threshold) wake_flusher(flusher);
+}
+
+// while threads share the file system lock, each one's changes go into its own transactions
+static struct dirty_state *journal_pending(filesystem_t *fs)
+{
+    if (single_user(fs)) return &fs->journal->pending;
+    struct dirty_state *pending = journal_writer_pending(fs);
+    return pending ? pending : &fs->journal->pending;
+}
+
+void mark_inode_dirty(filesystem_t *fs, inode_t *inode)
+{
+    if (!fs || !inode) return;
+    if (fs->dirty.inodes && !bitmap_set_atomic(fs->dirty.inodes, inode - fs->inodes) && fs->flusher) count_flush_bytes(fs, sizeof(inode_t));
+    if (fs->journal) bitmap_set_atomic(journal_pending(fs)->inodes, inode - fs->inodes);
+}
+
+void mark_dblock_dirty(filesystem_t *fs, dblock_index_t index)
+{
+    if (!fs) return;
+    if (fs->dirty.dblocks && !bitmap_set_atomic(fs->dirty.dblocks, index) && fs->flusher) count_flush_bytes(fs, DATA_BLOCK_SIZE);
+    if (fs->journal) bitmap_set_atomic(journal_pending(fs)->dblocks, index);
+}
+
+// marks the bitmask byte holding the bit of a dblock as changed
+void mark_bitmask_dirty(filesystem_t *fs, size_t dblock_index)
+{
+    if (fs->dirty.bitmask) bitmap_set(fs->dirty.bitmask, dblock_index / 8);
+    if (fs->journal) bitmap_set(journal_pending(fs)->bitmask, dblock_index / 8);
+    if (fs->flusher) count_flush_bytes(fs, 1);
+}
+
+// the same for the bitmask bytes of `count` dblocks from `dblock_index` on
+void mark_bitmask_range_dirty(filesystem_t *fs, size_t dblock_index, size_t count)
+{
+    size_t first = dblock_index / 8, bytes = (dblock_index + count - 1) / 8 - first + 1;
+    if (fs->dirty.bitmask) bitmap_set_range(fs->dirty.bitmask, first, bytes);
+    if (fs->journal) bitmap_set_range(journal_pending(fs)->bitmask, first, bytes);
+    if (fs->flusher) count_flush_bytes(fs, bytes);
+}
+
+void mark_header_dirty(filesystem_t *fs)
+{
+    __atomic_store_n(&fs->dirty.header, true, __ATOMIC_RELAXED);
+    if (fs->journal) __atomic_store_n(&journal_pending(fs)->header, true, __ATOMIC_RELAXED);
+    if (fs->flusher) count_flush_bytes(fs, 1);
+}
+
+// ----------------------- LOCKING ----------------------- //
+
+static void lock_free_inodes(filesystem_t *fs)
+{
+    if (fs->locks) pthread_mutex_lock(&fs->locks->free_inodes);
+}
+
+static void unlock_free_inodes(filesystem_t *fs)
+{
+    if (fs->locks) pthread_mutex_unlock(&fs->locks->free_inodes);
+}
+
+// numbers the threads in the order they first allocate something, starting at 0
+static size_t thread_number(void)
+{
+    static size_t threads_seen = 0;
+    static _Thread_local size_t number = 0;
+    if (number == 0) number = __atomic_add_fetch(&threads_seen, 1, __ATOMIC_RELAXED);
+    return number - 1;
+}
+
+// ----------------------- FREE INODE STACK ----------------------- //
+
+// with concurrency, and unless `sorted_free_inodes` is set, the free inode list is a lock-free
+// stack. its head lives in `free_inode_head` instead of `available_inode`, and each thread keeps
+// a few free inodes of its own, so most claims and releases do not touch the head at all. those
+// form a stack of their own, linked through `next_free_inode` like the list
+
+#define HEAD_INDEX_BITS 16
+
+static inode_index_t head_index(uint64_t head)
+{
+    return (inode_index_t) (head & ((1u << HEAD_INDEX_BITS) - 1));
+}
+
+// the head that replaces `head` when the list starts at `index` instead
+static uint64_t next_head(uint64_t head, inode_index_t index)
+{
+    return ((head >> HEAD_INDEX_BITS) + 1) << HEAD_INDEX_BITS | index;
+}
+
+// takes up to `max` inodes off the top of a stack in one swap of its head. returns how many
+static size_t list_pop(filesystem_t *fs, uint64_t *list, inode_index_t *indices, size_t max)
+{
+    uint64_t head = __atomic_load_n(list, __ATOMIC_ACQUIRE);
+    while (true)
+    {
+        // the inodes read here may be claimed and overwritten meanwhile. then the head moved on,
+        // the swap below fails and whatever was read is thrown away
+        size_t count = 0;
+        inode_index_t next = head_index(head);
+        while (count < max && next != 0 && next < fs->inode_count)
+        {
+            indices[count++] = next;
+            next = __atomic_load_n(&fs->inodes[next].next_free_inode, __ATOMIC_RELAXED);
+        }
+        if (count == 0) return 0;
+        if (__atomic_compare_exchange_n(list, &head, next_head(head, next), true, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) return count;
+    }
+}
+
+// puts the inodes linked from `first` to `last` on top of a stack in one swap of its head
+static void list_push_chain(filesystem_t *fs, uint64_t *list, inode_index_t first, inode_index_t last)
+{
+    inode_t *tail = &fs->inodes[last];
+    uint64_t head = __atomic_load_n(list, __ATOMIC_RELAXED);
+    do
+    {
+        __atomic_store_n(&tail->next_free_inode, head_index(head), __ATOMIC_RELAXED);
+    } while (!__atomic_compare_exchange_n(list, &head, next_head(head, first), true, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+    mark_inode_dirty(fs, tail);
+}
+
+// takes everything on a stack in one swap of its head. returns the inode that was on top, 0 if there was none
+static inode_index_t list_take(uint64_t *list)
+{
+    uint64_t head = __atomic_load_n(list, __ATOMIC_ACQUIRE);
+    while (head_index(head) != 0 && !__atomic_compare_exchange_n(list, &head, next_head(head, 0), true, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE));
+    return head_index(head);
+}
+
+// the last inode of a chain taken with `list_take`, and how many it holds
+static inode_index_t chain_end(filesystem_t *fs, inode_index_t first, size_t *count)
+{
+    *count = 1;
+    while (fs->inodes[first].next_free_inode != 0)
+    {
+        first = fs->inodes[first].next_free_inode;
+        ++*count;
+    }
+    return first;
+}
+
+static size_t stack_pop(filesystem_t *fs, inode_index_t *indices, size_t max)
+{
+    size_t count = list_pop(fs, &fs->locks->free_inode_head, indices, max);
+    if (count > 0) mark_header_dirty(fs);
+    return count;
+}
+
+// puts the inodes linked from `first` to `last` back on top of the list
+static void stack_push_chain(filesystem_t *fs, inode_index_t first, inode_index_t last)
+{
+    list_push_chain(fs, &fs->locks->free_inode_head, first, last);
+    mark_header_dirty(fs);
+}
+
+// the calling thread's cache in the locks it last used one of
+static _Thread_local struct
+{
+    uint64_t locks_id;
+    struct inode_cache *cache;
+} own_cache;
+
+static uint64_t locks_created = 0;
+
+// the calling thread's inode cache, set up on its first claim or release. null without memory
+static struct inode_cache *own_inode_cache(filesystem_t *fs)
+{
+    struct fs_locks *locks = fs->locks;
+    if (own_cache.locks_id == locks->id) return own_cache.cache;
+
+    pthread_t self = pthread_self();
+    struct inode_cache *cache = __atomic_load_n(&locks->inode_caches, __ATOMIC_ACQUIRE);
+    while (cache && !pthread_equal(cache->thread, self)) cache = cache->next;
+    if (!cache)
+    {
+        cache = aligned_alloc(_Alignof(struct inode_cache), sizeof(struct inode_cache));
+        if (!cache) return NULL;
+        memset(cache, 0, sizeof(struct inode_cache));
+        cache->thread = self;
+        cache->next = __atomic_load_n(&locks->inode_caches, __ATOMIC_RELAXED);
+        while (!__atomic_compare_exchange_n(&locks->inode_caches, &cache->next, cache, true, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+    }
+    own_cache.locks_id = locks->id;
+    own_cache.cache = cache;
+    return cache;
+}
+
+// takes the inodes of another thread's cache, keeping the first one and moving the others into `cache`
+static bool steal_cached_inodes(filesystem_t *fs, struct inode_cache *cache, struct inode_cache *other, inode_index_t *index)
+{
+    inode_index_t first = list_take(&other->head);
+    if (first == 0) return false;
+    *index = first;
+
+    inode_index_t rest = fs->inodes[first].next_free_inode;
+    if (rest == 0) return true;
+    size_t count;
+    inode_index_t last = chain_end(fs, rest, &count);
+    if (!cache) stack_push_chain(fs, rest, last);
+    else
+    {
+        list_push_chain(fs, &cache->head, rest, last);
+        cache->count += count;
+    }
+    return true;
+}
+
+// takes a free inode from the own cache, refilling it from the list if empty, or from another thread's cache
+static bool find_free_inode(filesystem_t *fs, struct inode_cache *cache, inode_index_t *index)
+{
+    if (cache)
+    {
+        if (list_pop(fs, &cache->head, index, 1) == 1)
+        {
+            if (cache->count > 0) cache->count--;
+            return true;
+        }
+        // whatever was left, another thread took
+        cache->count = 0;
+    }
+
+    // the inodes after the first one are already linked in the order they are claimed
+    inode_index_t refill[INODE_CACHE_REFILL];
+    size_t count = stack_pop(fs, refill, cache ? INODE_CACHE_REFILL : 1);
+    if (count > 0)
+    {
+        *index = refill[0];
+        if (count > 1)
+        {
+            list_push_chain(fs, &cache->head, refill[1], refill[count - 1]);
+            cache->count = count - 1;
+        }
+        return true;
+    }
+
+    // the list is empty, but other threads may still hold free inodes
+    for (struct inode_cache *other = __atomic_load_n(&fs->locks->inode_caches, __ATOMIC_ACQUIRE); other; other = other->next)
+    {
+        if (other != cache && steal_cached_inodes(fs, cache, other, index)) return true;
+    }
+    return false;
+}
+
+// free inodes move between the list and the caches while they are searched, so the search
+// can miss one that was there all along. it is repeated a few times while the count says so
+#define FREE_INODE_SEARCHES 4
+
+static fs_retcode_t claim_inode_lock_free(filesystem_t *fs, inode_index_t *index)
+{
+    struct inode_cache *cache = own_inode_cache(fs);
+    bool found = find_free_inode(fs, cache, index);
+    for (size_t i = 1; !found && i < FREE_INODE_SEARCHES && __atomic_load_n(&fs->free_inode_count, __ATOMIC_RELAXED) > 0; ++i)
+    {
+        found = find_free_inode(fs, cache, index);
+    }
+    if (!found) return INODE_UNAVAILABLE;
+
+    __atomic_fetch_sub(&fs->free_inode_count, 1, __ATOMIC_RELAXED);
+    mark_inode_dirty(fs, &fs->inodes[*index]);
+    return SUCCESS;
+}
+
+static void release_inode_lock_free(filesystem_t *fs, inode_t *inode)
+{
+    inode_index_t idx = inode - fs->inodes;
+    struct inode_cache *cache = own_inode_cache(fs);
+    if (cache && cache->count < INODE_CACHE_SIZE)
+    {
+        list_push_chain(fs, &cache->head, idx, idx);
+        cache->count++;
+    }
+    else stack_push_chain(fs, idx, idx);
+    __atomic_fetch_add(&fs->free_inode_count, 1, __ATOMIC_RELAXED);
+    mark_inode_dirty(fs, inode);
+}
+
+// puts every cached inode back on the list and makes `available_inode` its head again.
+// nobody else may claim or release meanwhile
+static void settle_free_inodes(filesystem_t *fs)
+{
+    for (struct inode_cache *cache = fs->locks->inode_caches; cache; cache = cache->next)
+    {
+        inode_index_t first = list_take(&cache->head);
+        cache->count = 0;
+        if (first == 0) continue;
+        size_t count;
+        stack_push_chain(fs, first, chain_end(fs, first, &count));
+    }
+    fs->available_inode = head_index(__atomic_load_n(&fs->locks->free_inode_head, __ATOMIC_ACQUIRE));
+}
+
+// the other way round, once whoever settled the list may have changed `available_inode`
+static void unsettle_free_inodes(filesystem_t *fs)
+{
+    uint64_t head = __atomic_load_n(&fs->locks->free_inode_head, __ATOMIC_RELAXED);
+    __atomic_store_n(&fs->locks->free_inode_head, next_head(head, fs->available_inode), __ATOMIC_RELEASE);
+}
+
+// ----------------------- DBLOCK GROUPS ----------------------- //
+
+// with concurrency, the dblocks are split into groups with a lock, hint and count each. a thread
+// allocates from its own group until it runs out and then from the others, so threads rarely wait
+// for each other and the dblocks of one file end up close together
+
+static void split_dblock_groups(filesystem_t *fs, struct fs_locks *locks)
+{
+    size_t size = (fs->dblock_count + DBLOCK_GROUP_COUNT - 1) / DBLOCK_GROUP_COUNT;
+    locks->dblock_group_size = size < 64 ? 64 : (size + 63) / 64 * 64;
+    locks->dblock_group_count = (fs->dblock_count + locks->dblock_group_size - 1) / locks->dblock_group_size;
+    for (size_t g = 0; g < locks->dblock_group_count; ++g)
+    {
+        struct dblock_group *group = &locks->dblock_groups[g];
+        group->start = g * locks->dblock_group_size;
+        group->end = group->start + locks->dblock_group_size < fs->dblock_count ? group->start + locks->dblock_group_size : fs->dblock_count;
+    }
+}
+
+// recounts the available dblocks of every group. nobody else may claim or release meanwhile
+static void recount_dblock_groups(filesystem_t *fs)
+{
+    for (size_t g = 0; g < fs->locks->dblock_group_count; ++g)
+    {
+        struct dblock_group *group = &fs->locks->dblock_groups[g];
+        group->hint = group->start;
+        group->free_count = bitmap_popcount(fs->dblock_bitmask + group->start / 8, group->end - group->start);
+    }
+}
+
+static struct dblock_group *dblock_group_of(filesystem_t *fs, size_t index)
+{
+    return &fs->locks->dblock_groups[index / fs->locks->dblock_group_size];
+}
+
+// the groups to try in turn, starting with the calling thread's own
+static struct dblock_group *nth_dblock_group(filesystem_t *fs, size_t n)
+{
+    return &fs->locks->dblock_groups[(thread_number() + n) % fs->locks->dblock_group_count];
+}
+
+// keeps `dblock_hint` a lower bound on the available dblocks, which the defragmenter relies on
+static void lower_dblock_hint(filesystem_t *fs, size_t index)
+{
+    size_t hint = __atomic_load_n(&fs->dblock_hint, __ATOMIC_RELAXED);
+    while (index < hint && !__atomic_compare_exchange_n(&fs->dblock_hint, &hint, index, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+}
+
+// takes up to `max` available dblocks of a locked group, lowest first. returns how many
+static size_t group_take_dblocks(filesystem_t *fs, struct dblock_group *group, size_t max, dblock_index_t *indices)
+{
+    size_t taken = 0;
+    size_t run_start = group->hint;
+    while (taken < max && bitmap_find_first_set(fs->dblock_bitmask, group->end, run_start, &run_start))
+    {
+        size_t run_end;
+        if (!bitmap_find_first_clear(fs->dblock_bitmask, group->end, run_start, &run_end)) run_end = group->end;
+
+        size_t run_len = run_end - run_start < max - taken ? run_end - run_start : max - taken;
+        for (size_t i = 0; i < run_len; ++i) indices[taken++] = run_start + i;
+        bitmap_clear_range(fs->dblock_bitmask, run_start, run_len);
+        mark_bitmask_range_dirty(fs, run_start, run_len);
+        run_start += run_len;
+    }
+    group->hint = taken < max ? group->end : indices[taken - 1] + 1;
+    group->free_count -= taken;
+    return taken;
+}
+
+static void group_release_dblock(filesystem_t *fs, size_t index)
+{
+    struct dblock_group *group = dblock_group_of(fs, index);
+    pthread_mutex_lock(&group->lock);
+    bool was_used = !bitmap_test(fs->dblock_bitmask, index);
+    if (was_used) group->free_count++;
+    mark_dblock_as_unused(fs->dblock_bitmask, index);
+    mark_bitmask_dirty(fs, index);
+    if (index < group->hint) group->hint = index;
+    pthread_mutex_unlock(&group->lock);
+
+    if (was_used) __atomic_fetch_add(&fs->free_dblock_count, 1, __ATOMIC_RELAXED);
+    lower_dblock_hint(fs, index);
+}
+
+static fs_retcode_t claim_dblocks_grouped(filesystem_t *fs, size_t count, dblock_index_t *indices)
+{
+    if (count > __atomic_load_n(&fs->free_dblock_count, __ATOMIC_RELAXED)) return DBLOCK_UNAVAILABLE;
+
+    size_t claimed = 0;
+    for (size_t n = 0; claimed < count && n < fs->locks->dblock_group_count; ++n)
+    {
+        struct dblock_group *group = nth_dblock_group(fs, n);
+        if (__atomic_load_n(&group->free_count, __ATOMIC_RELAXED) == 0) continue;
+        pthread_mutex_lock(&group->lock);
+        claimed += group_take_dblocks(fs, group, count - claimed, indices + claimed);
+        pthread_mutex_unlock(&group->lock);
+    }
+
+    // other threads took what the count promised. undo the claims
+    if (claimed < count)
+    {
+        __atomic_fetch_sub(&fs->free_dblock_count, claimed, __ATOMIC_RELAXED);
+        for (size_t i = 0; i < claimed; ++i) group_release_dblock(fs, indices[i]);
+        return DBLOCK_UNAVAILABLE;
+    }
+    __atomic_fetch_sub(&fs->free_dblock_count, count, __ATOMIC_RELAXED);
+    return SUCCESS;
+}
+
+// the groups holding the dblocks [start, start + count) are locked, in ascending order
+static void lock_dblock_groups(filesystem_t *fs, size_t start, size_t count)
+{
+    size_t last = (start + count - 1) / fs->locks->dblock_group_size;
+    for (size_t g = start / fs->locks->dblock_group_size; g <= last; ++g) pthread_mutex_lock(&fs->locks->dblock_groups[g].lock);
+}
+
+static void unlock_dblock_groups(filesystem_t *fs, size_t start, size_t count)
+{
+    size_t last = (start + count - 1) / fs->locks->dblock_group_size;
+    for (size_t g = start / fs->locks->dblock_group_size; g <= last; ++g) pthread_mutex_unlock(&fs->locks->dblock_groups[g].lock);
+}
+
+// takes a run of available dblocks whose groups are locked
+static void take_locked_run(filesystem_t *fs, size_t start, size_t count)
+{
+    bitmap_clear_range(fs->dblock_bitmask, start, count);
+    mark_bitmask_range_dirty(fs, start, count);
+    for (size_t index = start; index < start + count;)
+    {
+        struct dblock_group *group = dblock_group_of(fs, index);
+        size_t end = group->end < start + count ? group->end : start + count;
+        group->free_count -= end - index;
+        if (group->hint == index) group->hint = end;
+        index = end;
+    }
+    __atomic_fetch_sub(&fs->free_dblock_count, count, __ATOMIC_RELAXED);
+}
+
+static bool is_available_run(filesystem_t *fs, size_t start, size_t count)
+{
+    size_t busy;
+    return start < fs->dblock_count && count <= fs->dblock_count - start &&
+        !bitmap_find_first_clear(fs->dblock_bitmask, start + count, start, &busy);
+}
+
+static fs_retcode_t claim_run_grouped(filesystem_t *fs, size_t count, size_t preferred, dblock_index_t *first)
+{
+    if (count > __atomic_load_n(&fs->free_dblock_count, __ATOMIC_RELAXED)) return DBLOCK_UNAVAILABLE;
+
+    // the preferred run, whichever groups it falls into
+    if (preferred < fs->dblock_count && count <= fs->dblock_count - preferred)
+    {
+        lock_dblock_groups(fs, preferred, count);
+        bool available = is_available_run(fs, preferred, count);
+        if (available) take_locked_run(fs, preferred, count);
+        unlock_dblock_groups(fs, preferred, count);
+        if (available)
+        {
+            *first = preferred;
+            return SUCCESS;
+        }
+    }
+
+    // then a run inside one group, starting with the thread's own
+    for (size_t n = 0; count <= fs->locks->dblock_group_size && n < fs->locks->dblock_group_count; ++n)
+    {
+        struct dblock_group *group = nth_dblock_group(fs, n);
+        if (__atomic_load_n(&group->free_count, __ATOMIC_RELAXED) < count) continue;
+        pthread_mutex_lock(&group->lock);
+        size_t run_start;
+        bool found = bitmap_find_set_run(fs->dblock_bitmask, group->end, group->hint, count, &run_start);
+        if (found) take_locked_run(fs, run_start, count);
+        pthread_mutex_unlock(&group->lock);
+        if (found)
+        {
+            *first = run_start;
+            return SUCCESS;
+        }
+    }
+
+    // the run may still fit across groups, which are all needed to find it
+    size_t run_start;
+    lock_dblock_groups(fs, 0, fs->dblock_count);
+    bool found = bitmap_find_set_run(fs->dblock_bitmask, fs->dblock_count, __atomic_load_n(&fs->dblock_hint, __ATOMIC_RELAXED), count, &run_start);
+    if (found) take_locked_run(fs, run_start, count);
+    unlock_dblock_groups(fs, 0, fs->dblock_count);
+    if (!found) return DBLOCK_UNAVAILABLE;
+    *first = run_start;
+    return SUCCESS;
+}
+
+// ----------------------- LOCKS ----------------------- //
+
+// nobody else can be claiming or releasing inodes, so `available_inode` is the head of the list
+static bool single_user(filesystem_t *fs)
+{
+    return !fs->locks || fs->locks->exclusive;
+}
+
+static void free_locks(filesystem_t *fs)
+{
+    if (!fs->locks) return;
+    for (size_t i = 0; i < fs->inode_count; ++i) pthread_rwlock_destroy(&fs->locks->inodes[i]);
+    while (fs->locks->inode_caches)
+    {
+        struct inode_cache *cache = fs->locks->inode_caches;
+        fs->locks->inode_caches = cache->next;
+        free(cache);
+    }
+    for (size_t g = 0; g < DBLOCK_GROUP_COUNT; ++g) pthread_mutex_destroy(&fs->locks->dblock_groups[g].lock);
+    pthread_rwlock_destroy(&fs->locks->filesystem);
+    pthread_mutex_destroy(&fs->locks->free_inodes);
+    pthread_mutex_destroy(&fs->locks->dentries);
+    free(fs->locks->inodes);
+    free(fs->locks);
+    fs->locks = NULL;
+}
+
+fs_retcode_t fs_enable_concurrency(filesystem_t *fs)
+{
+    if (!fs) return INVALID_INPUT;
+    if (fs->locks) return SUCCESS;
+
+    struct fs_locks *locks = aligned_alloc(_Alignof(struct fs_locks), sizeof(struct fs_locks));
+    pthread_rwlock_t *inode_locks = calloc(fs->inode_count, sizeof(pthread_rwlock_t));
+    if (!locks || !inode_locks)
+    {
+        free(locks);
+        free(inode_locks);
+        return SYSTEM_ERROR;
+    }
+    memset(locks, 0, sizeof(struct fs_locks));
+
+    pthread_rwlock_init(&locks->filesystem, NULL);
+    for (size_t i = 0; i < fs->inode_count; ++i) pthread_rwlock_init(&inode_locks[i], NULL);
+    for (size_t g = 0; g < DBLOCK_GROUP_COUNT; ++g) pthread_mutex_init(&locks->dblock_groups[g].lock, NULL);
+    pthread_mutex_init(&locks->free_inodes, NULL);
+    pthread_mutex_init(&locks->dentries, NULL);
+    locks->id = __atomic_add_fetch(&locks_created, 1, __ATOMIC_RELAXED);
+    locks->inodes = inode_locks;
+    locks->free_inode_head = fs->available_inode;
+    split_dblock_groups(fs, locks);
+    fs->locks = locks;
+    recount_dblock_groups(fs);
+    return SUCCESS;
+}
+
+void fs_lock_filesystem(filesystem_t *fs, bool exclusive)
+{
+    if (!fs || !fs->locks) return;
+    if (!exclusive)
+    {
+        pthread_rwlock_rdlock(&fs->locks->filesystem);
+        return;
+    }
+
+    // whoever holds it exclusively sees the free inode list the way a single user would
+    pthread_rwlock_wrlock(&fs->locks->filesystem);
+    fs->locks->exclusive = true;
+    settle_free_inodes(fs);
+}
+
+void fs_unlock_filesystem(filesystem_t *fs)
+{
+    if (!fs || !fs->locks) return;
+    if (fs->locks->exclusive)
+    {
+        fs->locks->exclusive = false;
+        unsettle_free_inodes(fs);
+    }
+    pthread_rwlock_unlock(&fs->locks->filesystem);
+}
+
+void fs_lock_inode(filesystem_t *fs, inode_t *inode, bool exclusive)
+{
+    if (!fs || !fs->locks || !inode) return;
+    pthread_rwlock_t *lock = &fs->locks->inodes[inode - fs->inodes];
+    if (exclusive) pthread_rwlock_wrlock(lock);
+    else pthread_rwlock_rdlock(lock);
+}
+
+void fs_unlock_inode(filesystem_t *fs, inode_t *inode)
+{
+    if (!fs || !fs->locks || !inode) return;
+    pthread_rwlock_unlock(&fs->locks->inodes[inode - fs->inodes]);
 }
 
 // ----------------------- CORE FUNCTION ----------------------- //
@@ -76,6 +761,29 @@ fs_retcode_t new_filesystem(filesystem_t *fs, size_t inode_total, size_t dblock_
     fs->dblock_bitmask = dblock_bitmask;
     fs->dblocks = dblocks;
     fs->dblock_count = dblock_total;
+    fs->map_generation = 0;
+    fs->relocation_generation = 0;
+    fs->dblock_hint = 1; // dblock 0 holds the root directory
+    fs->free_inode_count = inode_total - 1;
+    fs->free_dblock_count = dblock_total - 1;
+    fs->image_map = NULL;
+    fs->image_map_size = 0;
+    fs->indirect_layout = INDIRECT_CHAIN;
+    fs->inline_data_limit = 0;
+    fs->sorted_free_inodes = false;
+    fs->dentry_cache = NULL;
+    fs->locks = NULL;
+    fs->journal = NULL;
+    fs->flusher = NULL;
+
+    // nothing of a new file system exists in any image yet
+    if (init_dirty_state(fs, true) != SUCCESS)
+    {
+        free(inodes);
+        free(dblocks);
+        free(dblock_bitmask);
+        return SYSTEM_ERROR;
+    }
 
     return SUCCESS;
 }
@@ -83,6 +791,17 @@ fs_retcode_t new_filesystem(filesystem_t *fs, size_t inode_total, size_t dblock_
 void free_filesystem(filesystem_t *fs)
 {
     if (!fs) return;
+    stop_flusher(fs);
+    detach_journal(fs);
+    free_dirty_state(fs);
+    free(fs->dentry_cache);
+    fs->dentry_cache = NULL;
+    free_locks(fs);
+    if (fs->image_map)
+    {
+        unmap_filesystem(fs);
+        return;
+    }
     free(fs->inodes);
     free(fs->dblock_bitmask);
     free(fs->dblocks);
@@ -91,37 +810,83 @@ void free_filesystem(filesystem_t *fs)
 size_t available_inodes(filesystem_t *fs)
 {
     if (!fs) return 0;
-    size_t count = 0;
+    return __atomic_load_n(&fs->free_inode_count, __ATOMIC_RELAXED);
+}
+
+size_t available_dblocks(filesystem_t *fs)
+{
+    if (!fs) return 0;
+    return __atomic_load_n(&fs->free_dblock_count, __ATOMIC_RELAXED);
+}
+
+void refresh_available_counts(filesystem_t *fs)
+{
+    if (!fs) return;
+
+    // the walk needs every free inode back on the list
+    fs_lock_filesystem(fs, true);
+    size_t inode_count = 0;
     inode_index_t iter = fs->available_inode;
     while (iter != 0)
     {
-        ++count;
+        ++inode_count;
         iter = fs->inodes[iter].next_free_inode;
     } 
-    return count;
+    fs->free_inode_count = inode_count;
+
+    size_t dblock_count = bitmap_popcount(fs->dblock_bitmask, fs->dblock_count);
+    fs->free_dblock_count = dblock_count;
+    if (fs->locks) recount_dblock_groups(fs);
+    fs_unlock_filesystem(fs);
 }
 
-size_t available_dblocks(filesystem_t *fs)
+// the claim and release functions below each come in two parts: the public one checks its
+// input and picks the way to do it once threads share the file system, while the static one
+// does the work for a single user
+
+static fs_retcode_t pop_free_inode(filesystem_t *fs, inode_index_t *index)
 {
-    if (!fs) return 0;
-    size_t count = 0;
-    for (size_t i = 0; i < fs->dblock_count; ++i)
-    {
-        size_t block_idx = i / 8;
-        size_t bit_idx = i % 8;
-        if (fs->dblock_bitmask[block_idx] & (1 << (7 - bit_idx))) ++count;
-    }
-    return count;
+    inode_index_t idx = fs->available_inode;
+    if (!idx) return INODE_UNAVAILABLE;
+    fs->available_inode = fs->inodes[idx].next_free_inode;
+    __atomic_fetch_sub(&fs->free_inode_count, 1, __ATOMIC_RELAXED);
+    mark_header_dirty(fs);
+    mark_inode_dirty(fs, &fs->inodes[idx]);
+    *index = idx;
+    return SUCCESS;
 }
 
 fs_retcode_t claim_available_inode(filesystem_t *fs, inode_index_t *index)
 {
     if (!fs || !index) return INVALID_INPUT;
+    if (single_user(fs)) return pop_free_inode(fs, index);
+    if (!fs->sorted_free_inodes) return claim_inode_lock_free(fs, index);
 
-    inode_index_t idx = fs->available_inode;
-    if (!idx) return INODE_UNAVAILABLE;
-    fs->available_inode = fs->inodes[idx].next_free_inode;
+    // the list stays in order only if one thread at a time walks it
+    lock_free_inodes(fs);
+    fs->available_inode = head_index(fs->locks->free_inode_head);
+    fs_retcode_t result = pop_free_inode(fs, index);
+    unsettle_free_inodes(fs);
+    unlock_free_inodes(fs);
+    return result;
+}
+
+static fs_retcode_t take_first_dblock(filesystem_t *fs, dblock_index_t *index)
+{
+    // everything below the hint is known to be in use, so the scan starts there
+    size_t idx;
+    if (!bitmap_find_first_set(fs->dblock_bitmask, fs->dblock_count, fs->dblock_hint, &idx))
+    {
+        fs->dblock_hint = fs->dblock_count;
+        return DBLOCK_UNAVAILABLE;
+    }
+
+    // claim the data block
     *index = idx;
+    mark_dblock_as_used(fs->dblock_bitmask, idx);
+    mark_bitmask_dirty(fs, idx);
+    fs->dblock_hint = idx + 1;
+    fs->free_dblock_count--;
     return SUCCESS;
 }
 
@@ -129,20 +894,101 @@ fs_retcode_t claim_available_dblock(filesystem_t *fs, dblock_index_t *index)
 {
     if (!fs || !index) return INVALID_INPUT;
 
-    for (size_t i = 0; i < fs->dblock_count; ++i)
+    if (!fs->locks) return take_first_dblock(fs, index);
+    return claim_dblocks_grouped(fs, 1, index);
+}
+
+static fs_retcode_t take_dblocks(filesystem_t *fs, size_t count, dblock_index_t *indices)
+{
+    if (count > fs->free_dblock_count) return DBLOCK_UNAVAILABLE;
+    if (count == 0) return SUCCESS;
+
+    size_t claimed = 0;
+    size_t run_start = fs->dblock_hint;
+
+    // take whole runs of available dblocks, lowest index first
+    while (claimed < count && bitmap_find_first_set(fs->dblock_bitmask, fs->dblock_count, run_start, &run_start))
     {
-        size_t block_idx = i / 8;
-        size_t bit_idx = i % 8;
-        // check if dblock is available via the mask
-        if (fs->dblock_bitmask[block_idx] & (1 << (7 - bit_idx)))
-        {
-            // claim the data block
-            *index = i;
-            mark_dblock_as_used(fs->dblock_bitmask, i);
-            return SUCCESS;
-        }
+        size_t run_end;
+        if (!bitmap_find_first_clear(fs->dblock_bitmask, fs->dblock_count, run_start, &run_end)) run_end = fs->dblock_count;
+
+        size_t run_len = run_end - run_start < count - claimed ? run_end - run_start : count - claimed;
+        for (size_t i = 0; i < run_len; ++i) indices[claimed++] = run_start + i;
+        bitmap_clear_range(fs->dblock_bitmask, run_start, run_len);
+        mark_bitmask_range_dirty(fs, run_start, run_len);
+        run_start += run_len;
+    }
+
+    // only possible if the running count disagrees with the bitmask. undo the claims
+    if (claimed < count)
+    {
+        for (size_t i = 0; i < claimed; ++i) mark_dblock_as_unused(fs->dblock_bitmask, indices[i]);
+        return DBLOCK_UNAVAILABLE;
     }
-    return DBLOCK_UNAVAILABLE;
+
+    fs->dblock_hint = indices[count - 1] + 1;
+    fs->free_dblock_count -= count;
+    return SUCCESS;
+}
+
+fs_retcode_t claim_available_dblocks(filesystem_t *fs, size_t count, dblock_index_t *indices)
+{
+    if (!fs || (!indices && count)) return INVALID_INPUT;
+
+    if (!fs->locks) return take_dblocks(fs, count, indices);
+    if (count == 0) return SUCCESS;
+    return claim_dblocks_grouped(fs, count, indices);
+}
+
+static fs_retcode_t take_dblock_run(filesystem_t *fs, size_t count, size_t preferred, dblock_index_t *first)
+{
+    if (count > fs->free_dblock_count) return DBLOCK_UNAVAILABLE;
+
+    size_t run_start = preferred, busy;
+    bool preferred_available = preferred < fs->dblock_count && count <= fs->dblock_count - preferred &&
+        !bitmap_find_first_clear(fs->dblock_bitmask, preferred + count, preferred, &busy);
+    if (!preferred_available && !bitmap_find_set_run(fs->dblock_bitmask, fs->dblock_count, fs->dblock_hint, count, &run_start))
+    {
+        return DBLOCK_UNAVAILABLE;
+    }
+
+    bitmap_clear_range(fs->dblock_bitmask, run_start, count);
+    mark_bitmask_range_dirty(fs, run_start, count);
+    if (run_start == fs->dblock_hint) fs->dblock_hint = run_start + count;
+    fs->free_dblock_count -= count;
+    *first = run_start;
+    return SUCCESS;
+}
+
+fs_retcode_t claim_dblock_run(filesystem_t *fs, size_t count, size_t preferred, dblock_index_t *first)
+{
+    if (!fs || !first || count == 0) return INVALID_INPUT;
+
+    if (!fs->locks) return take_dblock_run(fs, count, preferred, first);
+    return claim_run_grouped(fs, count, preferred, first);
+}
+
+static void push_free_inode(filesystem_t *fs, inode_t *inode)
+{
+    // add inode to the free "list"
+    inode_index_t idx = inode - fs->inodes; // inode - fs->inodes is index of inode
+    if (fs->sorted_free_inodes && fs->available_inode != 0 && fs->available_inode < idx)
+    {
+        // link it in after the last free inode below it
+        inode_t *prev = &fs->inodes[fs->available_inode];
+        while (prev->next_free_inode != 0 && prev->next_free_inode < idx) prev = &fs->inodes[prev->next_free_inode];
+        inode->next_free_inode = prev->next_free_inode;
+        prev->next_free_inode = idx;
+        mark_inode_dirty(fs, prev);
+    }
+    else
+    {
+        inode->next_free_inode = fs->available_inode;
+        fs->available_inode = idx;
+        mark_header_dirty(fs);
+    }
+    __atomic_fetch_add(&fs->free_inode_count, 1, __ATOMIC_RELAXED);
+    mark_inode_dirty(fs, inode);
 }
 
 fs_retcode_t release_inode(filesystem_t *fs, inode_t *inode)
@@ -153,11 +999,46 @@ fs_retcode_t release_inode(filesystem_t *fs, inode_t *inode)
     // if (inode < fs->inodes || inode >= fs->inodes + fs->inode_count) return INVALID_INPUT;
     // root inode cannot be released
     if (inode == &fs->inodes[0]) return INVALID_INPUT;
-    
-    // add inode to the free "list"
-    inode->next_free_inode = fs->available_inode;
-    fs->available_inode = inode - fs->inodes; // inode - fs->inodes is index of inode
 
+    if (single_user(fs)) push_free_inode(fs, inode);
+    else if (!fs->sorted_free_inodes) release_inode_lock_free(fs, inode);
+    else
+    {
+        lock_free_inodes(fs);
+        fs->available_inode = head_index(fs->locks->free_inode_head);
+        push_free_inode(fs, inode);
+        unsettle_free_inodes(fs);
+        unlock_free_inodes(fs);
+    }
+    return SUCCESS;
+}
+
+fs_retcode_t sort_free_inodes(filesystem_t *fs)
+{
+    if (!fs) return INVALID_INPUT;
+
+    byte *free_inodes = calloc(DBLOCK_MASK_SIZE(fs->inode_count) + 1, sizeof(byte));
+    if (!free_inodes) return SYSTEM_ERROR;
+    fs_lock_filesystem(fs, true);
+    for (inode_index_t iter = fs->available_inode; iter != 0; iter = fs->inodes[iter].next_free_inode)
+    {
+        bitmap_set(free_inodes, iter);
+    }
+
+    // relink from the top down, so each free inode points to the next higher one
+    inode_index_t head = 0;
+    for (size_t i = fs->inode_count; i-- > 1;)
+    {
+        if (!bitmap_test(free_inodes, i)) continue;
+        fs->inodes[i].next_free_inode = head;
+        mark_inode_dirty(fs, &fs->inodes[i]);
+        head = i;
+    }
+    fs->available_inode = head;
+    mark_header_dirty(fs);
+    fs_unlock_filesystem(fs);
+
+    free(free_inodes);
     return SUCCESS;
 }
 
@@ -171,8 +1052,18 @@ fs_retcode_t release_dblock(filesystem_t *fs, byte *dblock)
     ptrdiff_t dblock_idx = dblock_diff / DATA_BLOCK_SIZE;
     // if (dblock_idx < 0 || dblock_idx >= (long) fs->dblock_count) return INVALID_INPUT;
 
-    // enable bit in the bitmask marking availablity
+    // enable bit in the bitmask marking availablity. releasing twice must not count twice
+    if (fs->locks)
+    {
+        // a dblock outside the file system has no group
+        if (dblock_idx < 0 || (size_t) dblock_idx >= fs->dblock_count) return INVALID_INPUT;
+        group_release_dblock(fs, dblock_idx);
+        return SUCCESS;
+    }
+    if (!bitmap_test(fs->dblock_bitmask, dblock_idx)) fs->free_dblock_count++;
     mark_dblock_as_unused(fs->dblock_bitmask, dblock_idx);
+    mark_bitmask_dirty(fs, dblock_idx);
+    if ((size_t) dblock_idx < fs->dblock_hint) fs->dblock_hint = dblock_idx;
 
     return SUCCESS;
 }
@@ -0,0 +1,181 @@
+#include "flusher.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+void wake_flusher(struct fs_flusher *flusher)
+{
+    pthread_mutex_lock(&flusher->lock);
+    pthread_cond_signal(&flusher->wake);
+    pthread_mutex_unlock(&flusher->lock);
+}
+
+// copies what changed under the lock, then writes the copy without it. what a failed write
+// took from the dirty maps goes back, so the next flush tries again
+static fs_retcode_t flush_snapshot(filesystem_t *fs, struct fs_flusher *flusher)
+{
+    fs_lock_filesystem(fs, true);
+    flusher->snapshot.size = 0;
+    fs_retcode_t ret = for_each_dirty_region(fs, &fs->dirty, append_image_region, &flusher->snapshot);
+    if (ret == SUCCESS)
+    {
+        copy_dirty_maps(fs, &flusher->taken, &fs->dirty);
+        clear_dirty_state(fs);
+        __atomic_store_n(&flusher->pending_size, 0, __ATOMIC_RELAXED);
+    }
+    fs_unlock_filesystem(fs);
+    if (ret != SUCCESS || flusher->snapshot.size == 0) return ret;
+
+    int fd = fileno(flusher->file);
+    if (write_image_regions(fd, flusher->snapshot.data, flusher->snapshot.size) == SUCCESS && fdatasync(fd) == 0) return SUCCESS;
+
+    fs_lock_filesystem(fs, true);
+    merge_dirty_maps(fs, &fs->dirty, &flusher->taken);
+    __atomic_fetch_add(&flusher->pending_size, flusher->snapshot.size, __ATOMIC_RELAXED);
+    fs_unlock_filesystem(fs);
+    return SYSTEM_ERROR;
+}
+
+static bool flusher_has_work(struct fs_flusher *flusher)
+{
+    return flusher->stopping || flusher->requested != flusher->completed ||
+           (flusher->threshold && __atomic_load_n(&flusher->pending_size, __ATOMIC_RELAXED) >= flusher->threshold);
+}
+
+static void *run_flusher(void *arg)
+{
+    struct fs_flusher *flusher = arg;
+    pthread_mutex_lock(&flusher->lock);
+    while (true)
+    {
+        struct timespec deadline;
+        clock_gettime(CLOCK_MONOTONIC, &deadline);
+        deadline.tv_sec += flusher->interval_ms / 1000;
+        deadline.tv_nsec += (long) (flusher->interval_ms % 1000) * 1000000;
+        if (deadline.tv_nsec >= 1000000000)
+        {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000;
+        }
+
+        bool timed_out = false;
+        while (!flusher_has_work(flusher) && !timed_out)
+        {
+            if (flusher->interval_ms) timed_out = pthread_cond_timedwait(&flusher->wake, &flusher->lock, &deadline) == ETIMEDOUT;
+            else pthread_cond_wait(&flusher->wake, &flusher->lock);
+        }
+
+        // an interval without changes has nothing to write
+        if (timed_out && !flusher_has_work(flusher) && __atomic_load_n(&flusher->pending_size, __ATOMIC_RELAXED) == 0) continue;
+
+        // requests up to here were made before the snapshot is taken, so it answers them
+        bool stopping = flusher->stopping;
+        uint64_t requested = flusher->requested;
+        pthread_mutex_unlock(&flusher->lock);
+        fs_retcode_t result = flush_snapshot(flusher->fs, flusher);
+        pthread_mutex_lock(&flusher->lock);
+
+        flusher->result = result;
+        flusher->completed = requested;
+        pthread_cond_broadcast(&flusher->flushed);
+        if (stopping) break;
+    }
+    pthread_mutex_unlock(&flusher->lock);
+    return NULL;
+}
+
+static void free_flusher(struct fs_flusher *flusher)
+{
+    fclose(flusher->file);
+    pthread_mutex_destroy(&flusher->lock);
+    pthread_cond_destroy(&flusher->wake);
+    pthread_cond_destroy(&flusher->flushed);
+    free_dirty_maps(&flusher->taken);
+    free(flusher->snapshot.data);
+    free(flusher);
+}
+
+fs_retcode_t start_flusher(filesystem_t *fs, FILE *file, size_t interval_ms, size_t threshold)
+{
+    if (!fs || !file || fs->image_map) return INVALID_INPUT;
+    stop_flusher(fs);
+
+    if (fflush(file) == EOF) return SYSTEM_ERROR;
+    fs_retcode_t ret = check_image_layout(fileno(file), fs);
+    if (ret != SUCCESS) return ret;
+    if (fs_enable_concurrency(fs) != SUCCESS) return SYSTEM_ERROR;
+
+    struct fs_flusher *flusher = calloc(1, sizeof(struct fs_flusher));
+    if (!flusher) return SYSTEM_ERROR;
+    flusher->fs = fs;
+    flusher->file = file;
+    flusher->interval_ms = interval_ms;
+    flusher->threshold = threshold;
+    flusher->result = SUCCESS;
+
+    // the interval is measured on a clock nobody can set back
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_mutex_init(&flusher->lock, NULL);
+    pthread_cond_init(&flusher->wake, &attr);
+    pthread_cond_init(&flusher->flushed, NULL);
+    pthread_condattr_destroy(&attr);
+    if (init_dirty_maps(fs, &flusher->taken) != SUCCESS)
+    {
+        free_flusher(flusher);
+        return SYSTEM_ERROR;
+    }
+
+    // what changed before is not counted, but the first flush writes it as well
+    flusher->pending_size = 1;
+    fs_lock_filesystem(fs, true);
+    fs->flusher = flusher;
+    fs_unlock_filesystem(fs);
+
+    if (pthread_create(&flusher->thread, NULL, run_flusher, flusher) != 0)
+    {
+        fs_lock_filesystem(fs, true);
+        fs->flusher = NULL;
+        fs_unlock_filesystem(fs);
+        free_flusher(flusher);
+        return SYSTEM_ERROR;
+    }
+    return SUCCESS;
+}
+
+fs_retcode_t flush_filesystem(filesystem_t *fs, bool wait)
+{
+    if (!fs || !fs->flusher) return INVALID_INPUT;
+
+    struct fs_flusher *flusher = fs->flusher;
+    pthread_mutex_lock(&flusher->lock);
+    uint64_t request = ++flusher->requested;
+    pthread_cond_signal(&flusher->wake);
+    while (wait && flusher->completed < request) pthread_cond_wait(&flusher->flushed, &flusher->lock);
+    fs_retcode_t result = flusher->result;
+    pthread_mutex_unlock(&flusher->lock);
+    return result;
+}
+
+fs_retcode_t stop_flusher(filesystem_t *fs)
+{
+    if (!fs) return INVALID_INPUT;
+    if (!fs->flusher) return SUCCESS;
+
+    struct fs_flusher *flusher = fs->flusher;
+    pthread_mutex_lock(&flusher->lock);
+    flusher->stopping = true;
+    pthread_cond_signal(&flusher->wake);
+    pthread_mutex_unlock(&flusher->lock);
+    pthread_join(flusher->thread, NULL);
+
+    fs_retcode_t result = flusher->result;
+    fs_lock_filesystem(fs, true);
+    fs->flusher = NULL;
+    fs_unlock_filesystem(fs);
+    free_flusher(flusher);
+    return result;
+}
@@ -0,0 +1,241 @@
+#include "fsck.h"
+#include "utility.h"
+#include "bitmap.h"
+#include "scan.h"
+
+#include <stdlib.h>
+
+#define DBLOCK_MASK_SIZE(blk_count) (((blk_count) + 7) / (sizeof(byte) * 8))
+#define INDIRECT_DBLOCK_INDEX_COUNT (DATA_BLOCK_SIZE / sizeof(dblock_index_t) - 1)
+#define TREE_FANOUT (DATA_BLOCK_SIZE / sizeof(dblock_index_t))
+#define EXTENTS_PER_DBLOCK (INDIRECT_DBLOCK_INDEX_COUNT / 2)
+
+// waits until the loader has read a dblock. returns false if it never will
+static bool wait_for_dblock(consistency_check_t *check, dblock_index_t index)
+{
+    if (!check->progress || index < check->known_loaded_dblocks) return true;
+
+    load_progress_t *progress = check->progress;
+    pthread_mutex_lock(&progress->lock);
+    while (progress->loaded_dblocks <= index && !progress->failed) pthread_cond_wait(&progress->advanced, &progress->lock);
+    check->known_loaded_dblocks = progress->loaded_dblocks;
+    pthread_mutex_unlock(&progress->lock);
+
+    return index < check->known_loaded_dblocks;
+}
+
+// records a reference to a dblock. returns false if the index is out of range
+static bool reference_dblock(consistency_check_t *check, dblock_index_t index)
+{
+    if (index >= check->fs->dblock_count)
+    {
+        check->report.invalid_references++;
+        return false;
+    }
+    byte bit = (byte) (1 << (7 - index % 8));
+    if (__atomic_fetch_or(&check->referenced[index / 8], bit, __ATOMIC_RELAXED) & bit) check->report.shared_dblocks++;
+    return true;
+}
+
+// references a tree node and the dblocks below it holding its first `count` data dblocks
+static void check_tree(consistency_check_t *check, dblock_index_t node, size_t height, size_t count)
+{
+    if (height == 0 || !reference_dblock(check, node)) return;
+    if (!wait_for_dblock(check, node))
+    {
+        check->aborted = true;
+        return;
+    }
+
+    size_t span = calculate_tree_capacity(height - 1);
+    dblock_index_t *slots = cast_dblock_ptr(check->fs->dblocks + node * DATA_BLOCK_SIZE);
+    for (size_t slot = 0; slot < TREE_FANOUT && slot * span < count && !check->aborted; ++slot)
+    {
+        size_t below = count - slot * span < span ? count - slot * span : span;
+        if (height > 1) check_tree(check, slots[slot], height - 1, below);
+        else reference_dblock(check, slots[slot]);
+    }
+}
+
+// references the extent dblocks of an inode and the first `count` data dblocks they list.
+// a write can leave one empty extent dblock at the end of the chain, ready for its next extent
+static void check_extents(consistency_check_t *check, dblock_index_t extent_dblock, size_t count)
+{
+    // every other extent dblock lists at least one data dblock, so a longer chain must loop
+    size_t longest_chain = count + 1;
+    for (size_t visited = 0; extent_dblock != 0 && visited < longest_chain; ++visited)
+    {
+        if (!reference_dblock(check, extent_dblock)) return;
+        if (!wait_for_dblock(check, extent_dblock))
+        {
+            check->aborted = true;
+            return;
+        }
+
+        dblock_index_t *slots = cast_dblock_ptr(check->fs->dblocks + extent_dblock * DATA_BLOCK_SIZE);
+        if (count == 0)
+        {
+            if (slots[1] != 0) check->report.invalid_references++;
+            return;
+        }
+        for (size_t e = 0; e < EXTENTS_PER_DBLOCK && count > 0; ++e)
+        {
+            size_t length = slots[2 * e + 1] < count ? slots[2 * e + 1] : count;
+            if (length == 0)
+            {
+                check->report.invalid_references++;
+                return;
+            }
+            for (size_t i = 0; i < length; ++i)
+            {
+                if (!reference_dblock(check, slots[2 * e] + i)) break;
+            }
+            count -= length;
+        }
+        extent_dblock = slots[INDIRECT_DBLOCK_INDEX_COUNT];
+    }
+    if (count > 0) check->report.size_mismatches++;
+}
+
+// references every dblock an inode uses. only the slots covered by the file size count,
+// since shrinking leaves stale indices behind in the index dblocks
+static void check_inode(consistency_check_t *check, inode_t *inode)
+{
+    if (inode->internal.indirect_layout == INDIRECT_INLINE)
+    {
+        if (inode->internal.file_size > INODE_INLINE_CAPACITY) check->report.size_mismatches++;
+        return;
+    }
+
+    size_t data_dblocks = (inode->internal.file_size + DATA_BLOCK_SIZE - 1) / DATA_BLOCK_SIZE;
+    size_t direct_dblocks = data_dblocks < INODE_DIRECT_BLOCK_COUNT ? data_dblocks : INODE_DIRECT_BLOCK_COUNT;
+    for (size_t i = 0; i < direct_dblocks; ++i) reference_dblock(check, inode->internal.direct_data[i]);
+
+    size_t remaining = data_dblocks - direct_dblocks;
+    if (remaining > 0 && inode->internal.indirect_layout == INDIRECT_TREE)
+    {
+        size_t height = inode->internal.indirect_height;
+        if (height == 0 || height > TREE_MAX_HEIGHT || remaining > calculate_tree_capacity(height))
+        {
+            check->report.size_mismatches++;
+            return;
+        }
+        check_tree(check, inode->internal.indirect_dblock, inode->internal.indirect_height, remaining);
+        return;
+    }
+
+    if (remaining > 0 && inode->internal.indirect_layout == INDIRECT_EXTENTS)
+    {
+        check_extents(check, inode->internal.indirect_dblock, remaining);
+        return;
+    }
+
+    dblock_index_t index_dblock = inode->internal.indirect_dblock;
+    while (remaining > 0)
+    {
+        // dblock 0 belongs to the root directory, so a chain that gets there ended too early
+        if (index_dblock == 0)
+        {
+            check->report.size_mismatches++;
+            return;
+        }
+        if (!reference_dblock(check, index_dblock)) return;
+        if (!wait_for_dblock(check, index_dblock))
+        {
+            check->aborted = true;
+            return;
+        }
+
+        dblock_index_t *slots = cast_dblock_ptr(check->fs->dblocks + index_dblock * DATA_BLOCK_SIZE);
+        size_t used_slots = remaining < INDIRECT_DBLOCK_INDEX_COUNT ? remaining : INDIRECT_DBLOCK_INDEX_COUNT;
+        for (size_t i = 0; i < used_slots; ++i) reference_dblock(check, slots[i]);
+
+        remaining -= used_slots;
+        index_dblock = slots[INDIRECT_DBLOCK_INDEX_COUNT];
+    }
+}
+
+// checks one inode in use. `arg` holds one check per worker, so no two threads share a report
+static void check_scanned_inode(filesystem_t *fs, inode_index_t index, inode_t *inode, size_t worker, void *arg)
+{
+    (void) fs;
+    (void) index;
+    consistency_check_t *check = &((consistency_check_t *) arg)[worker];
+    if (!check->aborted) check_inode(check, inode);
+}
+
+// while loading, the check runs on a thread of its own as the loader reads the dblocks
+void *run_consistency_check(void *arg)
+{
+    consistency_check_t *check = arg;
+    if (scan_inodes(check->fs, check->free_inodes, NULL, check_scanned_inode, check, 1) != SUCCESS) check->aborted = true;
+    return NULL;
+}
+
+// compares the referenced dblocks with the bitmask, where a set bit means available
+void compare_referenced_dblocks(consistency_check_t *check)
+{
+    const byte *bitmask = check->fs->dblock_bitmask;
+    size_t dblock_count = check->fs->dblock_count;
+    for (size_t b = 0; b < DBLOCK_MASK_SIZE(dblock_count); ++b)
+    {
+        byte valid = b < dblock_count / 8 ? 0xFF : (byte) (0xFF << (8 - dblock_count % 8));
+        check->report.leaked_dblocks += __builtin_popcount((byte) ~(bitmask[b] | check->referenced[b]) & valid);
+        check->report.unmarked_dblocks += __builtin_popcount(bitmask[b] & check->referenced[b] & valid);
+    }
+}
+
+static fs_retcode_t check_filesystem(filesystem_t *fs, size_t thread_count, fs_fsck_report_t *report)
+{
+    if (!fs || !report) return INVALID_INPUT;
+
+    thread_count = fs_scan_thread_count(fs, thread_count);
+    byte *free_inodes = calloc(DBLOCK_MASK_SIZE(fs->inode_count) + 1, sizeof(byte));
+    byte *referenced = calloc(DBLOCK_MASK_SIZE(fs->dblock_count) + 1, sizeof(byte));
+    consistency_check_t *checks = calloc(thread_count, sizeof(consistency_check_t));
+    if (!free_inodes || !referenced || !checks)
+    {
+        free(free_inodes);
+        free(referenced);
+        free(checks);
+        return SYSTEM_ERROR;
+    }
+
+    // a broken free inode list is reported, and the inodes it did reach are still left out of the check
+    *report = (fs_fsck_report_t) { 0 };
+    report->broken_free_inode_list = !collect_free_inodes(fs, free_inodes);
+
+    for (size_t t = 0; t < thread_count; ++t)
+    {
+        checks[t] = (consistency_check_t) { .fs = fs, .free_inodes = free_inodes, .referenced = referenced };
+    }
+    fs_retcode_t result = scan_inodes(fs, free_inodes, NULL, check_scanned_inode, checks, thread_count);
+
+    consistency_check_t total = { .fs = fs, .referenced = referenced };
+    for (size_t t = 0; t < thread_count; ++t)
+    {
+        total.report.shared_dblocks += checks[t].report.shared_dblocks;
+        total.report.invalid_references += checks[t].report.invalid_references;
+        total.report.size_mismatches += checks[t].report.size_mismatches;
+    }
+    compare_referenced_dblocks(&total);
+
+    report->dblocks = total.report;
+    report->checked_inodes = fs->inode_count - bitmap_popcount(free_inodes, fs->inode_count);
+    report->thread_count = thread_count;
+
+    free(free_inodes);
+    free(referenced);
+    free(checks);
+    return result;
+}
+
+// a file changing halfway through the check would look broken
+fs_retcode_t fsck_filesystem(filesystem_t *fs, size_t thread_count, fs_fsck_report_t *report)
+{
+    if (!fs || !report) return INVALID_INPUT;
+    fs_lock_filesystem(fs, true);
+    fs_retcode_t result = check_filesystem(fs, thread_count, report);
+    fs_unlock_filesystem(fs);
+    return result;
+}
@@ -0,0 +1,264 @@
+#include "image.h"
+#include "bitmap.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+// serializes the header of the image of a file system
+void encode_image_header(const filesystem_t *fs, byte *header)
+{
+#if IMAGE_HAS_GEOMETRY
+    size_t geometry[2] = { IMAGE_GEOMETRY_MAGIC, DATA_BLOCK_SIZE };
+    memcpy(header, geometry, sizeof(geometry));
+#endif
+    memcpy(header + IMAGE_INODE_COUNT_OFFSET, &fs->inode_count, sizeof(fs->inode_count));
+    memcpy(header + IMAGE_AVAILABLE_INODE_OFFSET, &fs->available_inode, sizeof(fs->available_inode));
+    memcpy(header + IMAGE_DBLOCK_COUNT_OFFSET, &fs->dblock_count, sizeof(fs->dblock_count));
+}
+
+// reads a serialized header. returns false if it was written by a build with another block size
+bool decode_image_header(const byte *header, size_t *inode_count, inode_index_t *available_inode, size_t *dblock_count)
+{
+#if IMAGE_HAS_GEOMETRY
+    size_t geometry[2];
+    memcpy(geometry, header, sizeof(geometry));
+    if (geometry[0] != IMAGE_GEOMETRY_MAGIC || geometry[1] != DATA_BLOCK_SIZE) return false;
+#endif
+    memcpy(inode_count, header + IMAGE_INODE_COUNT_OFFSET, sizeof(*inode_count));
+    memcpy(available_inode, header + IMAGE_AVAILABLE_INODE_OFFSET, sizeof(*available_inode));
+    memcpy(dblock_count, header + IMAGE_DBLOCK_COUNT_OFFSET, sizeof(*dblock_count));
+    return true;
+}
+
+// the image has to be laid out exactly like this file system
+fs_retcode_t check_image_layout(int fd, const filesystem_t *fs)
+{
+    struct stat image_stat;
+    if (fstat(fd, &image_stat) == -1) return SYSTEM_ERROR;
+    byte header[IMAGE_HEADER_SIZE];
+    size_t inode_count, dblock_count;
+    inode_index_t available_inode;
+    if (pread(fd, header, IMAGE_HEADER_SIZE, 0) != IMAGE_HEADER_SIZE) return INVALID_BINARY_FORMAT;
+    if (!decode_image_header(header, &inode_count, &available_inode, &dblock_count)) return INVALID_BINARY_FORMAT;
+    if (inode_count != fs->inode_count || dblock_count != fs->dblock_count) return INVALID_BINARY_FORMAT;
+    if ((size_t) image_stat.st_size != IMAGE_SIZE(fs->inode_count, fs->dblock_count)) return INVALID_BINARY_FORMAT;
+    return SUCCESS;
+}
+
+// calls `fn` for each run of consecutive dirty units (inodes, bitmask bytes or dblocks)
+static fs_retcode_t for_each_dirty_run(filesystem_t *fs, const byte *dirty, size_t count, size_t image_offset, const byte *base, size_t unit_size, image_region_fn fn, void *ctx)
+{
+    size_t first = 0;
+    while (bitmap_find_first_set(dirty, count, first, &first))
+    {
+        size_t end;
+        if (!bitmap_find_first_clear(dirty, count, first, &end)) end = count;
+
+        fs_retcode_t ret = fn(fs, image_offset + first * unit_size, base + first * unit_size, (end - first) * unit_size, ctx);
+        if (ret != SUCCESS) return ret;
+        first = end;
+    }
+    return SUCCESS;
+}
+
+// calls `fn` for every region of the image a set of dirty maps marks as changed, in file order
+fs_retcode_t for_each_dirty_region(filesystem_t *fs, const struct dirty_state *dirty, image_region_fn fn, void *ctx)
+{
+    fs_retcode_t ret;
+    if (dirty->header)
+    {
+        byte header[IMAGE_HEADER_SIZE];
+        encode_image_header(fs, header);
+        if ((ret = fn(fs, 0, header, IMAGE_HEADER_SIZE, ctx)) != SUCCESS) return ret;
+    }
+
+    if (!dirty->inodes) return SUCCESS;
+
+    size_t block_bitmask_size = IMAGE_BITMASK_SIZE(fs->dblock_count);
+    ret = for_each_dirty_run(fs, dirty->inodes, fs->inode_count, IMAGE_INODES_OFFSET, 
+        (const byte *) fs->inodes, sizeof(inode_t), fn, ctx);
+    if (ret != SUCCESS) return ret;
+    ret = for_each_dirty_run(fs, dirty->bitmask, block_bitmask_size, IMAGE_BITMASK_OFFSET(fs->inode_count), 
+        fs->dblock_bitmask, sizeof(byte), fn, ctx);
+    if (ret != SUCCESS) return ret;
+    return for_each_dirty_run(fs, dirty->dblocks, fs->dblock_count, IMAGE_DBLOCKS_OFFSET(fs->inode_count, fs->dblock_count), 
+        fs->dblocks, DATA_BLOCK_SIZE, fn, ctx);
+}
+
+// writes a region of the image to its place in the image file
+fs_retcode_t write_image_region(filesystem_t *fs, size_t offset, const void *data, size_t len, void *ctx)
+{
+    (void) fs;
+    int fd = *(int *) ctx;
+    const byte *bytes = data;
+    while (len > 0)
+    {
+        ssize_t written = pwrite(fd, bytes, len, offset);
+        if (written <= 0) return SYSTEM_ERROR;
+        bytes += written;
+        offset += written;
+        len -= written;
+    }
+    return SUCCESS;
+}
+
+fs_retcode_t write_dirty_image(FILE *file, filesystem_t *fs)
+{
+    if (!fs || !file) return INVALID_INPUT;
+
+    // anything still buffered in `file` would land on top of our writes later
+    if (fflush(file) == EOF) return SYSTEM_ERROR;
+    int fd = fileno(file);
+    fs_retcode_t ret = check_image_layout(fd, fs);
+    if (ret != SUCCESS) return ret;
+
+    ret = for_each_dirty_region(fs, &fs->dirty, write_image_region, &fd);
+    if (ret != SUCCESS) return ret;
+
+    // a flusher still has to write the changes to its own image
+    if (!fs->flusher) clear_dirty_state(fs);
+    return SUCCESS;
+}
+
+// makes room for `len` more bytes at the end of the buffer
+fs_retcode_t grow_byte_buffer(struct byte_buffer *buffer, size_t len)
+{
+    if (buffer->size + len <= buffer->capacity) return SUCCESS;
+    size_t capacity = buffer->capacity ? buffer->capacity : 4096;
+    while (capacity < buffer->size + len) capacity *= 2;
+    byte *data = realloc(buffer->data, capacity);
+    if (!data) return SYSTEM_ERROR;
+    buffer->data = data;
+    buffer->capacity = capacity;
+    return SUCCESS;
+}
+
+// appends a changed region of the image to a buffer, behind its offset and length
+fs_retcode_t append_image_region(filesystem_t *fs, size_t offset, const void *data, size_t len, void *ctx)
+{
+    (void) fs;
+    struct byte_buffer *buffer = ctx;
+    if (grow_byte_buffer(buffer, sizeof(image_region_t) + len) != SUCCESS) return SYSTEM_ERROR;
+    image_region_t region = { offset, len };
+    memcpy(buffer->data + buffer->size, &region, sizeof(region));
+    memcpy(buffer->data + buffer->size + sizeof(region), data, len);
+    buffer->size += sizeof(region) + len;
+    return SUCCESS;
+}
+
+// writes regions appended by `append_image_region` to the image
+fs_retcode_t write_image_regions(int fd, const byte *regions, size_t length)
+{
+    for (size_t pos = 0; pos < length;)
+    {
+        image_region_t region;
+        memcpy(&region, regions + pos, sizeof(region));
+        pos += sizeof(region);
+        if (write_image_region(NULL, region.offset, regions + pos, region.length, &fd) != SUCCESS) return SYSTEM_ERROR;
+        pos += region.length;
+    }
+    return SUCCESS;
+}
+
+fs_retcode_t map_filesystem(FILE *file, filesystem_t *fs)
+{
+    if (!fs || !file) return INVALID_INPUT;
+
+    struct stat image_stat;
+    if (fstat(fileno(file), &image_stat) == -1) return SYSTEM_ERROR;
+    size_t image_size = image_stat.st_size;
+    if (image_size < IMAGE_HEADER_SIZE) return INVALID_BINARY_FORMAT;
+
+    byte *map = mmap(NULL, image_size, PROT_READ | PROT_WRITE, MAP_SHARED, fileno(file), 0);
+    if (map == MAP_FAILED) return SYSTEM_ERROR;
+
+    // read the header and make sure the image is as large as it claims to be
+    size_t inode_count, dblock_count;
+    inode_index_t available_inode;
+    if (!decode_image_header(map, &inode_count, &available_inode, &dblock_count) ||
+        inode_count > (image_size - IMAGE_HEADER_SIZE) / sizeof(inode_t) ||
+        dblock_count > image_size / DATA_BLOCK_SIZE ||
+        IMAGE_SIZE(inode_count, dblock_count) > image_size)
+    {
+        munmap(map, image_size);
+        return INVALID_BINARY_FORMAT;
+    }
+
+    fs->inode_count = inode_count;
+    fs->available_inode = available_inode;
+    fs->dblock_count = dblock_count;
+    fs->inodes = (inode_t *) (map + IMAGE_INODES_OFFSET);
+    fs->dblock_bitmask = map + IMAGE_BITMASK_OFFSET(inode_count);
+    fs->dblocks = map + IMAGE_DBLOCKS_OFFSET(inode_count, dblock_count);
+    fs->map_generation = 0;
+    fs->relocation_generation = 0;
+    fs->dblock_hint = 0;
+    fs->indirect_layout = INDIRECT_CHAIN;
+    fs->inline_data_limit = 0;
+    fs->sorted_free_inodes = false;
+    fs->dentry_cache = NULL;
+    fs->locks = NULL;
+    fs->journal = NULL;
+    fs->flusher = NULL;
+    fs->image_map = map;
+    fs->image_map_size = image_size;
+    refresh_available_counts(fs);
+    if (init_dirty_state(fs, false) != SUCCESS)
+    {
+        munmap(map, image_size);
+        fs->image_map = NULL;
+        return SYSTEM_ERROR;
+    }
+
+    return SUCCESS;
+}
+
+// msyncs the pages of the mapping that hold a region of the image
+static fs_retcode_t sync_image_region(filesystem_t *fs, size_t offset, const void *data, size_t len, void *ctx)
+{
+    (void) data;
+    size_t page_size = *(size_t *) ctx;
+    size_t page_offset = offset / page_size * page_size;
+    if (msync(fs->image_map + page_offset, offset + len - page_offset, MS_SYNC) == -1) return SYSTEM_ERROR;
+    return SUCCESS;
+}
+
+static fs_retcode_t sync_dirty_pages(filesystem_t *fs)
+{
+    if (!fs || !fs->image_map) return INVALID_INPUT;
+
+    // the head of the free inode list is the only part of the image kept outside the mapping
+    memcpy(fs->image_map + IMAGE_AVAILABLE_INODE_OFFSET, &fs->available_inode, sizeof(fs->available_inode));
+
+    size_t page_size = sysconf(_SC_PAGESIZE);
+    fs_retcode_t ret = for_each_dirty_region(fs, &fs->dirty, sync_image_region, &page_size);
+    if (ret != SUCCESS) return ret;
+
+    clear_dirty_state(fs);
+    return SUCCESS;
+}
+
+// the image has to be one consistent state, so every writer is kept out
+fs_retcode_t sync_filesystem(filesystem_t *fs)
+{
+    if (!fs || !fs->image_map) return INVALID_INPUT;
+    fs_lock_filesystem(fs, true);
+    fs_retcode_t result = sync_dirty_pages(fs);
+    fs_unlock_filesystem(fs);
+    return result;
+}
+
+// unmaps a file system opened with `map_filesystem`. the kernel writes back the pages lazily
+void unmap_filesystem(filesystem_t *fs)
+{
+    memcpy(fs->image_map + IMAGE_AVAILABLE_INODE_OFFSET, &fs->available_inode, sizeof(fs->available_inode));
+    munmap(fs->image_map, fs->image_map_size);
+    fs->image_map = NULL;
+    fs->image_map_size = 0;
+    fs->inodes = NULL;
+    fs->dblock_bitmask = NULL;
+    fs->dblocks = NULL;
+}
@@ -1,10 +1,15 @@
 #include "filesys.h"
 
 #include <string.h>
+#include <stddef.h>
+#include <stdlib.h>
 #include <assert.h>
 
 #include "utility.h"
 #include "debug.h"
+#include "bitmap.h"
+#include "image.h"
+#include "scan.h"
 
 #include <math.h>
 
@@ -15,11 +20,629 @@
 
 #define NEXT_INDIRECT_INDEX_OFFSET (DATA_BLOCK_SIZE - sizeof(dblock_index_t))
 
+#define TREE_FANOUT (DATA_BLOCK_SIZE / sizeof(dblock_index_t))
+
+//an extent dblock holds (first dblock, length) pairs and the index of the next extent dblock in the last slot
+#define EXTENTS_PER_DBLOCK (INDIRECT_DBLOCK_INDEX_COUNT / 2)
+
+#define DIRECTORY_ENTRY_SIZE (sizeof(inode_index_t) + MAX_FILE_NAME_LEN)
+
 // ----------------------- UTILITY FUNCTION ----------------------- //
 
+//dblocks claimed up front for one write, handed out in order as the write needs them
+//extent dblocks are kept apart from the data dblocks, so taking one does not cut a run of data dblocks in two
+typedef struct dblock_reservation
+{
+    dblock_index_t *indices; //the data dblocks, followed by the extent dblocks
+    size_t count;
+    size_t next;
+    size_t extent_count;
+    size_t extent_next;
+} dblock_reservation_t;
+
+static void release_reserved(filesystem_t *fs, dblock_index_t *indices, size_t count){
+    for(size_t i = 0; i < count; i++){
+        release_dblock(fs, fs->dblocks + (indices[i] * DATA_BLOCK_SIZE));
+    }
+}
+
+//claims every dblock a write needs at once, so the write either has all of them or nothing is touched
+//if `contiguous` is set, a single run of data dblocks is tried first, starting at `preferred` if that is free
+//the first `leading_extents` extent dblocks are claimed before the data dblocks, so they do not end up right behind the run
+static fs_retcode_t reserve_dblocks(filesystem_t *fs, size_t count, size_t extent_count, size_t leading_extents, bool contiguous, size_t preferred, dblock_reservation_t *reservation){
+    reservation->indices = NULL;
+    reservation->count = 0;
+    reservation->next = 0;
+    reservation->extent_count = 0;
+    reservation->extent_next = 0;
+
+    if(count + extent_count == 0){
+        return SUCCESS;
+    }
+
+    if(count + extent_count > available_dblocks(fs)){
+        return INSUFFICIENT_DBLOCKS;
+    }
+
+    dblock_index_t *indices = malloc((count + extent_count) * sizeof(dblock_index_t));
+    if(indices == NULL){
+        return SYSTEM_ERROR;
+    }
+
+    dblock_index_t *extents = indices + count;
+    if(claim_available_dblocks(fs, leading_extents, extents) != SUCCESS){
+        free(indices);
+        return INSUFFICIENT_DBLOCKS;
+    }
+
+    dblock_index_t run_start;
+    if(count > 0 && contiguous && claim_dblock_run(fs, count, preferred, &run_start) == SUCCESS){
+        for(size_t i = 0; i < count; i++){
+            indices[i] = run_start + i;
+        }
+    }else if(claim_available_dblocks(fs, count, indices) != SUCCESS){
+        release_reserved(fs, extents, leading_extents);
+        free(indices);
+        return INSUFFICIENT_DBLOCKS;
+    }
+
+    if(claim_available_dblocks(fs, extent_count - leading_extents, extents + leading_extents) != SUCCESS){
+        release_reserved(fs, extents, leading_extents);
+        release_reserved(fs, indices, count);
+        free(indices);
+        return INSUFFICIENT_DBLOCKS;
+    }
+
+    reservation->indices = indices;
+    reservation->count = count;
+    reservation->extent_count = extent_count;
+    return SUCCESS;
+}
+
+//releases whatever the write did not end up using and frees the reservation
+static void finish_reservation(filesystem_t *fs, dblock_reservation_t *reservation){
+    if(reservation->indices != NULL){
+        release_reserved(fs, reservation->indices + reservation->next, reservation->count - reservation->next);
+        release_reserved(fs, reservation->indices + reservation->count + reservation->extent_next, reservation->extent_count - reservation->extent_next);
+    }
+    free(reservation->indices);
+    reservation->indices = NULL;
+    reservation->count = 0;
+    reservation->next = 0;
+    reservation->extent_count = 0;
+    reservation->extent_next = 0;
+}
+
+//takes the next reserved dblock, or claims one if there is no reservation left
+static fs_retcode_t take_dblock(filesystem_t *fs, dblock_reservation_t *reservation, dblock_index_t *index){
+    if(reservation != NULL && reservation->next < reservation->count){
+        *index = reservation->indices[reservation->next++];
+        return SUCCESS;
+    }
+    return claim_available_dblock(fs, index);
+}
+
+//checks whether a cursor was filled in for this inode since the last time an index chain was cut
+static bool cursor_is_valid(filesystem_t *fs, inode_t *inode, dblock_cursor_t *cursor){
+    return cursor != NULL && cursor->inode == inode && cursor->generation == __atomic_load_n(&fs->map_generation, __ATOMIC_RELAXED) && cursor->index_dblock != 0;
+}
+
+//the layout of an inode's index dblocks, or the one they will get if it has none yet
+static indirect_layout_t inode_indirect_layout(filesystem_t *fs, inode_t *inode){
+    if(inode->internal.indirect_dblock != 0){
+        return inode->internal.indirect_layout;
+    }
+    return fs->indirect_layout;
+}
+
+//takes a dblock for a new index dblock and clears it. reserved extent dblocks are used first
+static fs_retcode_t take_index_dblock(filesystem_t *fs, dblock_reservation_t *reservation, dblock_index_t *index){
+    if(reservation != NULL && reservation->extent_next < reservation->extent_count){
+        *index = reservation->indices[reservation->count + reservation->extent_next++];
+    }else if(take_dblock(fs, reservation, index) != SUCCESS){
+        return INSUFFICIENT_DBLOCKS;
+    }
+    memset(fs->dblocks + (*index * DATA_BLOCK_SIZE), 0, DATA_BLOCK_SIZE);
+    mark_dblock_dirty(fs, *index);
+    return SUCCESS;
+}
+
+//number of data dblocks past the direct ones for a file size
+static size_t indirect_data_dblock_amount(size_t file_size){
+    size_t data_dblocks = (file_size + DATA_BLOCK_SIZE - 1) / DATA_BLOCK_SIZE;
+    return data_dblocks > INODE_DIRECT_BLOCK_COUNT ? data_dblocks - INODE_DIRECT_BLOCK_COUNT : 0;
+}
+
+//number of data and index dblocks an inode uses for a file size
+//for extents this is the worst case, where every data dblock past the direct ones is a run of its own
+static size_t inode_necessary_dblock_amount(filesystem_t *fs, inode_t *inode, size_t file_size){
+    indirect_layout_t layout = inode_indirect_layout(fs, inode);
+    if(layout == INDIRECT_TREE){
+        return (file_size + DATA_BLOCK_SIZE - 1) / DATA_BLOCK_SIZE + calculate_tree_index_dblock_amount(file_size);
+    }
+    if(layout == INDIRECT_EXTENTS){
+        size_t extent_dblocks = (indirect_data_dblock_amount(file_size) + EXTENTS_PER_DBLOCK - 1) / EXTENTS_PER_DBLOCK;
+        return (file_size + DATA_BLOCK_SIZE - 1) / DATA_BLOCK_SIZE + extent_dblocks;
+    }
+    return calculate_necessary_dblock_amount(file_size);
+}
+
+//where the extents of an inode end: the last extent in use and the last extent dblock with how many entries it holds
+typedef struct extent_tail
+{
+    dblock_index_t last_extent_dblock; //0 if there is no extent yet
+    size_t last_entry;
+    dblock_index_t tail_dblock; //0 if there is no extent dblock yet
+    size_t tail_entries;
+} extent_tail_t;
+
+//the dblock right after the last data dblock of an extent inode, where its next dblocks would ideally go. past the last dblock if there is none
+static size_t extent_append_point(filesystem_t *fs, inode_t *inode, const extent_tail_t *tail){
+    if(tail->last_extent_dblock != 0){
+        dblock_index_t *entry = cast_dblock_ptr(fs->dblocks + (tail->last_extent_dblock * DATA_BLOCK_SIZE)) + 2 * tail->last_entry;
+        return entry[0] + entry[1];
+    }
+
+    size_t data_dblocks = (inode->internal.file_size + DATA_BLOCK_SIZE - 1) / DATA_BLOCK_SIZE;
+    if(data_dblocks > 0 && data_dblocks <= INODE_DIRECT_BLOCK_COUNT){
+        return inode->internal.direct_data[data_dblocks - 1] + 1;
+    }
+    return fs->dblock_count;
+}
+
+//links a new, empty extent dblock after the tail
+static fs_retcode_t add_extent_dblock(filesystem_t *fs, inode_t *inode, extent_tail_t *tail, dblock_reservation_t *reservation){
+    dblock_index_t extent_dblock;
+    if(take_index_dblock(fs, reservation, &extent_dblock) != SUCCESS){
+        return INSUFFICIENT_DBLOCKS;
+    }
+    if(tail->tail_dblock == 0){
+        inode->internal.indirect_dblock = extent_dblock;
+        inode->internal.indirect_layout = INDIRECT_EXTENTS;
+    }else{
+        cast_dblock_ptr(fs->dblocks + (tail->tail_dblock * DATA_BLOCK_SIZE))[INDIRECT_DBLOCK_INDEX_COUNT] = extent_dblock;
+        mark_dblock_dirty(fs, tail->tail_dblock);
+    }
+    tail->tail_dblock = extent_dblock;
+    tail->tail_entries = 0;
+    return SUCCESS;
+}
+
+//claims the dblock for one more extent, extending the last extent when the dblock is right after it.
+//reserved dblocks that continue the run are pulled into the same extent, since the write will fill them
+static fs_retcode_t append_extent_dblock(filesystem_t *fs, inode_t *inode, extent_tail_t *tail, dblock_reservation_t *reservation, dblock_index_t *data_dblock, size_t *run_dblocks){
+    dblock_index_t dblock;
+    if(take_dblock(fs, reservation, &dblock) != SUCCESS){
+        return INSUFFICIENT_DBLOCKS;
+    }
+
+    dblock_index_t entry_dblock = tail->last_extent_dblock;
+    dblock_index_t *entry = NULL;
+    if(entry_dblock != 0){
+        entry = cast_dblock_ptr(fs->dblocks + (entry_dblock * DATA_BLOCK_SIZE)) + 2 * tail->last_entry;
+    }
+
+    if(entry != NULL && entry[0] + entry[1] == dblock){
+        entry[1]++;
+    }else{
+        //the new run needs its own entry, and maybe a new extent dblock for it
+        if(tail->tail_dblock == 0 || tail->tail_entries == EXTENTS_PER_DBLOCK){
+            if(add_extent_dblock(fs, inode, tail, reservation) != SUCCESS){
+                release_dblock(fs, fs->dblocks + (dblock * DATA_BLOCK_SIZE));
+                return INSUFFICIENT_DBLOCKS;
+            }
+        }
+        entry_dblock = tail->tail_dblock;
+        entry = cast_dblock_ptr(fs->dblocks + (entry_dblock * DATA_BLOCK_SIZE)) + 2 * tail->tail_entries;
+        entry[0] = dblock;
+        entry[1] = 1;
+        tail->last_extent_dblock = entry_dblock;
+        tail->last_entry = tail->tail_entries++;
+    }
+
+    size_t first_new = dblock - entry[0];
+    while(reservation != NULL && reservation->next < reservation->count && reservation->indices[reservation->next] == entry[0] + entry[1]){
+        reservation->next++;
+        entry[1]++;
+    }
+    mark_dblock_dirty(fs, entry_dblock);
+
+    *data_dblock = dblock;
+    *run_dblocks = entry[1] - first_new;
+    return SUCCESS;
+}
+
+//remembers an extent in a cursor, so the next lookup at or past it starts there
+static void remember_extent(filesystem_t *fs, inode_t *inode, dblock_cursor_t *cursor, dblock_index_t extent_dblock, size_t entry, size_t extent_first){
+    if(cursor != NULL){
+        cursor->inode = inode;
+        cursor->generation = __atomic_load_n(&fs->map_generation, __ATOMIC_RELAXED);
+        cursor->index_dblock = extent_dblock;
+        cursor->extent_entry = entry;
+        cursor->extent_first = extent_first;
+    }
+}
+
+//finds data dblock number n past the direct dblocks of an extent inode, and how many dblocks after it continue the same run
+//when writing, n may be the first dblock past the end of the extents, which is then claimed
+//if n is past the extents, tail_ptr gets where they end
+//if a cursor is given, the walk resumes from the extent it remembers and the cursor is left at the extent found, or the last one
+//appends only add extents after the last one or lengthen it, so a remembered extent stays where it is until map_generation changes
+static fs_retcode_t find_extent_dblock(filesystem_t *fs, inode_t *inode, size_t n, bool need_to_write, dblock_cursor_t *cursor, dblock_reservation_t *reservation, dblock_index_t *data_dblock, size_t *run_dblocks, extent_tail_t *tail_ptr){
+    size_t extent_first = 0;
+    size_t last_first = 0;
+    size_t first_entry = 0;
+    extent_tail_t tail = { 0 };
+    dblock_index_t extent_dblock = inode->internal.indirect_dblock;
+
+    if(cursor_is_valid(fs, inode, cursor) && cursor->extent_first <= n){
+        extent_dblock = cursor->index_dblock;
+        first_entry = cursor->extent_entry;
+        extent_first = cursor->extent_first;
+    }
+
+    while(extent_dblock != 0){
+        dblock_index_t *slots = cast_dblock_ptr(fs->dblocks + (extent_dblock * DATA_BLOCK_SIZE));
+        tail.tail_dblock = extent_dblock;
+        tail.tail_entries = first_entry;
+        for(size_t e = first_entry; e < EXTENTS_PER_DBLOCK && slots[2 * e + 1] != 0; e++){
+            size_t length = slots[2 * e + 1];
+            if(n < extent_first + length){
+                *data_dblock = slots[2 * e] + (n - extent_first);
+                *run_dblocks = length - (n - extent_first);
+                remember_extent(fs, inode, cursor, extent_dblock, e, extent_first);
+                return SUCCESS;
+            }
+            last_first = extent_first;
+            extent_first += length;
+            tail.last_extent_dblock = extent_dblock;
+            tail.last_entry = e;
+            tail.tail_entries = e + 1;
+        }
+        first_entry = 0;
+        extent_dblock = slots[INDIRECT_DBLOCK_INDEX_COUNT];
+    }
+
+    if(tail.last_extent_dblock != 0){
+        remember_extent(fs, inode, cursor, tail.last_extent_dblock, tail.last_entry, last_first);
+    }
+    if(tail_ptr != NULL){
+        *tail_ptr = tail;
+    }
+
+    //only the dblock right after the last one can be added
+    if(need_to_write == false || n != extent_first){
+        return INVALID_INPUT;
+    }
+    return append_extent_dblock(fs, inode, &tail, reservation, data_dblock, run_dblocks);
+}
+
+//how many extent dblocks an extent inode growing from `file_size` to `new_file_size` may need, in the worst case where
+//every new data dblock past the direct ones is a run of its own. `leading` gets how many it needs if they all continue one run
+static size_t extent_dblock_amount(const extent_tail_t *tail, size_t file_size, size_t new_file_size, size_t *leading){
+    *leading = 0;
+    size_t new_runs = indirect_data_dblock_amount(new_file_size) - indirect_data_dblock_amount(file_size);
+    if(new_runs == 0){
+        return 0;
+    }
+
+    size_t free_entries = tail->tail_dblock != 0 ? EXTENTS_PER_DBLOCK - tail->tail_entries : 0;
+    if(free_entries == 0){
+        *leading = 1;
+    }
+    return new_runs > free_entries ? (new_runs - free_entries + EXTENTS_PER_DBLOCK - 1) / EXTENTS_PER_DBLOCK : 0;
+}
+
+//claims every dblock an inode growing from `file_size` to `new_file_size` needs
+//extent dblocks are reserved for the worst case, so a fragmented reservation can not run out of them halfway through the write
+//the cursor is used to find the end of the extents, and left there for the write
+static fs_retcode_t reserve_growth(filesystem_t *fs, inode_t *inode, dblock_cursor_t *cursor, size_t file_size, size_t new_file_size, dblock_reservation_t *reservation){
+    if(inode_indirect_layout(fs, inode) != INDIRECT_EXTENTS){
+        size_t count = inode_necessary_dblock_amount(fs, inode, new_file_size) - inode_necessary_dblock_amount(fs, inode, file_size);
+        return reserve_dblocks(fs, count, 0, 0, false, 0, reservation);
+    }
+
+    extent_tail_t tail;
+    dblock_index_t dblock;
+    size_t run_dblocks;
+    find_extent_dblock(fs, inode, SIZE_MAX, false, cursor, NULL, &dblock, &run_dblocks, &tail);
+
+    size_t leading;
+    size_t extent_dblocks = extent_dblock_amount(&tail, file_size, new_file_size, &leading);
+    size_t count = (new_file_size + DATA_BLOCK_SIZE - 1) / DATA_BLOCK_SIZE - (file_size + DATA_BLOCK_SIZE - 1) / DATA_BLOCK_SIZE;
+    return reserve_dblocks(fs, count, extent_dblocks, leading, true, extent_append_point(fs, inode, &tail), reservation);
+}
+
+//releases the data dblocks of an extent inode past its first `keep` ones, and the extent dblocks that end up empty
+static fs_retcode_t shrink_extents(filesystem_t *fs, inode_t *inode, size_t keep){
+    size_t extent_first = 0;
+    dblock_index_t previous = 0;
+    dblock_index_t extent_dblock = inode->internal.indirect_dblock;
+
+    while(extent_dblock != 0){
+        dblock_index_t *slots = cast_dblock_ptr(fs->dblocks + (extent_dblock * DATA_BLOCK_SIZE));
+        dblock_index_t next = slots[INDIRECT_DBLOCK_INDEX_COUNT];
+        bool keeps_data = extent_first < keep;
+
+        for(size_t e = 0; e < EXTENTS_PER_DBLOCK && slots[2 * e + 1] != 0; e++){
+            size_t length = slots[2 * e + 1];
+            if(extent_first + length > keep){
+                size_t kept = extent_first >= keep ? 0 : keep - extent_first;
+                for(size_t i = kept; i < length; i++){
+                    fs_retcode_t result = release_dblock(fs, fs->dblocks + ((slots[2 * e] + i) * DATA_BLOCK_SIZE));
+                    if(result != SUCCESS){
+                        return result;
+                    }
+                }
+                slots[2 * e + 1] = kept;
+                if(kept == 0){
+                    slots[2 * e] = 0;
+                }
+                mark_dblock_dirty(fs, extent_dblock);
+            }
+            extent_first += length;
+        }
+
+        if(keeps_data){
+            previous = extent_dblock;
+        }else{
+            fs_retcode_t result = release_dblock(fs, fs->dblocks + (extent_dblock * DATA_BLOCK_SIZE));
+            if(result != SUCCESS){
+                return result;
+            }
+            if(previous != 0){
+                cast_dblock_ptr(fs->dblocks + (previous * DATA_BLOCK_SIZE))[INDIRECT_DBLOCK_INDEX_COUNT] = 0;
+                mark_dblock_dirty(fs, previous);
+            }else{
+                inode->internal.indirect_dblock = 0;
+                inode->internal.indirect_layout = INDIRECT_CHAIN;
+            }
+        }
+        extent_dblock = next;
+    }
+    return SUCCESS;
+}
+
+//finds data dblock number n past the direct dblocks in an inode's tree of index dblocks, walking down one level at a time
+//when writing, the tree gets a new root above the old one until it reaches n, and missing dblocks on the way are claimed
+static fs_retcode_t find_tree_dblock(filesystem_t *fs, inode_t *inode, size_t n, bool need_to_write, dblock_reservation_t *reservation, dblock_index_t *data_dblock){
+    //start the tree with a single index dblock
+    if(inode->internal.indirect_dblock == 0){
+        if(need_to_write == false){
+            return INVALID_INPUT;
+        }
+        dblock_index_t root;
+        if(take_index_dblock(fs, reservation, &root) != SUCCESS){
+            return INSUFFICIENT_DBLOCKS;
+        }
+        inode->internal.indirect_dblock = root;
+        inode->internal.indirect_layout = INDIRECT_TREE;
+        inode->internal.indirect_height = 1;
+    }
+
+    //make the tree taller until it reaches n. the old root becomes the first child of the new one
+    while(n >= calculate_tree_capacity(inode->internal.indirect_height)){
+        if(need_to_write == false){
+            return INVALID_INPUT;
+        }
+        dblock_index_t root;
+        if(take_index_dblock(fs, reservation, &root) != SUCCESS){
+            return INSUFFICIENT_DBLOCKS;
+        }
+        cast_dblock_ptr(fs->dblocks + (root * DATA_BLOCK_SIZE))[0] = inode->internal.indirect_dblock;
+        inode->internal.indirect_dblock = root;
+        inode->internal.indirect_height++;
+    }
+
+    //each level picks the child whose range holds n
+    dblock_index_t node = inode->internal.indirect_dblock;
+    for(size_t level = inode->internal.indirect_height; level > 0; level--){
+        dblock_index_t *slots = cast_dblock_ptr(fs->dblocks + (node * DATA_BLOCK_SIZE));
+        size_t slot = (n / calculate_tree_capacity(level - 1)) % TREE_FANOUT;
+
+        if(slots[slot] == 0){
+            if(need_to_write == false){
+                return INVALID_INPUT;
+            }
+            dblock_index_t child;
+            fs_retcode_t result = level > 1 ? take_index_dblock(fs, reservation, &child) : take_dblock(fs, reservation, &child);
+            if(result != SUCCESS){
+                return INSUFFICIENT_DBLOCKS;
+            }
+            slots[slot] = child;
+            mark_dblock_dirty(fs, node);
+        }
+        node = slots[slot];
+    }
+
+    *data_dblock = node;
+    return SUCCESS;
+}
+
+//releases every dblock below a tree node that holds data dblock `keep` or a later one, and clears the slots that pointed to them
+static fs_retcode_t release_tree_from(filesystem_t *fs, dblock_index_t node, size_t height, size_t keep){
+    size_t span = calculate_tree_capacity(height - 1);
+    dblock_index_t *slots = cast_dblock_ptr(fs->dblocks + (node * DATA_BLOCK_SIZE));
+
+    for(size_t slot = 0; slot < TREE_FANOUT; slot++){
+        size_t first = slot * span;
+        if(slots[slot] == 0 || first + span <= keep){
+            continue;
+        }
+
+        size_t child_keep = first >= keep ? 0 : keep - first;
+        if(height > 1){
+            fs_retcode_t result = release_tree_from(fs, slots[slot], height - 1, child_keep);
+            if(result != SUCCESS){
+                return result;
+            }
+        }
+        if(child_keep == 0){
+            fs_retcode_t result = release_dblock(fs, fs->dblocks + (slots[slot] * DATA_BLOCK_SIZE));
+            if(result != SUCCESS){
+                return result;
+            }
+            slots[slot] = 0;
+            mark_dblock_dirty(fs, node);
+        }
+    }
+    return SUCCESS;
+}
+
+//cuts an inode's tree down to its first `keep` data dblocks, dropping levels it no longer needs
+static fs_retcode_t shrink_tree(filesystem_t *fs, inode_t *inode, size_t keep){
+    dblock_index_t root = inode->internal.indirect_dblock;
+    size_t height = inode->internal.indirect_height;
+
+    fs_retcode_t result = release_tree_from(fs, root, height, keep);
+    if(result != SUCCESS){
+        return result;
+    }
+
+    //a root whose data all sits below its first child is replaced by that child
+    while(keep == 0 || (height > 1 && keep <= calculate_tree_capacity(height - 1))){
+        dblock_index_t first_child = cast_dblock_ptr(fs->dblocks + (root * DATA_BLOCK_SIZE))[0];
+        result = release_dblock(fs, fs->dblocks + (root * DATA_BLOCK_SIZE));
+        if(result != SUCCESS){
+            return result;
+        }
+        if(keep == 0){
+            root = 0;
+            height = 0;
+            break;
+        }
+        root = first_child;
+        height--;
+    }
+
+    inode->internal.indirect_dblock = root;
+    inode->internal.indirect_height = height;
+    if(root == 0){
+        inode->internal.indirect_layout = INDIRECT_CHAIN;
+    }
+    return SUCCESS;
+}
+
+//marks the dblocks a copy of `n` bytes into a run of consecutive dblocks touched. the first one is already marked
+static void mark_run_dirty(filesystem_t *fs, byte *dblock_ptr, size_t offset_within_dblock, size_t n){
+    dblock_index_t first = (dblock_ptr - fs->dblocks) / DATA_BLOCK_SIZE;
+    size_t touched = (offset_within_dblock + n + DATA_BLOCK_SIZE - 1) / DATA_BLOCK_SIZE;
+    for(size_t i = 1; i < touched; i++){
+        mark_dblock_dirty(fs, first + i);
+    }
+}
+
+// ----------------------- INLINE DATA ----------------------- //
+
+//appends to the dblocks of an inode, the part of `inode_write_data` that never stores data inline
+static fs_retcode_t append_dblock_data(filesystem_t *fs, inode_t *inode, void *data, size_t n);
+
+//inline data spans direct_data and indirect_dblock, so they must follow each other
+_Static_assert(offsetof(struct inode_internal, indirect_dblock) == offsetof(struct inode_internal, direct_data) + INODE_DIRECT_BLOCK_COUNT * sizeof(dblock_index_t), "inline data must be contiguous");
+
+static bool inode_is_inline(inode_t *inode){
+    return inode->internal.indirect_layout == INDIRECT_INLINE;
+}
+
+static byte *inline_data(inode_t *inode){
+    return (byte *)inode->internal.direct_data;
+}
+
+//whether a file of this size is small enough to be stored inline
+static bool fits_inline(filesystem_t *fs, size_t file_size){
+    size_t limit = fs->inline_data_limit < INODE_INLINE_CAPACITY ? fs->inline_data_limit : INODE_INLINE_CAPACITY;
+    return file_size > 0 && file_size <= limit;
+}
+
+//turns an empty inode into an inline one. any indices left from released dblocks are overwritten
+static void make_inline(filesystem_t *fs, inode_t *inode){
+    memset(inline_data(inode), 0, INODE_INLINE_CAPACITY);
+    inode->internal.indirect_layout = INDIRECT_INLINE;
+    inode->internal.indirect_height = 0;
+    mark_inode_dirty(fs, inode);
+}
+
+//turns an inline inode back into an empty one that uses dblocks
+static void clear_inline(filesystem_t *fs, inode_t *inode){
+    memset(inline_data(inode), 0, INODE_INLINE_CAPACITY);
+    inode->internal.indirect_layout = INDIRECT_CHAIN;
+    inode->internal.file_size = 0;
+    mark_inode_dirty(fs, inode);
+}
+
+//moves the data of an inline inode into dblocks before it grows to `final_file_size`
+//the inode stays inline unless every dblock the final size needs is available
+static fs_retcode_t promote_inline_data(filesystem_t *fs, inode_t *inode, size_t final_file_size){
+    byte data[INODE_INLINE_CAPACITY];
+    size_t size = inode->internal.file_size;
+    memcpy(data, inline_data(inode), size);
+    clear_inline(fs, inode);
+
+    fs_retcode_t result = INSUFFICIENT_DBLOCKS;
+    if(inode_necessary_dblock_amount(fs, inode, final_file_size) <= available_dblocks(fs)){
+        result = append_dblock_data(fs, inode, data, size);
+    }
+    if(result != SUCCESS){
+        make_inline(fs, inode);
+        memcpy(inline_data(inode), data, size);
+        inode->internal.file_size = size;
+    }
+    return result;
+}
+
+//moves the first `new_size` bytes of a file into the inode and releases all of its dblocks
+static fs_retcode_t demote_to_inline(filesystem_t *fs, inode_t *inode, size_t new_size){
+    byte data[INODE_INLINE_CAPACITY];
+    size_t bytes_read;
+    fs_retcode_t result = inode_read_data(fs, inode, 0, data, new_size, &bytes_read);
+    if(result != SUCCESS){
+        return result;
+    }
+    result = inode_shrink_data(fs, inode, 0);
+    if(result != SUCCESS){
+        return result;
+    }
+
+    make_inline(fs, inode);
+    memcpy(inline_data(inode), data, new_size);
+    inode->internal.file_size = new_size;
+    return SUCCESS;
+}
+
+//stores `n` bytes at `offset` in the inode itself if the file stays small enough, and sets *done.
+//an inline file that would grow too big is moved into dblocks instead, and the caller writes as usual
+static fs_retcode_t write_inline_data(filesystem_t *fs, inode_t *inode, size_t offset, void *data, size_t n, bool *done){
+    *done = false;
+    size_t file_size = inode->internal.file_size;
+    if(!inode_is_inline(inode) && file_size != 0){
+        return SUCCESS;
+    }
+
+    size_t final_file_size = offset + n > file_size ? offset + n : file_size;
+    if(fits_inline(fs, final_file_size)){
+        if(!inode_is_inline(inode)){
+            make_inline(fs, inode);
+        }
+        memcpy(inline_data(inode) + offset, data, n);
+        inode->internal.file_size = final_file_size;
+        mark_inode_dirty(fs, inode);
+        *done = true;
+        return SUCCESS;
+    }
+
+    if(inode_is_inline(inode)){
+        return promote_inline_data(fs, inode, final_file_size);
+    }
+    return SUCCESS;
+}
+
 //helper function made to reach the certain dblock we should work with, given an offset in bytes
-fs_retcode_t find_dblock_with_bytes(filesystem_t *fs, inode_t *inode, size_t offset, byte **dblock_ptr, size_t *offset_within_dblock_ptr, bool need_to_write){
-    if(fs == NULL || inode == NULL || dblock_ptr == NULL || offset_within_dblock_ptr == NULL){
+//if a cursor is given, the index chain walk resumes from it and the cursor is left at the last index dblock visited
+//new dblocks come from the reservation first if one is given
+//if run_bytes_ptr is given, it gets how many bytes from offset on are stored contiguously (more than one dblock only for extents)
+fs_retcode_t find_dblock_with_bytes(filesystem_t *fs, inode_t *inode, size_t offset, byte **dblock_ptr, size_t *offset_within_dblock_ptr, bool need_to_write, dblock_cursor_t *cursor, dblock_reservation_t *reservation, size_t *run_bytes_ptr){
+    //inline data has no dblock to point to
+    if(fs == NULL || inode == NULL || dblock_ptr == NULL || offset_within_dblock_ptr == NULL || inode_is_inline(inode)){
         return INVALID_INPUT;
     }
 
@@ -33,6 +656,9 @@ fs_retcode_t find_dblock_with_bytes(filesystem_t *fs, inode_t *inode, size_t off
     //offset_within_dblock_ptr keep track of how many bytes are already in the dblock, and what we should do next
     *dblock_ptr = NULL;
     *offset_within_dblock_ptr = 0;
+    if(run_bytes_ptr != NULL){
+        *run_bytes_ptr = DATA_BLOCK_SIZE - (offset % DATA_BLOCK_SIZE);
+    }
 
     //check if the offset is within the direct D-blocks
     if(offset < INODE_DIRECT_BLOCK_COUNT * DATA_BLOCK_SIZE){
@@ -42,15 +668,16 @@ fs_retcode_t find_dblock_with_bytes(filesystem_t *fs, inode_t *inode, size_t off
         // find the offset in the dblock to write to
         *offset_within_dblock_ptr = offset % DATA_BLOCK_SIZE;
 
-        // check if dblock is allocated
-        if(inode->internal.direct_data[dblock_index] == 0){
+        // check if dblock is allocated. the root directory starts at dblock 0
+        bool root_first_dblock = inode == &fs->inodes[0] && dblock_index == 0;
+        if(inode->internal.direct_data[dblock_index] == 0 && !root_first_dblock){
             //if we are only reading, throw error
             if(need_to_write == false){
                 return INVALID_INPUT;
             }
 
             dblock_index_t new_dblock_index;
-            fs_retcode_t new_dblock_return = claim_available_dblock(fs, &new_dblock_index);
+            fs_retcode_t new_dblock_return = take_dblock(fs, reservation, &new_dblock_index);
             if(new_dblock_return  != SUCCESS){
                 return INSUFFICIENT_DBLOCKS;
             }
@@ -59,11 +686,42 @@ fs_retcode_t find_dblock_with_bytes(filesystem_t *fs, inode_t *inode, size_t off
 
         // set the output pointer to the start of the dblock
         *dblock_ptr = fs->dblocks + (inode->internal.direct_data[dblock_index] * DATA_BLOCK_SIZE);
+        if(need_to_write){
+            mark_dblock_dirty(fs, inode->internal.direct_data[dblock_index]);
+        }
         return SUCCESS;
     }
 
     //the offset is not in direct dblocks, so check indirect dblocks
 
+    //trees are searched from the inode, so the cursor is only used for extents
+    indirect_layout_t layout = inode_indirect_layout(fs, inode);
+    if(layout == INDIRECT_TREE || layout == INDIRECT_EXTENTS){
+        size_t layout_offset = offset - (INODE_DIRECT_BLOCK_COUNT * DATA_BLOCK_SIZE);
+        *offset_within_dblock_ptr = layout_offset % DATA_BLOCK_SIZE;
+
+        dblock_index_t data_dblock;
+        size_t run_dblocks = 1;
+        fs_retcode_t result;
+        if(layout == INDIRECT_TREE){
+            result = find_tree_dblock(fs, inode, layout_offset / DATA_BLOCK_SIZE, need_to_write, reservation, &data_dblock);
+        }else{
+            result = find_extent_dblock(fs, inode, layout_offset / DATA_BLOCK_SIZE, need_to_write, cursor, reservation, &data_dblock, &run_dblocks, NULL);
+        }
+        if(result != SUCCESS){
+            return result;
+        }
+        if(run_bytes_ptr != NULL){
+            *run_bytes_ptr = run_dblocks * DATA_BLOCK_SIZE - *offset_within_dblock_ptr;
+        }
+
+        *dblock_ptr = fs->dblocks + (data_dblock * DATA_BLOCK_SIZE);
+        if(need_to_write){
+            mark_dblock_dirty(fs, data_dblock);
+        }
+        return SUCCESS;
+    }
+
     //check if the first indirect dblock is not allocated
     if(inode->internal.indirect_dblock == 0){
         //if we are only reading, then throw error
@@ -73,11 +731,12 @@ fs_retcode_t find_dblock_with_bytes(filesystem_t *fs, inode_t *inode, size_t off
 
         //if we are writing, need to allocate new indirect dblock
         dblock_index_t new_indirect_dblock_index;
-        fs_retcode_t new_dblock_return = claim_available_dblock(fs, &new_indirect_dblock_index);
+        fs_retcode_t new_dblock_return = take_dblock(fs, reservation, &new_indirect_dblock_index);
         if(new_dblock_return  != SUCCESS){
             return INSUFFICIENT_DBLOCKS;
         }
         memset(fs->dblocks + (new_indirect_dblock_index * DATA_BLOCK_SIZE), 0, DATA_BLOCK_SIZE);
+        mark_dblock_dirty(fs, new_indirect_dblock_index);
         inode->internal.indirect_dblock = new_indirect_dblock_index;
     }
 
@@ -100,14 +759,21 @@ fs_retcode_t find_dblock_with_bytes(filesystem_t *fs, inode_t *inode, size_t off
 
     //start with the first indirect dblock
     dblock_index_t curr_indirect_dblock_index = inode->internal.indirect_dblock;
+    size_t i = 0;
+
+    //skip ahead to the cursor if it is not past the index dblock we are looking for
+    if(cursor_is_valid(fs, inode, cursor) && cursor->index_block_number <= curr_index_block_number){
+        curr_indirect_dblock_index = cursor->index_dblock;
+        i = cursor->index_block_number;
+    }
 
     // go through all the index dblocks and find the last one we use
-    for(size_t i = 0; i < curr_index_block_number; i++){
+    for(; i < curr_index_block_number; i++){
         //get a pointer to the current indirect index dblock
         dblock_index_t *curr_indirect_dblock_index_ptr = cast_dblock_ptr(fs->dblocks + (curr_indirect_dblock_index * DATA_BLOCK_SIZE));
 
         //if the next index dblock is not allocated
-        dblock_index_t next_index_dblock = curr_indirect_dblock_index_ptr[15];
+        dblock_index_t next_index_dblock = curr_indirect_dblock_index_ptr[INDIRECT_DBLOCK_INDEX_COUNT];
         if(next_index_dblock == 0){
             //if we need to just read, throw error
             if(need_to_write == false){
@@ -116,18 +782,28 @@ fs_retcode_t find_dblock_with_bytes(filesystem_t *fs, inode_t *inode, size_t off
 
             //if we need to write, create new indirect dblock
             dblock_index_t new_indirect_dblock_index;
-            fs_retcode_t new_dblock_return = claim_available_dblock(fs, &new_indirect_dblock_index);
+            fs_retcode_t new_dblock_return = take_dblock(fs, reservation, &new_indirect_dblock_index);
             if(new_dblock_return != SUCCESS){
                 return INSUFFICIENT_DBLOCKS;
             }
             memset(fs->dblocks + (new_indirect_dblock_index * DATA_BLOCK_SIZE), 0, DATA_BLOCK_SIZE);
-            curr_indirect_dblock_index_ptr[15] = new_indirect_dblock_index;
+            mark_dblock_dirty(fs, new_indirect_dblock_index);
+            curr_indirect_dblock_index_ptr[INDIRECT_DBLOCK_INDEX_COUNT] = new_indirect_dblock_index;
+            mark_dblock_dirty(fs, curr_indirect_dblock_index);
             curr_indirect_dblock_index = new_indirect_dblock_index;
         }else{
             curr_indirect_dblock_index = next_index_dblock;
         }
     }
 
+    //remember where we stopped so the next lookup does not walk the chain again
+    if(cursor != NULL){
+        cursor->inode = inode;
+        cursor->generation = __atomic_load_n(&fs->map_generation, __ATOMIC_RELAXED);
+        cursor->index_block_number = curr_index_block_number;
+        cursor->index_dblock = curr_indirect_dblock_index;
+    }
+
     // now the current indirect dblock index points to the last index dblock used
     dblock_index_t *curr_indirect_dblock_index_ptr = cast_dblock_ptr(fs->dblocks + (curr_indirect_dblock_index * DATA_BLOCK_SIZE));
 
@@ -139,22 +815,26 @@ fs_retcode_t find_dblock_with_bytes(filesystem_t *fs, inode_t *inode, size_t off
 
         //to write, allocate a new dblock
         dblock_index_t new_data_dblock_index;
-        fs_retcode_t result = claim_available_dblock(fs, &new_data_dblock_index);
+        fs_retcode_t result = take_dblock(fs, reservation, &new_data_dblock_index);
         if(result != SUCCESS){
             return INSUFFICIENT_DBLOCKS;
         }
 
         //update hte index dblock with the new data dblock index
         curr_indirect_dblock_index_ptr[data_block_index_in_current_index] = new_data_dblock_index;
+        mark_dblock_dirty(fs, curr_indirect_dblock_index);
     }
 
     //set the output pointer to the start of the data dblock
     *dblock_ptr = fs->dblocks + (curr_indirect_dblock_index_ptr[data_block_index_in_current_index] * DATA_BLOCK_SIZE);
+    if(need_to_write){
+        mark_dblock_dirty(fs, curr_indirect_dblock_index_ptr[data_block_index_in_current_index]);
+    }
 
     return SUCCESS;
 }
 
-size_t write_data_in_direct_dblock(filesystem_t *fs, inode_t *inode, void *data, size_t n){
+size_t write_data_in_direct_dblock(filesystem_t *fs, inode_t *inode, void *data, size_t n, dblock_reservation_t *reservation){
     // get the current file size
     size_t original_file_size = inode->internal.file_size;
 
@@ -192,7 +872,7 @@ size_t write_data_in_direct_dblock(filesystem_t *fs, inode_t *inode, void *data,
         size_t offset_within_dblock;
 
         //find the dblock that we should start writing to
-        fs_retcode_t result = find_dblock_with_bytes(fs, inode, current_offset, &dblock_ptr, &offset_within_dblock, true);
+        fs_retcode_t result = find_dblock_with_bytes(fs, inode, current_offset, &dblock_ptr, &offset_within_dblock, true, NULL, reservation, NULL);
         if(result != SUCCESS){
             //reset file size
             inode->internal.file_size = original_file_size;
@@ -219,7 +899,7 @@ size_t write_data_in_direct_dblock(filesystem_t *fs, inode_t *inode, void *data,
     return total_bytes_written;
 }
 
-fs_retcode_t write_data_in_indirect_dblock(filesystem_t *fs, inode_t *inode, void *data, size_t n, size_t r){
+fs_retcode_t write_data_in_indirect_dblock(filesystem_t *fs, inode_t *inode, void *data, size_t n, size_t r, dblock_cursor_t *cursor, dblock_reservation_t *reservation){
     //if remaining bytes to fill equals 0
     if(r == 0){
         return SUCCESS;
@@ -239,21 +919,23 @@ fs_retcode_t write_data_in_indirect_dblock(filesystem_t *fs, inode_t *inode, voi
         //get the current dblock pointer within index dblock, and offset within that dblock
         byte *dblock_ptr;
         size_t offset_within_dblock;
+        size_t run_bytes;
 
         //call helper function
-        fs_retcode_t result = find_dblock_with_bytes(fs, inode, current_offset, &dblock_ptr, &offset_within_dblock, true);
+        fs_retcode_t result = find_dblock_with_bytes(fs, inode, current_offset, &dblock_ptr, &offset_within_dblock, true, cursor, reservation, &run_bytes);
         if(result != SUCCESS){
             return result;
         }
 
-        //find how many bytes to write in this specific block (if remaining bytes to write is less than remaining size in dblock)
-        size_t write_dblock_bytes = DATA_BLOCK_SIZE - offset_within_dblock;
+        //find how many bytes to write in this run of dblocks (if remaining bytes to write is less than remaining size in the run)
+        size_t write_dblock_bytes = run_bytes;
         if(write_dblock_bytes > (bytes_to_write - total_bytes_written)){
             write_dblock_bytes = bytes_to_write - total_bytes_written;
         }  
  
         //copy data from buffer to dblock at current dblock + offset position
         memcpy(dblock_ptr + offset_within_dblock, data_ptr_inBytes, write_dblock_bytes);
+        mark_run_dirty(fs, dblock_ptr, offset_within_dblock, write_dblock_bytes);
  
         //move data pointer forward by number of bytes written
         data_ptr_inBytes += write_dblock_bytes;
@@ -266,6 +948,387 @@ fs_retcode_t write_data_in_indirect_dblock(filesystem_t *fs, inode_t *inode, voi
     return SUCCESS;
 }
 
+// ----------------------- VECTORED IO ----------------------- //
+
+//where a copy is within an iovec array
+typedef struct iovec_position
+{
+    const struct iovec *iov;
+    size_t segment;
+    size_t segment_offset;
+} iovec_position_t;
+
+static size_t iovec_total_length(const struct iovec *iov, size_t iovcnt){
+    size_t total = 0;
+    for(size_t i = 0; i < iovcnt; i++){
+        total += iov[i].iov_len;
+    }
+    return total;
+}
+
+//copies `n` bytes between `run` and the buffers from `position` on, and moves `position` past them
+//`to_iovec` picks the direction: into the buffers for reads, out of them for writes
+static void copy_iovec_run(iovec_position_t *position, byte *run, size_t n, bool to_iovec){
+    while(n > 0){
+        const struct iovec *segment = &position->iov[position->segment];
+        size_t chunk = segment->iov_len - position->segment_offset;
+        if(chunk > n){
+            chunk = n;
+        }
+
+        byte *segment_bytes = (byte *)segment->iov_base + position->segment_offset;
+        if(to_iovec){
+            memcpy(segment_bytes, run, chunk);
+        }else{
+            memcpy(run, segment_bytes, chunk);
+        }
+        run += chunk;
+        n -= chunk;
+
+        position->segment_offset += chunk;
+        if(position->segment_offset == segment->iov_len){
+            position->segment++;
+            position->segment_offset = 0;
+        }
+    }
+}
+
+// ----------------------- SPANS ----------------------- //
+
+//finds the run of dblocks holding byte `offset` of an iterator's inode, clipped to the end of the range
+static fs_retcode_t find_span_run(dblock_span_iterator_t *it, size_t offset, const byte **ptr, size_t *len){
+    byte *dblock_ptr;
+    size_t offset_within_dblock;
+    size_t run_bytes;
+    fs_retcode_t result = find_dblock_with_bytes(it->fs, it->inode, offset, &dblock_ptr, &offset_within_dblock, false, &it->cursor, NULL, &run_bytes);
+    if(result != SUCCESS){
+        return result;
+    }
+
+    *ptr = dblock_ptr + offset_within_dblock;
+    *len = run_bytes < it->end - offset ? run_bytes : it->end - offset;
+    return SUCCESS;
+}
+
+// ----------------------- DEFRAGMENTATION ----------------------- //
+
+//a growing list of the places a chain or tree inode keeps its dblock indices
+typedef struct slot_list
+{
+    dblock_index_t **slots;
+    size_t count;
+    size_t capacity;
+} slot_list_t;
+
+//a growing list of dblock indices, for the extents of an inode
+typedef struct dblock_list
+{
+    dblock_index_t *dblocks;
+    size_t count;
+    size_t capacity;
+} dblock_list_t;
+
+static bool push_slot(slot_list_t *list, dblock_index_t *slot){
+    if(list->count == list->capacity){
+        size_t capacity = list->capacity ? 2 * list->capacity : 32;
+        dblock_index_t **slots = realloc(list->slots, capacity * sizeof(dblock_index_t *));
+        if(slots == NULL){
+            return false;
+        }
+        list->slots = slots;
+        list->capacity = capacity;
+    }
+    list->slots[list->count++] = slot;
+    return true;
+}
+
+static bool push_dblock(dblock_list_t *list, dblock_index_t dblock){
+    if(list->count == list->capacity){
+        size_t capacity = list->capacity ? 2 * list->capacity : 32;
+        dblock_index_t *dblocks = realloc(list->dblocks, capacity * sizeof(dblock_index_t));
+        if(dblocks == NULL){
+            return false;
+        }
+        list->dblocks = dblocks;
+        list->capacity = capacity;
+    }
+    list->dblocks[list->count++] = dblock;
+    return true;
+}
+
+//adds the data dblocks below a tree node in file order, then its index dblocks with every node after the ones below it
+static bool collect_tree_slots(filesystem_t *fs, slot_list_t *data, slot_list_t *index, dblock_index_t *slot, size_t height, size_t count){
+    dblock_index_t *node = cast_dblock_ptr(fs->dblocks + (*slot * DATA_BLOCK_SIZE));
+    size_t span = calculate_tree_capacity(height - 1);
+    for(size_t i = 0; i < TREE_FANOUT && i * span < count; i++){
+        size_t below = count - i * span < span ? count - i * span : span;
+        bool pushed = height > 1 ? collect_tree_slots(fs, data, index, &node[i], height - 1, below) : push_slot(data, &node[i]);
+        if(!pushed){
+            return false;
+        }
+    }
+    return push_slot(index, slot);
+}
+
+//lists where a chain or tree inode keeps each of its dblocks: the data dblocks in file order, then the index dblocks.
+//an index dblock is always listed before the one that points to it, so moving them in order only ever updates dblocks that have not moved yet
+static bool collect_inode_slots(filesystem_t *fs, inode_t *inode, slot_list_t *data, slot_list_t *index){
+    size_t data_dblocks = (inode->internal.file_size + DATA_BLOCK_SIZE - 1) / DATA_BLOCK_SIZE;
+    size_t direct_dblocks = data_dblocks < INODE_DIRECT_BLOCK_COUNT ? data_dblocks : INODE_DIRECT_BLOCK_COUNT;
+    for(size_t i = 0; i < direct_dblocks; i++){
+        if(!push_slot(data, &inode->internal.direct_data[i])){
+            return false;
+        }
+    }
+
+    size_t remaining = data_dblocks - direct_dblocks;
+    if(remaining == 0){
+        return true;
+    }
+    if(inode->internal.indirect_layout == INDIRECT_TREE){
+        return collect_tree_slots(fs, data, index, &inode->internal.indirect_dblock, inode->internal.indirect_height, remaining);
+    }
+
+    dblock_index_t *slot = &inode->internal.indirect_dblock;
+    while(remaining > 0){
+        dblock_index_t *slots = cast_dblock_ptr(fs->dblocks + (*slot * DATA_BLOCK_SIZE));
+        size_t used_slots = remaining < INDIRECT_DBLOCK_INDEX_COUNT ? remaining : INDIRECT_DBLOCK_INDEX_COUNT;
+        for(size_t i = 0; i < used_slots; i++){
+            if(!push_slot(data, &slots[i])){
+                return false;
+            }
+        }
+        if(!push_slot(index, slot)){
+            return false;
+        }
+        remaining -= used_slots;
+        slot = &slots[INDIRECT_DBLOCK_INDEX_COUNT];
+    }
+
+    //the last index dblock of the chain moves first, while the one pointing to it is still in place
+    for(size_t i = 0; i < index->count / 2; i++){
+        dblock_index_t *last = index->slots[index->count - 1 - i];
+        index->slots[index->count - 1 - i] = index->slots[i];
+        index->slots[i] = last;
+    }
+    return true;
+}
+
+//finds the lowest run of `count` available dblocks. dblock 0 stays with the root directory, an index of 0 means no dblock
+static bool find_free_run(filesystem_t *fs, size_t count, size_t *run){
+    size_t start = fs->dblock_hint > 1 ? fs->dblock_hint : 1;
+    return bitmap_find_set_run(fs->dblock_bitmask, fs->dblock_count, start, count, run);
+}
+
+//finds where `count` dblocks that are now at `current` should go. returns false if they are better off where they are:
+//a file that is already in one run only moves to a lower run, which keeps the free space together at the end
+static bool find_defrag_run(filesystem_t *fs, const dblock_index_t *current, size_t count, size_t *run){
+    bool contiguous = true;
+    for(size_t k = 1; k < count && contiguous; k++){
+        contiguous = current[k] == current[0] + k;
+    }
+    return find_free_run(fs, count, run) && (!contiguous || *run < current[0]);
+}
+
+//copies a dblock into the run claimed for it and releases the old one
+static dblock_index_t move_dblock(filesystem_t *fs, dblock_index_t from, dblock_index_t to){
+    memcpy(fs->dblocks + (to * DATA_BLOCK_SIZE), fs->dblocks + (from * DATA_BLOCK_SIZE), DATA_BLOCK_SIZE);
+    mark_dblock_dirty(fs, to);
+    release_dblock(fs, fs->dblocks + (from * DATA_BLOCK_SIZE));
+    return to;
+}
+
+//moves every dblock of a chain or tree inode into one run
+static fs_retcode_t defragment_slots(filesystem_t *fs, inode_t *inode, size_t limit, size_t *moved){
+    slot_list_t data = { 0 }, index = { 0 };
+    bool collected = collect_inode_slots(fs, inode, &data, &index);
+    for(size_t i = 0; collected && i < index.count; i++){
+        collected = push_slot(&data, index.slots[i]);
+    }
+    free(index.slots);
+
+    dblock_index_t *current = collected ? malloc(data.count * sizeof(dblock_index_t)) : NULL;
+    if(current == NULL || data.count > limit){
+        free(current);
+        free(data.slots);
+        return current == NULL ? SYSTEM_ERROR : INSUFFICIENT_DBLOCKS;
+    }
+    for(size_t k = 0; k < data.count; k++){
+        current[k] = *data.slots[k];
+    }
+
+    size_t run;
+    dblock_index_t first;
+    if(find_defrag_run(fs, current, data.count, &run) && claim_dblock_run(fs, data.count, run, &first) == SUCCESS){
+        for(size_t k = 0; k < data.count; k++){
+            *data.slots[k] = move_dblock(fs, current[k], first + k);
+        }
+        *moved = data.count;
+    }
+
+    free(current);
+    free(data.slots);
+    return SUCCESS;
+}
+
+//lists the data dblocks of an extent inode in file order, then its extent dblocks in chain order
+static bool collect_extent_dblocks(filesystem_t *fs, inode_t *inode, size_t data_dblocks, dblock_list_t *current, size_t *extent_dblock_count){
+    size_t direct_dblocks = data_dblocks < INODE_DIRECT_BLOCK_COUNT ? data_dblocks : INODE_DIRECT_BLOCK_COUNT;
+    for(size_t i = 0; i < direct_dblocks; i++){
+        if(!push_dblock(current, inode->internal.direct_data[i])){
+            return false;
+        }
+    }
+
+    size_t remaining = data_dblocks - direct_dblocks;
+    for(dblock_index_t extent_dblock = inode->internal.indirect_dblock; extent_dblock != 0 && remaining > 0;){
+        dblock_index_t *slots = cast_dblock_ptr(fs->dblocks + (extent_dblock * DATA_BLOCK_SIZE));
+        for(size_t e = 0; e < EXTENTS_PER_DBLOCK && remaining > 0 && slots[2 * e + 1] != 0; e++){
+            size_t length = slots[2 * e + 1] < remaining ? slots[2 * e + 1] : remaining;
+            for(size_t i = 0; i < length; i++){
+                if(!push_dblock(current, slots[2 * e] + i)){
+                    return false;
+                }
+            }
+            remaining -= length;
+        }
+        extent_dblock = slots[INDIRECT_DBLOCK_INDEX_COUNT];
+    }
+
+    *extent_dblock_count = 0;
+    for(dblock_index_t extent_dblock = inode->internal.indirect_dblock; extent_dblock != 0;){
+        if(!push_dblock(current, extent_dblock)){
+            return false;
+        }
+        (*extent_dblock_count)++;
+        extent_dblock = cast_dblock_ptr(fs->dblocks + (extent_dblock * DATA_BLOCK_SIZE))[INDIRECT_DBLOCK_INDEX_COUNT];
+    }
+    return true;
+}
+
+//moves the data of an extent inode into one run, followed by a single extent dblock listing it
+static fs_retcode_t defragment_extents(filesystem_t *fs, inode_t *inode, size_t limit, size_t *moved){
+    size_t data_dblocks = (inode->internal.file_size + DATA_BLOCK_SIZE - 1) / DATA_BLOCK_SIZE;
+    size_t direct_dblocks = data_dblocks < INODE_DIRECT_BLOCK_COUNT ? data_dblocks : INODE_DIRECT_BLOCK_COUNT;
+    size_t extent_dblocks_needed = data_dblocks > direct_dblocks ? 1 : 0;
+    size_t count = data_dblocks + extent_dblocks_needed;
+
+    dblock_list_t current = { 0 };
+    size_t extent_dblock_count;
+    if(!collect_extent_dblocks(fs, inode, data_dblocks, &current, &extent_dblock_count)){
+        free(current.dblocks);
+        return SYSTEM_ERROR;
+    }
+    if(count > limit){
+        free(current.dblocks);
+        return INSUFFICIENT_DBLOCKS;
+    }
+
+    //several extent dblocks, or an empty one left at the end of the chain, always mean the file is not in one run
+    size_t run;
+    dblock_index_t first;
+    bool found = current.count == count ? find_defrag_run(fs, current.dblocks, count, &run) : find_free_run(fs, count, &run);
+    if(!found || claim_dblock_run(fs, count, run, &first) != SUCCESS){
+        free(current.dblocks);
+        return SUCCESS;
+    }
+
+    for(size_t k = 0; k < data_dblocks; k++){
+        move_dblock(fs, current.dblocks[k], first + k);
+    }
+    for(size_t i = 0; i < direct_dblocks; i++){
+        inode->internal.direct_data[i] = first + i;
+    }
+    for(size_t i = 0; i < extent_dblock_count; i++){
+        release_dblock(fs, fs->dblocks + (current.dblocks[data_dblocks + i] * DATA_BLOCK_SIZE));
+    }
+
+    if(extent_dblocks_needed > 0){
+        dblock_index_t extent_dblock = first + data_dblocks;
+        dblock_index_t *slots = cast_dblock_ptr(fs->dblocks + (extent_dblock * DATA_BLOCK_SIZE));
+        memset(slots, 0, DATA_BLOCK_SIZE);
+        slots[0] = first + direct_dblocks;
+        slots[1] = data_dblocks - direct_dblocks;
+        mark_dblock_dirty(fs, extent_dblock);
+        inode->internal.indirect_dblock = extent_dblock;
+    }else{
+        inode->internal.indirect_dblock = 0;
+        inode->internal.indirect_layout = INDIRECT_CHAIN;
+    }
+    *moved = count;
+
+    free(current.dblocks);
+    return SUCCESS;
+}
+
+//the free inode list is the only record of which inodes are in use. stores a bitmap of the free inodes in `free_inodes_ptr`.
+//INVALID_INPUT if the list leaves the inode table or loops, since every inode it did not reach would look in use
+static fs_retcode_t free_inode_bitmap(filesystem_t *fs, byte **free_inodes_ptr){
+    *free_inodes_ptr = NULL;
+    byte *free_inodes = calloc(fs->inode_count / 8 + 1, sizeof(byte));
+    if(free_inodes == NULL){
+        return SYSTEM_ERROR;
+    }
+    if(!collect_free_inodes(fs, free_inodes)){
+        free(free_inodes);
+        return INVALID_INPUT;
+    }
+    *free_inodes_ptr = free_inodes;
+    return SUCCESS;
+}
+
+//moves the dblocks of one inode into a single run if that helps. INSUFFICIENT_DBLOCKS means the inode has more than `limit` dblocks
+static fs_retcode_t defragment_inode(filesystem_t *fs, inode_t *inode, size_t limit, size_t *moved){
+    *moved = 0;
+    if(inode_is_inline(inode) || inode->internal.file_size == 0){
+        return SUCCESS;
+    }
+
+    fs_retcode_t result;
+    if(inode->internal.indirect_layout == INDIRECT_EXTENTS && inode->internal.indirect_dblock != 0){
+        result = defragment_extents(fs, inode, limit, moved);
+    }else{
+        result = defragment_slots(fs, inode, limit, moved);
+    }
+    if(*moved > 0){
+        //the index dblocks moved, so every cursor into them is stale, and so is every pointer into the data
+        fs->map_generation++;
+        fs->relocation_generation++;
+        mark_inode_dirty(fs, inode);
+    }
+    return result;
+}
+
+// ----------------------- INODE COMPACTION ----------------------- //
+
+//reads every entry of a directory and renumbers the ones in use. tombstones have an empty name and are left alone.
+//INVALID_INPUT means the directory could not be read, or it names an inode that is free or does not exist
+static fs_retcode_t renumber_directory(filesystem_t *fs, inode_t *dir, const byte *free_inodes, const inode_index_t *renumbered, byte **entries_ptr){
+    size_t size = dir->internal.file_size;
+    byte *entries = malloc(size + 1);
+    if(entries == NULL){
+        return SYSTEM_ERROR;
+    }
+    *entries_ptr = entries;
+
+    size_t bytes_read;
+    if(inode_read_data(fs, dir, 0, entries, size, &bytes_read) != SUCCESS || bytes_read != size){
+        return INVALID_INPUT;
+    }
+    for(size_t offset = 0; offset + DIRECTORY_ENTRY_SIZE <= size; offset += DIRECTORY_ENTRY_SIZE){
+        if(entries[offset + sizeof(inode_index_t)] == '\0'){
+            continue;
+        }
+        inode_index_t idx;
+        memcpy(&idx, entries + offset, sizeof(idx));
+        if(idx >= fs->inode_count || bitmap_test(free_inodes, idx)){
+            return INVALID_INPUT;
+        }
+        memcpy(entries + offset, &renumbered[idx], sizeof(idx));
+    }
+    return SUCCESS;
+}
+
 // ----------------------- CORE FUNCTION ----------------------- //
 
 fs_retcode_t inode_write_data(filesystem_t *fs, inode_t *inode, void *data, size_t n){
@@ -274,26 +1337,34 @@ fs_retcode_t inode_write_data(filesystem_t *fs, inode_t *inode, void *data, size
         return INVALID_INPUT;
     }
 
+    // small files may not need any dblocks at all
+    bool stored_inline;
+    fs_retcode_t inline_result = write_inline_data(fs, inode, inode->internal.file_size, data, n, &stored_inline);
+    if(inline_result != SUCCESS || stored_inline){
+        return inline_result;
+    }
+    return append_dblock_data(fs, inode, data, n);
+}
+
+static fs_retcode_t append_dblock_data(filesystem_t *fs, inode_t *inode, void *data, size_t n){
     // do we have enough dblocks to store the data. if not, error. 
-    // find the number of dblocks needed to store n bytes
-    size_t total_dblocks_needed = calculate_necessary_dblock_amount(inode->internal.file_size + n);
-    size_t current_dblocks_used = calculate_necessary_dblock_amount(inode->internal.file_size);
-    size_t remaining_dblocks_needed = total_dblocks_needed - current_dblocks_used;
-    
-    // find the number of available dblocks in the filesystem
-    size_t available_dblocks_infile = available_dblocks(fs);
-    
-    // if the number of dblocks needed is greater than the available dblocks, return INSUFFICIENT_SPACE
-    if (remaining_dblocks_needed > available_dblocks_infile) {
-        return INSUFFICIENT_DBLOCKS;
+    // claim all of them now. if there are not enough, nothing has been modified yet
+    // the cursor keeps our place in the block map from the reservation to the last dblock written
+    dblock_cursor_t cursor = { 0 };
+    dblock_reservation_t reservation;
+    fs_retcode_t reserve_result = reserve_growth(fs, inode, &cursor, inode->internal.file_size, inode->internal.file_size + n, &reservation);
+    if (reserve_result != SUCCESS) {
+        return reserve_result;
     }
 
     size_t original_file_size = inode->internal.file_size;
+    mark_inode_dirty(fs, inode);
 
     // fill the direct nodes if necessary (helper function) 
-    int bytes_written = write_data_in_direct_dblock(fs, inode, data, n);
+    int bytes_written = write_data_in_direct_dblock(fs, inode, data, n, &reservation);
     if(bytes_written < 0){
         inode->internal.file_size = original_file_size;
+        finish_reservation(fs, &reservation);
         return INSUFFICIENT_DBLOCKS;
     }
 
@@ -302,10 +1373,11 @@ fs_retcode_t inode_write_data(filesystem_t *fs, inode_t *inode, void *data, size
 
     //if there are more bytes to write
     if(remaining_bytes_to_write > 0){
-        fs_retcode_t result = write_data_in_indirect_dblock(fs, inode, data, n, remaining_bytes_to_write);
+        fs_retcode_t result = write_data_in_indirect_dblock(fs, inode, data, n, remaining_bytes_to_write, &cursor, &reservation);
         if(result != SUCCESS){
             //reset file size and return error
             inode->internal.file_size = original_file_size;
+            finish_reservation(fs, &reservation);
             return result;
         }
     }
@@ -315,13 +1387,28 @@ fs_retcode_t inode_write_data(filesystem_t *fs, inode_t *inode, void *data, size
     }
     // we can store 64 bytes in the dblock?
 
+    finish_reservation(fs, &reservation);
+
     return SUCCESS;
 }
 
 fs_retcode_t inode_read_data(filesystem_t *fs, inode_t *inode, size_t offset, void *buffer, size_t n, size_t *bytes_read)
+{
+    //a fresh cursor still saves the chain walk between dblocks of this read
+    dblock_cursor_t cursor = { 0 };
+    return inode_read_data_cursor(fs, inode, &cursor, offset, buffer, n, bytes_read);
+}
+
+fs_retcode_t inode_read_data_cursor(filesystem_t *fs, inode_t *inode, dblock_cursor_t *cursor, size_t offset, void *buffer, size_t n, size_t *bytes_read)
+{
+    struct iovec iov = { .iov_base = buffer, .iov_len = n };
+    return inode_read_data_vec(fs, inode, cursor, offset, &iov, 1, bytes_read);
+}
+
+fs_retcode_t inode_read_data_vec(filesystem_t *fs, inode_t *inode, dblock_cursor_t *cursor, size_t offset, const struct iovec *iov, size_t iovcnt, size_t *bytes_read)
 {
     //check to make sure inputs are valid
-    if(fs == NULL || inode == NULL || bytes_read == NULL){
+    if(fs == NULL || inode == NULL || bytes_read == NULL || (iov == NULL && iovcnt > 0)){
         return INVALID_INPUT;
     }
 
@@ -336,6 +1423,7 @@ fs_retcode_t inode_read_data(filesystem_t *fs, inode_t *inode, size_t offset, vo
     }
 
     //start reading at offset
+    size_t n = iovec_total_length(iov, iovcnt);
     size_t file_bytes_to_read = current_file_size - offset;
     if(n > file_bytes_to_read){
         n = file_bytes_to_read;
@@ -346,40 +1434,58 @@ fs_retcode_t inode_read_data(filesystem_t *fs, inode_t *inode, size_t offset, vo
         return SUCCESS;
     }
 
-    //need to access memory through a byte pointer to increment by bytes, and read data
-    byte *buffer_destination = (byte *)buffer;
+    iovec_position_t position = { .iov = iov, .segment = 0, .segment_offset = 0 };
+    if(inode_is_inline(inode)){
+        copy_iovec_run(&position, inline_data(inode) + offset, n, true);
+        *bytes_read = n;
+        return SUCCESS;
+    }
+
     size_t remaining_bytes_to_read = n;
     size_t current_offset = offset;
 
-    //until we read all the bytes
+    //until we read all the bytes. each run of dblocks is looked up once, however many buffers it is spread over
     while(remaining_bytes_to_read > 0){
         byte *dblock_ptr;
         size_t offset_within_dblock;
-        find_dblock_with_bytes(fs, inode, current_offset, &dblock_ptr, &offset_within_dblock, false);
+        size_t run_bytes;
+        //a block map missing a dblock the file size covers is broken, and reading on would follow a null dblock
+        fs_retcode_t result = find_dblock_with_bytes(fs, inode, current_offset, &dblock_ptr, &offset_within_dblock, false, cursor, NULL, &run_bytes);
+        if(result != SUCCESS){
+            return result;
+        }
 
-        //calculate how many bytes we can read from this dblock
-        size_t curr_bytes_in_dblock = DATA_BLOCK_SIZE - offset_within_dblock;
+        //calculate how many bytes we can read from this run of dblocks
+        size_t curr_bytes_in_dblock = run_bytes;
         if(curr_bytes_in_dblock > remaining_bytes_to_read){
             curr_bytes_in_dblock = remaining_bytes_to_read;
         }
 
-        //copy data into the buffer destination
-        memcpy(buffer_destination, dblock_ptr + offset_within_dblock, curr_bytes_in_dblock);
+        //copy data into the buffers
+        copy_iovec_run(&position, dblock_ptr + offset_within_dblock, curr_bytes_in_dblock, true);
 
-        buffer_destination += curr_bytes_in_dblock;
         current_offset += curr_bytes_in_dblock;
         remaining_bytes_to_read -= curr_bytes_in_dblock;
         *bytes_read += curr_bytes_in_dblock;
 
     }
     return SUCCESS;
-
-    //for 0 to n, use the helper function to read and copy 1 byte at a time
 }
 
 fs_retcode_t inode_modify_data(filesystem_t *fs, inode_t *inode, size_t offset, void *buffer, size_t n){
+    //a fresh cursor still saves the chain walk between dblocks of this modify
+    dblock_cursor_t cursor = { 0 };
+    return inode_modify_data_cursor(fs, inode, &cursor, offset, buffer, n);
+}
+
+fs_retcode_t inode_modify_data_cursor(filesystem_t *fs, inode_t *inode, dblock_cursor_t *cursor, size_t offset, void *buffer, size_t n){
+    struct iovec iov = { .iov_base = buffer, .iov_len = n };
+    return inode_modify_data_vec(fs, inode, cursor, offset, &iov, 1);
+}
+
+fs_retcode_t inode_modify_data_vec(filesystem_t *fs, inode_t *inode, dblock_cursor_t *cursor, size_t offset, const struct iovec *iov, size_t iovcnt){
     //check to see if the input is valid
-    if (fs == NULL || inode == NULL) {
+    if (fs == NULL || inode == NULL || (iov == NULL && iovcnt > 0)) {
         return INVALID_INPUT;
     }
 
@@ -391,6 +1497,27 @@ fs_retcode_t inode_modify_data(filesystem_t *fs, inode_t *inode, size_t offset,
         return INVALID_INPUT;
     }
 
+    size_t n = iovec_total_length(iov, iovcnt);
+    iovec_position_t position = { .iov = iov, .segment = 0, .segment_offset = 0 };
+
+    // small files may not need any dblocks at all. a batch that small is gathered and stored in one go
+    if(n <= INODE_INLINE_CAPACITY && (inode_is_inline(inode) || current_file_size == 0)){
+        byte gathered[INODE_INLINE_CAPACITY];
+        copy_iovec_run(&position, gathered, n, false);
+        position = (iovec_position_t){ .iov = iov, .segment = 0, .segment_offset = 0 };
+
+        bool stored_inline;
+        fs_retcode_t inline_result = write_inline_data(fs, inode, offset, gathered, n, &stored_inline);
+        if(inline_result != SUCCESS || stored_inline){
+            return inline_result;
+        }
+    }else if(inode_is_inline(inode)){
+        fs_retcode_t promote_result = promote_inline_data(fs, inode, offset + n);
+        if(promote_result != SUCCESS){
+            return promote_result;
+        }
+    }
+
     //calculate the final filesize and check to make sure there are enough blocks
     size_t final_file_size;
     if(offset + n > current_file_size){
@@ -399,47 +1526,42 @@ fs_retcode_t inode_modify_data(filesystem_t *fs, inode_t *inode, size_t offset,
         final_file_size = current_file_size;
     }
 
-    //use calculate_necessary_dblock_amount and available_dblocks
-    size_t total_dblocks_needed = calculate_necessary_dblock_amount(final_file_size);
-    size_t current_dblocks_used = calculate_necessary_dblock_amount(current_file_size);
-    size_t new_dblocks_needed = total_dblocks_needed - current_dblocks_used;
-
-    //get available remaining dblocks in fs
-    size_t remaining_fs_dblocks = available_dblocks(fs);
-
-    if(new_dblocks_needed > remaining_fs_dblocks){
-        return INSUFFICIENT_DBLOCKS;
+    //claim every new dblock now. if there are not enough, nothing has been modified yet
+    dblock_reservation_t reservation;
+    fs_retcode_t reserve_result = reserve_growth(fs, inode, cursor, current_file_size, final_file_size, &reservation);
+    if(reserve_result != SUCCESS){
+        return reserve_result;
     }
 
-    byte *buffer_destination = (byte *)buffer;
     size_t current_offset = offset;
     size_t remaining_bytes_to_modify = n;
+    mark_inode_dirty(fs, inode);
 
-    //while there are still remaining bytes to write
+    //while there are still remaining bytes to write. each run of dblocks is looked up once, however many buffers fill it
     while(remaining_bytes_to_modify > 0){
         byte *curr_dblock_ptr; //stores the pointer to the dblock we write from
         size_t offset_within_dblock; //stores the position within that dblock
+        size_t run_bytes; //stores how many bytes from there on are contiguous
 
         //find the dblock we should start modifying from
-        fs_retcode_t result = find_dblock_with_bytes(fs, inode, current_offset, &curr_dblock_ptr, &offset_within_dblock, true);
+        fs_retcode_t result = find_dblock_with_bytes(fs, inode, current_offset, &curr_dblock_ptr, &offset_within_dblock, true, cursor, &reservation, &run_bytes);
 
         //if there was an error, return error
         if(result != SUCCESS){
             inode->internal.file_size = current_file_size;
+            finish_reservation(fs, &reservation);
             return result;
         }
 
-        //calcualte how many bytes we write in this current dblock
-        size_t bytes_to_write = DATA_BLOCK_SIZE - offset_within_dblock;
+        //calcualte how many bytes we write in this current run of dblocks
+        size_t bytes_to_write = run_bytes;
         if(bytes_to_write > remaining_bytes_to_modify){
             bytes_to_write = remaining_bytes_to_modify;
         }
 
-        //copy data from buffer to dblock at current dblock + offset position
-        memcpy(curr_dblock_ptr + offset_within_dblock, buffer_destination, bytes_to_write);
-
-        //move buffer pointer forward by number of bytes written
-        buffer_destination += bytes_to_write;
+        //copy data from the buffers to dblock at current dblock + offset position
+        copy_iovec_run(&position, curr_dblock_ptr + offset_within_dblock, bytes_to_write, false);
+        mark_run_dirty(fs, curr_dblock_ptr, offset_within_dblock, bytes_to_write);
 
         current_offset += bytes_to_write;
         remaining_bytes_to_modify -= bytes_to_write;
@@ -450,6 +1572,7 @@ fs_retcode_t inode_modify_data(filesystem_t *fs, inode_t *inode, size_t offset,
         }
 
     }
+    finish_reservation(fs, &reservation);
     return SUCCESS;
 }
 
@@ -473,6 +1596,25 @@ fs_retcode_t inode_shrink_data(filesystem_t *fs, inode_t *inode, size_t new_size
         return SUCCESS;
     }
 
+    // inline data only needs its tail cleared, and a file that becomes small enough moves into the inode
+    if(inode_is_inline(inode)){
+        if(new_size == 0){
+            clear_inline(fs, inode);
+        }else{
+            memset(inline_data(inode) + new_size, 0, original_file_size - new_size);
+            inode->internal.file_size = new_size;
+            mark_inode_dirty(fs, inode);
+        }
+        return SUCCESS;
+    }
+    if(fits_inline(fs, new_size)){
+        return demote_to_inline(fs, inode, new_size);
+    }
+
+    // index dblocks may be released below, so any cursor into a chain is now stale. other inodes' cursors read it meanwhile
+    __atomic_fetch_add(&fs->map_generation, 1, __ATOMIC_RELAXED);
+    mark_inode_dirty(fs, inode);
+
     // calculates how many data blocks are needed to store the file with new_size bytes
     size_t necessary_total_dblocks_new = (new_size + DATA_BLOCK_SIZE - 1) / DATA_BLOCK_SIZE;
     //size_t necessary_total_dblocks_new = calculate_necessary_dblock_amount(new_size);
@@ -496,6 +1638,21 @@ fs_retcode_t inode_shrink_data(filesystem_t *fs, inode_t *inode, size_t new_size
         }
     }
 
+    // trees and extents release their own index dblocks as they empty
+    indirect_layout_t layout = inode->internal.indirect_layout;
+    if(inode->internal.indirect_dblock != 0 && (layout == INDIRECT_TREE || layout == INDIRECT_EXTENTS)){
+        size_t kept_dblocks = 0;
+        if(necessary_total_dblocks_new > INODE_DIRECT_BLOCK_COUNT){
+            kept_dblocks = necessary_total_dblocks_new - INODE_DIRECT_BLOCK_COUNT;
+        }
+        fs_retcode_t result = layout == INDIRECT_TREE ? shrink_tree(fs, inode, kept_dblocks) : shrink_extents(fs, inode, kept_dblocks);
+        if(result != SUCCESS){
+            return result;
+        }
+        inode->internal.file_size = new_size;
+        return SUCCESS;
+    }
+
     // if the new size doesn't include any index dblocks, release all
     if(new_size <= INODE_DIRECT_BLOCK_COUNT * DATA_BLOCK_SIZE) {
         if(inode->internal.indirect_dblock != 0) {
@@ -508,10 +1665,10 @@ fs_retcode_t inode_shrink_data(filesystem_t *fs, inode_t *inode, size_t new_size
                 dblock_index_t *curr_indirect_dblock_index_ptr = cast_dblock_ptr(fs->dblocks + (current_indirect_dblock_index * DATA_BLOCK_SIZE));
                 
                 //if the next index dblock is not allocated
-                dblock_index_t next_index_dblock = curr_indirect_dblock_index_ptr[15];
+                dblock_index_t next_index_dblock = curr_indirect_dblock_index_ptr[INDIRECT_DBLOCK_INDEX_COUNT];
                 
                 //release all direct dblocks within index
-                for (size_t i = 0; i < 15; i++) {
+                for (size_t i = 0; i < INDIRECT_DBLOCK_INDEX_COUNT; i++) {
                     if (curr_indirect_dblock_index_ptr[i] != 0) {
                         fs_retcode_t result = release_dblock(fs, fs->dblocks + (curr_indirect_dblock_index_ptr[i] * DATA_BLOCK_SIZE));
                         if (result != SUCCESS) {
@@ -549,12 +1706,12 @@ fs_retcode_t inode_shrink_data(filesystem_t *fs, inode_t *inode, size_t new_size
         dblock_index_t *curr_indirect_dblock_index_ptr = cast_dblock_ptr(fs->dblocks + (curr_indirect_dblock_index * DATA_BLOCK_SIZE));
         
         // get the index of the next index dblock
-        dblock_index_t next_indirect_dblock_index = curr_indirect_dblock_index_ptr[15];
+        dblock_index_t next_indirect_dblock_index = curr_indirect_dblock_index_ptr[INDIRECT_DBLOCK_INDEX_COUNT];
         
         // if we've reached the number of dblocks we need to keep
         if(dblocks_kept >= necessary_indirect_dblocks_new){
             //release all direct dblocks within index
-            for(size_t i = 0; i < 15; i++){
+            for(size_t i = 0; i < INDIRECT_DBLOCK_INDEX_COUNT; i++){
                 if(curr_indirect_dblock_index_ptr[i] != 0){
                     fs_retcode_t result = release_dblock(fs, fs->dblocks + (curr_indirect_dblock_index_ptr[i] * DATA_BLOCK_SIZE));
                     if(result != SUCCESS){
@@ -572,7 +1729,8 @@ fs_retcode_t inode_shrink_data(filesystem_t *fs, inode_t *inode, size_t new_size
             //update previous block's next pointer or the inode's indirect pointer
             if(prev_indirect_dblock_index != 0){
                 dblock_index_t *prev_indirect_dblock_index_ptr = cast_dblock_ptr(fs->dblocks + (prev_indirect_dblock_index * DATA_BLOCK_SIZE));
-                prev_indirect_dblock_index_ptr[15] = next_indirect_dblock_index;
+                prev_indirect_dblock_index_ptr[INDIRECT_DBLOCK_INDEX_COUNT] = next_indirect_dblock_index;
+                mark_dblock_dirty(fs, prev_indirect_dblock_index);
             }else{
                 inode->internal.indirect_dblock = next_indirect_dblock_index;
             }
@@ -582,7 +1740,7 @@ fs_retcode_t inode_shrink_data(filesystem_t *fs, inode_t *inode, size_t new_size
         }
         
         // go through the data blocks within the index dblock
-        for(size_t i = 0; i < 15; i++){
+        for(size_t i = 0; i < INDIRECT_DBLOCK_INDEX_COUNT; i++){
             //if the data block is allocated
             if(curr_indirect_dblock_index_ptr[i] != 0){
                 //if we still need to keep data blocks
@@ -600,7 +1758,7 @@ fs_retcode_t inode_shrink_data(filesystem_t *fs, inode_t *inode, size_t new_size
         // check if the index dblock is empty (if we removed all data blocks)
         if(dblocks_kept >= necessary_indirect_dblocks_new) {
             bool index_dblock_empty = true;
-            for(size_t i = 0; i < 15; i++){
+            for(size_t i = 0; i < INDIRECT_DBLOCK_INDEX_COUNT; i++){
                 if(curr_indirect_dblock_index_ptr[i] != 0){
                     index_dblock_empty = false;
                     break;
@@ -610,7 +1768,7 @@ fs_retcode_t inode_shrink_data(filesystem_t *fs, inode_t *inode, size_t new_size
             //if the index dblock is empty, we release index dblock
             if(index_dblock_empty == true){
                 // get next index dblock
-                dblock_index_t next_index_dblock = curr_indirect_dblock_index_ptr[15];
+                dblock_index_t next_index_dblock = curr_indirect_dblock_index_ptr[INDIRECT_DBLOCK_INDEX_COUNT];
                 
                 // release current dblock
                 fs_retcode_t result = release_dblock(fs, fs->dblocks + (curr_indirect_dblock_index * DATA_BLOCK_SIZE));
@@ -621,7 +1779,7 @@ fs_retcode_t inode_shrink_data(filesystem_t *fs, inode_t *inode, size_t new_size
                 //update previous block's next pointer or the inode's indirect pointer
                 if(prev_indirect_dblock_index != 0){
                     dblock_index_t *prev_indirect_dblock_index_ptr = cast_dblock_ptr(fs->dblocks + (prev_indirect_dblock_index * DATA_BLOCK_SIZE));
-                    prev_indirect_dblock_index_ptr[15] = next_index_dblock;
+                    prev_indirect_dblock_index_ptr[INDIRECT_DBLOCK_INDEX_COUNT] = next_index_dblock;
                 }else{
                     inode->internal.indirect_dblock = next_index_dblock;
                 }
@@ -651,3 +1809,208 @@ fs_retcode_t inode_release_data(filesystem_t *fs, inode_t *inode)
     inode_shrink_data(fs, inode, 0);
     return SUCCESS;
 }
+
+fs_retcode_t inode_span_begin(filesystem_t *fs, inode_t *inode, size_t offset, size_t n, dblock_span_iterator_t *it)
+{
+    if(fs == NULL || inode == NULL || it == NULL){
+        return INVALID_INPUT;
+    }
+
+    //nothing past the end of the file can be looked at
+    size_t file_size = inode->internal.file_size;
+    if(offset > file_size){
+        offset = file_size;
+    }
+    if(n > file_size - offset){
+        n = file_size - offset;
+    }
+
+    *it = (dblock_span_iterator_t){ .fs = fs, .inode = inode, .offset = offset, .end = offset + n };
+    return SUCCESS;
+}
+
+bool inode_span_next(dblock_span_iterator_t *it, const byte **ptr, size_t *len)
+{
+    if(it == NULL || ptr == NULL || len == NULL || it->offset >= it->end){
+        return false;
+    }
+
+    //inline data is a single span inside the inode
+    if(inode_is_inline(it->inode)){
+        *ptr = inline_data(it->inode) + it->offset;
+        *len = it->end - it->offset;
+        it->offset = it->end;
+        return true;
+    }
+
+    const byte *span = it->pending;
+    size_t span_len = it->pending_len;
+    it->pending_len = 0;
+    if(span_len == 0 && find_span_run(it, it->offset, &span, &span_len) != SUCCESS){
+        return false;
+    }
+
+    //join the runs that follow right after this one in memory
+    while(it->offset + span_len < it->end){
+        const byte *next;
+        size_t next_len;
+        if(find_span_run(it, it->offset + span_len, &next, &next_len) != SUCCESS){
+            break;
+        }
+        if(next != span + span_len){
+            it->pending = next;
+            it->pending_len = next_len;
+            break;
+        }
+        span_len += next_len;
+    }
+
+    *ptr = span;
+    *len = span_len;
+    it->offset += span_len;
+    return true;
+}
+
+static fs_retcode_t defragment_pass(filesystem_t *fs, size_t budget, fs_defrag_state_t *state)
+{
+    if(fs == NULL || state == NULL){
+        return INVALID_INPUT;
+    }
+    if(state->done){
+        *state = (fs_defrag_state_t){ 0 };
+    }
+
+    byte *free_inodes;
+    fs_retcode_t bitmap_result = free_inode_bitmap(fs, &free_inodes);
+    if(bitmap_result != SUCCESS){
+        return bitmap_result;
+    }
+
+    //the root directory keeps dblock 0. an inode too big for what is left of the budget waits for the next call,
+    //unless nothing moved yet, so even a file bigger than the budget gets its turn
+    size_t moved_this_call = 0;
+    fs_retcode_t result = SUCCESS;
+    for(state->next_inode = state->next_inode > 0 ? state->next_inode : 1; state->next_inode < fs->inode_count; state->next_inode++){
+        if(budget > 0 && moved_this_call >= budget){
+            break;
+        }
+        if(bitmap_test(free_inodes, state->next_inode)){
+            continue;
+        }
+
+        size_t limit = budget == 0 || moved_this_call == 0 ? SIZE_MAX : budget - moved_this_call;
+        size_t moved;
+        result = defragment_inode(fs, &fs->inodes[state->next_inode], limit, &moved);
+        if(result == INSUFFICIENT_DBLOCKS){
+            result = SUCCESS;
+            break;
+        }
+        if(result != SUCCESS){
+            break;
+        }
+        moved_this_call += moved;
+        state->moved_dblocks += moved;
+    }
+
+    state->done = state->next_inode >= fs->inode_count;
+    free(free_inodes);
+    return result;
+}
+
+//dblocks of every file move, so nobody else may hold one meanwhile
+fs_retcode_t defragment_filesystem(filesystem_t *fs, size_t budget, fs_defrag_state_t *state)
+{
+    if(fs == NULL || state == NULL){
+        return INVALID_INPUT;
+    }
+    fs_lock_filesystem(fs, true);
+    fs_retcode_t result = defragment_pass(fs, budget, state);
+    fs_unlock_filesystem(fs);
+    return result;
+}
+
+static fs_retcode_t compact_inode_table(filesystem_t *fs, inode_index_t *renumbered)
+{
+    if(fs == NULL){
+        return INVALID_INPUT;
+    }
+
+    //a broken free inode list is refused before anything is allocated or touched
+    byte *free_inodes;
+    fs_retcode_t result = free_inode_bitmap(fs, &free_inodes);
+    if(result != SUCCESS){
+        return result;
+    }
+    inode_index_t *new_index = calloc(fs->inode_count, sizeof(inode_index_t));
+    byte **entries = calloc(fs->inode_count, sizeof(byte *));
+    if(new_index == NULL || entries == NULL){
+        result = SYSTEM_ERROR;
+    }
+
+    //the inodes in use keep their order. the root directory is never free, so it stays inode 0
+    size_t used_inodes = 0;
+    for(size_t i = 0; result == SUCCESS && i < fs->inode_count; i++){
+        if(!bitmap_test(free_inodes, i)){
+            new_index[i] = used_inodes++;
+        }
+    }
+
+    //every directory is renumbered in memory first, so a bad entry leaves the file system untouched
+    for(size_t i = 0; result == SUCCESS && i < fs->inode_count; i++){
+        if(!bitmap_test(free_inodes, i) && fs->inodes[i].internal.file_type == DIRECTORY){
+            result = renumber_directory(fs, &fs->inodes[i], free_inodes, new_index, &entries[i]);
+        }
+    }
+    for(size_t i = 0; result == SUCCESS && i < fs->inode_count; i++){
+        if(entries[i] != NULL){
+            result = inode_modify_data(fs, &fs->inodes[i], 0, entries[i], fs->inodes[i].internal.file_size);
+        }
+    }
+
+    if(result == SUCCESS){
+        //an inode only ever moves down, onto a free inode or one that already moved
+        for(size_t i = 0; i < fs->inode_count; i++){
+            if(!bitmap_test(free_inodes, i) && new_index[i] != i){
+                fs->inodes[new_index[i]] = fs->inodes[i];
+            }
+        }
+
+        //the free inodes follow in ascending order
+        for(size_t i = used_inodes; i < fs->inode_count; i++){
+            fs->inodes[i].next_free_inode = i + 1 < fs->inode_count ? i + 1 : 0;
+        }
+        fs->available_inode = used_inodes < fs->inode_count ? used_inodes : 0;
+        fs->free_inode_count = fs->inode_count - used_inodes;
+        mark_header_dirty(fs);
+        for(size_t i = 0; i < fs->inode_count; i++){
+            mark_inode_dirty(fs, &fs->inodes[i]);
+        }
+
+        //cursors remember inodes by address, and other files live at those addresses now
+        fs->map_generation++;
+        fs->relocation_generation++;
+        if(renumbered != NULL){
+            memcpy(renumbered, new_index, fs->inode_count * sizeof(inode_index_t));
+        }
+    }
+
+    for(size_t i = 0; entries != NULL && i < fs->inode_count; i++){
+        free(entries[i]);
+    }
+    free(entries);
+    free(new_index);
+    free(free_inodes);
+    return result;
+}
+
+//every inode may be renumbered, so nobody else may hold one meanwhile
+fs_retcode_t compact_inodes(filesystem_t *fs, inode_index_t *renumbered)
+{
+    if(fs == NULL){
+        return INVALID_INPUT;
+    }
+    fs_lock_filesystem(fs, true);
+    fs_retcode_t result = compact_inode_table(fs, renumbered);
+    fs_unlock_filesystem(fs);
+    return result;
+}
@@ -0,0 +1,395 @@
+#include "journal.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+// a journal file is a sequence of transactions, each a record followed by `length` bytes of
+// regions. a region is its offset in the image and its length, followed by its new contents
+#define JOURNAL_MAGIC ((uint64_t) 0x31304C4E524A5346) // "FSJRNL01"
+
+typedef struct journal_record
+{
+    uint64_t magic;
+    uint64_t sequence; // one more than the transaction before
+    uint64_t length;
+    uint64_t checksum; // of the regions, so a partly written transaction is recognized
+} journal_record_t;
+
+// FNV-1a, like the directory index
+static uint64_t journal_checksum(const byte *data, size_t len)
+{
+    uint64_t hash = 0xcbf29ce484222325;
+    for (size_t i = 0; i < len; ++i)
+    {
+        hash ^= data[i];
+        hash *= 0x100000001b3;
+    }
+    return hash;
+}
+
+// appends a region like `append_image_region` while other threads may be changing inodes. each inode
+// is copied under its lock, one at a time, so none of them is copied half changed
+static fs_retcode_t append_image_region_locked(filesystem_t *fs, size_t offset, const void *data, size_t len, void *ctx)
+{
+    if (offset < IMAGE_INODES_OFFSET || offset >= IMAGE_BITMASK_OFFSET(fs->inode_count)) return append_image_region(fs, offset, data, len, ctx);
+
+    struct byte_buffer *buffer = ctx;
+    if (grow_byte_buffer(buffer, sizeof(image_region_t) + len) != SUCCESS) return SYSTEM_ERROR;
+    image_region_t region = { offset, len };
+    memcpy(buffer->data + buffer->size, &region, sizeof(region));
+    byte *contents = buffer->data + buffer->size + sizeof(region);
+    inode_t *inode = &fs->inodes[(offset - IMAGE_INODES_OFFSET) / sizeof(inode_t)];
+    for (size_t i = 0; i < len / sizeof(inode_t); ++i, ++inode)
+    {
+        fs_lock_inode(fs, inode, false);
+        memcpy(contents + i * sizeof(inode_t), inode, sizeof(inode_t));
+        fs_unlock_inode(fs, inode);
+    }
+    buffer->size += sizeof(region) + len;
+    return SUCCESS;
+}
+
+// writes the buffered transactions after the last ones that were completely written, and waits for them.
+// called with the journal lock, which is left while waiting, so other threads can add transactions meanwhile.
+// a failed write leaves them buffered, and whatever part of them made it to the file is written over next time
+static fs_retcode_t write_journal(struct fs_journal *journal)
+{
+    size_t length = journal->buffer.size;
+    if (length == 0) return SUCCESS;
+    uint64_t sequence = journal->sequence;
+    int fd = fileno(journal->file);
+    fs_retcode_t ret = write_image_region(NULL, journal->durable_size, journal->buffer.data, length, &fd);
+    if (ret != SUCCESS) return ret;
+
+    journal->writing = true;
+    pthread_mutex_unlock(&journal->lock);
+    if (fdatasync(fd) == -1) ret = SYSTEM_ERROR;
+    pthread_mutex_lock(&journal->lock);
+    journal->writing = false;
+    if (ret == SUCCESS)
+    {
+        // the transactions added meanwhile move to the front
+        journal->buffer.size -= length;
+        memmove(journal->buffer.data, journal->buffer.data + length, journal->buffer.size);
+        journal->durable_size += length;
+        journal->durable_sequence = sequence;
+    }
+    pthread_cond_broadcast(&journal->changed);
+    return ret;
+}
+
+// waits until every transaction before `sequence` is in the journal file. a thread that finds nobody
+// writing writes them itself, once the threads still committing joined its group or the group is full.
+// called with the journal lock
+static fs_retcode_t wait_for_journal(struct fs_journal *journal, uint64_t sequence)
+{
+    while (journal->durable_sequence < sequence)
+    {
+        bool group_open = journal->sequence - journal->durable_sequence < journal->group_size &&
+                          __atomic_load_n(&journal->committing, __ATOMIC_ACQUIRE) > 0;
+        if (journal->writing || group_open)
+        {
+            pthread_cond_wait(&journal->changed, &journal->lock);
+            continue;
+        }
+        fs_retcode_t ret = write_journal(journal);
+        if (ret != SUCCESS) return ret;
+    }
+    return SUCCESS;
+}
+
+// the calling thread's writer of the journal it last looked one up in
+static _Thread_local struct
+{
+    uint64_t journal_id;
+    struct journal_writer *writer;
+} own_writer;
+
+static uint64_t journals_attached = 0;
+
+static struct journal_writer *find_journal_writer(struct fs_journal *journal)
+{
+    if (own_writer.journal_id == journal->id) return own_writer.writer;
+    pthread_t self = pthread_self();
+    for (struct journal_writer *writer = __atomic_load_n(&journal->writers, __ATOMIC_ACQUIRE); writer; writer = writer->next)
+    {
+        if (!pthread_equal(writer->thread, self)) continue;
+        own_writer.journal_id = journal->id;
+        own_writer.writer = writer;
+        return writer;
+    }
+    return NULL;
+}
+
+struct dirty_state *journal_writer_pending(filesystem_t *fs)
+{
+    struct fs_journal *journal = fs->journal;
+    struct journal_writer *writer = find_journal_writer(journal);
+    if (writer) return &writer->pending;
+
+    writer = calloc(1, sizeof(struct journal_writer));
+    if (!writer) return NULL;
+    if (init_dirty_maps(fs, &writer->pending) != SUCCESS)
+    {
+        free(writer);
+        return NULL;
+    }
+    writer->thread = pthread_self();
+    writer->next = __atomic_load_n(&journal->writers, __ATOMIC_RELAXED);
+    while (!__atomic_compare_exchange_n(&journal->writers, &writer->next, writer, true, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+    own_writer.journal_id = journal->id;
+    own_writer.writer = writer;
+    return &writer->pending;
+}
+
+// moves the changes of every thread into `journal->pending`. nobody may be changing anything meanwhile
+static void gather_journal_writers(filesystem_t *fs, struct fs_journal *journal)
+{
+    for (struct journal_writer *writer = journal->writers; writer; writer = writer->next)
+    {
+        merge_dirty_maps(fs, &journal->pending, &writer->pending);
+        clear_dirty_maps(fs, &writer->pending);
+    }
+}
+
+static void free_journal(struct fs_journal *journal)
+{
+    fclose(journal->file);
+    while (journal->writers)
+    {
+        struct journal_writer *writer = journal->writers;
+        journal->writers = writer->next;
+        free_dirty_maps(&writer->pending);
+        free(writer);
+    }
+    free_dirty_maps(&journal->pending);
+    free(journal->buffer.data);
+    pthread_mutex_destroy(&journal->lock);
+    pthread_cond_destroy(&journal->changed);
+    free(journal);
+}
+
+fs_retcode_t attach_journal(filesystem_t *fs, FILE *file, size_t group_size)
+{
+    if (!fs || !file || group_size == 0) return INVALID_INPUT;
+    detach_journal(fs);
+
+    struct fs_journal *journal = calloc(1, sizeof(struct fs_journal));
+    if (!journal) return SYSTEM_ERROR;
+    journal->file = file;
+    journal->id = __atomic_add_fetch(&journals_attached, 1, __ATOMIC_RELAXED);
+    journal->group_size = group_size;
+    pthread_mutex_init(&journal->lock, NULL);
+    pthread_cond_init(&journal->changed, NULL);
+    if (init_dirty_maps(fs, &journal->pending) != SUCCESS || ftruncate(fileno(file), 0) == -1)
+    {
+        free_journal(journal);
+        return SYSTEM_ERROR;
+    }
+
+    // what the image file is missing so far goes into the first transaction
+    fs_lock_filesystem(fs, true);
+    copy_dirty_maps(fs, &journal->pending, &fs->dirty);
+    fs->journal = journal;
+    fs_unlock_filesystem(fs);
+    return SUCCESS;
+}
+
+// adds what changed since the last transaction to the buffer, together with the changes of `own` unless it is null.
+// with `own`, other threads may be changing the file system meanwhile, just not what is in `journal->pending`
+static fs_retcode_t add_transaction(filesystem_t *fs, struct fs_journal *journal, struct dirty_state *own)
+{
+    struct byte_buffer *buffer = &journal->buffer;
+    size_t start = buffer->size;
+    if (grow_byte_buffer(buffer, sizeof(journal_record_t)) != SUCCESS) return SYSTEM_ERROR;
+    buffer->size += sizeof(journal_record_t);
+
+    image_region_fn append = own ? append_image_region_locked : append_image_region;
+    fs_retcode_t ret = for_each_dirty_region(fs, &journal->pending, append, buffer);
+    if (ret == SUCCESS && own) ret = for_each_dirty_region(fs, own, append, buffer);
+    size_t length = buffer->size - start - sizeof(journal_record_t);
+    if (ret != SUCCESS || length == 0)
+    {
+        // nothing changed, or the transaction did not fit in memory. then it stays pending
+        buffer->size = start;
+        return ret;
+    }
+
+    journal_record_t record = { JOURNAL_MAGIC, journal->sequence++, length,
+                                journal_checksum(buffer->data + start + sizeof(journal_record_t), length) };
+    memcpy(buffer->data + start, &record, sizeof(record));
+    clear_dirty_maps(fs, &journal->pending);
+    if (own) clear_dirty_maps(fs, own);
+    return SUCCESS;
+}
+
+// the header holds the head of the free inode list, which is only where it says while nobody shares the file system
+static bool header_pending(struct fs_journal *journal, struct journal_writer *writer)
+{
+    return __atomic_load_n(&journal->pending.header, __ATOMIC_RELAXED) || (writer && writer->pending.header);
+}
+
+fs_retcode_t commit_journal(filesystem_t *fs)
+{
+    if (!fs) return INVALID_INPUT;
+    struct fs_journal *journal = fs->journal;
+    if (!journal) return SUCCESS;
+
+    // a transaction holds the calling thread's changes and whatever changed while nobody shared the
+    // file system, so other threads only have to be kept out when the header changed
+    struct journal_writer *writer = find_journal_writer(journal);
+    bool exclusive = !fs->locks || header_pending(journal, writer);
+    fs_lock_filesystem(fs, exclusive);
+    if (!exclusive && header_pending(journal, writer))
+    {
+        // someone changed it before the lock was ours
+        fs_unlock_filesystem(fs);
+        exclusive = true;
+        fs_lock_filesystem(fs, true);
+    }
+    __atomic_fetch_add(&journal->committing, 1, __ATOMIC_RELEASE);
+
+    pthread_mutex_lock(&journal->lock);
+    if (exclusive) gather_journal_writers(fs, journal);
+    fs_retcode_t result = add_transaction(fs, journal, exclusive || !writer ? NULL : &writer->pending);
+    uint64_t sequence = journal->sequence;
+    __atomic_fetch_sub(&journal->committing, 1, __ATOMIC_RELEASE);
+    pthread_cond_broadcast(&journal->changed);
+    fs_unlock_filesystem(fs);
+
+    // the transactions before this one may be someone else's, but they could hold changes this one builds on
+    if (result == SUCCESS) result = wait_for_journal(journal, sequence);
+    pthread_mutex_unlock(&journal->lock);
+    return result;
+}
+
+fs_retcode_t sync_journal(filesystem_t *fs)
+{
+    if (!fs) return INVALID_INPUT;
+    struct fs_journal *journal = fs->journal;
+    if (!journal) return SUCCESS;
+
+    pthread_mutex_lock(&journal->lock);
+    fs_retcode_t result = wait_for_journal(journal, journal->sequence);
+    pthread_mutex_unlock(&journal->lock);
+    return result;
+}
+
+// called with the file system lock held exclusively and the journal lock
+static fs_retcode_t checkpoint(FILE *file, filesystem_t *fs, struct fs_journal *journal)
+{
+    // a write still going on would land on the journal file after it is emptied
+    while (journal->writing) pthread_cond_wait(&journal->changed, &journal->lock);
+
+    // the image file gets everything the journal holds, and what was not committed yet
+    fs_retcode_t ret = write_dirty_image(file, fs);
+    if (ret != SUCCESS) return ret;
+    if (fdatasync(fileno(file)) == -1) return SYSTEM_ERROR;
+
+    gather_journal_writers(fs, journal);
+    clear_dirty_maps(fs, &journal->pending);
+    journal->buffer.size = 0;
+    journal->durable_sequence = journal->sequence;
+    pthread_cond_broadcast(&journal->changed);
+    if (ftruncate(fileno(journal->file), 0) == -1) return SYSTEM_ERROR;
+    journal->durable_size = 0;
+    return SUCCESS;
+}
+
+fs_retcode_t checkpoint_journal(FILE *file, filesystem_t *fs)
+{
+    if (!file || !fs || !fs->journal) return INVALID_INPUT;
+
+    fs_lock_filesystem(fs, true);
+    pthread_mutex_lock(&fs->journal->lock);
+    fs_retcode_t result = checkpoint(file, fs, fs->journal);
+    pthread_mutex_unlock(&fs->journal->lock);
+    fs_unlock_filesystem(fs);
+    return result;
+}
+
+fs_retcode_t detach_journal(filesystem_t *fs)
+{
+    if (!fs) return INVALID_INPUT;
+    struct fs_journal *journal = fs->journal;
+    if (!journal) return SUCCESS;
+
+    pthread_mutex_lock(&journal->lock);
+    fs_retcode_t result = wait_for_journal(journal, journal->sequence);
+    pthread_mutex_unlock(&journal->lock);
+    free_journal(journal);
+    fs->journal = NULL;
+    return result;
+}
+
+// reads the transaction at `offset` into `*payload`. false if there is no complete one with the expected sequence number
+static bool read_transaction(int fd, size_t offset, size_t journal_size, const uint64_t *sequence, journal_record_t *record, byte **payload)
+{
+    if (journal_size - offset < sizeof(*record) || pread(fd, record, sizeof(*record), offset) != sizeof(*record)) return false;
+    if (record->magic != JOURNAL_MAGIC || (sequence && record->sequence != *sequence)) return false;
+    if (record->length > journal_size - offset - sizeof(*record)) return false;
+
+    *payload = malloc(record->length);
+    if (!*payload) return false;
+    if (pread(fd, *payload, record->length, offset + sizeof(*record)) != (ssize_t) record->length ||
+        journal_checksum(*payload, record->length) != record->checksum)
+    {
+        free(*payload);
+        return false;
+    }
+    return true;
+}
+
+// checks that every region of a transaction lies inside the image, then writes them all
+static fs_retcode_t apply_transaction(int image_fd, size_t image_size, const byte *payload, size_t length, bool *applied)
+{
+    *applied = false;
+    for (size_t pos = 0; pos < length;)
+    {
+        image_region_t region;
+        if (length - pos < sizeof(region)) return SUCCESS;
+        memcpy(&region, payload + pos, sizeof(region));
+        pos += sizeof(region);
+        if (region.length > length - pos || region.offset > image_size || region.length > image_size - region.offset) return SUCCESS;
+        pos += region.length;
+    }
+
+    if (write_image_regions(image_fd, payload, length) != SUCCESS) return SYSTEM_ERROR;
+    *applied = true;
+    return SUCCESS;
+}
+
+fs_retcode_t replay_journal(FILE *journal, FILE *image, size_t *replayed)
+{
+    if (!journal || !image) return INVALID_INPUT;
+    if (replayed) *replayed = 0;
+
+    // nothing buffered in either file may get in the way of reading and writing them directly
+    if (fflush(journal) == EOF || fflush(image) == EOF) return SYSTEM_ERROR;
+    int journal_fd = fileno(journal), image_fd = fileno(image);
+    struct stat journal_stat, image_stat;
+    if (fstat(journal_fd, &journal_stat) == -1 || fstat(image_fd, &image_stat) == -1) return SYSTEM_ERROR;
+
+    size_t offset = 0, count = 0;
+    uint64_t sequence = 0;
+    journal_record_t record;
+    byte *payload;
+    while (read_transaction(journal_fd, offset, journal_stat.st_size, count ? &sequence : NULL, &record, &payload))
+    {
+        bool applied;
+        fs_retcode_t ret = apply_transaction(image_fd, image_stat.st_size, payload, record.length, &applied);
+        free(payload);
+        if (ret != SUCCESS) return ret;
+        if (!applied) break;
+
+        offset += sizeof(record) + record.length;
+        sequence = record.sequence + 1;
+        count++;
+    }
+
+    if (count > 0 && fdatasync(image_fd) == -1) return SYSTEM_ERROR;
+    if (replayed) *replayed = count;
+    return SUCCESS;
+}
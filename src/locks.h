@@ -0,0 +1,63 @@
+#ifndef LOCKS_H
+#define LOCKS_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#include "filesys.h"
+
+/**
+ * the state `fs_enable_concurrency` sets up, private to filesys.c and the few modules
+ * that take one of its locks themselves.
+ */
+
+// the most free inodes a thread keeps aside
+#define INODE_CACHE_SIZE 32
+// how many free inodes an empty cache takes off the free inode list at once
+#define INODE_CACHE_REFILL 16
+
+// free inodes one thread took off the free inode list ahead of its claims. they count as available.
+// only that thread puts inodes in, and a thread that runs out everywhere else takes them all at once,
+// so neither needs a lock. each cache starts on its own cache line, so threads do not slow each other down
+struct inode_cache
+{
+    uint64_t head; // a stack like the free inode list, see `free_inode_head`
+    size_t count; // as far as the thread knows. another thread taking the inodes leaves it too high
+    pthread_t thread;
+    struct inode_cache *next;
+} __attribute__((aligned(64)));
+
+// the most groups the dblocks are split into once threads share them
+#define DBLOCK_GROUP_COUNT 16
+
+// a range of dblocks allocated apart from the others. its bitmask bits never share a word with another group's
+struct dblock_group
+{
+    pthread_mutex_t lock;
+    size_t start; // the dblocks [start, end) belong to the group
+    size_t end;
+    size_t hint; // no dblock of the group below this index is available
+    size_t free_count;
+} __attribute__((aligned(64)));
+
+// the locks of a file system with more than one user, see `fs_enable_concurrency`
+struct fs_locks
+{
+    pthread_rwlock_t filesystem;
+    bool exclusive; // the file system lock is held exclusively, so `available_inode` is the head of the list
+    pthread_rwlock_t *inodes; // one per inode
+    // the head of the free inode list in the low 16 bits. the bits above count changes to it, so a thread
+    // that read the head before another thread popped it and pushed it back cannot swap it in
+    uint64_t free_inode_head;
+    uint64_t id; // tells the locks apart from earlier ones, for the threads that remember their inode cache
+    struct inode_cache *inode_caches; // one per thread that claimed or released an inode. pushed without a lock
+    pthread_mutex_t free_inodes; // the free inode list while `sorted_free_inodes` is set
+    struct dblock_group dblock_groups[DBLOCK_GROUP_COUNT]; // the bitmask of each group's dblocks and their count
+    size_t dblock_group_size; // a multiple of 64
+    size_t dblock_group_count;
+    pthread_mutex_t dentries; // the dentry cache
+};
+
+#endif
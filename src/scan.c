@@ -0,0 +1,126 @@
+#include "scan.h"
+#include "bitmap.h"
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#define INODE_MASK_SIZE(inode_count) (((inode_count) + 7) / 8)
+
+// workers take the inode table this many inodes at a time. a multiple of 8, so no two share a byte of the free
+// inode mask, and of 64 bytes of inodes, so no two write to the same cache line of the table
+#define SCAN_CHUNK_INODES 1024
+
+// one scan of the inode table, shared by all of its workers
+typedef struct inode_scan
+{
+    filesystem_t *fs;
+    const byte *free_inodes; // one bit per inode on the free list
+    fs_inode_predicate_t predicate;
+    fs_inode_callback_t callback;
+    void *arg;
+    size_t next_inode; // first inode no worker has taken yet
+} inode_scan_t;
+
+typedef struct inode_scan_worker
+{
+    inode_scan_t *scan;
+    size_t worker;
+} inode_scan_worker_t;
+
+// takes chunks of the table until none are left, skipping the free inodes a word of the mask at a time
+static void *run_inode_scan(void *arg)
+{
+    inode_scan_worker_t *worker = arg;
+    inode_scan_t *scan = worker->scan;
+    size_t inode_count = scan->fs->inode_count;
+    while (true)
+    {
+        size_t first = __atomic_fetch_add(&scan->next_inode, SCAN_CHUNK_INODES, __ATOMIC_RELAXED);
+        if (first >= inode_count) break;
+
+        size_t end = inode_count - first < SCAN_CHUNK_INODES ? inode_count : first + SCAN_CHUNK_INODES;
+        size_t i;
+        for (size_t start = first; bitmap_find_first_clear(scan->free_inodes, end, start, &i); start = i + 1)
+        {
+            inode_t *inode = &scan->fs->inodes[i];
+            if (!scan->predicate || scan->predicate(scan->fs, i, inode, scan->arg)) scan->callback(scan->fs, i, inode, worker->worker, scan->arg);
+        }
+    }
+    return NULL;
+}
+
+// scans the inodes not set in `free_inodes` with `thread_count` workers. the calling thread is the first one,
+// and the chunks a thread that failed to start would have taken go to the others
+fs_retcode_t scan_inodes(filesystem_t *fs, const byte *free_inodes, fs_inode_predicate_t predicate, fs_inode_callback_t callback, void *arg, size_t thread_count)
+{
+    inode_scan_t scan = { .fs = fs, .free_inodes = free_inodes, .predicate = predicate, .callback = callback, .arg = arg };
+    inode_scan_worker_t *workers = calloc(thread_count, sizeof(inode_scan_worker_t));
+    pthread_t *threads = calloc(thread_count, sizeof(pthread_t));
+    bool *started = calloc(thread_count, sizeof(bool));
+    if (!workers || !threads || !started)
+    {
+        free(workers);
+        free(threads);
+        free(started);
+        return SYSTEM_ERROR;
+    }
+
+    for (size_t t = 0; t < thread_count; ++t)
+    {
+        workers[t] = (inode_scan_worker_t) { .scan = &scan, .worker = t };
+        if (t > 0) started[t] = pthread_create(&threads[t], NULL, run_inode_scan, &workers[t]) == 0;
+    }
+    run_inode_scan(&workers[0]);
+    for (size_t t = 1; t < thread_count; ++t)
+    {
+        if (started[t]) pthread_join(threads[t], NULL);
+    }
+
+    free(workers);
+    free(threads);
+    free(started);
+    return SUCCESS;
+}
+
+// follows the free inode list, making sure it stays in range and does not loop
+bool collect_free_inodes(filesystem_t *fs, byte *free_inodes)
+{
+    for (inode_index_t iter = fs->available_inode; iter != 0; iter = fs->inodes[iter].next_free_inode)
+    {
+        if (iter >= fs->inode_count || bitmap_test(free_inodes, iter)) return false;
+        bitmap_set(free_inodes, iter);
+    }
+    return true;
+}
+
+size_t fs_scan_thread_count(filesystem_t *fs, size_t thread_count)
+{
+    if (thread_count == 0)
+    {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        thread_count = cpus > 0 ? (size_t) cpus : 1;
+    }
+
+    // more threads than chunks of inodes would have nothing to do
+    size_t chunks = fs ? (fs->inode_count + SCAN_CHUNK_INODES - 1) / SCAN_CHUNK_INODES : 1;
+    if (thread_count > chunks) thread_count = chunks > 0 ? chunks : 1;
+    return thread_count;
+}
+
+fs_retcode_t fs_for_each_inode(filesystem_t *fs, fs_inode_predicate_t predicate, fs_inode_callback_t callback, void *arg, size_t thread_count)
+{
+    if (!fs || !callback) return INVALID_INPUT;
+
+    byte *free_inodes = calloc(INODE_MASK_SIZE(fs->inode_count) + 1, sizeof(byte));
+    if (!free_inodes) return SYSTEM_ERROR;
+
+    // the mask is built once, and the workers only ever read it
+    fs_retcode_t result = INVALID_INPUT;
+    if (collect_free_inodes(fs, free_inodes))
+    {
+        result = scan_inodes(fs, free_inodes, predicate, callback, arg, fs_scan_thread_count(fs, thread_count));
+    }
+    free(free_inodes);
+    return result;
+}
@@ -1,3 +1,4 @@
+#include <algorithm>
 #include <iostream>
 #include <string>
 #include <vector>
@@ -12,6 +13,11 @@ extern "C"
 {
     #include "filesys.h"
     #include "debug.h"
+    #include "image.h"
+    #include "journal.h"
+    #include "flusher.h"
+    #include "scan.h"
+    #include "fsck.h"
 }
 
 template<typename CharT>
@@ -95,6 +101,7 @@ class fs_env
 {
 private:
     filesystem_t fs;
+    std::string autosave_name; // the binary file the flusher of `fs` writes to, if it has one
 
     fs_env()
     {
@@ -118,6 +125,10 @@ public:
     }
 
     filesystem_t& get() { return fs; }
+
+    // the file system loses its flusher when it is replaced, and the name goes with it
+    const std::string *autosave() const { return fs.flusher ? &autosave_name : nullptr; }
+    void set_autosave(std::string name) { autosave_name = std::move(name); }
 };
 
 class terminal_env
@@ -170,6 +181,25 @@ struct load_fs_command
             printf("File with name %s does not exist.\n", file_name.data());
             return true;
         }
+
+        // a journal left next to the image holds what was committed after it was last written
+        std::string journal_name = file_name + ".journal";
+        FILE *journal = fopen(journal_name.data(), "r");
+        if (journal)
+        {
+            FILE *image = fopen(file_name.data(), "r+");
+            size_t replayed = 0;
+            fs_retcode_t ret = image ? replay_journal(journal, image, &replayed) : SYSTEM_ERROR;
+            if (image) fclose(image);
+            fclose(journal);
+            if (ret != SUCCESS)
+            {
+                REPORT_RETCODE(ret);
+                fclose(file);
+                return true;
+            }
+            if (replayed > 0) printf("Replayed %lu transactions from %s\n", replayed, journal_name.data());
+        }
         
         filesystem_t copy;
         fs_retcode_t ret = load_filesystem(file, &copy);
@@ -189,7 +219,7 @@ struct load_fs_command
 
 const char * const load_fs_command::help_messages[help_message_len] = {
     "load path_to_fs_binary",
-    "\tLoads a file system from a binary file."
+    "\tLoads a file system from a binary file, after replaying path_to_fs_binary.journal into it if there is one."
 };
 
 struct save_fs_command
@@ -209,6 +239,16 @@ struct save_fs_command
         }
 
         std::string file_name{ args[1] };
+
+        // the flusher already writes to this file. it is only asked to, so the terminal does not wait
+        const std::string *autosave = fs_env::instance().autosave();
+        if (autosave && *autosave == file_name)
+        {
+            fs_retcode_t ret = flush_filesystem(&fs_env::instance().get(), false);
+            if (ret != SUCCESS) REPORT_RETCODE(ret);
+            return true;
+        }
+
         FILE *file = fopen(file_name.data(), "w");
         if (!file)
         {
@@ -224,7 +264,232 @@ struct save_fs_command
 
 const char * const save_fs_command::help_messages[help_message_len] = {
     "save path_to_new_fs_binary",
-    "\tSaves a file system to a binary file."
+    "\tSaves a file system to a binary file. The binary file autosave writes to is flushed in the background instead."
+};
+
+struct map_fs_command
+{
+    static constexpr std::size_t help_message_len = 3;
+    static const char* const help_messages[help_message_len];
+
+    static bool exec(const std::vector<std::string_view>& args)
+    {
+        using namespace std::string_view_literals;
+        if (args[0].compare("map"sv) != 0) return false;
+
+        if (args.size() != 2)
+        {
+            puts("Incorrect number of arguments for map.");
+            return true;
+        }
+
+        std::string file_name{ args[1] };
+        FILE *file = fopen(file_name.data(), "r+");
+        if (!file)
+        {
+            printf("File with name %s does not exist.\n", file_name.data());
+            return true;
+        }
+        
+        filesystem_t copy;
+        fs_retcode_t ret = map_filesystem(file, &copy);
+        fclose(file);
+        if (ret != SUCCESS) 
+        {
+            REPORT_RETCODE(ret);
+            return true;
+        }
+        
+        free_filesystem(&fs_env::instance().get());
+        fs_env::instance().get() = copy;
+        new_terminal(&fs_env::instance().get(), &terminal_env::instance().get());
+        return true;
+    }   
+};
+
+const char * const map_fs_command::help_messages[help_message_len] = {
+    "map path_to_fs_binary",
+    "\tOpens a file system by memory mapping a binary file.",
+    "\tChanges are made directly to the file. Use `sync` to flush them."
+};
+
+struct sync_fs_command
+{
+    static constexpr std::size_t help_message_len = 2;
+    static const char* const help_messages[help_message_len];
+
+    static bool exec(const std::vector<std::string_view>& args)
+    {
+        using namespace std::string_view_literals;
+        if (args[0].compare("sync"sv) != 0) return false;
+
+        if (args.size() != 1)
+        {
+            puts("Incorrect number of arguments for sync.");
+            return true;
+        }
+
+        fs_retcode_t ret = sync_filesystem(&fs_env::instance().get());
+        if (ret != SUCCESS) REPORT_RETCODE(ret);
+        return true;
+    }  
+};
+
+const char * const sync_fs_command::help_messages[help_message_len] = {
+    "sync",
+    "\tFlushes a file system opened with `map` to its binary file."
+};
+
+struct journal_command
+{
+    static constexpr std::size_t help_message_len = 3;
+    static const char* const help_messages[help_message_len];
+
+    static bool exec(const std::vector<std::string_view>& args)
+    {
+        using namespace std::string_view_literals;
+        if (args[0].compare("journal"sv) != 0) return false;
+
+        if (args.size() != 2 && args.size() != 3)
+        {
+            puts("Incorrect number of arguments for journal.");
+            return true;
+        }
+
+        size_t group_size = 1;
+        try
+        {
+            if (args.size() == 3) group_size = std::stoul(std::string{ args[2] });
+        }
+        catch (std::invalid_argument&)
+        {
+            puts("Argument is not an unsigned integer type.");
+            return true;
+        }
+
+        std::string journal_name = std::string{ args[1] } + ".journal";
+        FILE *journal = fopen(journal_name.data(), "w+");
+        if (!journal)
+        {
+            printf("Unexpected error occurred when opening file %s\n", journal_name.data());
+            return true;
+        }
+
+        fs_retcode_t ret = attach_journal(&fs_env::instance().get(), journal, group_size);
+        if (ret != SUCCESS)
+        {
+            REPORT_RETCODE(ret);
+            fclose(journal);
+        }
+        return true;
+    }
+};
+
+const char * const journal_command::help_messages[help_message_len] = {
+    "journal path_to_fs_binary [group_size]",
+    "\tCommits every change to path_to_fs_binary.journal, writing group_size transactions at once (1 by default).",
+    "\tpath_to_fs_binary must be the binary file the file system was last loaded from or saved to."
+};
+
+struct checkpoint_command
+{
+    static constexpr std::size_t help_message_len = 2;
+    static const char* const help_messages[help_message_len];
+
+    static bool exec(const std::vector<std::string_view>& args)
+    {
+        using namespace std::string_view_literals;
+        if (args[0].compare("checkpoint"sv) != 0) return false;
+
+        if (args.size() != 2)
+        {
+            puts("Incorrect number of arguments for checkpoint.");
+            return true;
+        }
+
+        std::string file_name{ args[1] };
+        FILE *file = fopen(file_name.data(), "r+");
+        if (!file)
+        {
+            printf("File with name %s does not exist.\n", file_name.data());
+            return true;
+        }
+
+        fs_retcode_t ret = checkpoint_journal(file, &fs_env::instance().get());
+        if (ret != SUCCESS) REPORT_RETCODE(ret);
+        fclose(file);
+        return true;
+    }
+};
+
+const char * const checkpoint_command::help_messages[help_message_len] = {
+    "checkpoint path_to_fs_binary",
+    "\tWrites the changes to the binary file the journal belongs to and empties the journal."
+};
+
+struct autosave_command
+{
+    static constexpr std::size_t help_message_len = 6;
+    static const char* const help_messages[help_message_len];
+
+    static bool exec(const std::vector<std::string_view>& args)
+    {
+        using namespace std::string_view_literals;
+        if (args[0].compare("autosave"sv) != 0) return false;
+
+        if (args.size() < 2 || args.size() > 4)
+        {
+            puts("Incorrect number of arguments for autosave.");
+            return true;
+        }
+
+        filesystem_t& fs = fs_env::instance().get();
+        if (args[1].compare("off"sv) == 0 && args.size() == 2)
+        {
+            fs_retcode_t ret = stop_flusher(&fs);
+            if (ret != SUCCESS) REPORT_RETCODE(ret);
+            return true;
+        }
+
+        size_t interval_ms = 1000, threshold_kb = 1024;
+        try
+        {
+            if (args.size() > 2) interval_ms = std::stoul(std::string{ args[2] });
+            if (args.size() > 3) threshold_kb = std::stoul(std::string{ args[3] });
+        }
+        catch (std::invalid_argument&)
+        {
+            puts("Argument is not an unsigned integer type.");
+            return true;
+        }
+
+        std::string file_name{ args[1] };
+        FILE *file = fopen(file_name.data(), "r+");
+        if (!file)
+        {
+            printf("File with name %s does not exist.\n", file_name.data());
+            return true;
+        }
+
+        fs_retcode_t ret = start_flusher(&fs, file, interval_ms, threshold_kb * 1024);
+        if (ret != SUCCESS)
+        {
+            REPORT_RETCODE(ret);
+            fclose(file);
+            return true;
+        }
+        fs_env::instance().set_autosave(file_name);
+        return true;
+    }
+};
+
+const char * const autosave_command::help_messages[help_message_len] = {
+    "autosave path_to_fs_binary [interval_ms] [threshold_kb]",
+    "\tWrites the changes to path_to_fs_binary in the background, every interval_ms milliseconds (1000 by default)",
+    "\tand once threshold_kb kilobytes changed (1024 by default). 0 turns either off.",
+    "\tpath_to_fs_binary must be the binary file the file system was last loaded from or saved to.",
+    "autosave off",
+    "\tWrites what changed and stops writing in the background."
 };
 
 struct new_fs_command
@@ -313,6 +578,205 @@ const char * const available_command::help_messages[help_message_len] = {
     "\tDisplays the number of available inodes and dblocks in the file system."
 };
 
+struct fsck_command
+{
+    static constexpr std::size_t help_message_len = 3;
+    static const char* const help_messages[help_message_len];
+
+    static bool exec(const std::vector<std::string_view>& args)
+    {
+        using namespace std::string_view_literals;
+        if (args[0].compare("fsck"sv) != 0) return false;
+
+        if (args.size() > 2)
+        {
+            puts("Incorrect number of arguments for fsck.");
+            return true;
+        }
+
+        size_t thread_count = 0;
+        if (args.size() == 2)
+        {
+            try
+            {
+                thread_count = std::stoul(std::string{ args[1] });
+            }
+            catch (std::invalid_argument&)
+            {
+                puts("Argument for the thread count is not valid.");
+                return true;
+            }
+        }
+
+        fs_fsck_report_t report;
+        fs_retcode_t ret = fsck_filesystem(&fs_env::instance().get(), thread_count, &report);
+        if (ret != SUCCESS)
+        {
+            REPORT_RETCODE(ret);
+            return true;
+        }
+
+        printf("checked %lu inodes on %lu threads\n", report.checked_inodes, report.thread_count);
+        printf("\tbroken free inode list: %s\n", report.broken_free_inode_list ? "yes" : "no");
+        printf("\tleaked dblocks: %lu\n", report.dblocks.leaked_dblocks);
+        printf("\tunmarked dblocks: %lu\n", report.dblocks.unmarked_dblocks);
+        printf("\tcross-linked dblocks: %lu\n", report.dblocks.shared_dblocks);
+        printf("\tinvalid references: %lu\n", report.dblocks.invalid_references);
+        printf("\tsize mismatches: %lu\n", report.dblocks.size_mismatches);
+        return true;
+    }
+};
+
+const char * const fsck_command::help_messages[help_message_len] = {
+    "fsck [thread_count]",
+    "\tChecks the dblock bitmask, the free inode list and the file sizes against the inodes.",
+    "\tUses one thread per cpu unless `thread_count` is given."
+};
+
+struct defrag_command
+{
+    static constexpr std::size_t help_message_len = 3;
+    static const char* const help_messages[help_message_len];
+
+    static bool exec(const std::vector<std::string_view>& args)
+    {
+        using namespace std::string_view_literals;
+        if (args[0].compare("defrag"sv) != 0) return false;
+
+        if (args.size() > 2)
+        {
+            puts("Incorrect number of arguments for defrag.");
+            return true;
+        }
+
+        size_t budget = 0;
+        if (args.size() == 2)
+        {
+            try
+            {
+                budget = std::stoul(std::string{ args[1] });
+            }
+            catch (std::invalid_argument&)
+            {
+                puts("Argument for the budget is not valid.");
+                return true;
+            }
+        }
+
+        // the pass goes on across calls, and starts over once it is done
+        static fs_defrag_state_t state{};
+        size_t moved_before = state.done ? 0 : state.moved_dblocks;
+        fs_retcode_t ret = defragment_filesystem(&fs_env::instance().get(), budget, &state);
+        if (ret != SUCCESS)
+        {
+            REPORT_RETCODE(ret);
+            return true;
+        }
+
+        printf("moved %lu dblocks", state.moved_dblocks - moved_before);
+        if (state.done) printf(", pass done after %lu dblocks\n", state.moved_dblocks);
+        else printf(", continuing at inode %lu\n", state.next_inode);
+        return true;
+    }
+};
+
+const char * const defrag_command::help_messages[help_message_len] = {
+    "defrag [budget]",
+    "\tMoves the dblocks of each file into one run, and the runs toward the start of the file system.",
+    "\tStops after moving `budget` dblocks if given, and the next defrag continues from there."
+};
+
+struct compact_command
+{
+    static constexpr std::size_t help_message_len = 2;
+    static const char* const help_messages[help_message_len];
+
+    static bool exec(const std::vector<std::string_view>& args)
+    {
+        using namespace std::string_view_literals;
+        if (args[0].compare("compact"sv) != 0) return false;
+
+        if (args.size() != 1)
+        {
+            puts("Incorrect number of arguments for compact.");
+            return true;
+        }
+
+        filesystem_t& fs = fs_env::instance().get();
+        terminal_context_t& ctx = terminal_env::instance().get();
+        std::vector<inode_index_t> renumbered(fs.inode_count);
+        fs_retcode_t ret = compact_inodes(&fs, renumbered.data());
+        if (ret != SUCCESS)
+        {
+            REPORT_RETCODE(ret);
+            return true;
+        }
+
+        // the working directory moved along with every other inode
+        ctx.working_directory = &fs.inodes[renumbered[ctx.working_directory - fs.inodes]];
+        printf("%lu inodes in use\n", fs.inode_count - available_inodes(&fs));
+        return true;
+    }
+};
+
+const char * const compact_command::help_messages[help_message_len] = {
+    "compact",
+    "\tRenumbers the inodes in use to the start of the inode table and updates the directories to match."
+};
+
+struct find_command
+{
+    static constexpr std::size_t help_message_len = 2;
+    static const char* const help_messages[help_message_len];
+
+    static bool exec(const std::vector<std::string_view>& args)
+    {
+        using namespace std::string_view_literals;
+        if (args[0].compare("find"sv) != 0) return false;
+
+        if (args.size() != 2)
+        {
+            puts("Incorrect number of arguments for find.");
+            return true;
+        }
+
+        filesystem_t& fs = fs_env::instance().get();
+        struct search
+        {
+            std::string name;
+            std::vector<std::vector<inode_index_t>> found; // one list per worker
+        } s{ std::string{ args[1] }, std::vector<std::vector<inode_index_t>>(fs_scan_thread_count(&fs, 0)) };
+
+        auto matches = [](const filesystem_t *, inode_index_t, const inode_t *inode, void *arg)
+        {
+            const std::string& name = static_cast<search *>(arg)->name;
+            return name.size() <= MAX_FILE_NAME_LEN && strncmp(inode->internal.file_name, name.c_str(), MAX_FILE_NAME_LEN) == 0;
+        };
+        auto collect = [](filesystem_t *, inode_index_t index, inode_t *, size_t worker, void *arg)
+        {
+            static_cast<search *>(arg)->found[worker].push_back(index);
+        };
+        fs_retcode_t ret = fs_for_each_inode(&fs, matches, collect, &s, 0);
+        if (ret != SUCCESS)
+        {
+            REPORT_RETCODE(ret);
+            return true;
+        }
+
+        std::vector<inode_index_t> found;
+        for (const auto& worker_found : s.found) found.insert(found.end(), worker_found.begin(), worker_found.end());
+        std::sort(found.begin(), found.end());
+        for (inode_index_t index : found) printf("inode %u\n", index);
+        if (found.empty()) puts("no inode has that name");
+        return true;
+    }
+};
+
+const char * const find_command::help_messages[help_message_len] = {
+    "find name",
+    "\tLists every inode in use with this file name, searching the inode table on one thread per cpu."
+};
+
 struct ls_command
 {
     static constexpr std::size_t help_message_len = 3;
@@ -582,12 +1046,20 @@ struct cat_command
         fs_file_t f = fs_open(&terminal_env::instance().get(), filename.data());
         if (!f) return true;
 
-        size_t file_sz = f->inode->internal.file_size;
-        std::unique_ptr<char[]> buf{ new char[file_sz + 1]{ 0 } };
-        fs_read(f, buf.get(), file_sz);
+        // print straight from the dblocks. like a C string, the output ends at the first zero byte
+        dblock_span_iterator_t spans;
+        inode_span_begin(f->fs, f->inode, 0, f->inode->internal.file_size, &spans);
+        const byte *span;
+        size_t span_len;
+        while (inode_span_next(&spans, &span, &span_len))
+        {
+            const byte *zero = static_cast<const byte *>(memchr(span, 0, span_len));
+            fwrite(span, 1, zero ? zero - span : span_len, stdout);
+            if (zero) break;
+        }
         fs_close(f);
 
-        printf("%s\n", buf.get());
+        puts("");
 
         return true;
     }
@@ -801,9 +1273,18 @@ int main(int argc, char *argv[])
         stdin_interpreter<
             load_fs_command, 
             save_fs_command, 
+            map_fs_command,
+            sync_fs_command,
+            journal_command,
+            checkpoint_command,
+            autosave_command,
             new_fs_command,
             display_fs_command,
             available_command,
+            fsck_command,
+            defrag_command,
+            compact_command,
+            find_command,
             ls_command,
             tree_command,
             new_file_command,
@@ -822,9 +1303,18 @@ int main(int argc, char *argv[])
         source_interpreter<
             load_fs_command, 
             save_fs_command, 
+            map_fs_command,
+            sync_fs_command,
+            journal_command,
+            checkpoint_command,
+            autosave_command,
             new_fs_command,
             display_fs_command,
             available_command,
+            fsck_command,
+            defrag_command,
+            compact_command,
+            find_command,
             ls_command,
             tree_command,
             new_file_command,
@@ -838,5 +1328,7 @@ int main(int argc, char *argv[])
         >{ argv[1] }.start();
     }
 
+    // whatever the flusher and the journal still hold goes to their files
+    free_filesystem(&fs_env::instance().get());
     return 0;
 }
\ No newline at end of file
@@ -1,8 +1,15 @@
 #include "filesys.h"
 #include "utility.h"
+#include "bitmap.h"
+#include "image.h"
+#include "scan.h"
+#include "fsck.h"
 
 #include <string.h>
 #include <stdlib.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <sys/stat.h>
 
 /**
  * !! DO NOT MODIFY THIS FILE !!
@@ -12,6 +19,8 @@
 #define INDIRECT_DBLOCK_INDEX_COUNT (DATA_BLOCK_SIZE / sizeof(dblock_index_t) - 1)
 #define INDIRECT_DBLOCK_MAX_DATA_SIZE ( DATA_BLOCK_SIZE * INDIRECT_DBLOCK_INDEX_COUNT )
 #define NEXT_INDIRECT_INDEX_OFFSET (DATA_BLOCK_SIZE - sizeof(dblock_index_t))
+#define TREE_FANOUT (DATA_BLOCK_SIZE / sizeof(dblock_index_t))
+#define EXTENTS_PER_DBLOCK (INDIRECT_DBLOCK_INDEX_COUNT / 2)
 #define DBLOCK_DISPLAY_LEN 16
 
 const char *fs_retcode_string_table[FS_RETCODE_TOTAL] = {
@@ -51,7 +60,7 @@ static void extract_filename(inode_t *inode, char *buffer)
     buffer[i] = '\0';
 }
 
-static void display_direct_dblock_indices(filesystem_t *fs, inode_t *node)
+static void display_direct_dblock_indices(filesystem_t *fs, FILE *out, inode_t *node)
 {
     size_t file_size = node->internal.file_size;
     size_t dblocks_needed = (file_size + DATA_BLOCK_SIZE - 1) / DATA_BLOCK_SIZE;
@@ -60,21 +69,11 @@ static void display_direct_dblock_indices(filesystem_t *fs, inode_t *node)
 
     for (size_t i = 0; i < direct_dblocks_used; ++i)
     {
-        printf("%u ", node->internal.direct_data[i]);
+        fprintf(out, "%u ", node->internal.direct_data[i]);
     }
 }
 
-static void set_inode_mask(filesystem_t *fs, byte *mask)
-{
-    inode_index_t iter = fs->available_inode;
-    while (iter != 0)
-    {
-        mask[iter / 8] |= 1 << (iter % 8);
-        iter = fs->inodes[iter].next_free_inode;
-    }
-}
-
-static void display_indirect_dblock_indices(filesystem_t *fs, inode_t *node)
+static void display_indirect_dblock_indices(filesystem_t *fs, FILE *out, inode_t *node)
 {
     size_t file_size = node->internal.file_size;
     size_t dblocks_needed = (file_size + DATA_BLOCK_SIZE - 1) / DATA_BLOCK_SIZE;
@@ -97,12 +96,12 @@ static void display_indirect_dblock_indices(filesystem_t *fs, inode_t *node)
         // indirect_idx_offset * sizeof(dblock_index_t) is the number of bytes into the data block that the indirect_dblock_index index begins.
         // so, the line below returns the dblock index at index indirect_idx_offset in the index_blk_idx index block.
         dblock_index_t indirect_dblock_index = *cast_dblock_ptr(&fs->dblocks[ index_blk_idx * DATA_BLOCK_SIZE + indirect_idx_offset * sizeof(dblock_index_t) ]);
-        printf("%u ", indirect_dblock_index);
+        fprintf(out, "%u ", indirect_dblock_index);
         ++i;
     };  
 }
 
-static void display_indirect_index_indices(filesystem_t *fs, inode_t *node)
+static void display_indirect_index_indices(filesystem_t *fs, FILE *out, inode_t *node)
 {
     size_t file_size = node->internal.file_size;
     size_t dblocks_needed = (file_size + DATA_BLOCK_SIZE - 1) / DATA_BLOCK_SIZE;
@@ -121,13 +120,80 @@ static void display_indirect_index_indices(filesystem_t *fs, inode_t *node)
         {
             index_blk_idx = *cast_dblock_ptr(&fs->dblocks[ index_blk_idx * DATA_BLOCK_SIZE + NEXT_INDIRECT_INDEX_OFFSET ]);
         }
-        printf("%u ", index_blk_idx);
+        fprintf(out, "%u ", index_blk_idx);
         i += INDIRECT_DBLOCK_INDEX_COUNT;
     };  
 }
 
+// prints the dblocks of the first `count` data dblocks below a tree node, or the index dblocks leading to them
+static void display_tree_indices(filesystem_t *fs, FILE *out, dblock_index_t node, size_t height, size_t count, bool index_dblocks)
+{
+    if (index_dblocks) fprintf(out, "%u ", node);
+
+    size_t span = calculate_tree_capacity(height - 1);
+    dblock_index_t *slots = cast_dblock_ptr(&fs->dblocks[ node * DATA_BLOCK_SIZE ]);
+    for (size_t slot = 0; slot < TREE_FANOUT && slot * span < count; ++slot)
+    {
+        size_t below = count - slot * span < span ? count - slot * span : span;
+        if (height > 1) display_tree_indices(fs, out, slots[slot], height - 1, below, index_dblocks);
+        else if (!index_dblocks) fprintf(out, "%u ", slots[slot]);
+    }
+}
+
+static void display_tree_dblock_indices(filesystem_t *fs, FILE *out, inode_t *node, bool index_dblocks)
+{
+    size_t dblocks_needed = (node->internal.file_size + DATA_BLOCK_SIZE - 1) / DATA_BLOCK_SIZE;
+    display_tree_indices(fs, out, node->internal.indirect_dblock, node->internal.indirect_height, 
+        dblocks_needed - INODE_DIRECT_BLOCK_COUNT, index_dblocks);
+}
+
+// prints the data dblocks past the direct ones of an extent inode, or its extent dblocks
+static void display_extent_dblock_indices(filesystem_t *fs, FILE *out, inode_t *node, bool extent_dblocks)
+{
+    size_t remaining = (node->internal.file_size + DATA_BLOCK_SIZE - 1) / DATA_BLOCK_SIZE - INODE_DIRECT_BLOCK_COUNT;
+    for (dblock_index_t extent_dblock = node->internal.indirect_dblock; extent_dblock != 0 && remaining > 0; )
+    {
+        if (extent_dblocks) fprintf(out, "%u ", extent_dblock);
+
+        dblock_index_t *slots = cast_dblock_ptr(&fs->dblocks[ extent_dblock * DATA_BLOCK_SIZE ]);
+        for (size_t e = 0; e < EXTENTS_PER_DBLOCK && remaining > 0 && slots[2 * e + 1] != 0; ++e)
+        {
+            size_t length = slots[2 * e + 1] < remaining ? slots[2 * e + 1] : remaining;
+            for (size_t i = 0; i < length && !extent_dblocks; ++i) fprintf(out, "%zu ", slots[2 * e] + i);
+            remaining -= length;
+        }
+        extent_dblock = slots[INDIRECT_DBLOCK_INDEX_COUNT];
+    }
+}
+
 // -------------------------------- CORE FUNCTIONS -------------------------------- //
 
+// calculates the number of data dblocks a tree of index dblocks with `height` levels can reach
+size_t calculate_tree_capacity(size_t height)
+{
+    size_t capacity = 1;
+    while (height-- > 0) capacity *= TREE_FANOUT;
+    return capacity;
+}
+
+// calculates the number of index dblocks used for a file size if they form a tree.
+// the tree is never taller than it needs to be, and every level holds only the nodes its data needs
+size_t calculate_tree_index_dblock_amount(size_t file_size)
+{
+    if (file_size <= DATA_BLOCK_SIZE * INODE_DIRECT_BLOCK_COUNT) return 0;
+    size_t data_dblocks = (file_size + DATA_BLOCK_SIZE - 1) / DATA_BLOCK_SIZE - INODE_DIRECT_BLOCK_COUNT;
+
+    // each level needs one node per TREE_FANOUT nodes (or data dblocks) of the level below
+    size_t index_dblocks = 0;
+    size_t nodes = data_dblocks;
+    do
+    {
+        nodes = (nodes + TREE_FANOUT - 1) / TREE_FANOUT;
+        index_dblocks += nodes;
+    } while (nodes > 1);
+    return index_dblocks;
+}
+
 // calculates the number of index dblocks used for a file size
 size_t calculate_index_dblock_amount(size_t file_size)
 {
@@ -153,55 +219,278 @@ dblock_index_t *cast_dblock_ptr(void *addr)
     return ptr;
 }
 
-fs_retcode_t save_filesystem(FILE* file, filesystem_t *fs)
+// the image has to be one consistent state, so every writer is kept out
+fs_retcode_t save_filesystem_incremental(FILE *file, filesystem_t *fs)
+{
+    if (!fs || !file) return INVALID_INPUT;
+    fs_lock_filesystem(fs, true);
+    fs_retcode_t result = write_dirty_image(file, fs);
+    fs_unlock_filesystem(fs);
+    return result;
+}
+
+static fs_retcode_t write_image(FILE* file, filesystem_t *fs)
 {
     if (!fs || !file) return INVALID_INPUT;
 
-    fwrite(&fs->inode_count, sizeof(fs->inode_count), 1, file); // write the inode count
-    fwrite(&fs->available_inode, sizeof(fs->available_inode), 1, file); // write the next available inode
-    fwrite(&fs->dblock_count, sizeof(fs->dblock_count), 1, file); // write the dblock count
+    // a short write leaves the image incomplete, so the dirty maps are kept for the next save
+    byte header[IMAGE_HEADER_SIZE];
+    encode_image_header(fs, header);
+    if (fwrite(header, sizeof(byte), IMAGE_HEADER_SIZE, file) != IMAGE_HEADER_SIZE) return SYSTEM_ERROR; // write the counts, and the block size if it is not the default
 
-    fwrite(fs->inodes, sizeof(inode_t), fs->inode_count, file); // write the inodes to file
+    if (fwrite(fs->inodes, sizeof(inode_t), fs->inode_count, file) != fs->inode_count) return SYSTEM_ERROR; // write the inodes to file
     
     size_t block_bitmask_size = DBLOCK_MASK_SIZE(fs->dblock_count);
-    fwrite(fs->dblock_bitmask, sizeof(byte), block_bitmask_size, file); // write the dblock bit masks
+    if (fwrite(fs->dblock_bitmask, sizeof(byte), block_bitmask_size, file) != block_bitmask_size) return SYSTEM_ERROR; // write the dblock bit masks
+
+    if (fwrite(fs->dblocks, DATA_BLOCK_SIZE, fs->dblock_count, file) != fs->dblock_count) return SYSTEM_ERROR; // write the data blocks
 
-    fwrite(fs->dblocks, DATA_BLOCK_SIZE, fs->dblock_count, file); // write the data blocks
+    if (!fs->flusher) clear_dirty_state(fs);
 
     return SUCCESS;
 }
 
-fs_retcode_t load_filesystem(FILE* file, filesystem_t *fs)
+// the image has to be one consistent state, so every writer is kept out
+fs_retcode_t save_filesystem(FILE* file, filesystem_t *fs)
 {
     if (!fs || !file) return INVALID_INPUT;
-    // read the inode count 
-    if (fread(&fs->inode_count, sizeof(fs->inode_count), 1, file) != 1) return INVALID_BINARY_FORMAT;
-    // read the next available inode
-    if (fread(&fs->available_inode, sizeof(fs->available_inode), 1, file) != 1) return INVALID_BINARY_FORMAT; 
-    // read the dblock count
-    if (fread(&fs->dblock_count, sizeof(fs->dblock_count), 1, file) != 1) return INVALID_BINARY_FORMAT; 
+    fs_lock_filesystem(fs, true);
+    fs_retcode_t result = write_image(file, fs);
+    fs_unlock_filesystem(fs);
+    return result;
+}
 
-    fs->inodes = malloc(fs->inode_count * sizeof(inode_t));
-    // read the inodes
-    if (fread(fs->inodes, sizeof(inode_t), fs->inode_count, file) != fs->inode_count) return INVALID_BINARY_FORMAT; 
+// the loader reads the image this many bytes at a time, so the consistency check can follow the dblocks as they arrive
+#define LOAD_CHUNK_SIZE ((size_t) 1 << 20)
+
+// reads `len` bytes into `dest`, publishing the number of complete dblocks read if `progress` is given
+static bool read_in_chunks(FILE *file, byte *dest, size_t len, load_progress_t *progress)
+{
+    for (size_t done = 0; done < len;)
+    {
+        size_t chunk = len - done < LOAD_CHUNK_SIZE ? len - done : LOAD_CHUNK_SIZE;
+        if (fread(dest + done, 1, chunk, file) != chunk) return false;
+        done += chunk;
+
+        if (progress)
+        {
+            pthread_mutex_lock(&progress->lock);
+            progress->loaded_dblocks = done / DATA_BLOCK_SIZE;
+            pthread_cond_broadcast(&progress->advanced);
+            pthread_mutex_unlock(&progress->lock);
+        }
+    }
+    return true;
+}
+
+// frees whatever a failed load allocated
+static void discard_partial_load(filesystem_t *fs)
+{
+    free(fs->inodes);
+    free(fs->dblock_bitmask);
+    free(fs->dblocks);
+    fs->inodes = NULL;
+    fs->dblock_bitmask = NULL;
+    fs->dblocks = NULL;
+}
+
+// checks the header counts against the bytes left in the file before anything is allocated
+static bool image_fits_file(FILE *file, size_t inode_count, size_t dblock_count)
+{
+    if (inode_count > SIZE_MAX / 2 / sizeof(inode_t) || dblock_count > SIZE_MAX / 2 / DATA_BLOCK_SIZE) return false;
+
+    // a pipe or a terminal has no size to check against. truncation is caught while reading
+    struct stat image_stat;
+    long position = ftell(file);
+    if (fstat(fileno(file), &image_stat) == -1 || !S_ISREG(image_stat.st_mode) || position < 0) return true;
+
+    size_t remaining = (size_t) image_stat.st_size > (size_t) position ? (size_t) image_stat.st_size - position : 0;
+    return IMAGE_SIZE(inode_count, dblock_count) - IMAGE_HEADER_SIZE <= remaining;
+}
+
+static fs_retcode_t load_image(FILE *file, filesystem_t *fs, fs_load_report_t *report)
+{
+    if (!fs || !file) return INVALID_INPUT;
+    // read the inode count, the next available inode and the dblock count
+    byte header[IMAGE_HEADER_SIZE];
+    if (fread(header, sizeof(byte), IMAGE_HEADER_SIZE, file) != IMAGE_HEADER_SIZE) return INVALID_BINARY_FORMAT;
+    if (!decode_image_header(header, &fs->inode_count, &fs->available_inode, &fs->dblock_count)) return INVALID_BINARY_FORMAT;
+
+    if (!image_fits_file(file, fs->inode_count, fs->dblock_count)) return INVALID_BINARY_FORMAT;
 
     size_t block_bitmask_size = DBLOCK_MASK_SIZE(fs->dblock_count);
+    fs->inodes = malloc(fs->inode_count * sizeof(inode_t));
     fs->dblock_bitmask = malloc(block_bitmask_size * sizeof(byte));
-    // read the data blocks
-    if (fread(fs->dblock_bitmask, sizeof(byte), block_bitmask_size, file) != block_bitmask_size) return INVALID_BINARY_FORMAT; 
-
     fs->dblocks = malloc(fs->dblock_count * DATA_BLOCK_SIZE);
+    byte *free_inodes = calloc(DBLOCK_MASK_SIZE(fs->inode_count) + 1, sizeof(byte));
+    if ((!fs->inodes && fs->inode_count) || (!fs->dblock_bitmask && block_bitmask_size) || 
+        (!fs->dblocks && fs->dblock_count) || !free_inodes)
+    {
+        free(free_inodes);
+        discard_partial_load(fs);
+        return SYSTEM_ERROR;
+    }
+
+    // read the inodes and the dblock bitmask, then make sure the free inode list is sound
+    if (!read_in_chunks(file, (byte *) fs->inodes, fs->inode_count * sizeof(inode_t), NULL) ||
+        !read_in_chunks(file, fs->dblock_bitmask, block_bitmask_size, NULL) ||
+        !collect_free_inodes(fs, free_inodes))
+    {
+        free(free_inodes);
+        discard_partial_load(fs);
+        return INVALID_BINARY_FORMAT;
+    }
+
+    // the check follows the index dblocks while the loader is still reading later ones
+    consistency_check_t check = { .fs = fs, .free_inodes = free_inodes };
+    load_progress_t progress = { .lock = PTHREAD_MUTEX_INITIALIZER, .advanced = PTHREAD_COND_INITIALIZER };
+    pthread_t checker;
+    bool checker_running = false;
+    if (report)
+    {
+        check.referenced = calloc(block_bitmask_size + 1, sizeof(byte));
+        if (!check.referenced)
+        {
+            free(free_inodes);
+            discard_partial_load(fs);
+            return SYSTEM_ERROR;
+        }
+        check.progress = &progress;
+        checker_running = pthread_create(&checker, NULL, run_consistency_check, &check) == 0;
+        if (!checker_running) check.progress = NULL;
+    }
+
     // read the data blocks
-    if (fread(fs->dblocks, DATA_BLOCK_SIZE, fs->dblock_count, file) != fs->dblock_count) return INVALID_BINARY_FORMAT; 
+    bool loaded = read_in_chunks(file, fs->dblocks, fs->dblock_count * DATA_BLOCK_SIZE, checker_running ? &progress : NULL);
+    if (checker_running)
+    {
+        if (!loaded)
+        {
+            pthread_mutex_lock(&progress.lock);
+            progress.failed = true;
+            pthread_cond_broadcast(&progress.advanced);
+            pthread_mutex_unlock(&progress.lock);
+        }
+        pthread_join(checker, NULL);
+    }
+    else if (report && loaded)
+    {
+        // no thread to spare, check once everything is in memory
+        run_consistency_check(&check);
+    }
+
+    if (loaded && report)
+    {
+        compare_referenced_dblocks(&check);
+        *report = check.report;
+    }
+    free(check.referenced);
+    free(free_inodes);
+    if (!loaded)
+    {
+        discard_partial_load(fs);
+        return INVALID_BINARY_FORMAT;
+    }
+
+    fs->map_generation = 0;
+    fs->relocation_generation = 0;
+    fs->dblock_hint = 0;
+    fs->indirect_layout = INDIRECT_CHAIN;
+    fs->inline_data_limit = 0;
+    fs->sorted_free_inodes = false;
+    fs->dentry_cache = NULL;
+    fs->locks = NULL;
+    fs->journal = NULL;
+    fs->flusher = NULL;
+    fs->image_map = NULL;
+    fs->image_map_size = 0;
+    refresh_available_counts(fs);
+    if (init_dirty_state(fs, false) != SUCCESS)
+    {
+        discard_partial_load(fs);
+        return SYSTEM_ERROR;
+    }
 
     return SUCCESS;
 }
 
+fs_retcode_t load_filesystem(FILE* file, filesystem_t *fs)
+{
+    return load_image(file, fs, NULL);
+}
+
+fs_retcode_t load_filesystem_checked(FILE *file, filesystem_t *fs, fs_load_report_t *report)
+{
+    if (!report) return INVALID_INPUT;
+    *report = (fs_load_report_t) { 0 };
+    return load_image(file, fs, report);
+}
+
 static const char *filetype_str_table[] = {
     STR(DATA_FILE),
     STR(DIRECTORY)
 };
 
+// formats an inode in use the way the inode list shows it, into the text of its index
+static void format_inode(filesystem_t *fs, inode_index_t index, inode_t *inode, size_t worker, void *arg)
+{
+    char **texts = arg;
+    size_t length;
+    FILE *out = open_memstream(&texts[index], &length);
+    if (!out) return;
+
+    char filename[MAX_FILE_NAME_LEN + 1] = { 0 };
+    extract_filename(inode, filename);
+
+    if (inode->internal.file_perms)
+    {
+        const char *rd_perm_str = inode->internal.file_perms & FS_READ ? "READ " : "";
+        const char *wr_perm_str = inode->internal.file_perms & FS_WRITE ? "WRITE " : "";
+        const char *x_perm_str = inode->internal.file_perms & FS_EXECUTE ? "EXECUTE " : "";
+        fprintf(out, "\tinode index %u [.type = %s .perm = %s%s%s .name = \"%s\" .size = %lu]\n", 
+            index, filetype_str_table[inode->internal.file_type],
+            rd_perm_str, wr_perm_str, x_perm_str, filename, inode->internal.file_size
+        );
+    }
+    else
+    {
+        fprintf(out, "\tinode index %u [.type = %s .name = \"%s\" .size = %lu]\n", 
+            index, filetype_str_table[inode->internal.file_type],
+            filename, inode->internal.file_size
+        );
+    }
+
+    size_t file_size = inode->internal.file_size;
+
+    if (inode->internal.indirect_layout == INDIRECT_INLINE)
+    {
+        fputs("\t\tInline Data\n", out);
+    }
+    else if (file_size > 0)
+    {
+        fprintf(out, "\t\tDirect Data Blocks: ");
+        display_direct_dblock_indices(fs, out, inode);
+        fputc('\n', out);
+        
+        if (file_size > DATA_BLOCK_SIZE * INODE_DIRECT_BLOCK_COUNT)
+        {
+            indirect_layout_t layout = inode->internal.indirect_layout;
+            fprintf(out, "\t\tIndirect Data Blocks: ");
+            if (layout == INDIRECT_TREE) display_tree_dblock_indices(fs, out, inode, false);
+            else if (layout == INDIRECT_EXTENTS) display_extent_dblock_indices(fs, out, inode, false);
+            else display_indirect_dblock_indices(fs, out, inode);
+            fputc('\n', out);
+
+            fprintf(out, "\t\tIndirect Index Blocks: ");
+            if (layout == INDIRECT_TREE) display_tree_dblock_indices(fs, out, inode, true);
+            else if (layout == INDIRECT_EXTENTS) display_extent_dblock_indices(fs, out, inode, true);
+            else display_indirect_index_indices(fs, out, inode);
+            fputc('\n', out);
+        }
+    }
+    fclose(out);
+}
+
 void display_filesystem(filesystem_t *fs, fs_display_flag_t flag)
 {
     if (!fs)
@@ -219,78 +508,34 @@ void display_filesystem(filesystem_t *fs, fs_display_flag_t flag)
 
     if (flag & DISPLAY_INODES)
     {
-        byte *inode_mask = calloc((fs->inode_count + 7) / 8, sizeof(byte));
-        set_inode_mask(fs, inode_mask);
+        // the inodes are formatted in parallel, and printed in index order once every worker is done
+        char **texts = calloc(fs->inode_count, sizeof(char *));
+        if (texts) fs_for_each_inode(fs, NULL, format_inode, texts, 0);
+
         puts("I-Node List:");
-        for (size_t i = 0; i < fs->inode_count; ++i)
+        for (size_t i = 0; texts && i < fs->inode_count; ++i)
         {
-            if (!(inode_mask[i / 8] & (1 << (i % 8))))
-            {
-                inode_t *inode = &fs->inodes[i];
-                char filename[MAX_FILE_NAME_LEN + 1] = { 0 };
-                extract_filename(inode, filename);
-
-                if (inode->internal.file_perms)
-                {
-                    const char *rd_perm_str = inode->internal.file_perms & FS_READ ? "READ " : "";
-                    const char *wr_perm_str = inode->internal.file_perms & FS_WRITE ? "WRITE " : "";
-                    const char *x_perm_str = inode->internal.file_perms & FS_EXECUTE ? "EXECUTE " : "";
-                    printf("\tinode index %lu [.type = %s .perm = %s%s%s .name = \"%s\" .size = %lu]\n", 
-                        i, filetype_str_table[inode->internal.file_type],
-                        rd_perm_str, wr_perm_str, x_perm_str, filename, inode->internal.file_size
-                    );
-                }
-                else
-                {
-                    printf("\tinode index %lu [.type = %s .name = \"%s\" .size = %lu]\n", 
-                        i, filetype_str_table[inode->internal.file_type],
-                        filename, inode->internal.file_size
-                    );
-                }
-                
-
-                size_t file_size = inode->internal.file_size;
-
-                if (file_size > 0)
-                {
-                    printf("\t\tDirect Data Blocks: ");
-                    display_direct_dblock_indices(fs, inode);
-                    puts("");
-                    
-                    if (file_size > DATA_BLOCK_SIZE * INODE_DIRECT_BLOCK_COUNT)
-                    {
-                        printf("\t\tIndirect Data Blocks: ");
-                        display_indirect_dblock_indices(fs, inode);
-                        puts("");
-
-                        printf("\t\tIndirect Index Blocks: ");
-                        display_indirect_index_indices(fs, inode);
-                        puts("");
-                    }
-                }
-            }
+            if (texts[i]) fputs(texts[i], stdout);
+            free(texts[i]);
         }
-        
-        free(inode_mask);
+        free(texts);
     }
 
     if (flag & DISPLAY_DBLOCKS)
     {
         puts("Data Block List:");
-        for (size_t idx = 0; idx < fs->dblock_count; ++idx)
+        // a clear bit marks a dblock in use
+        size_t idx = 0;
+        while (bitmap_find_first_clear(fs->dblock_bitmask, fs->dblock_count, idx, &idx))
         {
-            size_t block_idx = idx / 8;
-            size_t bit_idx = idx % 8;
-            if (!(fs->dblock_bitmask[block_idx] & (1 << (7 - bit_idx))))
+            printf("\tdblock index %ld", idx);
+            for (size_t k = 0; k < DATA_BLOCK_SIZE; ++k)
             {
-                printf("\tdblock index %ld", idx);
-                for (size_t k = 0; k < DATA_BLOCK_SIZE; ++k)
-                {
-                    if (k % DBLOCK_DISPLAY_LEN == 0) printf("\n\t\t");
-                    printf("%02x ", fs->dblocks[idx * DATA_BLOCK_SIZE + k]);
-                }
-                printf("\n");
+                if (k % DBLOCK_DISPLAY_LEN == 0) printf("\n\t\t");
+                printf("%02x ", fs->dblocks[idx * DATA_BLOCK_SIZE + k]);
             }
+            printf("\n");
+            ++idx;
         }
     }
 }
\ No newline at end of file
@@ -6,6 +6,9 @@
 #include <sys/stat.h>
 #include <sys/mman.h>
 
+#include <cstring>
+#include <vector>
+
 #include <gtest/gtest.h>
 
 extern "C"
@@ -20,6 +23,43 @@ extern "C"
 
 #define PATH(path) std::string{ path }.data()
 
+// the bundled images and expected outputs use 64 byte dblocks, so tests reading them only run in the default build
+#define SKIP_WITHOUT_BUNDLED_IMAGES() \
+    if (DATA_BLOCK_SIZE != DEFAULT_DATA_BLOCK_SIZE) GTEST_SKIP() << "the bundled images need the default block size"
+
+// a directory entry: the inode index followed by the name
+constexpr size_t entry_size = sizeof(inode_index_t) + MAX_FILE_NAME_LEN;
+
+// claims an inode and clears it, for a test that builds a file by hand
+inline inode_t *new_test_inode(filesystem_t& fs, file_type_t type = DATA_FILE, const char *name = nullptr)
+{
+    inode_index_t idx = 0;
+    EXPECT_EQ(claim_available_inode(&fs, &idx), SUCCESS);
+    inode_t *inode = &fs.inodes[idx];
+    inode->internal = {};
+    inode->internal.file_type = type;
+    if (name) strncpy(inode->internal.file_name, name, MAX_FILE_NAME_LEN);
+    return inode;
+}
+
+// `n` bytes of test data. no two dblocks of it are the same, and different seeds give different data
+inline std::vector<char> test_pattern(size_t n, size_t seed = 0)
+{
+    std::vector<char> data(n);
+    for (size_t i = 0; i < n; ++i) data[i] = (char) (i * 13 + seed + i / DATA_BLOCK_SIZE);
+    return data;
+}
+
+// the file holds exactly `expected`
+inline void expect_contents(filesystem_t& fs, inode_t *file, const std::vector<char>& expected)
+{
+    std::vector<char> read(expected.size() + 1);
+    size_t bytes_read;
+    ASSERT_EQ(inode_read_data(&fs, file, 0, read.data(), read.size(), &bytes_read), SUCCESS);
+    ASSERT_EQ(bytes_read, expected.size());
+    ASSERT_EQ(memcmp(read.data(), expected.data(), expected.size()), 0);
+}
+
 void compare_fs_files(char *output_buf, size_t output_size, char *expected_buf, size_t expected_size);
 
 template<typename Test>
@@ -88,6 +128,19 @@ protected:
         fclose(fs_file);
     }
 
+    // copies an image into the output file so it can be opened and modified in place
+    void copy_image(const char *fs_name)
+    {
+        FILE *input = fopen(fs_name, "r");
+        ASSERT_NE(input, nullptr) << "File for input is not found.";
+
+        char buffer[4096];
+        size_t len;
+        while ((len = fread(buffer, 1, sizeof(buffer), input)) > 0) fwrite(buffer, 1, len, output_file);
+        fflush(output_file);
+        fclose(input);
+    }
+
     void compare_expected(const char *expected_filename)
     {
         fflush(output_file);
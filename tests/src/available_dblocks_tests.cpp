@@ -61,4 +61,31 @@ TEST_F(AvailableDBlocksSuite, Test4)
 
     ASSERT_EQ(expected_val, output_val);
     free_filesystem(&fs);
-}
\ No newline at end of file
+}
+
+TEST_F(AvailableDBlocksSuite, TracksClaimAndRelease)
+{
+    SKIP_WITHOUT_BUNDLED_IMAGES();
+
+    filesystem_t fs;
+    load_fs(INPUT "empty_random_inode_fragmented.bin", fs);
+
+    size_t initial_val = available_dblocks(&fs);
+
+    dblock_index_t idx0, idx1;
+    ASSERT_EQ(claim_available_dblock(&fs, &idx0), SUCCESS);
+    ASSERT_EQ(claim_available_dblock(&fs, &idx1), SUCCESS);
+    ASSERT_EQ(available_dblocks(&fs), initial_val - 2);
+
+    ASSERT_EQ(release_dblock(&fs, fs.dblocks + idx0 * DATA_BLOCK_SIZE), SUCCESS);
+    ASSERT_EQ(available_dblocks(&fs), initial_val - 1);
+
+    // releasing an available dblock again does not change the count
+    ASSERT_EQ(release_dblock(&fs, fs.dblocks + idx0 * DATA_BLOCK_SIZE), SUCCESS);
+    ASSERT_EQ(available_dblocks(&fs), initial_val - 1);
+
+    // the running count agrees with a full recount
+    refresh_available_counts(&fs);
+    ASSERT_EQ(available_dblocks(&fs), initial_val - 1);
+    free_filesystem(&fs);
+}
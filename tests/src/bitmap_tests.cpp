@@ -0,0 +1,112 @@
+#include "test_util.hpp"
+
+#include <random>
+#include <vector>
+
+extern "C"
+{
+    #include "bitmap.h"
+}
+
+using BitmapSuite = fs_internal_test;
+
+static bool reference_test(const std::vector<byte>& bitmap, size_t n)
+{
+    return bitmap[n / 8] & (1 << (7 - n % 8));
+}
+
+static std::vector<byte> random_bitmap(std::mt19937& rng, size_t nbits, unsigned density)
+{
+    std::vector<byte> bitmap((nbits + 7) / 8 + 1, 0);
+    for (size_t i = 0; i < bitmap.size(); ++i)
+    {
+        byte value = 0;
+        for (int bit = 0; bit < 8; ++bit) value = (value << 1) | (rng() % 100 < density);
+        bitmap[i] = value;
+    }
+    return bitmap;
+}
+
+// every kernel the cpu supports must agree with a bit by bit scan
+TEST_F(BitmapSuite, KernelsMatchReference)
+{
+    std::mt19937 rng{ 1234 };
+    bitmap_kernel_t original = bitmap_current_kernel();
+
+    for (int kernel = 0; kernel < BITMAP_KERNEL_TOTAL; ++kernel)
+    {
+        if (!bitmap_select_kernel((bitmap_kernel_t) kernel)) continue;
+
+        for (size_t nbits : { 1, 7, 8, 63, 64, 65, 255, 256, 257, 1000, 4099 })
+        {
+            for (unsigned density : { 0, 2, 50, 98, 100 })
+            {
+                auto bitmap = random_bitmap(rng, nbits, density);
+
+                size_t expected_count = 0;
+                for (size_t i = 0; i < nbits; ++i) expected_count += reference_test(bitmap, i);
+                ASSERT_EQ(bitmap_popcount(bitmap.data(), nbits), expected_count)
+                    << "kernel " << kernel << " nbits " << nbits << " density " << density;
+
+                for (size_t start : { (size_t) 0, (size_t) 3, nbits / 2, nbits - 1, nbits })
+                {
+                    size_t expected_set = nbits, expected_clear = nbits;
+                    for (size_t i = start; i < nbits && expected_set == nbits; ++i) if (reference_test(bitmap, i)) expected_set = i;
+                    for (size_t i = start; i < nbits && expected_clear == nbits; ++i) if (!reference_test(bitmap, i)) expected_clear = i;
+
+                    size_t idx = nbits;
+                    ASSERT_EQ(bitmap_find_first_set(bitmap.data(), nbits, start, &idx), expected_set != nbits);
+                    if (expected_set != nbits)
+                    {
+                        ASSERT_EQ(idx, expected_set) << "kernel " << kernel << " nbits " << nbits << " start " << start;
+                    }
+
+                    idx = nbits;
+                    ASSERT_EQ(bitmap_find_first_clear(bitmap.data(), nbits, start, &idx), expected_clear != nbits);
+                    if (expected_clear != nbits)
+                    {
+                        ASSERT_EQ(idx, expected_clear) << "kernel " << kernel << " nbits " << nbits << " start " << start;
+                    }
+
+                    for (size_t len : { 1, 3, 9, 70 })
+                    {
+                        size_t expected_run = nbits;
+                        for (size_t i = start; i + len <= nbits && expected_run == nbits; ++i)
+                        {
+                            size_t k = 0;
+                            while (k < len && reference_test(bitmap, i + k)) ++k;
+                            if (k == len) expected_run = i;
+                        }
+                        idx = nbits;
+                        ASSERT_EQ(bitmap_find_set_run(bitmap.data(), nbits, start, len, &idx), expected_run != nbits);
+                        if (expected_run != nbits)
+                        {
+                            ASSERT_EQ(idx, expected_run) << "kernel " << kernel << " run length " << len;
+                        }
+                    }
+                }
+            }
+        }
+    }
+
+    bitmap_select_kernel(original);
+}
+
+TEST_F(BitmapSuite, SetAndClearRange)
+{
+    for (size_t first : { 0, 3, 8, 13 })
+    {
+        for (size_t len : { 0, 1, 5, 8, 30, 64 })
+        {
+            std::vector<byte> bitmap(16, 0x00);
+            bitmap_set_range(bitmap.data(), first, len);
+            for (size_t i = 0; i < bitmap.size() * 8; ++i)
+                ASSERT_EQ(reference_test(bitmap, i), i >= first && i < first + len) << "first " << first << " len " << len << " bit " << i;
+
+            std::vector<byte> cleared(16, 0xFF);
+            bitmap_clear_range(cleared.data(), first, len);
+            for (size_t i = 0; i < cleared.size() * 8; ++i)
+                ASSERT_EQ(reference_test(cleared, i), !(i >= first && i < first + len)) << "first " << first << " len " << len << " bit " << i;
+        }
+    }
+}
@@ -0,0 +1,60 @@
+#include "test_util.hpp"
+
+#include <vector>
+
+using BlockSizeSuite = fs_internal_test;
+
+// these tests do not depend on bundled images, so they also pass with -DFS_DATA_BLOCK_SIZE=<n>
+constexpr size_t index_slots = DATA_BLOCK_SIZE / sizeof(dblock_index_t) - 1;
+
+// a file running past the end of the second index dblock
+constexpr size_t data_dblocks = INODE_DIRECT_BLOCK_COUNT + index_slots + 3;
+constexpr size_t file_size = data_dblocks * DATA_BLOCK_SIZE - DATA_BLOCK_SIZE / 2;
+
+TEST_F(BlockSizeSuite, WriteReadAcrossIndexDBlocks)
+{
+    filesystem_t fs;
+    ASSERT_EQ(new_filesystem(&fs, 4, data_dblocks + 4), SUCCESS);
+    inode_t *file = new_test_inode(fs);
+    size_t free_before = available_dblocks(&fs);
+
+    std::vector<char> data = test_pattern(file_size);
+    ASSERT_EQ(inode_write_data(&fs, file, data.data(), data.size()), SUCCESS);
+    ASSERT_EQ(available_dblocks(&fs), free_before - data_dblocks - 2);
+
+    std::vector<char> read(file_size);
+    size_t bytes_read;
+    ASSERT_EQ(inode_read_data(&fs, file, 0, read.data(), read.size(), &bytes_read), SUCCESS);
+    ASSERT_EQ(bytes_read, file_size);
+    ASSERT_EQ(memcmp(read.data(), data.data(), file_size), 0);
+
+    // dropping the second index dblock gives back its data dblocks too
+    ASSERT_EQ(inode_shrink_data(&fs, file, (INODE_DIRECT_BLOCK_COUNT + 1) * DATA_BLOCK_SIZE), SUCCESS);
+    ASSERT_EQ(available_dblocks(&fs), free_before - (INODE_DIRECT_BLOCK_COUNT + 1) - 1);
+
+    free_filesystem(&fs);
+}
+
+// the block size is part of the image, so an image reloads into the same geometry
+TEST_F(BlockSizeSuite, SaveLoadRoundTrip)
+{
+    filesystem_t fs, loaded;
+    ASSERT_EQ(new_filesystem(&fs, 4, data_dblocks + 4), SUCCESS);
+    inode_t *file = new_test_inode(fs);
+    std::vector<char> data = test_pattern(file_size);
+    ASSERT_EQ(inode_write_data(&fs, file, data.data(), data.size()), SUCCESS);
+    ASSERT_EQ(save_filesystem(output_file, &fs), SUCCESS);
+
+    rewind(output_file);
+    ASSERT_EQ(load_filesystem(output_file, &loaded), SUCCESS);
+    ASSERT_EQ(loaded.dblock_count, fs.dblock_count);
+    ASSERT_EQ(available_dblocks(&loaded), available_dblocks(&fs));
+
+    std::vector<char> read(file_size);
+    size_t bytes_read;
+    ASSERT_EQ(inode_read_data(&loaded, &loaded.inodes[file - fs.inodes], 0, read.data(), read.size(), &bytes_read), SUCCESS);
+    ASSERT_EQ(memcmp(read.data(), data.data(), file_size), 0);
+
+    free_filesystem(&loaded);
+    free_filesystem(&fs);
+}
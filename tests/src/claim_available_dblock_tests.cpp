@@ -106,4 +106,77 @@ TEST_F(ClaimAvailableDBlockSuite, DBlockComplexClaim0)
 
     check_fs(OUTPUT "DBlockComplexClaim0.bin", fs);
     free_filesystem(&fs);
-}
\ No newline at end of file
+}
+
+// claims across several 64 bit words of the bitmask and makes sure a released
+// dblock below the previous claims is handed out first again
+TEST_F(ClaimAvailableDBlockSuite, DBlockClaimAfterRelease0)
+{
+    constexpr size_t dblock_total = 300;
+
+    filesystem_t fs;
+    new_filesystem(&fs, 1, dblock_total);
+
+    for (size_t i = 1; i < dblock_total; ++i)
+    {
+        dblock_index_t idx = 0;
+        ASSERT_EQ(claim_available_dblock(&fs, &idx), SUCCESS) << "Return value do not match for index " << i << "!";
+        ASSERT_EQ(idx, i) << "D-Block claimed by " << i << "th call is incorrect!";
+    }
+
+    dblock_index_t tmp;
+    ASSERT_EQ(claim_available_dblock(&fs, &tmp), DBLOCK_UNAVAILABLE) << "Claimed a dblock from the bitmask padding!";
+
+    ASSERT_EQ(release_dblock(&fs, fs.dblocks + 200 * DATA_BLOCK_SIZE), SUCCESS);
+    ASSERT_EQ(release_dblock(&fs, fs.dblocks + 70 * DATA_BLOCK_SIZE), SUCCESS);
+
+    dblock_index_t idx = 0;
+    ASSERT_EQ(claim_available_dblock(&fs, &idx), SUCCESS);
+    ASSERT_EQ(idx, 70) << "Lowest released dblock should be claimed first!";
+    ASSERT_EQ(claim_available_dblock(&fs, &idx), SUCCESS);
+    ASSERT_EQ(idx, 200) << "Remaining released dblock should be claimed next!";
+    ASSERT_EQ(claim_available_dblock(&fs, &idx), DBLOCK_UNAVAILABLE);
+
+    free_filesystem(&fs);
+}
+
+// claiming several dblocks at once matches the order of repeated single claims
+TEST_F(ClaimAvailableDBlockSuite, DBlockMultiClaim0)
+{
+    SKIP_WITHOUT_BUNDLED_IMAGES();
+
+    constexpr size_t actual_dblock_count = 16;
+    
+    dblock_index_t expected_claimed_list[actual_dblock_count] = { 
+        1, 3, 4, 5, 6, 8, 9, 14, 16, 17, 18, 19, 22, 25, 26, 29
+    };
+    dblock_index_t output_claimed_list[actual_dblock_count];
+
+    filesystem_t fs;
+    load_fs(INPUT "empty_random_inode_fragmented.bin", fs);
+
+    ASSERT_EQ(claim_available_dblocks(&fs, actual_dblock_count, output_claimed_list), SUCCESS);
+    for (size_t i = 0; i < actual_dblock_count; ++i)
+    {
+        ASSERT_EQ(output_claimed_list[i], expected_claimed_list[i]) << "D-Block claimed at position " << i << " is incorrect!";
+    }
+
+    check_fs(OUTPUT "DBlockComplexClaim0.bin", fs);
+    free_filesystem(&fs);
+}
+
+// asking for more dblocks than available claims none of them
+TEST_F(ClaimAvailableDBlockSuite, DBlockMultiClaimUnavailable0)
+{
+    SKIP_WITHOUT_BUNDLED_IMAGES();
+
+    dblock_index_t output_claimed_list[17];
+
+    filesystem_t fs;
+    load_fs(INPUT "empty_random_inode_fragmented.bin", fs);
+
+    ASSERT_EQ(claim_available_dblocks(&fs, std::size(output_claimed_list), output_claimed_list), DBLOCK_UNAVAILABLE);
+
+    check_fs(INPUT "empty_random_inode_fragmented.bin", fs);
+    free_filesystem(&fs);
+}
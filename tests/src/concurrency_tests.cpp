@@ -0,0 +1,365 @@
+#include "test_util.hpp"
+
+extern "C"
+{
+#include "bitmap.h"
+#include "directory.h"
+#include "fsck.h"
+}
+
+#include <algorithm>
+#include <atomic>
+#include <functional>
+#include <string>
+#include <thread>
+#include <vector>
+
+using ConcurrencySuite = fs_internal_test;
+
+constexpr size_t thread_count = 8;
+
+static void run_threads(size_t count, const std::function<void(size_t)>& body)
+{
+    std::vector<std::thread> threads;
+    for (size_t t = 0; t < count; ++t) threads.emplace_back(body, t);
+    for (std::thread& thread : threads) thread.join();
+}
+
+TEST_F(ConcurrencySuite, InvalidInput)
+{
+    ASSERT_EQ(fs_enable_concurrency(NULL), INVALID_INPUT);
+
+    // without concurrency every lock is a no-op, so taking one twice cannot block
+    filesystem_t fs;
+    ASSERT_EQ(new_filesystem(&fs, 8, 8), SUCCESS);
+    fs_lock_filesystem(&fs, true);
+    fs_lock_filesystem(&fs, true);
+    fs_lock_inode(&fs, &fs.inodes[1], true);
+    fs_lock_inode(&fs, &fs.inodes[1], true);
+    fs_unlock_inode(&fs, &fs.inodes[1]);
+    fs_unlock_filesystem(&fs);
+    fs_lock_filesystem(NULL, true);
+    fs_unlock_filesystem(NULL);
+
+    ASSERT_EQ(fs_enable_concurrency(&fs), SUCCESS);
+    ASSERT_EQ(fs_enable_concurrency(&fs), SUCCESS);
+    fs_lock_filesystem(&fs, false);
+    fs_lock_filesystem(&fs, false);
+    fs_unlock_filesystem(&fs);
+    fs_unlock_filesystem(&fs);
+    free_filesystem(&fs);
+}
+
+// inodes and dblocks claimed from many threads at once are each handed out once, and the counts add up
+TEST_F(ConcurrencySuite, ParallelClaims)
+{
+    constexpr size_t inodes_per_thread = 200;
+    constexpr size_t dblocks_per_thread = 1000;
+    filesystem_t fs;
+    ASSERT_EQ(new_filesystem(&fs, 1 + thread_count * inodes_per_thread, 1 + thread_count * dblocks_per_thread), SUCCESS);
+    ASSERT_EQ(fs_enable_concurrency(&fs), SUCCESS);
+
+    std::vector<std::vector<inode_index_t>> inodes(thread_count);
+    std::vector<std::vector<dblock_index_t>> dblocks(thread_count);
+    run_threads(thread_count, [&](size_t t) {
+        for (size_t i = 0; i < inodes_per_thread; ++i)
+        {
+            inode_index_t idx;
+            if (claim_available_inode(&fs, &idx) == SUCCESS) inodes[t].push_back(idx);
+        }
+        for (size_t i = 0; i < dblocks_per_thread; i += 4)
+        {
+            dblock_index_t batch[4];
+            if (i % 8 == 0 && claim_available_dblocks(&fs, 4, batch) == SUCCESS) dblocks[t].insert(dblocks[t].end(), batch, batch + 4);
+            if (i % 8 == 4 && claim_dblock_run(&fs, 4, 0, batch) == SUCCESS) dblocks[t].insert(dblocks[t].end(), { batch[0], batch[0] + 1, batch[0] + 2, batch[0] + 3 });
+        }
+    });
+
+    // every thread got all it asked for, and nothing twice
+    std::vector<inode_index_t> all_inodes;
+    std::vector<dblock_index_t> all_dblocks;
+    for (size_t t = 0; t < thread_count; ++t)
+    {
+        ASSERT_EQ(inodes[t].size(), inodes_per_thread);
+        ASSERT_EQ(dblocks[t].size(), dblocks_per_thread);
+        all_inodes.insert(all_inodes.end(), inodes[t].begin(), inodes[t].end());
+        all_dblocks.insert(all_dblocks.end(), dblocks[t].begin(), dblocks[t].end());
+    }
+    std::sort(all_inodes.begin(), all_inodes.end());
+    ASSERT_EQ(std::adjacent_find(all_inodes.begin(), all_inodes.end()), all_inodes.end());
+    std::sort(all_dblocks.begin(), all_dblocks.end());
+    ASSERT_EQ(std::adjacent_find(all_dblocks.begin(), all_dblocks.end()), all_dblocks.end());
+    ASSERT_EQ(available_inodes(&fs), 0);
+    ASSERT_EQ(available_dblocks(&fs), 0);
+
+    // then every other one goes back, again from all threads
+    run_threads(thread_count, [&](size_t t) {
+        for (size_t i = 0; i < inodes[t].size(); i += 2) release_inode(&fs, &fs.inodes[inodes[t][i]]);
+        for (size_t i = 0; i < dblocks[t].size(); i += 2) release_dblock(&fs, fs.dblocks + dblocks[t][i] * DATA_BLOCK_SIZE);
+    });
+    ASSERT_EQ(available_inodes(&fs), thread_count * inodes_per_thread / 2);
+    ASSERT_EQ(available_dblocks(&fs), thread_count * dblocks_per_thread / 2);
+    size_t free_inodes = available_inodes(&fs), free_dblocks = available_dblocks(&fs);
+    refresh_available_counts(&fs);
+    ASSERT_EQ(available_inodes(&fs), free_inodes);
+    ASSERT_EQ(available_dblocks(&fs), free_dblocks);
+
+    free_filesystem(&fs);
+}
+
+// each thread grows its own file through fs_write while others read theirs back
+TEST_F(ConcurrencySuite, ParallelWriters)
+{
+    constexpr size_t file_size = 40 * DATA_BLOCK_SIZE + 17;
+    filesystem_t fs;
+    ASSERT_EQ(new_filesystem(&fs, 64, 2 * thread_count * 64), SUCCESS);
+    ASSERT_EQ(fs_enable_concurrency(&fs), SUCCESS);
+    fs.indirect_layout = INDIRECT_TREE;
+    std::vector<inode_t *> files;
+    for (size_t t = 0; t < thread_count; ++t) files.push_back(new_test_inode(fs));
+
+    run_threads(thread_count, [&](size_t t) {
+        std::vector<char> data = test_pattern(file_size, t);
+        struct fs_file file { &fs, files[t], 0, {} };
+        for (size_t offset = 0; offset < file_size; offset += 100)
+        {
+            size_t n = std::min<size_t>(100, file_size - offset);
+            if (fs_write(&file, data.data() + offset, n) != n) ADD_FAILURE() << "write " << t;
+
+            // and the file written so far reads back
+            std::vector<char> read(offset + n);
+            if (fs_pread(&file, read.data(), read.size(), 0) != read.size() || memcmp(read.data(), data.data(), read.size()) != 0) ADD_FAILURE() << "read " << t;
+        }
+    });
+
+    for (size_t t = 0; t < thread_count; ++t)
+    {
+        ASSERT_EQ(files[t]->internal.file_size, file_size);
+        std::vector<char> data(file_size);
+        size_t bytes_read;
+        ASSERT_EQ(inode_read_data(&fs, files[t], 0, data.data(), file_size, &bytes_read), SUCCESS);
+        ASSERT_EQ(data, test_pattern(file_size, t));
+    }
+    fs_fsck_report_t report;
+    ASSERT_EQ(fsck_filesystem(&fs, 1, &report), SUCCESS);
+    ASSERT_EQ(report.dblocks.shared_dblocks, 0);
+    ASSERT_EQ(report.dblocks.invalid_references, 0);
+
+    free_filesystem(&fs);
+}
+
+// the defragmenter runs between writes, and no file loses any of its data
+TEST_F(ConcurrencySuite, DefragmentWhileWriting)
+{
+    constexpr size_t file_size = 24 * DATA_BLOCK_SIZE;
+    constexpr size_t writers = 4;
+    filesystem_t fs;
+    ASSERT_EQ(new_filesystem(&fs, 16, 4 * writers * 32), SUCCESS);
+    ASSERT_EQ(fs_enable_concurrency(&fs), SUCCESS);
+    std::vector<inode_t *> files;
+    for (size_t t = 0; t < writers; ++t) files.push_back(new_test_inode(fs));
+
+    std::atomic<size_t> writing{ writers };
+    run_threads(writers + 1, [&](size_t t) {
+        if (t == writers)
+        {
+            fs_defrag_state_t state = {};
+            while (writing > 0)
+            {
+                if (defragment_filesystem(&fs, 8, &state) != SUCCESS) ADD_FAILURE() << "defragment";
+            }
+            return;
+        }
+        std::vector<char> data = test_pattern(file_size, t);
+        struct fs_file file { &fs, files[t], 0, {} };
+        for (size_t offset = 0; offset < file_size; offset += DATA_BLOCK_SIZE)
+        {
+            if (fs_write(&file, data.data() + offset, DATA_BLOCK_SIZE) != DATA_BLOCK_SIZE) ADD_FAILURE() << "write " << t;
+        }
+        writing--;
+    });
+
+    for (size_t t = 0; t < writers; ++t)
+    {
+        std::vector<char> data(file_size);
+        size_t bytes_read;
+        ASSERT_EQ(inode_read_data(&fs, files[t], 0, data.data(), file_size, &bytes_read), SUCCESS);
+        ASSERT_EQ(data, test_pattern(file_size, t));
+    }
+    fs_fsck_report_t report;
+    ASSERT_EQ(fsck_filesystem(&fs, 1, &report), SUCCESS);
+    ASSERT_EQ(report.dblocks.shared_dblocks, 0);
+    ASSERT_EQ(report.dblocks.invalid_references, 0);
+
+    free_filesystem(&fs);
+}
+
+// threads fill one directory and resolve each other's names as they appear
+TEST_F(ConcurrencySuite, SharedDirectory)
+{
+    constexpr size_t names_per_thread = 50;
+    filesystem_t fs;
+    ASSERT_EQ(new_filesystem(&fs, 8, 256), SUCCESS);
+    ASSERT_EQ(fs_enable_concurrency(&fs), SUCCESS);
+    inode_t *root = &fs.inodes[0];
+
+    run_threads(thread_count, [&](size_t t) {
+        fs_lock_filesystem(&fs, false);
+        for (size_t i = 0; i < names_per_thread; ++i)
+        {
+            std::string name = "t" + std::to_string(t) + "_" + std::to_string(i);
+            if (directory_add_entry(&fs, root, NULL, name.c_str(), (inode_index_t) t) != SUCCESS) ADD_FAILURE() << name;
+            inode_index_t found;
+            std::string path = "/" + name;
+            if (directory_resolve_path(&fs, root, path.c_str(), &found) != SUCCESS || found != t) ADD_FAILURE() << path;
+            std::string other = "/t" + std::to_string((t + 1) % thread_count) + "_" + std::to_string(i);
+            fs_retcode_t result = directory_resolve_path(&fs, root, other.c_str(), &found);
+            if (result != SUCCESS && result != NOT_FOUND) ADD_FAILURE() << other;
+        }
+        fs_unlock_filesystem(&fs);
+    });
+
+    ASSERT_EQ(root->internal.file_size, (1 + thread_count * names_per_thread) * (sizeof(inode_index_t) + MAX_FILE_NAME_LEN));
+    for (size_t t = 0; t < thread_count; ++t)
+    {
+        for (size_t i = 0; i < names_per_thread; ++i)
+        {
+            inode_index_t found;
+            std::string name = "t" + std::to_string(t) + "_" + std::to_string(i);
+            ASSERT_EQ(directory_resolve_path(&fs, root, name.c_str(), &found), SUCCESS) << name;
+            ASSERT_EQ(found, t);
+        }
+    }
+
+    free_filesystem(&fs);
+}
+
+// threads claim and release the same inodes over and over, and the free inode list comes out whole
+TEST_F(ConcurrencySuite, InodeChurn)
+{
+    constexpr size_t rounds = 2000;
+    constexpr size_t held = 12;
+    filesystem_t fs;
+    ASSERT_EQ(new_filesystem(&fs, 1 + thread_count * held, 8), SUCCESS);
+    ASSERT_EQ(fs_enable_concurrency(&fs), SUCCESS);
+
+    std::atomic<size_t> failed_claims{ 0 };
+    run_threads(thread_count, [&](size_t t) {
+        std::vector<inode_index_t> mine;
+        for (size_t round = 0; round < rounds; ++round)
+        {
+            inode_index_t idx;
+            if (mine.size() < held && claim_available_inode(&fs, &idx) == SUCCESS) mine.push_back(idx);
+            else if (mine.size() < held) failed_claims++;
+            if (round % 3 == 2 && !mine.empty())
+            {
+                release_inode(&fs, &fs.inodes[mine.front()]);
+                mine.erase(mine.begin());
+            }
+        }
+        for (inode_index_t idx : mine) release_inode(&fs, &fs.inodes[idx]);
+    });
+
+    // there were always enough inodes to go round, even when the ones left were kept by other threads
+    ASSERT_EQ(failed_claims, 0);
+    ASSERT_EQ(available_inodes(&fs), thread_count * held);
+
+    // holding the file system lock exclusively puts every inode back on the list
+    fs_lock_filesystem(&fs, true);
+    std::vector<bool> listed(fs.inode_count);
+    size_t length = 0;
+    for (inode_index_t iter = fs.available_inode; iter != 0 && length <= fs.inode_count; iter = fs.inodes[iter].next_free_inode, ++length)
+    {
+        ASSERT_LT(iter, fs.inode_count);
+        ASSERT_FALSE(listed[iter]) << iter;
+        listed[iter] = true;
+    }
+    ASSERT_EQ(length, thread_count * held);
+    fs_unlock_filesystem(&fs);
+
+    // and claims carry on from it afterwards
+    inode_index_t idx;
+    ASSERT_EQ(claim_available_inode(&fs, &idx), SUCCESS);
+    ASSERT_EQ(available_inodes(&fs), thread_count * held - 1);
+
+    free_filesystem(&fs);
+}
+
+// a sorted free inode list still hands out the lowest inode
+TEST_F(ConcurrencySuite, SortedFreeInodes)
+{
+    filesystem_t fs;
+    ASSERT_EQ(new_filesystem(&fs, 1 + thread_count * 8, 8), SUCCESS);
+    ASSERT_EQ(fs_enable_concurrency(&fs), SUCCESS);
+    fs.sorted_free_inodes = true;
+
+    run_threads(thread_count, [&](size_t t) {
+        inode_index_t idx;
+        for (size_t i = 0; i < 8; ++i)
+        {
+            if (claim_available_inode(&fs, &idx) != SUCCESS) ADD_FAILURE() << "claim " << t;
+        }
+    });
+    run_threads(thread_count, [&](size_t t) {
+        for (size_t i = 1 + t; i < fs.inode_count; i += 2 * thread_count) release_inode(&fs, &fs.inodes[i]);
+    });
+
+    inode_index_t idx;
+    ASSERT_EQ(claim_available_inode(&fs, &idx), SUCCESS);
+    ASSERT_EQ(idx, 1);
+    ASSERT_EQ(claim_available_inode(&fs, &idx), SUCCESS);
+    ASSERT_EQ(idx, 2);
+
+    free_filesystem(&fs);
+}
+
+// each thread claims from its own part of the dblocks, and takes from the others once that is used up
+TEST_F(ConcurrencySuite, DblockGroups)
+{
+    constexpr size_t dblocks_per_thread = 32;
+    filesystem_t fs;
+    ASSERT_EQ(new_filesystem(&fs, 8, 16 * 64), SUCCESS);
+    ASSERT_EQ(fs_enable_concurrency(&fs), SUCCESS);
+
+    std::vector<std::vector<dblock_index_t>> dblocks(thread_count);
+    run_threads(thread_count, [&](size_t t) {
+        for (size_t i = 0; i < dblocks_per_thread; ++i)
+        {
+            dblock_index_t idx;
+            if (claim_available_dblock(&fs, &idx) == SUCCESS) dblocks[t].push_back(idx);
+        }
+    });
+    for (size_t t = 0; t < thread_count; ++t)
+    {
+        ASSERT_EQ(dblocks[t].size(), dblocks_per_thread);
+        auto [low, high] = std::minmax_element(dblocks[t].begin(), dblocks[t].end());
+        ASSERT_LT(*high - *low, 64) << t;
+    }
+
+    // a run larger than any one part still fits across them
+    dblock_index_t first;
+    ASSERT_EQ(claim_dblock_run(&fs, 200, 0, &first), SUCCESS);
+    ASSERT_EQ(available_dblocks(&fs), 16 * 64 - 1 - thread_count * dblocks_per_thread - 200);
+
+    // a single thread empties every part
+    size_t left = available_dblocks(&fs);
+    for (size_t i = 0; i < left; ++i)
+    {
+        dblock_index_t idx;
+        ASSERT_EQ(claim_available_dblock(&fs, &idx), SUCCESS) << i;
+    }
+    dblock_index_t idx;
+    ASSERT_EQ(claim_available_dblock(&fs, &idx), DBLOCK_UNAVAILABLE);
+    ASSERT_EQ(claim_dblock_run(&fs, 1, 0, &first), DBLOCK_UNAVAILABLE);
+    ASSERT_EQ(available_dblocks(&fs), 0);
+
+    // releases make the dblocks available again, to any thread
+    ASSERT_EQ(release_dblock(&fs, fs.dblocks + 700 * DATA_BLOCK_SIZE), SUCCESS);
+    ASSERT_EQ(release_dblock(&fs, fs.dblocks + 701 * DATA_BLOCK_SIZE), SUCCESS);
+    ASSERT_EQ(release_dblock(&fs, fs.dblocks + 701 * DATA_BLOCK_SIZE), SUCCESS);
+    ASSERT_EQ(available_dblocks(&fs), 2);
+    ASSERT_EQ(claim_dblock_run(&fs, 2, 0, &first), SUCCESS);
+    ASSERT_EQ(first, 700);
+
+    free_filesystem(&fs);
+}
@@ -0,0 +1,302 @@
+#include "test_util.hpp"
+
+#include <vector>
+
+extern "C"
+{
+    #include "bitmap.h"
+    #include "fsck.h"
+}
+
+using DefragSuite = fs_internal_test;
+
+// dblock indices per index dblock. chains and extent dblocks use the last one to link to the next dblock
+constexpr size_t index_slots = DATA_BLOCK_SIZE / sizeof(dblock_index_t);
+constexpr size_t extents_per_dblock = (index_slots - 1) / 2;
+
+// appends `n` bytes that tell the file and the position apart, and keeps a copy of them in `expected`
+static void append(filesystem_t& fs, inode_t *inode, std::vector<char>& expected, size_t n)
+{
+    std::vector<char> data(n);
+    for (size_t i = 0; i < n; ++i) data[i] = (char) ((expected.size() + i) * 13 + (inode - fs.inodes));
+    ASSERT_EQ(inode_write_data(&fs, inode, data.data(), n), SUCCESS);
+    expected.insert(expected.end(), data.begin(), data.end());
+}
+
+static std::vector<char> read_all(filesystem_t& fs, inode_t *inode)
+{
+    std::vector<char> data(inode->internal.file_size);
+    size_t bytes_read;
+    EXPECT_EQ(inode_read_data(&fs, inode, 0, data.data(), data.size(), &bytes_read), SUCCESS);
+    EXPECT_EQ(bytes_read, data.size());
+    return data;
+}
+
+static size_t count_spans(filesystem_t& fs, inode_t *inode)
+{
+    dblock_span_iterator_t it;
+    EXPECT_EQ(inode_span_begin(&fs, inode, 0, inode->internal.file_size, &it), SUCCESS);
+    const byte *span;
+    size_t len, spans = 0;
+    while (inode_span_next(&it, &span, &len)) ++spans;
+    return spans;
+}
+
+static void expect_consistent(filesystem_t& fs)
+{
+    fs_fsck_report_t report;
+    ASSERT_EQ(fsck_filesystem(&fs, 1, &report), SUCCESS);
+    EXPECT_EQ(report.dblocks.leaked_dblocks, 0);
+    EXPECT_EQ(report.dblocks.unmarked_dblocks, 0);
+    EXPECT_EQ(report.dblocks.shared_dblocks, 0);
+    EXPECT_EQ(report.dblocks.invalid_references, 0);
+    EXPECT_EQ(report.dblocks.size_mismatches, 0);
+}
+
+// writes `files` files one dblock at a time, taking turns, so no file ends up in one run
+static void write_interleaved(filesystem_t& fs, std::vector<inode_t *>& inodes, std::vector<std::vector<char>>& contents, size_t files, size_t dblocks)
+{
+    for (size_t f = 0; f < files; ++f) inodes.push_back(new_test_inode(fs));
+    contents.resize(files);
+    for (size_t d = 0; d < dblocks; ++d)
+    {
+        for (size_t f = 0; f < files; ++f) append(fs, inodes[f], contents[f], DATA_BLOCK_SIZE);
+    }
+}
+
+TEST_F(DefragSuite, InvalidInput)
+{
+    filesystem_t fs;
+    fs_defrag_state_t state = {};
+    ASSERT_EQ(defragment_filesystem(NULL, 0, &state), INVALID_INPUT);
+    ASSERT_EQ(defragment_filesystem(&fs, 0, NULL), INVALID_INPUT);
+
+    // a free inode list that loops hides which inodes are in use
+    ASSERT_EQ(new_filesystem(&fs, 4, 16), SUCCESS);
+    inode_index_t head = fs.available_inode;
+    inode_index_t last = head;
+    while (fs.inodes[last].next_free_inode != 0) last = fs.inodes[last].next_free_inode;
+    fs.inodes[last].next_free_inode = head;
+    ASSERT_EQ(defragment_filesystem(&fs, 0, &state), INVALID_INPUT);
+    fs.inodes[last].next_free_inode = 0;
+    free_filesystem(&fs);
+}
+
+// chained files written in turns each end up in one run, index dblocks included
+TEST_F(DefragSuite, InterleavedChains)
+{
+    filesystem_t fs;
+    size_t dblocks = INODE_DIRECT_BLOCK_COUNT + 2 * (index_slots - 1) + 3;
+    ASSERT_EQ(new_filesystem(&fs, 8, 8 * dblocks), SUCCESS);
+    std::vector<inode_t *> inodes;
+    std::vector<std::vector<char>> contents;
+    write_interleaved(fs, inodes, contents, 3, dblocks);
+    for (inode_t *inode : inodes) ASSERT_GT(count_spans(fs, inode), 1);
+
+    fs_defrag_state_t state = {};
+    ASSERT_EQ(defragment_filesystem(&fs, 0, &state), SUCCESS);
+    ASSERT_TRUE(state.done);
+    ASSERT_GT(state.moved_dblocks, 0);
+
+    for (size_t f = 0; f < inodes.size(); ++f)
+    {
+        ASSERT_EQ(count_spans(fs, inodes[f]), 1);
+        ASSERT_EQ(read_all(fs, inodes[f]), contents[f]);
+    }
+    expect_consistent(fs);
+
+    // appending after the move still follows the moved chain
+    append(fs, inodes[0], contents[0], 3 * DATA_BLOCK_SIZE);
+    ASSERT_EQ(read_all(fs, inodes[0]), contents[0]);
+
+    // a second pass over files already in place only moves the one that just grew
+    ASSERT_EQ(defragment_filesystem(&fs, 0, &state), SUCCESS);
+    ASSERT_TRUE(state.done);
+    ASSERT_EQ(count_spans(fs, inodes[0]), 1);
+    ASSERT_EQ(read_all(fs, inodes[0]), contents[0]);
+    expect_consistent(fs);
+
+    free_filesystem(&fs);
+}
+
+// a budgeted pass stops early and picks up where it left off, but never skips a file bigger than the budget
+TEST_F(DefragSuite, BudgetResumes)
+{
+    filesystem_t fs;
+    ASSERT_EQ(new_filesystem(&fs, 16, 256), SUCCESS);
+    std::vector<inode_t *> inodes;
+    std::vector<std::vector<char>> contents;
+    write_interleaved(fs, inodes, contents, 6, 2);
+    inode_t *big = new_test_inode(fs);
+    std::vector<char> big_contents;
+    append(fs, big, big_contents, DATA_BLOCK_SIZE);
+    append(fs, inodes[0], contents[0], DATA_BLOCK_SIZE);
+    append(fs, big, big_contents, (INODE_DIRECT_BLOCK_COUNT - 1) * DATA_BLOCK_SIZE);
+
+    fs_defrag_state_t state = {};
+    size_t calls = 0;
+    size_t total = 0;
+    do
+    {
+        size_t before = state.moved_dblocks;
+        ASSERT_EQ(defragment_filesystem(&fs, 3, &state), SUCCESS);
+        size_t moved = state.moved_dblocks - before;
+        ASSERT_TRUE(moved <= 3 || moved == INODE_DIRECT_BLOCK_COUNT) << "only a file bigger than the budget may go over it";
+        total += moved;
+        ++calls;
+        ASSERT_LT(calls, 20);
+    } while (!state.done);
+
+    ASSERT_GT(calls, 2);
+    ASSERT_EQ(state.moved_dblocks, total);
+    for (size_t f = 0; f < inodes.size(); ++f)
+    {
+        ASSERT_EQ(count_spans(fs, inodes[f]), 1);
+        ASSERT_EQ(read_all(fs, inodes[f]), contents[f]);
+    }
+    ASSERT_EQ(count_spans(fs, big), 1);
+    ASSERT_EQ(read_all(fs, big), big_contents);
+    expect_consistent(fs);
+
+    // a finished pass starts over on the next call, counting from zero. it may still pull files down into the holes the last one left
+    ASSERT_EQ(defragment_filesystem(&fs, 3, &state), SUCCESS);
+    ASSERT_LE(state.moved_dblocks, 3);
+
+    free_filesystem(&fs);
+}
+
+// files behind a hole move down into it, leaving all free space in one run at the end
+TEST_F(DefragSuite, CompactsFreeSpace)
+{
+    filesystem_t fs;
+    ASSERT_EQ(new_filesystem(&fs, 8, 64), SUCCESS);
+    std::vector<inode_t *> inodes;
+    std::vector<std::vector<char>> contents(4);
+    for (size_t f = 0; f < 4; ++f)
+    {
+        inodes.push_back(new_test_inode(fs));
+        append(fs, inodes[f], contents[f], 3 * DATA_BLOCK_SIZE);
+    }
+    ASSERT_EQ(inode_release_data(&fs, inodes[0]), SUCCESS);
+    ASSERT_EQ(inode_shrink_data(&fs, inodes[2], DATA_BLOCK_SIZE), SUCCESS);
+    contents[2].resize(DATA_BLOCK_SIZE);
+
+    size_t index;
+    size_t free_dblocks = available_dblocks(&fs);
+    ASSERT_FALSE(bitmap_find_set_run(fs.dblock_bitmask, fs.dblock_count, 0, free_dblocks, &index));
+
+    fs_defrag_state_t state = {};
+    ASSERT_EQ(defragment_filesystem(&fs, 0, &state), SUCCESS);
+    ASSERT_TRUE(state.done);
+    ASSERT_EQ(available_dblocks(&fs), free_dblocks);
+    ASSERT_TRUE(bitmap_find_set_run(fs.dblock_bitmask, fs.dblock_count, 0, free_dblocks, &index));
+    ASSERT_EQ(index, fs.dblock_count - free_dblocks);
+
+    for (size_t f = 1; f < inodes.size(); ++f) ASSERT_EQ(read_all(fs, inodes[f]), contents[f]);
+    expect_consistent(fs);
+
+    free_filesystem(&fs);
+}
+
+// interleaved tree files are moved leaves first, and their nodes still lead to the right data
+TEST_F(DefragSuite, TreeFiles)
+{
+    filesystem_t fs;
+    size_t dblocks = INODE_DIRECT_BLOCK_COUNT + 2 * index_slots;
+    ASSERT_EQ(new_filesystem(&fs, 8, 6 * dblocks), SUCCESS);
+    fs.indirect_layout = INDIRECT_TREE;
+    std::vector<inode_t *> inodes;
+    std::vector<std::vector<char>> contents;
+    write_interleaved(fs, inodes, contents, 2, dblocks);
+    ASSERT_EQ(inodes[0]->internal.indirect_layout, INDIRECT_TREE);
+    ASSERT_GT(inodes[0]->internal.indirect_height, 1);
+
+    fs_defrag_state_t state = {};
+    ASSERT_EQ(defragment_filesystem(&fs, 0, &state), SUCCESS);
+    for (size_t f = 0; f < inodes.size(); ++f)
+    {
+        ASSERT_EQ(count_spans(fs, inodes[f]), 1);
+        ASSERT_EQ(read_all(fs, inodes[f]), contents[f]);
+    }
+    expect_consistent(fs);
+
+    free_filesystem(&fs);
+}
+
+// an extent file broken into many extents comes back as a single extent
+TEST_F(DefragSuite, ExtentFilesCollapse)
+{
+    filesystem_t fs;
+    // enough extents per file to need a second extent dblock
+    size_t extents = extents_per_dblock + 2;
+    ASSERT_EQ(new_filesystem(&fs, 8, 4 * (INODE_DIRECT_BLOCK_COUNT + extents) + 16), SUCCESS);
+    fs.indirect_layout = INDIRECT_EXTENTS;
+    std::vector<inode_t *> inodes;
+    std::vector<std::vector<char>> contents;
+    write_interleaved(fs, inodes, contents, 2, INODE_DIRECT_BLOCK_COUNT + extents);
+    ASSERT_NE(((dblock_index_t *) (fs.dblocks + inodes[0]->internal.indirect_dblock * DATA_BLOCK_SIZE))[index_slots - 1], 0);
+    ASSERT_EQ(inodes[0]->internal.indirect_layout, INDIRECT_EXTENTS);
+
+    fs_defrag_state_t state = {};
+    ASSERT_EQ(defragment_filesystem(&fs, 0, &state), SUCCESS);
+    for (size_t f = 0; f < inodes.size(); ++f)
+    {
+        inode_t *inode = inodes[f];
+        ASSERT_EQ(read_all(fs, inode), contents[f]);
+        ASSERT_EQ(count_spans(fs, inode), 1);
+
+        dblock_index_t *slots = (dblock_index_t *) (fs.dblocks + inode->internal.indirect_dblock * DATA_BLOCK_SIZE);
+        ASSERT_EQ(slots[0], inode->internal.direct_data[INODE_DIRECT_BLOCK_COUNT - 1] + 1);
+        ASSERT_EQ(slots[1], extents);
+        ASSERT_EQ(slots[3], 0);
+        ASSERT_EQ(slots[index_slots - 1], 0);
+    }
+    expect_consistent(fs);
+
+    // the collapsed file keeps growing in place
+    append(fs, inodes[1], contents[1], 2 * DATA_BLOCK_SIZE);
+    ASSERT_EQ(read_all(fs, inodes[1]), contents[1]);
+    expect_consistent(fs);
+
+    free_filesystem(&fs);
+}
+
+// a bundled image reads the same after a pass, and the dblocks it leaks stay untouched
+TEST_F(DefragSuite, BundledImage)
+{
+    SKIP_WITHOUT_BUNDLED_IMAGES();
+
+    filesystem_t fs;
+    load_fs(INPUT "half_random_inode_fragmented.bin", fs);
+    fs_fsck_report_t before;
+    ASSERT_EQ(fsck_filesystem(&fs, 1, &before), SUCCESS);
+
+    // the root directory keeps dblock 0, which reads do not follow
+    std::vector<bool> in_use(fs.inode_count, true);
+    in_use[0] = false;
+    for (inode_index_t i = fs.available_inode; i != 0; i = fs.inodes[i].next_free_inode) in_use[i] = false;
+    std::vector<std::vector<char>> contents(fs.inode_count);
+    for (size_t i = 0; i < fs.inode_count; ++i)
+    {
+        if (in_use[i]) contents[i] = read_all(fs, &fs.inodes[i]);
+    }
+
+    fs_defrag_state_t state = {};
+    ASSERT_EQ(defragment_filesystem(&fs, 0, &state), SUCCESS);
+    ASSERT_TRUE(state.done);
+    for (size_t i = 0; i < fs.inode_count; ++i)
+    {
+        if (in_use[i])
+        {
+            ASSERT_EQ(read_all(fs, &fs.inodes[i]), contents[i]) << "inode " << i;
+        }
+    }
+
+    fs_fsck_report_t after;
+    ASSERT_EQ(fsck_filesystem(&fs, 1, &after), SUCCESS);
+    ASSERT_EQ(after.dblocks.leaked_dblocks, before.dblocks.leaked_dblocks);
+    ASSERT_EQ(after.dblocks.shared_dblocks, 0);
+    ASSERT_EQ(after.dblocks.invalid_references, 0);
+
+    free_filesystem(&fs);
+}
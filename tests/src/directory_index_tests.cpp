@@ -0,0 +1,222 @@
+#include "test_util.hpp"
+
+extern "C"
+{
+#include "directory.h"
+}
+
+#include <string>
+#include <vector>
+
+using DirectoryIndexSuite = fs_internal_test;
+
+// the lookups with and without an index agree on every name
+static void expect_same_lookups(filesystem_t& fs, inode_t *dir, directory_index_t *index, const std::vector<std::string>& names)
+{
+    for (const std::string& name : names)
+    {
+        inode_index_t scanned = 0, indexed = 0;
+        fs_retcode_t scan_result = directory_lookup(&fs, dir, NULL, name.c_str(), &scanned);
+        ASSERT_EQ(directory_lookup(&fs, dir, index, name.c_str(), &indexed), scan_result) << name;
+        ASSERT_EQ(indexed, scanned) << name;
+    }
+}
+
+TEST_F(DirectoryIndexSuite, InvalidInput)
+{
+    filesystem_t fs;
+    ASSERT_EQ(new_filesystem(&fs, 8, 8), SUCCESS);
+    inode_t *root = &fs.inodes[0];
+    inode_t *file = new_test_inode(fs, DATA_FILE);
+    directory_index_t index = {};
+    inode_index_t found;
+    size_t root_size = root->internal.file_size;
+
+    ASSERT_EQ(directory_lookup(NULL, root, &index, "a", &found), INVALID_INPUT);
+    ASSERT_EQ(directory_lookup(&fs, NULL, &index, "a", &found), INVALID_INPUT);
+    ASSERT_EQ(directory_lookup(&fs, root, &index, NULL, &found), INVALID_INPUT);
+    ASSERT_EQ(directory_lookup(&fs, root, &index, "a", NULL), INVALID_INPUT);
+    ASSERT_EQ(directory_lookup(&fs, file, &index, "a", &found), INVALID_INPUT);
+    ASSERT_EQ(directory_add_entry(&fs, file, NULL, "a", 1), INVALID_INPUT);
+    ASSERT_EQ(directory_remove_entry(&fs, file, NULL, "a"), INVALID_INPUT);
+
+    ASSERT_EQ(directory_lookup(&fs, root, &index, "", &found), EMPTY_FILENAME);
+    ASSERT_EQ(directory_add_entry(&fs, root, &index, "", 1), EMPTY_FILENAME);
+    ASSERT_EQ(directory_add_entry(&fs, root, &index, "fifteen_chars__", 1), INVALID_FILENAME);
+    ASSERT_EQ(directory_remove_entry(&fs, root, NULL, "fifteen_chars__"), INVALID_FILENAME);
+    ASSERT_EQ(directory_remove_entry(&fs, root, &index, "a"), NOT_FOUND);
+    ASSERT_EQ(root->internal.file_size, root_size);
+
+    directory_index_free(&index);
+    directory_index_free(NULL);
+    free_filesystem(&fs);
+}
+
+// the bundled image's root reads the same through the index as through a scan
+TEST_F(DirectoryIndexSuite, BundledImage)
+{
+    SKIP_WITHOUT_BUNDLED_IMAGES();
+
+    filesystem_t fs;
+    load_fs(INPUT "medium.bin", fs);
+    inode_t *root = &fs.inodes[0];
+    directory_index_t index = {};
+
+    std::vector<std::string> names = { ".", "..", "missing" };
+    for (size_t i = 1; i < fs.inode_count; ++i)
+    {
+        names.emplace_back(fs.inodes[i].internal.file_name, strnlen(fs.inodes[i].internal.file_name, MAX_FILE_NAME_LEN));
+    }
+    expect_same_lookups(fs, root, &index, names);
+
+    inode_index_t found;
+    ASSERT_EQ(directory_lookup(&fs, root, &index, ".", &found), SUCCESS);
+    ASSERT_EQ(found, 0);
+    ASSERT_EQ(directory_lookup(&fs, root, &index, "missing", &found), NOT_FOUND);
+
+    directory_index_free(&index);
+    free_filesystem(&fs);
+}
+
+// entries are added at the end, removed as tombstones and the tombstones are reused
+TEST_F(DirectoryIndexSuite, AddRemoveReuse)
+{
+    for (bool indexed : { false, true })
+    {
+        SCOPED_TRACE(indexed);
+        filesystem_t fs;
+        ASSERT_EQ(new_filesystem(&fs, 16, 16), SUCCESS);
+        inode_t *dir = new_test_inode(fs, DIRECTORY);
+        inode_t *sub = new_test_inode(fs, DIRECTORY);
+        directory_index_t storage = {};
+        directory_index_t *index = indexed ? &storage : NULL;
+
+        ASSERT_EQ(directory_add_entry(&fs, dir, index, "a", 3), SUCCESS);
+        ASSERT_EQ(directory_add_entry(&fs, dir, index, "sub", sub - fs.inodes), SUCCESS);
+        ASSERT_EQ(directory_add_entry(&fs, dir, index, "fourteen_chars", 5), SUCCESS);
+        ASSERT_EQ(dir->internal.file_size, 3 * entry_size);
+        ASSERT_EQ(directory_add_entry(&fs, dir, index, "a", 6), FILE_EXIST);
+        ASSERT_EQ(directory_add_entry(&fs, dir, index, "sub", 6), DIRECTORY_EXIST);
+
+        inode_index_t found;
+        ASSERT_EQ(directory_lookup(&fs, dir, index, "fourteen_chars", &found), SUCCESS);
+        ASSERT_EQ(found, 5);
+
+        // the removed name is gone, and the next entry fills its slot without growing the directory
+        ASSERT_EQ(directory_remove_entry(&fs, dir, index, "a"), SUCCESS);
+        ASSERT_EQ(directory_lookup(&fs, dir, index, "a", &found), NOT_FOUND);
+        ASSERT_EQ(directory_remove_entry(&fs, dir, index, "a"), NOT_FOUND);
+        ASSERT_EQ(dir->internal.file_size, 3 * entry_size);
+        ASSERT_EQ(directory_add_entry(&fs, dir, index, "b", 7), SUCCESS);
+        ASSERT_EQ(dir->internal.file_size, 3 * entry_size);
+
+        byte entry[entry_size];
+        size_t bytes_read;
+        ASSERT_EQ(inode_read_data(&fs, dir, 0, entry, entry_size, &bytes_read), SUCCESS);
+        ASSERT_EQ(entry[0], 7);
+        ASSERT_STREQ((const char *) entry + sizeof(inode_index_t), "b");
+        expect_same_lookups(fs, dir, index, { "a", "b", "sub", "fourteen_chars" });
+
+        directory_index_free(&storage);
+        free_filesystem(&fs);
+    }
+}
+
+// a directory with thousands of entries, across inline data, direct dblocks and the index tree
+TEST_F(DirectoryIndexSuite, LargeDirectory)
+{
+    filesystem_t fs;
+    ASSERT_EQ(new_filesystem(&fs, 8, 3000 * entry_size / DATA_BLOCK_SIZE * 2), SUCCESS);
+    inode_t *dir = new_test_inode(fs, DIRECTORY);
+    directory_index_t index = {};
+
+    std::vector<std::string> names;
+    for (size_t i = 0; i < 3000; ++i)
+    {
+        names.push_back("file" + std::to_string(i));
+        ASSERT_EQ(directory_add_entry(&fs, dir, &index, names.back().c_str(), i % 1000), SUCCESS) << names.back();
+    }
+    ASSERT_EQ(dir->internal.file_size, names.size() * entry_size);
+    for (size_t i = 0; i < names.size(); ++i)
+    {
+        inode_index_t found;
+        ASSERT_EQ(directory_lookup(&fs, dir, &index, names[i].c_str(), &found), SUCCESS) << names[i];
+        ASSERT_EQ(found, i % 1000);
+    }
+
+    for (size_t i = 0; i < names.size(); i += 3) ASSERT_EQ(directory_remove_entry(&fs, dir, &index, names[i].c_str()), SUCCESS);
+    for (size_t i = 0; i < names.size(); i += 3) ASSERT_EQ(directory_add_entry(&fs, dir, &index, ("new" + names[i]).c_str(), 1), SUCCESS);
+    ASSERT_EQ(dir->internal.file_size, names.size() * entry_size);
+    for (size_t i = 0; i < names.size(); i += 3) names.push_back("new" + names[i]);
+    expect_same_lookups(fs, dir, &index, names);
+
+    directory_index_free(&index);
+    free_filesystem(&fs);
+}
+
+// an index notices the directory changing under it and rebuilds
+TEST_F(DirectoryIndexSuite, RebuildsWhenStale)
+{
+    filesystem_t fs;
+    ASSERT_EQ(new_filesystem(&fs, 8, 64), SUCCESS);
+    inode_t *dir = new_test_inode(fs, DIRECTORY);
+    inode_t *other = new_test_inode(fs, DIRECTORY);
+    directory_index_t index = {};
+    std::vector<std::string> names;
+    for (size_t i = 0; i < 100; ++i)
+    {
+        names.push_back("n" + std::to_string(i));
+        ASSERT_EQ(directory_add_entry(&fs, dir, NULL, names.back().c_str(), i + 1), SUCCESS);
+    }
+    expect_same_lookups(fs, dir, &index, names);
+
+    // shrunk behind the index's back
+    ASSERT_EQ(inode_shrink_data(&fs, dir, 50 * entry_size), SUCCESS);
+    expect_same_lookups(fs, dir, &index, names);
+
+    // moved by the defragmenter
+    fs_defrag_state_t state = {};
+    ASSERT_EQ(defragment_filesystem(&fs, 0, &state), SUCCESS);
+    expect_same_lookups(fs, dir, &index, names);
+    inode_index_t found;
+    ASSERT_EQ(directory_lookup(&fs, dir, &index, "n49", &found), SUCCESS);
+    ASSERT_EQ(found, 50);
+
+    // and the same index can serve another directory
+    ASSERT_EQ(directory_add_entry(&fs, other, &index, "only", 3), SUCCESS);
+    ASSERT_EQ(directory_lookup(&fs, other, &index, "n1", &found), NOT_FOUND);
+    ASSERT_EQ(directory_lookup(&fs, other, &index, "only", &found), SUCCESS);
+    ASSERT_EQ(found, 3);
+
+    directory_index_free(&index);
+    free_filesystem(&fs);
+}
+
+// shrinking another file leaves the entries where they are, so the index is kept as it is
+TEST_F(DirectoryIndexSuite, KeptAcrossUnrelatedShrink)
+{
+    filesystem_t fs;
+    ASSERT_EQ(new_filesystem(&fs, 8, 64), SUCCESS);
+    inode_t *dir = new_test_inode(fs, DIRECTORY);
+    inode_t *file = new_test_inode(fs, DATA_FILE);
+    directory_index_t index = {};
+    std::vector<std::string> names;
+    for (size_t i = 0; i < 20; ++i)
+    {
+        names.push_back("n" + std::to_string(i));
+        ASSERT_EQ(directory_add_entry(&fs, dir, &index, names.back().c_str(), i + 1), SUCCESS);
+    }
+    std::vector<char> data(3 * DATA_BLOCK_SIZE, 'x');
+    ASSERT_EQ(inode_write_data(&fs, file, data.data(), data.size()), SUCCESS);
+    ASSERT_EQ(inode_shrink_data(&fs, file, 1), SUCCESS);
+
+    // an index built again would know the name changed behind its back
+    char renamed[MAX_FILE_NAME_LEN] = "renamed";
+    ASSERT_EQ(inode_modify_data(&fs, dir, 4 * entry_size + sizeof(inode_index_t), renamed, MAX_FILE_NAME_LEN), SUCCESS);
+    inode_index_t found;
+    ASSERT_EQ(directory_lookup(&fs, dir, NULL, "renamed", &found), SUCCESS);
+    ASSERT_EQ(directory_lookup(&fs, dir, &index, "renamed", &found), NOT_FOUND);
+
+    directory_index_free(&index);
+    free_filesystem(&fs);
+}
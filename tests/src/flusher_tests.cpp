@@ -0,0 +1,218 @@
+#include "test_util.hpp"
+
+extern "C"
+{
+#include "flusher.h"
+}
+
+#include <chrono>
+#include <functional>
+#include <thread>
+#include <vector>
+
+using FlusherSuite = fs_internal_test;
+
+// the flusher closes the file it is given, and the output file is closed by the suite
+static FILE *share_file(FILE *file)
+{
+    fflush(file);
+    return fdopen(dup(fileno(file)), "r+");
+}
+
+// waits until the image holds a file of `size` bytes at `inode`, or gives up after a few seconds
+static bool wait_for_image(FILE *image, size_t inode, size_t size)
+{
+    for (size_t attempt = 0; attempt < 500; ++attempt)
+    {
+        filesystem_t fs;
+        rewind(image);
+        if (load_filesystem(image, &fs) == SUCCESS)
+        {
+            bool done = fs.inodes[inode].internal.file_size == size;
+            free_filesystem(&fs);
+            if (done) return true;
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+    return false;
+}
+
+TEST_F(FlusherSuite, InvalidInput)
+{
+    SKIP_WITHOUT_BUNDLED_IMAGES();
+
+    filesystem_t fs;
+    load_fs(INPUT "medium.bin", fs);
+
+    ASSERT_EQ(start_flusher(NULL, output_file, 0, 0), INVALID_INPUT);
+    ASSERT_EQ(start_flusher(&fs, NULL, 0, 0), INVALID_INPUT);
+    ASSERT_EQ(flush_filesystem(NULL, true), INVALID_INPUT);
+    ASSERT_EQ(flush_filesystem(&fs, true), INVALID_INPUT);
+    ASSERT_EQ(stop_flusher(NULL), INVALID_INPUT);
+    ASSERT_EQ(stop_flusher(&fs), SUCCESS);
+
+    // the image has to have the geometry of the file system
+    copy_image(INPUT "large.bin");
+    ASSERT_EQ(start_flusher(&fs, output_file, 0, 0), INVALID_BINARY_FORMAT);
+    ASSERT_EQ(fs.flusher, nullptr);
+
+    free_filesystem(&fs);
+}
+
+// a flush asked for writes the same bytes an incremental save does
+TEST_F(FlusherSuite, FlushOnRequest)
+{
+    SKIP_WITHOUT_BUNDLED_IMAGES();
+
+    copy_image(INPUT "large.bin");
+
+    filesystem_t fs;
+    load_fs(INPUT "large.bin", fs);
+    ASSERT_EQ(start_flusher(&fs, share_file(output_file), 0, 0), SUCCESS);
+
+    char test_message[1024];
+    memset(test_message, 0x20, std::size(test_message));
+    ASSERT_EQ(inode_write_data(&fs, &fs.inodes[4], test_message, std::size(test_message)), SUCCESS);
+    ASSERT_EQ(flush_filesystem(&fs, true), SUCCESS);
+    compare_expected(OUTPUT "WriteDirectIndirect.bin");
+
+    // nothing changed since
+    ASSERT_EQ(flush_filesystem(&fs, true), SUCCESS);
+    compare_expected(OUTPUT "WriteDirectIndirect.bin");
+
+    ASSERT_EQ(stop_flusher(&fs), SUCCESS);
+    ASSERT_EQ(fs.flusher, nullptr);
+    free_filesystem(&fs);
+}
+
+// stopping the flusher writes what it had not written yet
+TEST_F(FlusherSuite, FlushOnStop)
+{
+    SKIP_WITHOUT_BUNDLED_IMAGES();
+
+    copy_image(INPUT "large.bin");
+
+    filesystem_t fs;
+    load_fs(INPUT "large.bin", fs);
+    ASSERT_EQ(start_flusher(&fs, share_file(output_file), 0, 0), SUCCESS);
+
+    char test_message[1024];
+    memset(test_message, 0x20, std::size(test_message));
+    ASSERT_EQ(inode_write_data(&fs, &fs.inodes[4], test_message, std::size(test_message)), SUCCESS);
+    free_filesystem(&fs);
+
+    compare_expected(OUTPUT "WriteDirectIndirect.bin");
+}
+
+TEST_F(FlusherSuite, FlushOnInterval)
+{
+    SKIP_WITHOUT_BUNDLED_IMAGES();
+
+    copy_image(INPUT "large.bin");
+
+    filesystem_t fs;
+    load_fs(INPUT "large.bin", fs);
+    ASSERT_EQ(start_flusher(&fs, share_file(output_file), 10, 0), SUCCESS);
+
+    char test_message[1024];
+    memset(test_message, 0x20, std::size(test_message));
+    size_t size = fs.inodes[4].internal.file_size + std::size(test_message);
+    ASSERT_EQ(inode_write_data(&fs, &fs.inodes[4], test_message, std::size(test_message)), SUCCESS);
+    ASSERT_TRUE(wait_for_image(output_file, 4, size));
+    compare_expected(OUTPUT "WriteDirectIndirect.bin");
+
+    free_filesystem(&fs);
+}
+
+// without an interval, enough changes start a flush
+TEST_F(FlusherSuite, FlushOnThreshold)
+{
+    SKIP_WITHOUT_BUNDLED_IMAGES();
+
+    copy_image(INPUT "large.bin");
+
+    filesystem_t fs;
+    load_fs(INPUT "large.bin", fs);
+    ASSERT_EQ(start_flusher(&fs, share_file(output_file), 0, DATA_BLOCK_SIZE), SUCCESS);
+
+    char test_message[1024];
+    memset(test_message, 0x20, std::size(test_message));
+    size_t size = fs.inodes[4].internal.file_size + std::size(test_message);
+    ASSERT_EQ(inode_write_data(&fs, &fs.inodes[4], test_message, std::size(test_message)), SUCCESS);
+    ASSERT_TRUE(wait_for_image(output_file, 4, size));
+    compare_expected(OUTPUT "WriteDirectIndirect.bin");
+
+    free_filesystem(&fs);
+}
+
+// the save functions leave the changes to the flusher
+TEST_F(FlusherSuite, SaveKeepsChanges)
+{
+    SKIP_WITHOUT_BUNDLED_IMAGES();
+
+    copy_image(INPUT "large.bin");
+
+    filesystem_t fs;
+    load_fs(INPUT "large.bin", fs);
+    ASSERT_EQ(start_flusher(&fs, share_file(output_file), 0, 0), SUCCESS);
+
+    char test_message[1024];
+    memset(test_message, 0x20, std::size(test_message));
+    ASSERT_EQ(inode_write_data(&fs, &fs.inodes[4], test_message, std::size(test_message)), SUCCESS);
+    FILE *other = tmpfile();
+    ASSERT_NE(other, nullptr);
+    ASSERT_EQ(save_filesystem(other, &fs), SUCCESS);
+    fclose(other);
+
+    ASSERT_EQ(flush_filesystem(&fs, true), SUCCESS);
+    compare_expected(OUTPUT "WriteDirectIndirect.bin");
+
+    free_filesystem(&fs);
+}
+
+// writers keep going while flushes are taken, and the image ends up with everything they wrote
+TEST_F(FlusherSuite, WritersDuringFlush)
+{
+    constexpr size_t writers = 4;
+    constexpr size_t file_size = 12 * DATA_BLOCK_SIZE + 5;
+    filesystem_t fs;
+    ASSERT_EQ(new_filesystem(&fs, 16, writers * 32), SUCCESS);
+    ASSERT_EQ(save_filesystem(output_file, &fs), SUCCESS);
+    ASSERT_EQ(start_flusher(&fs, share_file(output_file), 1, 4 * DATA_BLOCK_SIZE), SUCCESS);
+
+    std::vector<inode_t *> files;
+    for (size_t t = 0; t < writers; ++t) files.push_back(new_test_inode(fs));
+
+    std::vector<std::thread> threads;
+    for (size_t t = 0; t < writers; ++t)
+    {
+        threads.emplace_back([&, t] {
+            std::vector<char> data = test_pattern(file_size, t);
+            struct fs_file file { &fs, files[t], 0, {} };
+            for (size_t offset = 0; offset < file_size; offset += 100)
+            {
+                size_t n = std::min<size_t>(100, file_size - offset);
+                if (fs_write(&file, data.data() + offset, n) != n) ADD_FAILURE() << "write " << t;
+                if (offset % 1000 == 0) flush_filesystem(&fs, false);
+            }
+        });
+    }
+    for (std::thread& thread : threads) thread.join();
+    ASSERT_EQ(stop_flusher(&fs), SUCCESS);
+
+    filesystem_t flushed;
+    rewind(output_file);
+    ASSERT_EQ(load_filesystem(output_file, &flushed), SUCCESS);
+    for (size_t t = 0; t < writers; ++t)
+    {
+        inode_t *inode = &flushed.inodes[files[t] - fs.inodes];
+        ASSERT_EQ(inode->internal.file_size, file_size);
+        std::vector<char> data(file_size);
+        size_t bytes_read;
+        ASSERT_EQ(inode_read_data(&flushed, inode, 0, data.data(), file_size, &bytes_read), SUCCESS);
+        ASSERT_EQ(data, test_pattern(file_size, t));
+    }
+
+    free_filesystem(&flushed);
+    free_filesystem(&fs);
+}
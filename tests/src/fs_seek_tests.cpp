@@ -34,7 +34,7 @@ TEST_F(FSSeekSuite, SeekCurrent0)
     load_fs(INPUT "medium_text.bin", fs);
 
     inode_t *inode = &fs.inodes[inode_index];
-    fs_file file{ &fs, inode, offset };
+    fs_file file{ &fs, inode, offset, {} };
 
     {   // begin logging stdout
         stdout_logger_lock lk{ this };
@@ -68,7 +68,7 @@ TEST_F(FSSeekSuite, SeekCurrent1)
     load_fs(INPUT "medium_text.bin", fs);
 
     inode_t *inode = &fs.inodes[inode_index];
-    fs_file file{ &fs, inode, offset };
+    fs_file file{ &fs, inode, offset, {} };
 
     {   // begin logging stdout
         stdout_logger_lock lk{ this };
@@ -102,7 +102,7 @@ TEST_F(FSSeekSuite, SeekCurrent2)
     load_fs(INPUT "medium_text.bin", fs);
 
     inode_t *inode = &fs.inodes[inode_index];
-    fs_file file{ &fs, inode, offset };
+    fs_file file{ &fs, inode, offset, {} };
 
     {   // begin logging stdout
         stdout_logger_lock lk{ this };
@@ -136,7 +136,7 @@ TEST_F(FSSeekSuite, SeekCurrent3)
     load_fs(INPUT "medium_text.bin", fs);
 
     inode_t *inode = &fs.inodes[inode_index];
-    fs_file file{ &fs, inode, offset };
+    fs_file file{ &fs, inode, offset, {} };
 
     {   // begin logging stdout
         stdout_logger_lock lk{ this };
@@ -170,7 +170,7 @@ TEST_F(FSSeekSuite, SeekStart0)
     load_fs(INPUT "medium_text.bin", fs);
 
     inode_t *inode = &fs.inodes[inode_index];
-    fs_file file{ &fs, inode, offset };
+    fs_file file{ &fs, inode, offset, {} };
 
     {   // begin logging stdout
         stdout_logger_lock lk{ this };
@@ -204,7 +204,7 @@ TEST_F(FSSeekSuite, SeekStart1)
     load_fs(INPUT "medium_text.bin", fs);
 
     inode_t *inode = &fs.inodes[inode_index];
-    fs_file file{ &fs, inode, offset };
+    fs_file file{ &fs, inode, offset, {} };
 
     {   // begin logging stdout
         stdout_logger_lock lk{ this };
@@ -239,7 +239,7 @@ TEST_F(FSSeekSuite, SeekStart2)
     load_fs(INPUT "medium_text.bin", fs);
 
     inode_t *inode = &fs.inodes[inode_index];
-    fs_file file{ &fs, inode, offset };
+    fs_file file{ &fs, inode, offset, {} };
 
     {   // begin logging stdout
         stdout_logger_lock lk{ this };
@@ -274,7 +274,7 @@ TEST_F(FSSeekSuite, SeekStart3)
     load_fs(INPUT "medium_text.bin", fs);
 
     inode_t *inode = &fs.inodes[inode_index];
-    fs_file file{ &fs, inode, offset };
+    fs_file file{ &fs, inode, offset, {} };
 
     {   // begin logging stdout
         stdout_logger_lock lk{ this };
@@ -308,7 +308,7 @@ TEST_F(FSSeekSuite, SeekEnd0)
     load_fs(INPUT "medium_text.bin", fs);
 
     inode_t *inode = &fs.inodes[inode_index];
-    fs_file file{ &fs, inode, offset };
+    fs_file file{ &fs, inode, offset, {} };
 
     {   // begin logging stdout
         stdout_logger_lock lk{ this };
@@ -342,7 +342,7 @@ TEST_F(FSSeekSuite, SeekEnd1)
     load_fs(INPUT "medium_text.bin", fs);
 
     inode_t *inode = &fs.inodes[inode_index];
-    fs_file file{ &fs, inode, offset };
+    fs_file file{ &fs, inode, offset, {} };
 
     {   // begin logging stdout
         stdout_logger_lock lk{ this };
@@ -376,7 +376,7 @@ TEST_F(FSSeekSuite, SeekEnd2)
     load_fs(INPUT "medium_text.bin", fs);
 
     inode_t *inode = &fs.inodes[inode_index];
-    fs_file file{ &fs, inode, offset };
+    fs_file file{ &fs, inode, offset, {} };
 
     {   // begin logging stdout
         stdout_logger_lock lk{ this };
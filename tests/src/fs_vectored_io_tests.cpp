@@ -0,0 +1,131 @@
+#include "test_util.hpp"
+
+#include <vector>
+
+using FSVectoredIOSuite = fs_internal_test;
+
+TEST_F(FSVectoredIOSuite, InvalidInput)
+{
+    struct iovec iov { nullptr, 0 };
+    ASSERT_EQ(fs_readv(NULL, &iov, 1), 0);
+    ASSERT_EQ(fs_writev(NULL, &iov, 1), 0);
+    ASSERT_EQ(fs_pread(NULL, NULL, 0, 0), 0);
+    ASSERT_EQ(fs_pwrite(NULL, NULL, 0, 0), 0);
+}
+
+// a batch of buffers changes the image exactly like one write of them put together
+TEST_F(FSVectoredIOSuite, WritevMatchesWrite)
+{
+    SKIP_WITHOUT_BUNDLED_IMAGES();
+
+    filesystem_t fs;
+    load_fs(INPUT "medium_text.bin", fs);
+
+    inode_t *inode = &fs.inodes[1];
+    struct fs_file file { &fs, inode, 0, {} };
+    std::vector<char> buffer(80, 0x24);
+    struct iovec iov[] = {
+        { buffer.data(), 7 },
+        { buffer.data() + 7, 0 },
+        { buffer.data() + 7, 60 },
+        { buffer.data() + 67, 13 },
+    };
+
+    ASSERT_EQ(fs_writev(&file, iov, 4), 80);
+    ASSERT_EQ(file.offset, 80);
+    ASSERT_EQ(inode->internal.file_size, 614);
+    check_fs(OUTPUT "SimpleWrite0.bin", fs);
+
+    free_filesystem(&fs);
+}
+
+// reading into several buffers fills them in order with the same bytes as one read
+TEST_F(FSVectoredIOSuite, ReadvScatters)
+{
+    SKIP_WITHOUT_BUNDLED_IMAGES();
+
+    filesystem_t fs;
+    load_fs(INPUT "medium_text.bin", fs);
+
+    inode_t *inode = &fs.inodes[1];
+    size_t file_size = inode->internal.file_size;
+    std::vector<char> expected(file_size);
+    struct fs_file reference { &fs, inode, 0, {} };
+    ASSERT_EQ(fs_read(&reference, expected.data(), expected.size()), file_size);
+
+    std::vector<char> a(5), b(64), c(100), d(1000);
+    struct iovec iov[] = {
+        { a.data(), a.size() },
+        { nullptr, 0 },
+        { b.data(), b.size() },
+        { c.data(), c.size() },
+        { d.data(), d.size() },
+    };
+    struct fs_file file { &fs, inode, 0, {} };
+    ASSERT_EQ(fs_readv(&file, iov, 5), file_size);
+    ASSERT_EQ(file.offset, file_size);
+
+    ASSERT_EQ(memcmp(a.data(), expected.data(), 5), 0);
+    ASSERT_EQ(memcmp(b.data(), expected.data() + 5, 64), 0);
+    ASSERT_EQ(memcmp(c.data(), expected.data() + 69, 100), 0);
+    ASSERT_EQ(memcmp(d.data(), expected.data() + 169, file_size - 169), 0);
+
+    free_filesystem(&fs);
+}
+
+// positional reads and writes leave the file position alone
+TEST_F(FSVectoredIOSuite, PositionalKeepsOffset)
+{
+    SKIP_WITHOUT_BUNDLED_IMAGES();
+
+    filesystem_t fs;
+    load_fs(INPUT "medium_text.bin", fs);
+
+    inode_t *inode = &fs.inodes[1];
+    size_t file_size = inode->internal.file_size;
+    struct fs_file file { &fs, inode, 10, {} };
+
+    char written[] = "positional";
+    ASSERT_EQ(fs_pwrite(&file, written, sizeof(written), 100), sizeof(written));
+    ASSERT_EQ(file.offset, 10);
+
+    // appending right at the end grows the file
+    ASSERT_EQ(fs_pwrite(&file, written, sizeof(written), file_size), sizeof(written));
+    ASSERT_EQ(inode->internal.file_size, file_size + sizeof(written));
+    ASSERT_EQ(fs_pwrite(&file, written, sizeof(written), file_size + 2 * sizeof(written)), 0);
+
+    char read[sizeof(written)] = { 0 };
+    ASSERT_EQ(fs_pread(&file, read, sizeof(read), 100), sizeof(read));
+    ASSERT_EQ(memcmp(read, written, sizeof(written)), 0);
+    ASSERT_EQ(fs_pread(&file, read, sizeof(read), file_size), sizeof(read));
+    ASSERT_EQ(memcmp(read, written, sizeof(written)), 0);
+    ASSERT_EQ(file.offset, 10);
+
+    free_filesystem(&fs);
+}
+
+// a batch that does not fit changes nothing
+TEST_F(FSVectoredIOSuite, WritevAllOrNothing)
+{
+    filesystem_t fs;
+    ASSERT_EQ(new_filesystem(&fs, 4, 4), SUCCESS);
+    inode_index_t idx = 0;
+    ASSERT_EQ(claim_available_inode(&fs, &idx), SUCCESS);
+    fs.inodes[idx].internal = {};
+    struct fs_file file { &fs, &fs.inodes[idx], 0, {} };
+
+    std::vector<char> buffer(4 * DATA_BLOCK_SIZE, 'v');
+    struct iovec iov[] = {
+        { buffer.data(), DATA_BLOCK_SIZE },
+        { buffer.data(), 3 * DATA_BLOCK_SIZE },
+    };
+    ASSERT_EQ(fs_writev(&file, iov, 2), 0);
+    ASSERT_EQ(file.offset, 0);
+    ASSERT_EQ(fs.inodes[idx].internal.file_size, 0);
+    ASSERT_EQ(available_dblocks(&fs), 3);
+
+    ASSERT_EQ(fs_writev(&file, iov, 1), DATA_BLOCK_SIZE);
+    ASSERT_EQ(file.offset, DATA_BLOCK_SIZE);
+
+    free_filesystem(&fs);
+}
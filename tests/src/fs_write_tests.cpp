@@ -30,7 +30,8 @@ TEST_F(FSWriteSuite, SimpleWrite0)
     struct fs_file file {
         &fs,
         inode,
-        offset
+        offset,
+        {}
     };
     char buffer[buffer_size] = { 0 };
     memset(buffer, 0x24, buffer_size);
@@ -73,7 +74,8 @@ TEST_F(FSWriteSuite, SimpleWrite1)
     struct fs_file file {
         &fs,
         inode,
-        offset
+        offset,
+        {}
     };
     char buffer[buffer_size] = { 0 };
     memset(buffer, 0x30, buffer_size);
@@ -116,7 +118,8 @@ TEST_F(FSWriteSuite, WriteFromEOF0)
     struct fs_file file {
         &fs,
         inode,
-        offset
+        offset,
+        {}
     };
     char buffer[buffer_size] = { 0 };
     memset(buffer, 0x41, buffer_size);
@@ -159,7 +162,8 @@ TEST_F(FSWriteSuite, WriteExpandFile0)
     struct fs_file file {
         &fs,
         inode,
-        offset
+        offset,
+        {}
     };
     char buffer[buffer_size] = { 0 };
     memset(buffer, 0x44, buffer_size);
@@ -0,0 +1,102 @@
+#include "test_util.hpp"
+
+extern "C"
+{
+#include "fsck.h"
+}
+
+#include <vector>
+
+using FsckSuite = fs_internal_test;
+
+static void expect_clean(const fs_fsck_report_t& report)
+{
+    EXPECT_FALSE(report.broken_free_inode_list);
+    EXPECT_EQ(report.dblocks.leaked_dblocks, 0);
+    EXPECT_EQ(report.dblocks.unmarked_dblocks, 0);
+    EXPECT_EQ(report.dblocks.shared_dblocks, 0);
+    EXPECT_EQ(report.dblocks.invalid_references, 0);
+    EXPECT_EQ(report.dblocks.size_mismatches, 0);
+}
+
+// claims a data file and gives it `dblocks` dblocks of data
+// a file of `dblocks` full dblocks, each byte its inode index
+static inode_t *new_data_file(filesystem_t& fs, size_t dblocks)
+{
+    inode_t *inode = new_test_inode(fs);
+    std::vector<char> data(dblocks * DATA_BLOCK_SIZE, (char) (inode - fs.inodes));
+    EXPECT_EQ(inode_write_data(&fs, inode, data.data(), data.size()), SUCCESS);
+    return inode;
+}
+
+TEST_F(FsckSuite, InvalidInput)
+{
+    filesystem_t fs;
+    fs_fsck_report_t report;
+    ASSERT_EQ(fsck_filesystem(NULL, 1, &report), INVALID_INPUT);
+    ASSERT_EQ(fsck_filesystem(&fs, 1, NULL), INVALID_INPUT);
+}
+
+// the bundled images are all consistent
+TEST_F(FsckSuite, BundledImagesClean)
+{
+    SKIP_WITHOUT_BUNDLED_IMAGES();
+
+    for (const char *image : { INPUT "medium.bin", INPUT "large.bin", INPUT "small_full_inode.bin",
+                               INPUT "medium_tombstone.bin" })
+    {
+        SCOPED_TRACE(image);
+        filesystem_t fs;
+        load_fs(image, fs);
+        fs_fsck_report_t report;
+        ASSERT_EQ(fsck_filesystem(&fs, 0, &report), SUCCESS);
+        expect_clean(report);
+        ASSERT_EQ(report.checked_inodes, fs.inode_count - available_inodes(&fs));
+        free_filesystem(&fs);
+    }
+}
+
+// every kind of damage is found, and the threads agree with a single one on how much
+TEST_F(FsckSuite, FindsDamage)
+{
+    filesystem_t fs;
+    ASSERT_EQ(new_filesystem(&fs, 5000, 10000), SUCCESS);
+    std::vector<inode_t *> files;
+    for (size_t i = 0; i < 4000; ++i) files.push_back(new_data_file(fs, 1 + i % 3));
+    inode_t *chained = new_data_file(fs, INODE_DIRECT_BLOCK_COUNT + 20);
+    inode_t *direct_only = new_data_file(fs, INODE_DIRECT_BLOCK_COUNT);
+
+    fs_fsck_report_t report;
+    ASSERT_EQ(fsck_filesystem(&fs, 4, &report), SUCCESS);
+    expect_clean(report);
+    ASSERT_EQ(report.thread_count, 4);
+    ASSERT_EQ(report.checked_inodes, 4003);
+    ASSERT_NE(chained->internal.indirect_dblock, 0);
+
+    // a claimed dblock nobody uses, one in use marked free, two files sharing one,
+    // a size the block map cannot hold and a looping free inode list
+    dblock_index_t leaked;
+    ASSERT_EQ(claim_available_dblock(&fs, &leaked), SUCCESS);
+    fs.dblock_bitmask[files[10]->internal.direct_data[0] / 8] |= 1 << (7 - files[10]->internal.direct_data[0] % 8);
+    files[20]->internal.direct_data[0] = files[30]->internal.direct_data[0];
+    direct_only->internal.file_size += DATA_BLOCK_SIZE;
+    fs.inodes[fs.inode_count - 1].next_free_inode = fs.available_inode;
+
+    fs_fsck_report_t single;
+    ASSERT_EQ(fsck_filesystem(&fs, 1, &single), SUCCESS);
+    ASSERT_EQ(fsck_filesystem(&fs, 8, &report), SUCCESS);
+
+    for (const fs_fsck_report_t& r : { single, report })
+    {
+        EXPECT_TRUE(r.broken_free_inode_list);
+        EXPECT_EQ(r.dblocks.unmarked_dblocks, 1);
+        EXPECT_EQ(r.dblocks.shared_dblocks, 1);
+        EXPECT_EQ(r.dblocks.size_mismatches, 1);
+        EXPECT_EQ(r.dblocks.invalid_references, 0);
+    }
+    // the shared dblock of files[20] is no longer referenced by its old owner
+    EXPECT_EQ(single.dblocks.leaked_dblocks, 2);
+    EXPECT_EQ(report.dblocks.leaked_dblocks, single.dblocks.leaked_dblocks);
+
+    free_filesystem(&fs);
+}
@@ -0,0 +1,125 @@
+#include "test_util.hpp"
+
+#include <vector>
+
+using IndirectTreeSuite = fs_internal_test;
+
+constexpr size_t fanout = DATA_BLOCK_SIZE / sizeof(dblock_index_t);
+
+// a file that needs a second level: three full leaves and part of a fourth
+TEST_F(IndirectTreeSuite, WriteReadTwoLevels)
+{
+    constexpr size_t tree_dblocks = 3 * fanout + 5;
+    constexpr size_t file_size = (INODE_DIRECT_BLOCK_COUNT + tree_dblocks) * DATA_BLOCK_SIZE - 3;
+
+    filesystem_t fs;
+    ASSERT_EQ(new_filesystem(&fs, 4, 4 * fanout + 16), SUCCESS);
+    fs.indirect_layout = INDIRECT_TREE;
+    inode_t *file = new_test_inode(fs);
+    size_t free_before = available_dblocks(&fs);
+
+    std::vector<char> data = test_pattern(file_size);
+    ASSERT_EQ(inode_write_data(&fs, file, data.data(), file_size), SUCCESS);
+    ASSERT_EQ(file->internal.indirect_layout, INDIRECT_TREE);
+    ASSERT_EQ(file->internal.indirect_height, 2);
+    // 4 leaves and a root
+    ASSERT_EQ(available_dblocks(&fs), free_before - INODE_DIRECT_BLOCK_COUNT - tree_dblocks - 5);
+
+    // reads at arbitrary offsets go straight down the tree
+    for (size_t offset : { (size_t) 0, (size_t) 300, file_size / 2, file_size - 70 })
+    {
+        char buffer[70];
+        size_t bytes_read;
+        ASSERT_EQ(inode_read_data(&fs, file, offset, buffer, sizeof(buffer), &bytes_read), SUCCESS);
+        ASSERT_EQ(bytes_read, sizeof(buffer));
+        ASSERT_EQ(memcmp(buffer, data.data() + offset, sizeof(buffer)), 0) << "offset " << offset;
+    }
+
+    free_filesystem(&fs);
+}
+
+// shrinking releases emptied leaves and drops the root once one leaf is enough
+TEST_F(IndirectTreeSuite, ShrinkCollapses)
+{
+    constexpr size_t tree_dblocks = 2 * fanout + 1;
+
+    filesystem_t fs;
+    ASSERT_EQ(new_filesystem(&fs, 4, 4 * fanout + 16), SUCCESS);
+    fs.indirect_layout = INDIRECT_TREE;
+    inode_t *file = new_test_inode(fs);
+    size_t free_before = available_dblocks(&fs);
+
+    std::vector<char> data = test_pattern((INODE_DIRECT_BLOCK_COUNT + tree_dblocks) * DATA_BLOCK_SIZE);
+    ASSERT_EQ(inode_write_data(&fs, file, data.data(), data.size()), SUCCESS);
+    ASSERT_EQ(file->internal.indirect_height, 2);
+
+    size_t new_size = (INODE_DIRECT_BLOCK_COUNT + fanout) * DATA_BLOCK_SIZE;
+    ASSERT_EQ(inode_shrink_data(&fs, file, new_size), SUCCESS);
+    ASSERT_EQ(file->internal.indirect_height, 1);
+    ASSERT_EQ(available_dblocks(&fs), free_before - INODE_DIRECT_BLOCK_COUNT - fanout - 1);
+
+    std::vector<char> read(new_size);
+    size_t bytes_read;
+    ASSERT_EQ(inode_read_data(&fs, file, 0, read.data(), new_size, &bytes_read), SUCCESS);
+    ASSERT_EQ(memcmp(read.data(), data.data(), new_size), 0);
+
+    ASSERT_EQ(inode_shrink_data(&fs, file, 0), SUCCESS);
+    ASSERT_EQ(file->internal.indirect_dblock, 0);
+    ASSERT_EQ(file->internal.indirect_layout, INDIRECT_CHAIN);
+    ASSERT_EQ(available_dblocks(&fs), free_before);
+
+    free_filesystem(&fs);
+}
+
+// files that already have a chain keep it
+TEST_F(IndirectTreeSuite, ExistingChainKept)
+{
+    SKIP_WITHOUT_BUNDLED_IMAGES();
+
+    filesystem_t fs;
+    load_fs(INPUT "large.bin", fs);
+    fs.indirect_layout = INDIRECT_TREE;
+
+    inode_t *file = &fs.inodes[5];
+    size_t old_size = file->internal.file_size;
+    char message[100];
+    memset(message, 'x', sizeof(message));
+    ASSERT_EQ(inode_write_data(&fs, file, message, sizeof(message)), SUCCESS);
+    ASSERT_EQ(file->internal.indirect_layout, INDIRECT_CHAIN);
+
+    char buffer[100];
+    size_t bytes_read;
+    ASSERT_EQ(inode_read_data(&fs, file, old_size, buffer, sizeof(buffer), &bytes_read), SUCCESS);
+    ASSERT_EQ(memcmp(buffer, message, sizeof(message)), 0);
+
+    free_filesystem(&fs);
+}
+
+// the layout is stored in the inode, so a reloaded image still reads and checks clean
+TEST_F(IndirectTreeSuite, SaveLoadChecked)
+{
+    filesystem_t fs, loaded;
+    ASSERT_EQ(new_filesystem(&fs, 4, 4 * fanout + 16), SUCCESS);
+    fs.indirect_layout = INDIRECT_TREE;
+    inode_t *file = new_test_inode(fs);
+    std::vector<char> data = test_pattern((INODE_DIRECT_BLOCK_COUNT + fanout + 2) * DATA_BLOCK_SIZE);
+    ASSERT_EQ(inode_write_data(&fs, file, data.data(), data.size()), SUCCESS);
+    ASSERT_EQ(save_filesystem(output_file, &fs), SUCCESS);
+
+    rewind(output_file);
+    fs_load_report_t report;
+    ASSERT_EQ(load_filesystem_checked(output_file, &loaded, &report), SUCCESS);
+    ASSERT_EQ(report.leaked_dblocks, 0);
+    ASSERT_EQ(report.unmarked_dblocks, 0);
+    ASSERT_EQ(report.shared_dblocks, 0);
+    ASSERT_EQ(report.invalid_references, 0);
+
+    std::vector<char> read(data.size());
+    size_t bytes_read;
+    inode_t *loaded_file = &loaded.inodes[file - fs.inodes];
+    ASSERT_EQ(inode_read_data(&loaded, loaded_file, 0, read.data(), read.size(), &bytes_read), SUCCESS);
+    ASSERT_EQ(memcmp(read.data(), data.data(), data.size()), 0);
+
+    free_filesystem(&loaded);
+    free_filesystem(&fs);
+}
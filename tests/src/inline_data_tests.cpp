@@ -0,0 +1,174 @@
+#include "test_util.hpp"
+
+#include <vector>
+
+using InlineDataSuite = fs_internal_test;
+
+// small writes and modifies never touch the dblocks
+TEST_F(InlineDataSuite, SmallFileStaysInline)
+{
+    filesystem_t fs;
+    ASSERT_EQ(new_filesystem(&fs, 4, 16), SUCCESS);
+    fs.inline_data_limit = INODE_INLINE_CAPACITY;
+    inode_t *file = new_test_inode(fs);
+    size_t free_before = available_dblocks(&fs);
+
+    std::vector<char> data = test_pattern(INODE_INLINE_CAPACITY - 4, 1);
+    ASSERT_EQ(inode_write_data(&fs, file, data.data(), 6), SUCCESS);
+    ASSERT_EQ(inode_write_data(&fs, file, data.data() + 6, data.size() - 6), SUCCESS);
+    ASSERT_EQ(file->internal.indirect_layout, INDIRECT_INLINE);
+    ASSERT_EQ(available_dblocks(&fs), free_before);
+    expect_contents(fs, file, data);
+
+    // a modify that grows the file up to the capacity stays inline too
+    std::vector<char> changed = test_pattern(8, 2);
+    ASSERT_EQ(inode_modify_data(&fs, file, data.size() - 4, changed.data(), changed.size()), SUCCESS);
+    data.resize(INODE_INLINE_CAPACITY);
+    memcpy(data.data() + data.size() - 8, changed.data(), changed.size());
+    ASSERT_EQ(file->internal.indirect_layout, INDIRECT_INLINE);
+    ASSERT_EQ(available_dblocks(&fs), free_before);
+    expect_contents(fs, file, data);
+
+    free_filesystem(&fs);
+}
+
+// growing past the limit moves the data into dblocks
+TEST_F(InlineDataSuite, GrowthPromotes)
+{
+    filesystem_t fs;
+    ASSERT_EQ(new_filesystem(&fs, 4, 16), SUCCESS);
+    fs.inline_data_limit = 12;
+    inode_t *file = new_test_inode(fs);
+    size_t free_before = available_dblocks(&fs);
+
+    std::vector<char> data = test_pattern(3 * DATA_BLOCK_SIZE, 3);
+    ASSERT_EQ(inode_write_data(&fs, file, data.data(), 12), SUCCESS);
+    ASSERT_EQ(file->internal.indirect_layout, INDIRECT_INLINE);
+
+    ASSERT_EQ(inode_modify_data(&fs, file, 10, data.data() + 10, 10), SUCCESS);
+    ASSERT_EQ(file->internal.indirect_layout, INDIRECT_CHAIN);
+    ASSERT_EQ(available_dblocks(&fs), free_before - 1);
+
+    ASSERT_EQ(inode_write_data(&fs, file, data.data() + 20, data.size() - 20), SUCCESS);
+    ASSERT_EQ(available_dblocks(&fs), free_before - 3);
+    expect_contents(fs, file, data);
+
+    free_filesystem(&fs);
+}
+
+// a promotion that cannot get its dblocks leaves the inline data alone
+TEST_F(InlineDataSuite, FailedPromotionKeepsData)
+{
+    filesystem_t fs;
+    ASSERT_EQ(new_filesystem(&fs, 4, 3), SUCCESS);
+    fs.inline_data_limit = INODE_INLINE_CAPACITY;
+    inode_t *file = new_test_inode(fs);
+
+    std::vector<char> data = test_pattern(8, 4);
+    ASSERT_EQ(inode_write_data(&fs, file, data.data(), data.size()), SUCCESS);
+
+    std::vector<char> big = test_pattern(3 * DATA_BLOCK_SIZE, 5);
+    ASSERT_EQ(inode_write_data(&fs, file, big.data(), big.size()), INSUFFICIENT_DBLOCKS);
+    ASSERT_EQ(file->internal.indirect_layout, INDIRECT_INLINE);
+    ASSERT_EQ(available_dblocks(&fs), 2);
+    expect_contents(fs, file, data);
+
+    free_filesystem(&fs);
+}
+
+// shrinking below the limit releases every dblock, and shrinking to nothing leaves a plain empty file
+TEST_F(InlineDataSuite, ShrinkDemotes)
+{
+    filesystem_t fs;
+    ASSERT_EQ(new_filesystem(&fs, 4, 32), SUCCESS);
+    fs.inline_data_limit = INODE_INLINE_CAPACITY;
+    inode_t *file = new_test_inode(fs);
+    size_t free_before = available_dblocks(&fs);
+
+    std::vector<char> data = test_pattern((INODE_DIRECT_BLOCK_COUNT + 2) * DATA_BLOCK_SIZE, 6);
+    ASSERT_EQ(inode_write_data(&fs, file, data.data(), data.size()), SUCCESS);
+    ASSERT_EQ(file->internal.indirect_layout, INDIRECT_CHAIN);
+
+    ASSERT_EQ(inode_shrink_data(&fs, file, 9), SUCCESS);
+    ASSERT_EQ(file->internal.indirect_layout, INDIRECT_INLINE);
+    ASSERT_EQ(available_dblocks(&fs), free_before);
+    data.resize(9);
+    expect_contents(fs, file, data);
+
+    ASSERT_EQ(inode_shrink_data(&fs, file, 4), SUCCESS);
+    data.resize(4);
+    expect_contents(fs, file, data);
+
+    ASSERT_EQ(inode_shrink_data(&fs, file, 0), SUCCESS);
+    ASSERT_EQ(file->internal.indirect_layout, INDIRECT_CHAIN);
+    ASSERT_EQ(file->internal.indirect_dblock, 0);
+    ASSERT_EQ(available_dblocks(&fs), free_before);
+
+    free_filesystem(&fs);
+}
+
+// a file whose block map lost a dblock can not be read into the inode, so it stays as it is
+TEST_F(InlineDataSuite, BrokenMapNotDemoted)
+{
+    filesystem_t fs;
+    ASSERT_EQ(new_filesystem(&fs, 4, 32), SUCCESS);
+    fs.inline_data_limit = INODE_INLINE_CAPACITY;
+    inode_t *file = new_test_inode(fs);
+    std::vector<char> data = test_pattern(3 * DATA_BLOCK_SIZE, 8);
+    ASSERT_EQ(inode_write_data(&fs, file, data.data(), data.size()), SUCCESS);
+
+    dblock_index_t first = file->internal.direct_data[0];
+    file->internal.direct_data[0] = 0;
+    inode_t before = *file;
+    ASSERT_EQ(inode_shrink_data(&fs, file, 9), INVALID_INPUT);
+    ASSERT_EQ(memcmp(file, &before, sizeof(inode_t)), 0);
+
+    file->internal.direct_data[0] = first;
+    expect_contents(fs, file, data);
+    free_filesystem(&fs);
+}
+
+// without a limit, even one byte gets its own dblock as before
+TEST_F(InlineDataSuite, OffByDefault)
+{
+    filesystem_t fs;
+    ASSERT_EQ(new_filesystem(&fs, 4, 16), SUCCESS);
+    ASSERT_EQ(fs.inline_data_limit, 0);
+    fs.inline_data_limit = 0;
+    inode_t *file = new_test_inode(fs);
+    size_t free_before = available_dblocks(&fs);
+
+    char c = 'x';
+    ASSERT_EQ(inode_write_data(&fs, file, &c, 1), SUCCESS);
+    ASSERT_EQ(file->internal.indirect_layout, INDIRECT_CHAIN);
+    ASSERT_EQ(available_dblocks(&fs), free_before - 1);
+
+    free_filesystem(&fs);
+}
+
+// inline inodes survive a save and load, and the consistency check finds no dblocks for them
+TEST_F(InlineDataSuite, SaveLoadChecked)
+{
+    filesystem_t fs, loaded;
+    ASSERT_EQ(new_filesystem(&fs, 4, 16), SUCCESS);
+    fs.inline_data_limit = INODE_INLINE_CAPACITY;
+    inode_t *file = new_test_inode(fs);
+    std::vector<char> data = test_pattern(INODE_INLINE_CAPACITY, 7);
+    ASSERT_EQ(inode_write_data(&fs, file, data.data(), data.size()), SUCCESS);
+    ASSERT_EQ(save_filesystem(output_file, &fs), SUCCESS);
+
+    rewind(output_file);
+    fs_load_report_t report;
+    ASSERT_EQ(load_filesystem_checked(output_file, &loaded, &report), SUCCESS);
+    ASSERT_EQ(report.leaked_dblocks, 0);
+    ASSERT_EQ(report.unmarked_dblocks, 0);
+    ASSERT_EQ(report.shared_dblocks, 0);
+    ASSERT_EQ(report.invalid_references, 0);
+
+    // the limit is not part of the image, but inline inodes stay readable without it
+    ASSERT_EQ(loaded.inline_data_limit, 0);
+    expect_contents(loaded, &loaded.inodes[file - fs.inodes], data);
+
+    free_filesystem(&loaded);
+    free_filesystem(&fs);
+}
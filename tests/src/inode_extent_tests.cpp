@@ -0,0 +1,233 @@
+#include "test_util.hpp"
+
+#include <vector>
+
+using INodeExtentSuite = fs_internal_test;
+
+// (first dblock, length) pairs per extent dblock, the last slot links to the next one
+constexpr size_t extents_per_dblock = (DATA_BLOCK_SIZE / sizeof(dblock_index_t) - 1) / 2;
+
+static dblock_index_t *extent_slots(filesystem_t& fs, dblock_index_t extent_dblock)
+{
+    return (dblock_index_t *) (fs.dblocks + extent_dblock * DATA_BLOCK_SIZE);
+}
+
+// a write into free space becomes a single extent
+TEST_F(INodeExtentSuite, ContiguousWriteOneExtent)
+{
+    filesystem_t fs;
+    ASSERT_EQ(new_filesystem(&fs, 4, 256), SUCCESS);
+    fs.indirect_layout = INDIRECT_EXTENTS;
+    inode_t *file = new_test_inode(fs);
+    size_t free_before = available_dblocks(&fs);
+
+    std::vector<char> data = test_pattern(100 * DATA_BLOCK_SIZE - 10, 0);
+    ASSERT_EQ(inode_write_data(&fs, file, data.data(), data.size()), SUCCESS);
+    ASSERT_EQ(file->internal.indirect_layout, INDIRECT_EXTENTS);
+    ASSERT_EQ(available_dblocks(&fs), free_before - 100 - 1);
+
+    dblock_index_t *slots = extent_slots(fs, file->internal.indirect_dblock);
+    ASSERT_EQ(slots[0], file->internal.direct_data[INODE_DIRECT_BLOCK_COUNT - 1] + 1);
+    ASSERT_EQ(slots[1], 100 - INODE_DIRECT_BLOCK_COUNT);
+    ASSERT_EQ(slots[3], 0);
+
+    expect_contents(fs, file, data);
+
+    // modifying across the whole extent reads back too
+    std::vector<char> changed = test_pattern(data.size() - 500, 7);
+    ASSERT_EQ(inode_modify_data(&fs, file, 300, changed.data(), changed.size()), SUCCESS);
+    memcpy(data.data() + 300, changed.data(), changed.size());
+    expect_contents(fs, file, data);
+
+    free_filesystem(&fs);
+}
+
+// a file keeps growing in place, and starts a new extent when another file is in the way
+TEST_F(INodeExtentSuite, InterleavedAppends)
+{
+    filesystem_t fs;
+    ASSERT_EQ(new_filesystem(&fs, 4, 256), SUCCESS);
+    fs.indirect_layout = INDIRECT_EXTENTS;
+    inode_t *a = new_test_inode(fs);
+    inode_t *b = new_test_inode(fs);
+
+    std::vector<char> a_data = test_pattern(30 * DATA_BLOCK_SIZE, 1);
+    std::vector<char> b_data = test_pattern(10 * DATA_BLOCK_SIZE, 2);
+    ASSERT_EQ(inode_write_data(&fs, a, a_data.data(), 10 * DATA_BLOCK_SIZE), SUCCESS);
+    ASSERT_EQ(inode_write_data(&fs, a, a_data.data() + 10 * DATA_BLOCK_SIZE, 10 * DATA_BLOCK_SIZE), SUCCESS);
+    ASSERT_EQ(inode_write_data(&fs, b, b_data.data(), b_data.size()), SUCCESS);
+    ASSERT_EQ(inode_write_data(&fs, a, a_data.data() + 20 * DATA_BLOCK_SIZE, 10 * DATA_BLOCK_SIZE), SUCCESS);
+
+    dblock_index_t *slots = extent_slots(fs, a->internal.indirect_dblock);
+    ASSERT_EQ(slots[1], 20 - INODE_DIRECT_BLOCK_COUNT) << "the second write should extend the first extent";
+    ASSERT_EQ(slots[3], 10);
+    ASSERT_EQ(slots[5], 0);
+
+    expect_contents(fs, a, a_data);
+    expect_contents(fs, b, b_data);
+
+    free_filesystem(&fs);
+}
+
+// more extents than fit in one extent dblock, then shrinking them away
+TEST_F(INodeExtentSuite, ChainedExtentDBlocks)
+{
+    // every one dblock append of a lands behind one of b, so each needs a new extent
+    size_t appends = INODE_DIRECT_BLOCK_COUNT + extents_per_dblock + 3;
+
+    filesystem_t fs;
+    ASSERT_EQ(new_filesystem(&fs, 4, 2 * appends + 16), SUCCESS);
+    fs.indirect_layout = INDIRECT_EXTENTS;
+    inode_t *a = new_test_inode(fs);
+    inode_t *b = new_test_inode(fs);
+    size_t free_before = available_dblocks(&fs);
+
+    std::vector<char> a_data = test_pattern(appends * DATA_BLOCK_SIZE, 3);
+    std::vector<char> b_data = test_pattern(appends * DATA_BLOCK_SIZE, 4);
+    for (size_t i = 0; i < appends; ++i)
+    {
+        ASSERT_EQ(inode_write_data(&fs, a, a_data.data() + i * DATA_BLOCK_SIZE, DATA_BLOCK_SIZE), SUCCESS);
+        ASSERT_EQ(inode_write_data(&fs, b, b_data.data() + i * DATA_BLOCK_SIZE, DATA_BLOCK_SIZE), SUCCESS);
+    }
+    ASSERT_NE(extent_slots(fs, a->internal.indirect_dblock)[DATA_BLOCK_SIZE / sizeof(dblock_index_t) - 1], 0);
+    expect_contents(fs, a, a_data);
+    expect_contents(fs, b, b_data);
+
+    // back into the first extent dblock, the second one is released
+    size_t kept = INODE_DIRECT_BLOCK_COUNT + 2;
+    ASSERT_EQ(inode_shrink_data(&fs, a, kept * DATA_BLOCK_SIZE), SUCCESS);
+    ASSERT_EQ(extent_slots(fs, a->internal.indirect_dblock)[DATA_BLOCK_SIZE / sizeof(dblock_index_t) - 1], 0);
+    a_data.resize(kept * DATA_BLOCK_SIZE);
+    expect_contents(fs, a, a_data);
+
+    ASSERT_EQ(inode_shrink_data(&fs, a, 0), SUCCESS);
+    ASSERT_EQ(inode_shrink_data(&fs, b, 0), SUCCESS);
+    ASSERT_EQ(a->internal.indirect_dblock, 0);
+    ASSERT_EQ(a->internal.indirect_layout, INDIRECT_CHAIN);
+    ASSERT_EQ(available_dblocks(&fs), free_before);
+
+    free_filesystem(&fs);
+}
+
+// a cursor resumes from the extent it stopped at, through appends, seeks and shrinks
+TEST_F(INodeExtentSuite, CursorFollowsExtents)
+{
+    size_t appends = INODE_DIRECT_BLOCK_COUNT + 2 * extents_per_dblock + 3;
+
+    filesystem_t fs;
+    ASSERT_EQ(new_filesystem(&fs, 4, 2 * appends + 16), SUCCESS);
+    fs.indirect_layout = INDIRECT_EXTENTS;
+    inode_t *a = new_test_inode(fs);
+    inode_t *b = new_test_inode(fs);
+
+    // every append of a goes through the same cursor and lands behind one of b, so each is an extent of its own
+    std::vector<char> a_data = test_pattern(appends * DATA_BLOCK_SIZE, 5);
+    std::vector<char> b_data = test_pattern(appends * DATA_BLOCK_SIZE, 6);
+    dblock_cursor_t cursor{};
+    for (size_t i = 0; i < appends; ++i)
+    {
+        ASSERT_EQ(inode_modify_data_cursor(&fs, a, &cursor, i * DATA_BLOCK_SIZE, a_data.data() + i * DATA_BLOCK_SIZE, DATA_BLOCK_SIZE), SUCCESS);
+        ASSERT_EQ(inode_write_data(&fs, b, b_data.data() + i * DATA_BLOCK_SIZE, DATA_BLOCK_SIZE), SUCCESS);
+    }
+    expect_contents(fs, a, a_data);
+    expect_contents(fs, b, b_data);
+
+    // small sequential reads, then a seek back to before the remembered extent
+    constexpr size_t chunk_size = 7;
+    std::vector<char> output(a_data.size());
+    for (size_t offset = 0; offset < output.size();)
+    {
+        size_t bytes_read = 0;
+        ASSERT_EQ(inode_read_data_cursor(&fs, a, &cursor, offset, output.data() + offset, chunk_size, &bytes_read), SUCCESS);
+        ASSERT_NE(bytes_read, 0) << "No progress at offset " << offset;
+        offset += bytes_read;
+    }
+    ASSERT_EQ(output, a_data);
+
+    char back[chunk_size];
+    size_t bytes_read = 0;
+    size_t back_offset = (INODE_DIRECT_BLOCK_COUNT + 1) * DATA_BLOCK_SIZE + 3;
+    ASSERT_EQ(inode_read_data_cursor(&fs, a, &cursor, back_offset, back, chunk_size, &bytes_read), SUCCESS);
+    ASSERT_EQ(memcmp(back, a_data.data() + back_offset, chunk_size), 0);
+
+    // a shrink releases extents, so the cursor must not be trusted afterwards
+    size_t kept = INODE_DIRECT_BLOCK_COUNT + 2;
+    ASSERT_EQ(inode_shrink_data(&fs, a, kept * DATA_BLOCK_SIZE), SUCCESS);
+    ASSERT_EQ(inode_shrink_data(&fs, b, 0), SUCCESS);
+    ASSERT_EQ(inode_modify_data_cursor(&fs, a, &cursor, kept * DATA_BLOCK_SIZE, a_data.data() + kept * DATA_BLOCK_SIZE, a_data.size() - kept * DATA_BLOCK_SIZE), SUCCESS);
+    expect_contents(fs, a, a_data);
+    size_t tail_offset = a_data.size() - chunk_size;
+    ASSERT_EQ(inode_read_data_cursor(&fs, a, &cursor, tail_offset, back, chunk_size, &bytes_read), SUCCESS);
+    ASSERT_EQ(memcmp(back, a_data.data() + tail_offset, chunk_size), 0);
+
+    free_filesystem(&fs);
+}
+
+// a write into scattered dblocks reserves an extent dblock for every run it may need, so running
+// out of them is noticed before anything changes
+TEST_F(INodeExtentSuite, FragmentedWriteFailsUntouched)
+{
+    // one run per dblock needs two extent dblocks, one more than there is room for
+    size_t runs = 2 * extents_per_dblock;
+
+    filesystem_t fs;
+    ASSERT_EQ(new_filesystem(&fs, 4, 2 * runs + 16), SUCCESS);
+    fs.indirect_layout = INDIRECT_EXTENTS;
+    inode_t *file = new_test_inode(fs);
+    std::vector<char> data = test_pattern(INODE_DIRECT_BLOCK_COUNT * DATA_BLOCK_SIZE, 3);
+    ASSERT_EQ(inode_write_data(&fs, file, data.data(), data.size()), SUCCESS);
+
+    // leave every other dblock of a stretch available, enough for the data and one extent dblock
+    std::vector<dblock_index_t> claimed;
+    dblock_index_t index;
+    while (claim_available_dblock(&fs, &index) == SUCCESS) claimed.push_back(index);
+    ASSERT_GE(claimed.size(), 2 * (runs + 1));
+    for (size_t i = 0; i < runs + 1; ++i)
+    {
+        ASSERT_EQ(release_dblock(&fs, fs.dblocks + claimed[2 * i] * DATA_BLOCK_SIZE), SUCCESS);
+    }
+
+    std::vector<byte> bitmask(fs.dblock_bitmask, fs.dblock_bitmask + (fs.dblock_count + 7) / 8);
+    inode_t before = *file;
+    std::vector<char> more = test_pattern(runs * DATA_BLOCK_SIZE, 4);
+    ASSERT_EQ(inode_write_data(&fs, file, more.data(), more.size()), INSUFFICIENT_DBLOCKS);
+    EXPECT_EQ(memcmp(fs.dblock_bitmask, bitmask.data(), bitmask.size()), 0);
+    EXPECT_EQ(memcmp(file, &before, sizeof(inode_t)), 0);
+    expect_contents(fs, file, data);
+
+    // with one more dblock available the second extent dblock fits as well
+    ASSERT_EQ(release_dblock(&fs, fs.dblocks + claimed[1] * DATA_BLOCK_SIZE), SUCCESS);
+    ASSERT_EQ(inode_write_data(&fs, file, more.data(), more.size()), SUCCESS);
+    data.insert(data.end(), more.begin(), more.end());
+    expect_contents(fs, file, data);
+
+    free_filesystem(&fs);
+}
+
+// the layout is stored in the inode, so a reloaded image still reads and checks clean
+TEST_F(INodeExtentSuite, SaveLoadChecked)
+{
+    filesystem_t fs, loaded;
+    ASSERT_EQ(new_filesystem(&fs, 4, 256), SUCCESS);
+    fs.indirect_layout = INDIRECT_EXTENTS;
+    inode_t *a = new_test_inode(fs);
+    inode_t *b = new_test_inode(fs);
+    std::vector<char> a_data = test_pattern(40 * DATA_BLOCK_SIZE + 5, 5);
+    ASSERT_EQ(inode_write_data(&fs, a, a_data.data(), 20 * DATA_BLOCK_SIZE), SUCCESS);
+    ASSERT_EQ(inode_write_data(&fs, b, a_data.data(), 3 * DATA_BLOCK_SIZE), SUCCESS);
+    ASSERT_EQ(inode_write_data(&fs, a, a_data.data() + 20 * DATA_BLOCK_SIZE, a_data.size() - 20 * DATA_BLOCK_SIZE), SUCCESS);
+    ASSERT_EQ(save_filesystem(output_file, &fs), SUCCESS);
+
+    rewind(output_file);
+    fs_load_report_t report;
+    ASSERT_EQ(load_filesystem_checked(output_file, &loaded, &report), SUCCESS);
+    ASSERT_EQ(report.leaked_dblocks, 0);
+    ASSERT_EQ(report.unmarked_dblocks, 0);
+    ASSERT_EQ(report.shared_dblocks, 0);
+    ASSERT_EQ(report.invalid_references, 0);
+
+    expect_contents(loaded, &loaded.inodes[a - fs.inodes], a_data);
+
+    free_filesystem(&loaded);
+    free_filesystem(&fs);
+}
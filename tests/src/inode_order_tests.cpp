@@ -0,0 +1,267 @@
+#include "test_util.hpp"
+
+extern "C"
+{
+#include "fsck.h"
+}
+
+#include <algorithm>
+#include <cstring>
+#include <string>
+#include <vector>
+
+using INodeOrderSuite = fs_internal_test;
+
+static std::vector<inode_index_t> free_list(filesystem_t& fs)
+{
+    std::vector<inode_index_t> list;
+    for (inode_index_t i = fs.available_inode; i != 0 && list.size() <= fs.inode_count; i = fs.inodes[i].next_free_inode) list.push_back(i);
+    return list;
+}
+
+// appends a directory entry for `idx` to `dir`
+static void add_entry(filesystem_t& fs, inode_t *dir, inode_index_t idx, const char *name)
+{
+    byte entry[entry_size] = {};
+    memcpy(entry, &idx, sizeof(idx));
+    strncpy((char *) entry + sizeof(idx), name, MAX_FILE_NAME_LEN);
+    ASSERT_EQ(inode_write_data(&fs, dir, entry, entry_size), SUCCESS);
+}
+
+// every named entry of every directory leads to an inode in use with that name
+static void expect_entries_match(filesystem_t& fs)
+{
+    std::vector<inode_index_t> free_inodes = free_list(fs);
+    for (size_t i = 0; i < fs.inode_count; ++i)
+    {
+        inode_t *dir = &fs.inodes[i];
+        bool in_use = i == 0 || std::find(free_inodes.begin(), free_inodes.end(), i) == free_inodes.end();
+        if (!in_use || dir->internal.file_type != DIRECTORY) continue;
+
+        std::vector<byte> entries(dir->internal.file_size);
+        size_t bytes_read;
+        ASSERT_EQ(inode_read_data(&fs, dir, 0, entries.data(), entries.size(), &bytes_read), SUCCESS);
+        for (size_t offset = 0; offset + entry_size <= entries.size(); offset += entry_size)
+        {
+            std::string name((const char *) entries.data() + offset + sizeof(inode_index_t), strnlen((const char *) entries.data() + offset + sizeof(inode_index_t), MAX_FILE_NAME_LEN));
+            if (name.empty() || name == "..") continue;
+            inode_index_t idx;
+            memcpy(&idx, entries.data() + offset, sizeof(idx));
+            ASSERT_LT(idx, fs.inode_count);
+            if (name == ".")
+            {
+                ASSERT_EQ(idx, i);
+                continue;
+            }
+            ASSERT_EQ(std::string(fs.inodes[idx].internal.file_name, strnlen(fs.inodes[idx].internal.file_name, MAX_FILE_NAME_LEN)), name);
+        }
+    }
+}
+
+// released inodes are handed out LIFO by default, lowest first once the list is kept sorted
+TEST_F(INodeOrderSuite, SortedReleasePrefersLowInodes)
+{
+    filesystem_t fs;
+    ASSERT_EQ(new_filesystem(&fs, 16, 4), SUCCESS);
+    for (size_t i = 1; i <= 10; ++i)
+    {
+        inode_index_t idx;
+        ASSERT_EQ(claim_available_inode(&fs, &idx), SUCCESS);
+        ASSERT_EQ(idx, i);
+    }
+
+    for (inode_index_t i : { 7, 3, 9 }) ASSERT_EQ(release_inode(&fs, &fs.inodes[i]), SUCCESS);
+    ASSERT_EQ(free_list(fs), (std::vector<inode_index_t>{ 9, 3, 7, 11, 12, 13, 14, 15 }));
+    inode_index_t idx;
+    for (inode_index_t expected : { 9, 3, 7 })
+    {
+        ASSERT_EQ(claim_available_inode(&fs, &idx), SUCCESS);
+        ASSERT_EQ(idx, expected);
+    }
+
+    fs.sorted_free_inodes = true;
+    for (inode_index_t i : { 7, 3, 9, 1 }) ASSERT_EQ(release_inode(&fs, &fs.inodes[i]), SUCCESS);
+    ASSERT_EQ(free_list(fs), (std::vector<inode_index_t>{ 1, 3, 7, 9, 11, 12, 13, 14, 15 }));
+    ASSERT_EQ(available_inodes(&fs), 9);
+    for (inode_index_t expected : { 1, 3, 7, 9, 11 })
+    {
+        ASSERT_EQ(claim_available_inode(&fs, &idx), SUCCESS);
+        ASSERT_EQ(idx, expected);
+    }
+
+    free_filesystem(&fs);
+}
+
+// sorting a scattered free list keeps the same free inodes, in ascending order
+TEST_F(INodeOrderSuite, SortFreeInodes)
+{
+    SKIP_WITHOUT_BUNDLED_IMAGES();
+
+    filesystem_t fs;
+    load_fs(INPUT "empty_random_inode_fragmented.bin", fs);
+    std::vector<inode_index_t> before = free_list(fs);
+    ASSERT_FALSE(std::is_sorted(before.begin(), before.end()));
+
+    ASSERT_EQ(sort_free_inodes(&fs), SUCCESS);
+    std::vector<inode_index_t> after = free_list(fs);
+    ASSERT_TRUE(std::is_sorted(after.begin(), after.end()));
+    std::sort(before.begin(), before.end());
+    ASSERT_EQ(after, before);
+    ASSERT_EQ(available_inodes(&fs), after.size());
+
+    ASSERT_EQ(sort_free_inodes(NULL), INVALID_INPUT);
+    free_filesystem(&fs);
+}
+
+// a bundled image with holes in its inode table is packed, and its directories still lead to the same files
+TEST_F(INodeOrderSuite, CompactImage)
+{
+    SKIP_WITHOUT_BUNDLED_IMAGES();
+
+    filesystem_t fs;
+    load_fs(INPUT "medium_tombstone.bin", fs);
+    size_t used = fs.inode_count - available_inodes(&fs);
+    std::vector<std::string> names;
+    std::vector<inode_index_t> free_inodes = free_list(fs);
+    for (size_t i = 0; i < fs.inode_count; ++i)
+    {
+        if (std::find(free_inodes.begin(), free_inodes.end(), i) == free_inodes.end()) names.push_back(fs.inodes[i].internal.file_name);
+    }
+
+    std::vector<inode_index_t> renumbered(fs.inode_count);
+    ASSERT_EQ(compact_inodes(&fs, renumbered.data()), SUCCESS);
+    ASSERT_EQ(renumbered[0], 0);
+    ASSERT_EQ(fs.inode_count - available_inodes(&fs), used);
+
+    // the files keep their order, and the free inodes are everything after them
+    std::vector<inode_index_t> after = free_list(fs);
+    ASSERT_EQ(after.size(), fs.inode_count - used);
+    for (size_t i = 0; i < after.size(); ++i) ASSERT_EQ(after[i], used + i);
+    for (size_t i = 0; i < used; ++i) ASSERT_STREQ(fs.inodes[i].internal.file_name, names[i].c_str());
+    expect_entries_match(fs);
+
+    fs_fsck_report_t report;
+    ASSERT_EQ(fsck_filesystem(&fs, 1, &report), SUCCESS);
+    ASSERT_FALSE(report.broken_free_inode_list);
+    ASSERT_EQ(report.dblocks.invalid_references, 0);
+    ASSERT_EQ(report.dblocks.shared_dblocks, 0);
+
+    free_filesystem(&fs);
+}
+
+// files with data keep it, and a directory naming a free inode stops the compaction before anything changes
+TEST_F(INodeOrderSuite, CompactFilesAndRejectDangling)
+{
+    filesystem_t fs;
+    ASSERT_EQ(new_filesystem(&fs, 32, 256), SUCCESS);
+    inode_t *root = &fs.inodes[0];
+    std::vector<inode_t *> files;
+    for (size_t i = 0; i < 12; ++i)
+    {
+        std::string name = "f" + std::to_string(i);
+        inode_t *file = new_test_inode(fs, DATA_FILE, name.c_str());
+        std::vector<char> data((i + 1) * DATA_BLOCK_SIZE / 2, (char) ('a' + i));
+        ASSERT_EQ(inode_write_data(&fs, file, data.data(), data.size()), SUCCESS);
+        files.push_back(file);
+    }
+    inode_t *sub = new_test_inode(fs, DIRECTORY, "sub");
+    add_entry(fs, sub, sub - fs.inodes, ".");
+    add_entry(fs, sub, 0, "..");
+    add_entry(fs, root, sub - fs.inodes, "sub");
+
+    // every other file is deleted, and the rest are split between the two directories
+    for (size_t i = 0; i < files.size(); ++i)
+    {
+        if (i % 2 == 0)
+        {
+            ASSERT_EQ(inode_release_data(&fs, files[i]), SUCCESS);
+            ASSERT_EQ(release_inode(&fs, files[i]), SUCCESS);
+        }
+        else
+        {
+            add_entry(fs, i % 4 == 1 ? root : sub, files[i] - fs.inodes, files[i]->internal.file_name);
+        }
+    }
+    expect_entries_match(fs);
+
+    // a dangling entry: nothing may change
+    add_entry(fs, sub, files[0] - fs.inodes, "gone");
+    std::vector<inode_t> inodes_before(fs.inodes, fs.inodes + fs.inode_count);
+    inode_index_t available_before = fs.available_inode;
+    ASSERT_EQ(compact_inodes(&fs, NULL), INVALID_INPUT);
+    ASSERT_EQ(memcmp(inodes_before.data(), fs.inodes, fs.inode_count * sizeof(inode_t)), 0);
+    ASSERT_EQ(fs.available_inode, available_before);
+    ASSERT_EQ(inode_shrink_data(&fs, sub, sub->internal.file_size - entry_size), SUCCESS);
+
+    std::vector<inode_index_t> renumbered(fs.inode_count);
+    ASSERT_EQ(compact_inodes(&fs, renumbered.data()), SUCCESS);
+    expect_entries_match(fs);
+    ASSERT_EQ(fs.available_inode, 1 + files.size() / 2 + 1);
+    for (size_t i = 1; i < files.size(); i += 2)
+    {
+        inode_t *file = &fs.inodes[renumbered[files[i] - fs.inodes]];
+        ASSERT_STREQ(file->internal.file_name, ("f" + std::to_string(i)).c_str());
+        std::vector<char> expected((i + 1) * DATA_BLOCK_SIZE / 2, (char) ('a' + i));
+        std::vector<char> data(file->internal.file_size);
+        size_t bytes_read;
+        ASSERT_EQ(inode_read_data(&fs, file, 0, data.data(), data.size(), &bytes_read), SUCCESS);
+        ASSERT_EQ(data, expected);
+    }
+
+    // a new file now gets the first inode after the packed ones
+    inode_index_t idx;
+    ASSERT_EQ(claim_available_inode(&fs, &idx), SUCCESS);
+    ASSERT_EQ(idx, 1 + files.size() / 2 + 1);
+
+    free_filesystem(&fs);
+}
+
+// without a sound free inode list there is no telling which inodes are in use
+TEST_F(INodeOrderSuite, CompactRejectsBrokenFreeList)
+{
+    filesystem_t fs;
+    ASSERT_EQ(new_filesystem(&fs, 8, 64), SUCCESS);
+    inode_t *file = new_test_inode(fs, DATA_FILE, "f");
+    std::vector<char> data(2 * DATA_BLOCK_SIZE, 'x');
+    ASSERT_EQ(inode_write_data(&fs, file, data.data(), data.size()), SUCCESS);
+    add_entry(fs, &fs.inodes[0], file - fs.inodes, "f");
+
+    // the list loops back onto its own head
+    std::vector<inode_index_t> list = free_list(fs);
+    ASSERT_GE(list.size(), 2);
+    fs.inodes[list.back()].next_free_inode = list.front();
+
+    std::vector<inode_t> inodes_before(fs.inodes, fs.inodes + fs.inode_count);
+    inode_index_t available_before = fs.available_inode;
+    ASSERT_EQ(compact_inodes(&fs, NULL), INVALID_INPUT);
+    ASSERT_EQ(memcmp(inodes_before.data(), fs.inodes, fs.inode_count * sizeof(inode_t)), 0);
+    ASSERT_EQ(fs.available_inode, available_before);
+
+    fs.inodes[list.back()].next_free_inode = 0;
+    free_filesystem(&fs);
+}
+
+// a directory that can not be read can not be renumbered, and nothing else is either
+TEST_F(INodeOrderSuite, CompactRejectsUnreadableDirectory)
+{
+    filesystem_t fs;
+    ASSERT_EQ(new_filesystem(&fs, 8, 64), SUCCESS);
+    inode_t *sub = new_test_inode(fs, DIRECTORY, "sub");
+    add_entry(fs, sub, sub - fs.inodes, ".");
+    add_entry(fs, sub, 0, "..");
+    add_entry(fs, &fs.inodes[0], sub - fs.inodes, "sub");
+
+    // the block map of the directory lost its first dblock
+    dblock_index_t first = sub->internal.direct_data[0];
+    sub->internal.direct_data[0] = 0;
+    std::vector<byte> entries(sub->internal.file_size);
+    size_t bytes_read;
+    ASSERT_EQ(inode_read_data(&fs, sub, 0, entries.data(), entries.size(), &bytes_read), INVALID_INPUT);
+
+    std::vector<inode_t> inodes_before(fs.inodes, fs.inodes + fs.inode_count);
+    ASSERT_EQ(compact_inodes(&fs, NULL), INVALID_INPUT);
+    ASSERT_EQ(memcmp(inodes_before.data(), fs.inodes, fs.inode_count * sizeof(inode_t)), 0);
+
+    sub->internal.direct_data[0] = first;
+    free_filesystem(&fs);
+}
@@ -97,4 +97,59 @@ TEST_F(INodeReadDataSuite, ReadData2)
     check_fs(INPUT "medium_text.bin", fs); // no changes shouldve been made to the file system
 
     free_filesystem(&fs);
-}
\ No newline at end of file
+}
+
+// reading a file spanning several index dblocks in small pieces while reusing a cursor
+TEST_F(INodeReadDataSuite, ReadDataCursor0)
+{
+    constexpr size_t file_size = 4000;
+    constexpr size_t chunk_size = 7;
+
+    filesystem_t fs;
+    new_filesystem(&fs, 2, 128);
+
+    inode_index_t inode_idx;
+    ASSERT_EQ(claim_available_inode(&fs, &inode_idx), SUCCESS);
+    inode_t *file = &fs.inodes[inode_idx];
+    file->internal.file_type = DATA_FILE;
+    file->internal.file_size = 0;
+
+    char expected[file_size];
+    for (size_t i = 0; i < file_size; ++i) expected[i] = static_cast<char>('a' + i % 26);
+    ASSERT_EQ(inode_write_data(&fs, file, expected, file_size), SUCCESS);
+
+    char output[file_size + OVERFLOW] = { 0 };
+    dblock_cursor_t cursor{};
+    size_t offset = 0;
+    while (offset < file_size)
+    {
+        size_t bytes_read = 0;
+        ASSERT_EQ(inode_read_data_cursor(&fs, file, &cursor, offset, output + offset, chunk_size, &bytes_read), SUCCESS);
+        ASSERT_NE(bytes_read, 0) << "No progress at offset " << offset;
+        offset += bytes_read;
+    }
+    ASSERT_EQ(offset, file_size) << "Incorrect number of bytes read from file.";
+
+    size_t idx = 0;
+    for (; idx < file_size; ++idx)
+        ASSERT_EQ(expected[idx], output[idx]) << "Incorrect for index " << idx;
+    for (; idx < std::size(output); ++idx)
+        ASSERT_EQ(output[idx], 0) << "Wrote into overflow buffer.";
+
+    // seeking backwards with the same cursor must restart from the head of the chain
+    char back[chunk_size] = { 0 };
+    size_t bytes_read = 0;
+    ASSERT_EQ(inode_read_data_cursor(&fs, file, &cursor, 1500, back, chunk_size, &bytes_read), SUCCESS);
+    ASSERT_EQ(bytes_read, chunk_size);
+    for (size_t i = 0; i < chunk_size; ++i)
+        ASSERT_EQ(back[i], expected[1500 + i]) << "Incorrect for index " << 1500 + i;
+
+    // a shrink cuts the chain, so the cursor must not be trusted afterwards
+    ASSERT_EQ(inode_shrink_data(&fs, file, 1000), SUCCESS);
+    ASSERT_EQ(inode_write_data(&fs, file, expected + 1000, file_size - 1000), SUCCESS);
+    ASSERT_EQ(inode_read_data_cursor(&fs, file, &cursor, 3900, back, chunk_size, &bytes_read), SUCCESS);
+    for (size_t i = 0; i < chunk_size; ++i)
+        ASSERT_EQ(back[i], expected[3900 + i]) << "Incorrect for index " << 3900 + i;
+
+    free_filesystem(&fs);
+}
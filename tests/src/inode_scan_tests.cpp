@@ -0,0 +1,124 @@
+#include "test_util.hpp"
+
+extern "C"
+{
+#include "scan.h"
+}
+
+#include <atomic>
+#include <vector>
+
+using INodeScanSuite = fs_internal_test;
+
+struct scan_record
+{
+    std::vector<std::atomic<int>> visits;
+    size_t thread_count;
+    std::atomic<bool> bad_worker{ false };
+
+    explicit scan_record(size_t inode_count, size_t threads) : visits(inode_count), thread_count(threads) {}
+};
+
+static void record_visit(filesystem_t *fs, inode_index_t index, inode_t *inode, size_t worker, void *arg)
+{
+    scan_record *record = static_cast<scan_record *>(arg);
+    if (inode != &fs->inodes[index] || worker >= record->thread_count) record->bad_worker = true;
+    record->visits[index]++;
+}
+
+static bool every_seventh(const filesystem_t *, inode_index_t index, const inode_t *, void *)
+{
+    return index % 7 == 0;
+}
+
+// a file system with `count` inodes where every third one and a few scattered ones are free
+static void make_holes(filesystem_t& fs, size_t count, std::vector<bool>& free_inodes)
+{
+    ASSERT_EQ(new_filesystem(&fs, count, 4), SUCCESS);
+    for (size_t i = 1; i < count; ++i)
+    {
+        inode_index_t idx;
+        ASSERT_EQ(claim_available_inode(&fs, &idx), SUCCESS);
+    }
+    free_inodes.assign(count, false);
+    for (size_t i = 1; i < count; ++i)
+    {
+        if (i % 3 == 0 || i % 1000 == 1)
+        {
+            ASSERT_EQ(release_inode(&fs, &fs.inodes[i]), SUCCESS);
+            free_inodes[i] = true;
+        }
+    }
+}
+
+TEST_F(INodeScanSuite, InvalidInput)
+{
+    filesystem_t fs;
+    ASSERT_EQ(fs_for_each_inode(NULL, NULL, record_visit, NULL, 1), INVALID_INPUT);
+    ASSERT_EQ(new_filesystem(&fs, 4, 4), SUCCESS);
+    ASSERT_EQ(fs_for_each_inode(&fs, NULL, NULL, NULL, 1), INVALID_INPUT);
+    free_filesystem(&fs);
+}
+
+// never more threads than chunks of inodes, and 0 asks for every cpu
+TEST_F(INodeScanSuite, ThreadCount)
+{
+    filesystem_t fs;
+    ASSERT_EQ(new_filesystem(&fs, 5000, 4), SUCCESS);
+    ASSERT_GE(fs_scan_thread_count(&fs, 0), 1);
+    ASSERT_EQ(fs_scan_thread_count(&fs, 3), 3);
+    ASSERT_EQ(fs_scan_thread_count(&fs, 100), 5);
+    free_filesystem(&fs);
+
+    ASSERT_EQ(new_filesystem(&fs, 10, 4), SUCCESS);
+    ASSERT_EQ(fs_scan_thread_count(&fs, 8), 1);
+    free_filesystem(&fs);
+}
+
+// every inode in use is handed out exactly once, however many threads share the table
+TEST_F(INodeScanSuite, VisitsEachInodeInUseOnce)
+{
+    filesystem_t fs;
+    std::vector<bool> free_inodes;
+    make_holes(fs, 9000, free_inodes);
+
+    for (size_t threads : { 1, 2, 4, 0 })
+    {
+        SCOPED_TRACE(threads);
+        scan_record record(fs.inode_count, fs_scan_thread_count(&fs, threads));
+        ASSERT_EQ(fs_for_each_inode(&fs, NULL, record_visit, &record, threads), SUCCESS);
+        ASSERT_FALSE(record.bad_worker);
+        for (size_t i = 0; i < fs.inode_count; ++i) ASSERT_EQ(record.visits[i], free_inodes[i] ? 0 : 1) << "inode " << i;
+    }
+
+    free_filesystem(&fs);
+}
+
+// the predicate decides which inodes in use reach the callback
+TEST_F(INodeScanSuite, Predicate)
+{
+    filesystem_t fs;
+    std::vector<bool> free_inodes;
+    make_holes(fs, 3000, free_inodes);
+
+    scan_record record(fs.inode_count, fs_scan_thread_count(&fs, 3));
+    ASSERT_EQ(fs_for_each_inode(&fs, every_seventh, record_visit, &record, 3), SUCCESS);
+    for (size_t i = 0; i < fs.inode_count; ++i) ASSERT_EQ(record.visits[i], !free_inodes[i] && i % 7 == 0 ? 1 : 0) << "inode " << i;
+
+    free_filesystem(&fs);
+}
+
+// a looping free inode list gives no trustworthy mask, so nothing is scanned
+TEST_F(INodeScanSuite, BrokenFreeList)
+{
+    filesystem_t fs;
+    std::vector<bool> free_inodes;
+    make_holes(fs, 100, free_inodes);
+    fs.inodes[fs.available_inode].next_free_inode = fs.available_inode;
+
+    scan_record record(fs.inode_count, 1);
+    ASSERT_EQ(fs_for_each_inode(&fs, NULL, record_visit, &record, 1), INVALID_INPUT);
+    for (size_t i = 0; i < fs.inode_count; ++i) ASSERT_EQ(record.visits[i], 0);
+
+    free_filesystem(&fs);
+}
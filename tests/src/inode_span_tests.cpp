@@ -0,0 +1,109 @@
+#include "test_util.hpp"
+
+#include <vector>
+
+using INodeSpanSuite = fs_internal_test;
+
+// joins every span of a range, checking that no two of them could have been one
+static std::vector<char> collect_spans(filesystem_t& fs, inode_t *inode, size_t offset, size_t n, size_t *span_count)
+{
+    dblock_span_iterator_t it;
+    EXPECT_EQ(inode_span_begin(&fs, inode, offset, n, &it), SUCCESS);
+
+    std::vector<char> joined;
+    const byte *span, *previous_end = nullptr;
+    size_t len;
+    *span_count = 0;
+    while (inode_span_next(&it, &span, &len))
+    {
+        EXPECT_GT(len, 0);
+        EXPECT_NE(span, previous_end) << "adjacent spans should have been joined";
+        joined.insert(joined.end(), span, span + len);
+        previous_end = span + len;
+        ++*span_count;
+    }
+    return joined;
+}
+
+TEST_F(INodeSpanSuite, InvalidInput)
+{
+    filesystem_t fs;
+    dblock_span_iterator_t it;
+    ASSERT_EQ(inode_span_begin(NULL, NULL, 0, 0, &it), INVALID_INPUT);
+    ASSERT_EQ(inode_span_begin(&fs, NULL, 0, 0, &it), INVALID_INPUT);
+
+    const byte *span;
+    size_t len;
+    ASSERT_FALSE(inode_span_next(NULL, &span, &len));
+}
+
+// the spans of a chained file hold the same bytes a read copies out
+TEST_F(INodeSpanSuite, MatchesRead)
+{
+    SKIP_WITHOUT_BUNDLED_IMAGES();
+
+    filesystem_t fs;
+    load_fs(INPUT "medium_text.bin", fs);
+    inode_t *inode = &fs.inodes[1];
+    size_t file_size = inode->internal.file_size;
+
+    std::vector<char> expected(file_size);
+    size_t bytes_read;
+    ASSERT_EQ(inode_read_data(&fs, inode, 0, expected.data(), file_size, &bytes_read), SUCCESS);
+
+    size_t span_count;
+    ASSERT_EQ(collect_spans(fs, inode, 0, file_size, &span_count), expected);
+    ASSERT_LE(span_count, (file_size + DATA_BLOCK_SIZE - 1) / DATA_BLOCK_SIZE);
+
+    // a range in the middle, clipped at the end of the file
+    std::vector<char> tail(expected.begin() + 100, expected.end());
+    ASSERT_EQ(collect_spans(fs, inode, 100, file_size, &span_count), tail);
+    ASSERT_EQ(collect_spans(fs, inode, file_size, 10, &span_count).size(), 0);
+    ASSERT_EQ(span_count, 0);
+
+    free_filesystem(&fs);
+}
+
+// a file written into free space is one span, direct dblocks included
+TEST_F(INodeSpanSuite, ContiguousFileIsOneSpan)
+{
+    filesystem_t fs;
+    ASSERT_EQ(new_filesystem(&fs, 4, 128), SUCCESS);
+    fs.indirect_layout = INDIRECT_EXTENTS;
+    inode_index_t idx = 0;
+    ASSERT_EQ(claim_available_inode(&fs, &idx), SUCCESS);
+    inode_t *inode = &fs.inodes[idx];
+    inode->internal = {};
+
+    std::vector<char> data(50 * DATA_BLOCK_SIZE - 3);
+    for (size_t i = 0; i < data.size(); ++i) data[i] = (char) (i * 31 + i / DATA_BLOCK_SIZE);
+    ASSERT_EQ(inode_write_data(&fs, inode, data.data(), data.size()), SUCCESS);
+
+    size_t span_count;
+    ASSERT_EQ(collect_spans(fs, inode, 0, data.size(), &span_count), data);
+    ASSERT_EQ(span_count, 1);
+
+    free_filesystem(&fs);
+}
+
+// inline data is looked at in place too
+TEST_F(INodeSpanSuite, InlineFile)
+{
+    filesystem_t fs;
+    ASSERT_EQ(new_filesystem(&fs, 4, 8), SUCCESS);
+    fs.inline_data_limit = INODE_INLINE_CAPACITY;
+    inode_index_t idx = 0;
+    ASSERT_EQ(claim_available_inode(&fs, &idx), SUCCESS);
+    inode_t *inode = &fs.inodes[idx];
+    inode->internal = {};
+
+    char data[] = "tiny";
+    ASSERT_EQ(inode_write_data(&fs, inode, data, sizeof(data)), SUCCESS);
+
+    size_t span_count;
+    std::vector<char> joined = collect_spans(fs, inode, 1, sizeof(data), &span_count);
+    ASSERT_EQ(span_count, 1);
+    ASSERT_EQ(std::string(joined.data()), "iny");
+
+    free_filesystem(&fs);
+}
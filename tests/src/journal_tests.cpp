@@ -0,0 +1,313 @@
+#include "test_util.hpp"
+
+extern "C"
+{
+#include "journal.h"
+}
+
+#include <thread>
+#include <vector>
+
+using JournalSuite = fs_internal_test;
+
+static size_t file_size(FILE *file)
+{
+    struct stat file_stat;
+    EXPECT_NE(fstat(fileno(file), &file_stat), -1) << "System Error. stat failed.";
+    return file_stat.st_size;
+}
+
+TEST_F(JournalSuite, InvalidInput)
+{
+    SKIP_WITHOUT_BUNDLED_IMAGES();
+
+    filesystem_t fs;
+    load_fs(INPUT "medium.bin", fs);
+
+    FILE *journal = tmpfile();
+    ASSERT_NE(journal, nullptr);
+    ASSERT_EQ(attach_journal(NULL, journal, 1), INVALID_INPUT);
+    ASSERT_EQ(attach_journal(&fs, NULL, 1), INVALID_INPUT);
+    ASSERT_EQ(attach_journal(&fs, journal, 0), INVALID_INPUT);
+    ASSERT_EQ(commit_journal(NULL), INVALID_INPUT);
+    ASSERT_EQ(sync_journal(NULL), INVALID_INPUT);
+    ASSERT_EQ(detach_journal(NULL), INVALID_INPUT);
+    ASSERT_EQ(replay_journal(NULL, output_file, NULL), INVALID_INPUT);
+    ASSERT_EQ(replay_journal(journal, NULL, NULL), INVALID_INPUT);
+
+    // without a journal there is nothing to commit, sync or detach, but nothing to checkpoint either
+    ASSERT_EQ(commit_journal(&fs), SUCCESS);
+    ASSERT_EQ(sync_journal(&fs), SUCCESS);
+    ASSERT_EQ(detach_journal(&fs), SUCCESS);
+    ASSERT_EQ(checkpoint_journal(output_file, &fs), INVALID_INPUT);
+    ASSERT_EQ(checkpoint_journal(NULL, &fs), INVALID_INPUT);
+
+    fclose(journal);
+    free_filesystem(&fs);
+}
+
+// a committed write brings the old image to the same bytes an incremental save does
+TEST_F(JournalSuite, ReplayCommitted)
+{
+    SKIP_WITHOUT_BUNDLED_IMAGES();
+
+    copy_image(INPUT "large.bin");
+
+    filesystem_t fs;
+    load_fs(INPUT "large.bin", fs);
+    FILE *journal = tmpfile();
+    ASSERT_NE(journal, nullptr);
+    ASSERT_EQ(attach_journal(&fs, journal, 1), SUCCESS);
+
+    char test_message[1024];
+    memset(test_message, 0x20, std::size(test_message));
+    ASSERT_EQ(inode_write_data(&fs, &fs.inodes[4], test_message, std::size(test_message)), SUCCESS);
+    ASSERT_EQ(commit_journal(&fs), SUCCESS);
+
+    size_t replayed = 0;
+    ASSERT_EQ(replay_journal(journal, output_file, &replayed), SUCCESS);
+    ASSERT_EQ(replayed, 1);
+    compare_expected(OUTPUT "WriteDirectIndirect.bin");
+
+    // replaying again writes the same bytes
+    ASSERT_EQ(replay_journal(journal, output_file, &replayed), SUCCESS);
+    ASSERT_EQ(replayed, 1);
+    compare_expected(OUTPUT "WriteDirectIndirect.bin");
+
+    free_filesystem(&fs);
+}
+
+// nothing changed, nothing committed
+TEST_F(JournalSuite, EmptyCommit)
+{
+    SKIP_WITHOUT_BUNDLED_IMAGES();
+
+    filesystem_t fs;
+    load_fs(INPUT "large.bin", fs);
+    FILE *journal = tmpfile();
+    ASSERT_NE(journal, nullptr);
+    ASSERT_EQ(attach_journal(&fs, journal, 1), SUCCESS);
+
+    ASSERT_EQ(commit_journal(&fs), SUCCESS);
+    ASSERT_EQ(file_size(journal), 0);
+
+    copy_image(INPUT "large.bin");
+    size_t replayed = 1;
+    ASSERT_EQ(replay_journal(journal, output_file, &replayed), SUCCESS);
+    ASSERT_EQ(replayed, 0);
+    compare_expected(INPUT "large.bin");
+
+    free_filesystem(&fs);
+}
+
+// a transaction cut short by a crash is not applied, and neither is anything after it
+TEST_F(JournalSuite, TornTail)
+{
+    SKIP_WITHOUT_BUNDLED_IMAGES();
+
+    copy_image(INPUT "large.bin");
+
+    filesystem_t fs;
+    load_fs(INPUT "large.bin", fs);
+    FILE *journal = tmpfile();
+    ASSERT_NE(journal, nullptr);
+    ASSERT_EQ(attach_journal(&fs, journal, 1), SUCCESS);
+
+    char test_message[1024];
+    memset(test_message, 0x20, std::size(test_message));
+    ASSERT_EQ(inode_write_data(&fs, &fs.inodes[4], test_message, std::size(test_message)), SUCCESS);
+    ASSERT_EQ(commit_journal(&fs), SUCCESS);
+    ASSERT_EQ(inode_shrink_data(&fs, &fs.inodes[5], 0), SUCCESS);
+    ASSERT_EQ(commit_journal(&fs), SUCCESS);
+
+    ASSERT_EQ(ftruncate(fileno(journal), file_size(journal) - 3), 0);
+
+    size_t replayed = 0;
+    ASSERT_EQ(replay_journal(journal, output_file, &replayed), SUCCESS);
+    ASSERT_EQ(replayed, 1);
+    compare_expected(OUTPUT "WriteDirectIndirect.bin");
+
+    free_filesystem(&fs);
+}
+
+// a transaction whose contents do not match its checksum is not applied
+TEST_F(JournalSuite, CorruptTail)
+{
+    SKIP_WITHOUT_BUNDLED_IMAGES();
+
+    copy_image(INPUT "large.bin");
+
+    filesystem_t fs;
+    load_fs(INPUT "large.bin", fs);
+    FILE *journal = tmpfile();
+    ASSERT_NE(journal, nullptr);
+    ASSERT_EQ(attach_journal(&fs, journal, 1), SUCCESS);
+
+    char test_message[1024];
+    memset(test_message, 0x20, std::size(test_message));
+    ASSERT_EQ(inode_write_data(&fs, &fs.inodes[4], test_message, std::size(test_message)), SUCCESS);
+    ASSERT_EQ(commit_journal(&fs), SUCCESS);
+    ASSERT_EQ(inode_shrink_data(&fs, &fs.inodes[5], 0), SUCCESS);
+    ASSERT_EQ(commit_journal(&fs), SUCCESS);
+
+    char last;
+    off_t last_offset = file_size(journal) - 1;
+    ASSERT_EQ(pread(fileno(journal), &last, 1, last_offset), 1);
+    last ^= 0x5a;
+    ASSERT_EQ(pwrite(fileno(journal), &last, 1, last_offset), 1);
+
+    size_t replayed = 0;
+    ASSERT_EQ(replay_journal(journal, output_file, &replayed), SUCCESS);
+    ASSERT_EQ(replayed, 1);
+    compare_expected(OUTPUT "WriteDirectIndirect.bin");
+
+    free_filesystem(&fs);
+}
+
+// a commit returns once its transaction is written, whether or not anybody joined its group
+TEST_F(JournalSuite, GroupCommit)
+{
+    SKIP_WITHOUT_BUNDLED_IMAGES();
+
+    copy_image(INPUT "large.bin");
+
+    filesystem_t fs;
+    load_fs(INPUT "large.bin", fs);
+    FILE *journal = tmpfile();
+    ASSERT_NE(journal, nullptr);
+    ASSERT_EQ(attach_journal(&fs, journal, 3), SUCCESS);
+
+    char test_message[1024];
+    memset(test_message, 0x20, std::size(test_message));
+    ASSERT_EQ(inode_write_data(&fs, &fs.inodes[4], test_message, std::size(test_message)), SUCCESS);
+    ASSERT_EQ(commit_journal(&fs), SUCCESS);
+    size_t written = file_size(journal);
+    ASSERT_GT(written, 0);
+    ASSERT_EQ(inode_shrink_data(&fs, &fs.inodes[5], 0), SUCCESS);
+    ASSERT_EQ(commit_journal(&fs), SUCCESS);
+    ASSERT_GT(file_size(journal), written);
+
+    // nothing is left for a sync
+    written = file_size(journal);
+    ASSERT_EQ(sync_journal(&fs), SUCCESS);
+    ASSERT_EQ(file_size(journal), written);
+
+    size_t replayed = 0;
+    ASSERT_EQ(replay_journal(journal, output_file, &replayed), SUCCESS);
+    ASSERT_EQ(replayed, 2);
+
+    for (size_t i = 0; i < 3; ++i)
+    {
+        memset(test_message, 'a' + i, std::size(test_message));
+        ASSERT_EQ(inode_modify_data(&fs, &fs.inodes[4], i * 100, test_message, std::size(test_message)), SUCCESS);
+        ASSERT_EQ(commit_journal(&fs), SUCCESS);
+        ASSERT_GT(file_size(journal), written);
+        written = file_size(journal);
+    }
+
+    ASSERT_EQ(replay_journal(journal, output_file, &replayed), SUCCESS);
+    ASSERT_EQ(replayed, 5);
+
+    // the replayed image is the file system as it is in memory
+    filesystem_t replayed_fs;
+    rewind(output_file);
+    ASSERT_EQ(load_filesystem(output_file, &replayed_fs), SUCCESS);
+    ASSERT_EQ(replayed_fs.inodes[4].internal.file_size, fs.inodes[4].internal.file_size);
+    ASSERT_EQ(replayed_fs.inodes[5].internal.file_size, 0);
+    ASSERT_EQ(memcmp(replayed_fs.dblocks, fs.dblocks, fs.dblock_count * DATA_BLOCK_SIZE), 0);
+
+    free_filesystem(&replayed_fs);
+    free_filesystem(&fs);
+}
+
+// writers commit side by side, and every write that returned can be replayed
+TEST_F(JournalSuite, ConcurrentCommits)
+{
+    constexpr size_t writers = 4;
+    constexpr size_t file_size = 6 * DATA_BLOCK_SIZE + 5;
+    filesystem_t fs;
+    ASSERT_EQ(new_filesystem(&fs, 16, writers * 16), SUCCESS);
+    ASSERT_EQ(fs_enable_concurrency(&fs), SUCCESS);
+    ASSERT_EQ(save_filesystem(output_file, &fs), SUCCESS);
+
+    std::vector<inode_t *> files;
+    for (size_t t = 0; t < writers; ++t) files.push_back(new_test_inode(fs));
+
+    FILE *journal = tmpfile();
+    ASSERT_NE(journal, nullptr);
+    ASSERT_EQ(attach_journal(&fs, journal, writers), SUCCESS);
+
+    std::vector<std::thread> threads;
+    for (size_t t = 0; t < writers; ++t)
+    {
+        threads.emplace_back([&, t] {
+            std::vector<char> data = test_pattern(file_size, t);
+            for (size_t offset = 0; offset < file_size; offset += 100)
+            {
+                // what `fs_write` does
+                size_t n = std::min<size_t>(100, file_size - offset);
+                fs_lock_filesystem(&fs, false);
+                fs_lock_inode(&fs, files[t], true);
+                fs_retcode_t ret = inode_write_data(&fs, files[t], data.data() + offset, n);
+                fs_unlock_inode(&fs, files[t]);
+                fs_unlock_filesystem(&fs);
+                if (ret != SUCCESS || commit_journal(&fs) != SUCCESS) ADD_FAILURE() << "write " << t;
+            }
+        });
+    }
+    for (std::thread& thread : threads) thread.join();
+
+    size_t replayed = 0;
+    ASSERT_EQ(replay_journal(journal, output_file, &replayed), SUCCESS);
+    ASSERT_GT(replayed, 0);
+
+    filesystem_t replayed_fs;
+    rewind(output_file);
+    ASSERT_EQ(load_filesystem(output_file, &replayed_fs), SUCCESS);
+    for (size_t t = 0; t < writers; ++t)
+    {
+        inode_t *inode = &replayed_fs.inodes[files[t] - fs.inodes];
+        ASSERT_EQ(inode->internal.file_size, file_size);
+        std::vector<char> data(file_size);
+        size_t bytes_read;
+        ASSERT_EQ(inode_read_data(&replayed_fs, inode, 0, data.data(), file_size, &bytes_read), SUCCESS);
+        ASSERT_EQ(data, test_pattern(file_size, t));
+    }
+    ASSERT_EQ(memcmp(replayed_fs.dblocks, fs.dblocks, fs.dblock_count * DATA_BLOCK_SIZE), 0);
+
+    free_filesystem(&replayed_fs);
+    free_filesystem(&fs);
+}
+
+// a checkpoint writes the changes to the image and empties the journal
+TEST_F(JournalSuite, Checkpoint)
+{
+    SKIP_WITHOUT_BUNDLED_IMAGES();
+
+    copy_image(INPUT "large.bin");
+
+    filesystem_t fs;
+    load_fs(INPUT "large.bin", fs);
+    FILE *journal = tmpfile();
+    ASSERT_NE(journal, nullptr);
+    ASSERT_EQ(attach_journal(&fs, journal, 4), SUCCESS);
+
+    char test_message[1024];
+    memset(test_message, 0x20, std::size(test_message));
+    ASSERT_EQ(inode_write_data(&fs, &fs.inodes[4], test_message, std::size(test_message)), SUCCESS);
+    ASSERT_EQ(commit_journal(&fs), SUCCESS);
+    ASSERT_EQ(sync_journal(&fs), SUCCESS);
+    ASSERT_GT(file_size(journal), 0);
+
+    ASSERT_EQ(checkpoint_journal(output_file, &fs), SUCCESS);
+    ASSERT_EQ(file_size(journal), 0);
+    compare_expected(OUTPUT "WriteDirectIndirect.bin");
+
+    // the journal picks up after the checkpoint
+    ASSERT_EQ(inode_shrink_data(&fs, &fs.inodes[5], 0), SUCCESS);
+    ASSERT_EQ(commit_journal(&fs), SUCCESS);
+    ASSERT_EQ(detach_journal(&fs), SUCCESS);
+    ASSERT_EQ(fs.journal, nullptr);
+
+    free_filesystem(&fs);
+}
@@ -0,0 +1,101 @@
+#include "test_util.hpp"
+
+using LoadFilesystemSuite = fs_internal_test;
+
+TEST_F(LoadFilesystemSuite, InvalidInput)
+{
+    filesystem_t fs;
+    fs_load_report_t report;
+    ASSERT_EQ(load_filesystem(NULL, &fs), INVALID_INPUT);
+    ASSERT_EQ(load_filesystem(output_file, NULL), INVALID_INPUT);
+    ASSERT_EQ(load_filesystem_checked(output_file, &fs, NULL), INVALID_INPUT);
+    ASSERT_EQ(load_filesystem_checked(NULL, &fs, &report), INVALID_INPUT);
+}
+
+// the header claims more than the file holds, so nothing is allocated or read
+TEST_F(LoadFilesystemSuite, HeaderTooLarge)
+{
+    size_t inode_count = SIZE_MAX / 4;
+    inode_index_t available_inode = 0;
+    size_t dblock_count = 1;
+    fwrite(&inode_count, sizeof(inode_count), 1, output_file);
+    fwrite(&available_inode, sizeof(available_inode), 1, output_file);
+    fwrite(&dblock_count, sizeof(dblock_count), 1, output_file);
+    rewind(output_file);
+
+    filesystem_t fs;
+    ASSERT_EQ(load_filesystem(output_file, &fs), INVALID_BINARY_FORMAT);
+}
+
+// an image cut short in the middle of its dblocks
+TEST_F(LoadFilesystemSuite, Truncated0)
+{
+    SKIP_WITHOUT_BUNDLED_IMAGES();
+
+    copy_image(INPUT "medium.bin");
+    struct stat image_stat;
+    ASSERT_NE(fstat(fileno(output_file), &image_stat), -1);
+    ASSERT_EQ(ftruncate(fileno(output_file), image_stat.st_size - DATA_BLOCK_SIZE / 2), 0);
+    rewind(output_file);
+
+    filesystem_t fs;
+    fs_load_report_t report;
+    ASSERT_EQ(load_filesystem(output_file, &fs), INVALID_BINARY_FORMAT);
+    rewind(output_file);
+    ASSERT_EQ(load_filesystem_checked(output_file, &fs, &report), INVALID_BINARY_FORMAT);
+}
+
+// a consistent image loads exactly like an unchecked load
+TEST_F(LoadFilesystemSuite, CheckedConsistent0)
+{
+    SKIP_WITHOUT_BUNDLED_IMAGES();
+
+    FILE *image = fopen(INPUT "large.bin", "r");
+    ASSERT_NE(image, nullptr) << "File for input is not found.";
+
+    filesystem_t fs;
+    fs_load_report_t report;
+    ASSERT_EQ(load_filesystem_checked(image, &fs, &report), SUCCESS);
+    fclose(image);
+
+    ASSERT_EQ(report.leaked_dblocks, 0);
+    ASSERT_EQ(report.unmarked_dblocks, 0);
+    ASSERT_EQ(report.shared_dblocks, 0);
+    ASSERT_EQ(report.invalid_references, 0);
+
+    check_fs(INPUT "large.bin", fs);
+    free_filesystem(&fs);
+}
+
+// a dblock marked as used that no inode references is reported as leaked
+TEST_F(LoadFilesystemSuite, CheckedLeak0)
+{
+    SKIP_WITHOUT_BUNDLED_IMAGES();
+
+    filesystem_t fs;
+    load_fs(INPUT "medium.bin", fs);
+    dblock_index_t idx;
+    ASSERT_EQ(claim_available_dblock(&fs, &idx), SUCCESS);
+    ASSERT_EQ(save_filesystem(output_file, &fs), SUCCESS);
+    free_filesystem(&fs);
+
+    rewind(output_file);
+    fs_load_report_t report;
+    ASSERT_EQ(load_filesystem_checked(output_file, &fs, &report), SUCCESS);
+    ASSERT_EQ(report.leaked_dblocks, 1);
+    ASSERT_EQ(report.unmarked_dblocks, 0);
+    free_filesystem(&fs);
+}
+
+// a free inode list that loops would hang every walk of it
+TEST_F(LoadFilesystemSuite, FreeListLoop)
+{
+    filesystem_t fs;
+    ASSERT_EQ(new_filesystem(&fs, 4, 4), SUCCESS);
+    fs.inodes[3].next_free_inode = 1;
+    ASSERT_EQ(save_filesystem(output_file, &fs), SUCCESS);
+    free_filesystem(&fs);
+
+    rewind(output_file);
+    ASSERT_EQ(load_filesystem(output_file, &fs), INVALID_BINARY_FORMAT);
+}
@@ -0,0 +1,66 @@
+#include "test_util.hpp"
+
+extern "C"
+{
+#include "image.h"
+}
+
+using MapFilesystemSuite = fs_internal_test;
+
+TEST_F(MapFilesystemSuite, InvalidInput)
+{
+    filesystem_t fs;
+    ASSERT_EQ(map_filesystem(NULL, &fs), INVALID_INPUT);
+    ASSERT_EQ(map_filesystem(output_file, NULL), INVALID_INPUT);
+    ASSERT_EQ(sync_filesystem(NULL), INVALID_INPUT);
+
+    // an empty image is not a file system
+    ASSERT_EQ(map_filesystem(output_file, &fs), INVALID_BINARY_FORMAT);
+}
+
+// a mapped file system reads the same as a loaded one
+TEST_F(MapFilesystemSuite, MapMatchesLoad0)
+{
+    SKIP_WITHOUT_BUNDLED_IMAGES();
+
+    copy_image(INPUT "medium_text.bin");
+
+    filesystem_t mapped, loaded;
+    ASSERT_EQ(map_filesystem(output_file, &mapped), SUCCESS);
+    load_fs(INPUT "medium_text.bin", loaded);
+
+    ASSERT_EQ(mapped.inode_count, loaded.inode_count);
+    ASSERT_EQ(mapped.dblock_count, loaded.dblock_count);
+    ASSERT_EQ(mapped.available_inode, loaded.available_inode);
+    ASSERT_EQ(available_dblocks(&mapped), available_dblocks(&loaded));
+    ASSERT_EQ(available_inodes(&mapped), available_inodes(&loaded));
+
+    char mapped_buffer[1024] = { 0 }, loaded_buffer[1024] = { 0 };
+    size_t mapped_read, loaded_read;
+    ASSERT_EQ(inode_read_data(&mapped, &mapped.inodes[1], 0, mapped_buffer, sizeof(mapped_buffer), &mapped_read), SUCCESS);
+    ASSERT_EQ(inode_read_data(&loaded, &loaded.inodes[1], 0, loaded_buffer, sizeof(loaded_buffer), &loaded_read), SUCCESS);
+    ASSERT_EQ(mapped_read, loaded_read);
+    ASSERT_EQ(memcmp(mapped_buffer, loaded_buffer, mapped_read), 0);
+
+    free_filesystem(&mapped);
+    free_filesystem(&loaded);
+}
+
+// changes to a mapped file system land in the image file
+TEST_F(MapFilesystemSuite, ClaimPersists0)
+{
+    SKIP_WITHOUT_BUNDLED_IMAGES();
+
+    copy_image(INPUT "medium.bin");
+
+    filesystem_t fs;
+    ASSERT_EQ(map_filesystem(output_file, &fs), SUCCESS);
+
+    dblock_index_t idx;
+    ASSERT_EQ(claim_available_dblock(&fs, &idx), SUCCESS);
+    ASSERT_EQ(idx, 6) << "D-Block index value do not match!";
+    ASSERT_EQ(sync_filesystem(&fs), SUCCESS);
+    free_filesystem(&fs);
+
+    compare_expected(OUTPUT "SimpleClaimDBlock1.bin");
+}
@@ -0,0 +1,209 @@
+#include "test_util.hpp"
+
+extern "C"
+{
+#include "directory.h"
+}
+
+#include <cstring>
+#include <vector>
+
+using PathResolutionSuite = fs_internal_test;
+
+static inode_index_t new_child(filesystem_t& fs, inode_index_t parent, file_type_t type, const char *name)
+{
+    inode_index_t idx = new_test_inode(fs, type, name) - fs.inodes;
+    EXPECT_EQ(directory_add_entry(&fs, &fs.inodes[parent], NULL, name, idx), SUCCESS);
+    if (type == DIRECTORY)
+    {
+        EXPECT_EQ(directory_add_entry(&fs, &fs.inodes[idx], NULL, ".", idx), SUCCESS);
+        EXPECT_EQ(directory_add_entry(&fs, &fs.inodes[idx], NULL, "..", parent), SUCCESS);
+    }
+    return idx;
+}
+
+// renames the entry in slot `slot` of a directory without telling the cache
+static void rename_behind_cache(filesystem_t& fs, inode_index_t dir, size_t slot, const char *name)
+{
+    char new_name[MAX_FILE_NAME_LEN] = {};
+    strncpy(new_name, name, MAX_FILE_NAME_LEN);
+    ASSERT_EQ(inode_modify_data(&fs, &fs.inodes[dir], slot * entry_size + sizeof(inode_index_t), new_name, MAX_FILE_NAME_LEN), SUCCESS);
+}
+
+TEST_F(PathResolutionSuite, ResolvePaths)
+{
+    filesystem_t fs;
+    ASSERT_EQ(new_filesystem(&fs, 16, 32), SUCCESS);
+    inode_index_t docs = new_child(fs, 0, DIRECTORY, "docs");
+    inode_index_t notes = new_child(fs, docs, DIRECTORY, "notes");
+    inode_index_t file = new_child(fs, notes, DATA_FILE, "a.txt");
+    inode_t *root = &fs.inodes[0];
+    inode_index_t found;
+
+    ASSERT_EQ(directory_resolve_path(&fs, root, "docs/notes/a.txt", &found), SUCCESS);
+    ASSERT_EQ(found, file);
+    ASSERT_EQ(directory_resolve_path(&fs, &fs.inodes[file], "/docs//notes/", &found), SUCCESS);
+    ASSERT_EQ(found, notes);
+    ASSERT_EQ(directory_resolve_path(&fs, &fs.inodes[notes], "../notes/./a.txt", &found), SUCCESS);
+    ASSERT_EQ(found, file);
+    ASSERT_EQ(directory_resolve_path(&fs, &fs.inodes[notes], "../..", &found), SUCCESS);
+    ASSERT_EQ(found, 0);
+    ASSERT_EQ(directory_resolve_path(&fs, &fs.inodes[notes], "/", &found), SUCCESS);
+    ASSERT_EQ(found, 0);
+
+    ASSERT_EQ(directory_resolve_path(&fs, root, "docs/missing", &found), NOT_FOUND);
+    ASSERT_EQ(directory_resolve_path(&fs, root, "missing/a.txt", &found), DIR_NOT_FOUND);
+    ASSERT_EQ(directory_resolve_path(&fs, root, "docs/notes/a.txt/b", &found), DIR_NOT_FOUND);
+    ASSERT_EQ(directory_resolve_path(&fs, root, "docs/fifteen_chars__", &found), INVALID_FILENAME);
+    ASSERT_EQ(directory_resolve_path(&fs, root, "", &found), EMPTY_FILENAME);
+    ASSERT_EQ(directory_resolve_path(NULL, root, "docs", &found), INVALID_INPUT);
+    ASSERT_EQ(directory_resolve_path(&fs, NULL, "docs", &found), INVALID_INPUT);
+    ASSERT_EQ(directory_resolve_path(&fs, root, NULL, &found), INVALID_INPUT);
+    ASSERT_EQ(directory_resolve_path(&fs, root, "docs", NULL), INVALID_INPUT);
+
+    free_filesystem(&fs);
+}
+
+// names are answered from the cache, found or not, until something changes them
+TEST_F(PathResolutionSuite, CachedNames)
+{
+    filesystem_t fs;
+    ASSERT_EQ(new_filesystem(&fs, 16, 32), SUCCESS);
+    inode_index_t docs = new_child(fs, 0, DIRECTORY, "docs");
+    inode_index_t file = new_child(fs, docs, DATA_FILE, "a.txt");
+    inode_t *root = &fs.inodes[0];
+    inode_index_t found;
+
+    // a rename the cache never hears of goes unnoticed, until the names are forgotten
+    ASSERT_EQ(directory_resolve_path(&fs, root, "docs/a.txt", &found), SUCCESS);
+    ASSERT_EQ(directory_resolve_path(&fs, root, "docs/b.txt", &found), NOT_FOUND);
+    rename_behind_cache(fs, docs, 2, "b.txt");
+    ASSERT_EQ(directory_resolve_path(&fs, root, "docs/a.txt", &found), SUCCESS);
+    ASSERT_EQ(found, file);
+    ASSERT_EQ(directory_resolve_path(&fs, root, "docs/b.txt", &found), NOT_FOUND);
+    dentry_cache_forget(&fs, docs, "a.txt");
+    dentry_cache_forget(&fs, docs, "b.txt");
+    ASSERT_EQ(directory_resolve_path(&fs, root, "docs/a.txt", &found), NOT_FOUND);
+    ASSERT_EQ(directory_resolve_path(&fs, root, "docs/b.txt", &found), SUCCESS);
+    ASSERT_EQ(found, file);
+
+    // entries added and removed through the directory functions are seen at once
+    ASSERT_EQ(directory_resolve_path(&fs, root, "docs/c.txt", &found), NOT_FOUND);
+    ASSERT_EQ(directory_add_entry(&fs, &fs.inodes[docs], NULL, "c.txt", file), SUCCESS);
+    ASSERT_EQ(directory_resolve_path(&fs, root, "docs/c.txt", &found), SUCCESS);
+    ASSERT_EQ(found, file);
+    ASSERT_EQ(directory_remove_entry(&fs, &fs.inodes[docs], NULL, "b.txt"), SUCCESS);
+    ASSERT_EQ(directory_resolve_path(&fs, root, "docs/b.txt", &found), NOT_FOUND);
+
+    free_filesystem(&fs);
+}
+
+// a removed directory's names go with it, so a directory reusing its inode starts clean
+TEST_F(PathResolutionSuite, ForgetDirectory)
+{
+    filesystem_t fs;
+    ASSERT_EQ(new_filesystem(&fs, 16, 32), SUCCESS);
+    inode_index_t parent = new_child(fs, 0, DIRECTORY, "parent");
+    inode_index_t docs = new_child(fs, 0, DIRECTORY, "docs");
+    inode_t *root = &fs.inodes[0];
+    inode_index_t found;
+    ASSERT_EQ(directory_resolve_path(&fs, root, "docs/..", &found), SUCCESS);
+    ASSERT_EQ(found, 0);
+
+    // docs is removed, and its inode comes back as a directory under another parent
+    ASSERT_EQ(directory_remove_entry(&fs, root, NULL, "docs"), SUCCESS);
+    dentry_cache_forget_directory(&fs, docs);
+    ASSERT_EQ(inode_release_data(&fs, &fs.inodes[docs]), SUCCESS);
+    ASSERT_EQ(release_inode(&fs, &fs.inodes[docs]), SUCCESS);
+    ASSERT_EQ(new_child(fs, parent, DIRECTORY, "docs"), docs);
+
+    ASSERT_EQ(directory_resolve_path(&fs, root, "docs", &found), NOT_FOUND);
+    ASSERT_EQ(directory_resolve_path(&fs, root, "parent/docs/..", &found), SUCCESS);
+    ASSERT_EQ(found, parent);
+
+    free_filesystem(&fs);
+}
+
+// truncating another file does not touch any name, so the cache keeps them
+TEST_F(PathResolutionSuite, KeptAcrossUnrelatedShrink)
+{
+    filesystem_t fs;
+    ASSERT_EQ(new_filesystem(&fs, 16, 32), SUCCESS);
+    inode_index_t docs = new_child(fs, 0, DIRECTORY, "docs");
+    inode_index_t file = new_child(fs, docs, DATA_FILE, "a.txt");
+    inode_index_t other = new_child(fs, 0, DATA_FILE, "other");
+    inode_t *root = &fs.inodes[0];
+    inode_index_t found;
+    ASSERT_EQ(directory_resolve_path(&fs, root, "docs/a.txt", &found), SUCCESS);
+
+    std::vector<char> data(3 * DATA_BLOCK_SIZE, 'x');
+    ASSERT_EQ(inode_write_data(&fs, &fs.inodes[other], data.data(), data.size()), SUCCESS);
+    ASSERT_EQ(inode_shrink_data(&fs, &fs.inodes[other], 1), SUCCESS);
+
+    // still answered from the cache, which never heard of the rename
+    rename_behind_cache(fs, docs, 2, "b.txt");
+    ASSERT_EQ(directory_resolve_path(&fs, root, "docs/a.txt", &found), SUCCESS);
+    ASSERT_EQ(found, file);
+
+    free_filesystem(&fs);
+}
+
+// a compaction renumbers the inodes, and the cache starts over
+TEST_F(PathResolutionSuite, CompactionDropsCache)
+{
+    filesystem_t fs;
+    ASSERT_EQ(new_filesystem(&fs, 16, 32), SUCCESS);
+    std::vector<inode_index_t> gaps;
+    for (size_t i = 0; i < 4; ++i)
+    {
+        inode_index_t idx;
+        ASSERT_EQ(claim_available_inode(&fs, &idx), SUCCESS);
+        gaps.push_back(idx);
+    }
+    inode_index_t docs = new_child(fs, 0, DIRECTORY, "docs");
+    inode_index_t file = new_child(fs, docs, DATA_FILE, "a.txt");
+    for (inode_index_t idx : gaps) ASSERT_EQ(release_inode(&fs, &fs.inodes[idx]), SUCCESS);
+
+    inode_index_t found;
+    ASSERT_EQ(directory_resolve_path(&fs, &fs.inodes[0], "docs/a.txt", &found), SUCCESS);
+    ASSERT_EQ(found, file);
+
+    std::vector<inode_index_t> renumbered(fs.inode_count);
+    ASSERT_EQ(compact_inodes(&fs, renumbered.data()), SUCCESS);
+    ASSERT_NE(renumbered[file], file);
+    ASSERT_EQ(directory_resolve_path(&fs, &fs.inodes[0], "docs/a.txt", &found), SUCCESS);
+    ASSERT_EQ(found, renumbered[file]);
+    ASSERT_EQ(directory_resolve_path(&fs, &fs.inodes[renumbered[docs]], "a.txt", &found), SUCCESS);
+    ASSERT_EQ(found, renumbered[file]);
+
+    free_filesystem(&fs);
+}
+
+// every name in the bundled image's root resolves to what a scan of the root finds
+TEST_F(PathResolutionSuite, BundledImage)
+{
+    SKIP_WITHOUT_BUNDLED_IMAGES();
+
+    filesystem_t fs;
+    load_fs(INPUT "medium.bin", fs);
+    inode_t *root = &fs.inodes[0];
+
+    for (size_t i = 1; i < fs.inode_count; ++i)
+    {
+        char name[MAX_FILE_NAME_LEN + 1] = {};
+        strncpy(name, fs.inodes[i].internal.file_name, MAX_FILE_NAME_LEN);
+        if (name[0] == '\0') continue;
+        inode_index_t scanned, resolved;
+        fs_retcode_t result = directory_lookup(&fs, root, NULL, name, &scanned);
+        for (int pass = 0; pass < 2; ++pass)
+        {
+            ASSERT_EQ(directory_resolve_path(&fs, root, name, &resolved), result) << name;
+            if (result == SUCCESS)
+            {
+                ASSERT_EQ(resolved, scanned) << name;
+            }
+        }
+    }
+
+    free_filesystem(&fs);
+}
@@ -0,0 +1,121 @@
+#include "test_util.hpp"
+
+using SaveFilesystemIncrementalSuite = fs_internal_test;
+
+TEST_F(SaveFilesystemIncrementalSuite, InvalidInput)
+{
+    SKIP_WITHOUT_BUNDLED_IMAGES();
+
+    filesystem_t fs;
+    load_fs(INPUT "medium.bin", fs);
+
+    ASSERT_EQ(save_filesystem_incremental(NULL, &fs), INVALID_INPUT);
+    ASSERT_EQ(save_filesystem_incremental(output_file, NULL), INVALID_INPUT);
+
+    free_filesystem(&fs);
+}
+
+// an image with a different geometry can not be patched
+TEST_F(SaveFilesystemIncrementalSuite, GeometryMismatch)
+{
+    SKIP_WITHOUT_BUNDLED_IMAGES();
+
+    copy_image(INPUT "large.bin");
+
+    filesystem_t fs;
+    load_fs(INPUT "medium.bin", fs);
+    ASSERT_EQ(save_filesystem_incremental(output_file, &fs), INVALID_BINARY_FORMAT);
+
+    free_filesystem(&fs);
+}
+
+// an unchanged file system writes nothing
+TEST_F(SaveFilesystemIncrementalSuite, NothingDirty)
+{
+    SKIP_WITHOUT_BUNDLED_IMAGES();
+
+    copy_image(INPUT "large.bin");
+
+    filesystem_t fs;
+    load_fs(INPUT "large.bin", fs);
+    ASSERT_EQ(save_filesystem_incremental(output_file, &fs), SUCCESS);
+    free_filesystem(&fs);
+
+    compare_expected(INPUT "large.bin");
+}
+
+// new index and data dblocks, the bitmask and the inode are written back
+TEST_F(SaveFilesystemIncrementalSuite, WriteDirectIndirect)
+{
+    SKIP_WITHOUT_BUNDLED_IMAGES();
+
+    copy_image(INPUT "large.bin");
+
+    filesystem_t fs;
+    load_fs(INPUT "large.bin", fs);
+
+    char test_message[1024];
+    memset(test_message, 0x20, std::size(test_message));
+    ASSERT_EQ(inode_write_data(&fs, &fs.inodes[4], test_message, std::size(test_message)), SUCCESS);
+    ASSERT_EQ(save_filesystem_incremental(output_file, &fs), SUCCESS);
+    free_filesystem(&fs);
+
+    compare_expected(OUTPUT "WriteDirectIndirect.bin");
+}
+
+// released dblocks only change the bitmask and the inode
+TEST_F(SaveFilesystemIncrementalSuite, ShrinkComplete0)
+{
+    SKIP_WITHOUT_BUNDLED_IMAGES();
+
+    copy_image(INPUT "large.bin");
+
+    filesystem_t fs;
+    load_fs(INPUT "large.bin", fs);
+
+    ASSERT_EQ(inode_shrink_data(&fs, &fs.inodes[5], 0), SUCCESS);
+    ASSERT_EQ(save_filesystem_incremental(output_file, &fs), SUCCESS);
+    free_filesystem(&fs);
+
+    compare_expected(OUTPUT "ShrinkComplete0.bin");
+}
+
+// claiming an inode changes the head of the free inode list in the header
+TEST_F(SaveFilesystemIncrementalSuite, ClaimINodeUpdatesHeader)
+{
+    filesystem_t fs, reloaded;
+    ASSERT_EQ(new_filesystem(&fs, 8, 16), SUCCESS);
+    ASSERT_EQ(save_filesystem(output_file, &fs), SUCCESS);
+
+    inode_index_t inode_idx;
+    ASSERT_EQ(claim_available_inode(&fs, &inode_idx), SUCCESS);
+    ASSERT_EQ(save_filesystem_incremental(output_file, &fs), SUCCESS);
+
+    rewind(output_file);
+    ASSERT_EQ(load_filesystem(output_file, &reloaded), SUCCESS);
+    ASSERT_EQ(reloaded.available_inode, fs.available_inode);
+    ASSERT_EQ(memcmp(reloaded.inodes, fs.inodes, fs.inode_count * sizeof(inode_t)), 0);
+
+    free_filesystem(&reloaded);
+    free_filesystem(&fs);
+}
+
+// a full save that could not be written leaves the changes marked for the next save
+TEST_F(SaveFilesystemIncrementalSuite, FailedSaveKeepsDirty)
+{
+    filesystem_t fs;
+    ASSERT_EQ(new_filesystem(&fs, 8, 16), SUCCESS);
+
+    FILE *read_only = fopen("/dev/null", "r");
+    ASSERT_NE(read_only, nullptr);
+    ASSERT_EQ(save_filesystem(read_only, &fs), SYSTEM_ERROR);
+    fclose(read_only);
+
+    ASSERT_TRUE(fs.dirty.header);
+    ASSERT_NE(fs.dirty.inodes[0], 0);
+
+    ASSERT_EQ(save_filesystem(output_file, &fs), SUCCESS);
+    ASSERT_FALSE(fs.dirty.header);
+
+    free_filesystem(&fs);
+}